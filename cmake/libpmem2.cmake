@@ -57,7 +57,11 @@ file(
 
 add_library(pmem2 STATIC ${libpmem2_SRC})
 set_property(TARGET pmem2 PROPERTY POSITION_INDEPENDENT_CODE ON)
-target_compile_options(pmem2 PRIVATE -mavx512f)
+# only the kernels are built for their ISA; they are called on capable CPUs only
+file(GLOB libpmem2_AVX_SRC ${pmdk_SOURCE_DIR}/libpmem2/x86_64/mem*/mem*_avx.c)
+file(GLOB libpmem2_AVX512F_SRC ${pmdk_SOURCE_DIR}/libpmem2/x86_64/mem*/mem*_avx512f.c)
+set_source_files_properties(${libpmem2_AVX_SRC} PROPERTIES COMPILE_OPTIONS -mavx)
+set_source_files_properties(${libpmem2_AVX512F_SRC} PROPERTIES COMPILE_OPTIONS -mavx512f)
 target_compile_definitions(pmem2 PRIVATE -DSRCVERSION="0.2" -DAVX512F_AVAILABLE=1)
 target_include_directories(
     pmem2
@@ -21,6 +21,8 @@ logical_to_virtual_size = {
     256: 256 * 1024 * 1024 - 4096 * 129,
     512: 512 * 1024 * 1024 - 4096 * 257,
     1024: 1024 * 1024 * 1024 - 4096 * 514,
+    4096: 4096 * 1024 * 1024 - 4096 * 2049,
+    10240: 10240 * 1024 * 1024 - 4096 * 5121,
 }
 
 
@@ -59,10 +59,14 @@ def plot_open(result_dir):
     print(f"MMAP = {coeff[0]:.3f} us per 2MB + {coeff[1]:.3f} us")
 
     df = df[df["size"].isin([4, 16, 64, 256])]
-    df["Others"] = df["OPEN"] - df["MMAP"] - df["UPDATE"]
+    if "POPULATE" not in df:
+        df["POPULATE"] = 0
+    df["POPULATE"] = df["POPULATE"].fillna(0)
+    df["Others"] = df["OPEN"] - df["MMAP"] - df["POPULATE"] - df["UPDATE"]
 
     columns = {
         "MMAP": "Mmap",
+        "POPULATE": "Populate",
         "UPDATE": "Block Table",
     }
     df.rename(columns=columns, inplace=True)
@@ -70,7 +74,7 @@ def plot_open(result_dir):
 
     ax = df.plot.barh(
         x="size",
-        y=["Mmap", "Block Table", "Others"],
+        y=["Mmap", "Populate", "Block Table", "Others"],
         stacked=True,
         legend=False,
         figsize=(5, 1),
@@ -79,7 +83,7 @@ def plot_open(result_dir):
     ax.set_ylabel("File Size (MB)    ")
     ax.set_xlabel(r"Time ($\mu$s)")
     ax.legend(
-        ncols=3,
+        ncols=4,
         fontsize=9,
         columnspacing=.75,
         handlelength=0.75,
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+
+#include "config.h"
+#include "const.h"
+#include "posix.h"
+#include "utils/logging.h"
+#include "utils/timer.h"
+#include "utils/utils.h"
+
+namespace madfs::dram {
+
+/**
+ * Admission control for the large PM writes of all processes: PM loses
+ * aggregate write bandwidth once too many threads stream to it at once, so at
+ * most runtime_options.max_pm_writers threads per NUMA node copy a large
+ * range at a time, and the others wait for a slot.
+ *
+ * A slot is a byte of a file in /dev/shm shared by the processes of a user,
+ * held with an OFD lock on a file description opened for the copy. The kernel
+ * drops the lock when the description is closed, so the slots of a crashed
+ * process are freed without guessing from its pid. Writes below MIN_BYTES
+ * (e.g., the CoW of a partial block) are latency-sensitive rather than
+ * bandwidth-bound, so they never wait.
+ */
+class WriteAdmission {
+  constexpr static uint32_t MAX_NUM_NODES = 8;
+  constexpr static uint32_t MAX_NUM_SLOTS = 64;
+  // the number of rounds over the slots before blocking on one of them
+  constexpr static uint32_t NUM_POLLS = 16;
+
+  static inline char path[64];
+  static inline std::once_flag path_once;
+
+ public:
+  // a copy of fewer bytes does not wait
+  constexpr static size_t MIN_BYTES = 64 << 10;
+
+  /**
+   * Hold a slot for a copy of num_bytes until destroyed; a no-op if the copy
+   * is small or admission control is disabled
+   */
+  class Guard : noncopyable {
+    int fd = -1;
+
+   public:
+    explicit Guard(size_t num_bytes) {
+      if (runtime_options.max_pm_writers == 0 || num_bytes < MIN_BYTES) return;
+      fd = acquire();
+    }
+    ~Guard() {
+      // closing the description releases its lock
+      if (fd >= 0) posix::close(fd);
+    }
+  };
+
+ private:
+  /**
+   * @return a new file description of the slots file; -1 if it cannot be
+   * trusted, in which case the copy goes ahead without a slot
+   */
+  static int open_slots() {
+    // per user, so that no one else can hold the slots
+    std::call_once(path_once, [] {
+      snprintf(path, sizeof(path), "/dev/shm/madfs_admission_%u", getuid());
+    });
+    int fd = posix::open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC,
+                         S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+      LOG_WARN("WriteAdmission: open %s failed: %m", path);
+      return -1;
+    }
+    struct stat stat_buf;
+    if (posix::fstat(fd, &stat_buf) < 0 || stat_buf.st_uid != getuid() ||
+        (stat_buf.st_mode & (S_IWGRP | S_IWOTH))) {
+      LOG_WARN("WriteAdmission: %s is writable by others; ignored", path);
+      posix::close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  static int acquire() {
+    int fd = open_slots();
+    if (fd < 0) return -1;
+
+    unsigned cpu, node_idx;
+    if (syscall(SYS_getcpu, &cpu, &node_idx, nullptr) < 0) node_idx = 0;
+    auto num_slots = std::min(
+        static_cast<uint32_t>(runtime_options.max_pm_writers), MAX_NUM_SLOTS);
+    off_t base = (node_idx % MAX_NUM_NODES) * MAX_NUM_SLOTS;
+    // the threads start from different slots, so that they rarely collide
+    auto first = static_cast<uint32_t>(tid) % num_slots;
+
+    if (try_acquire(fd, base, num_slots, first)) return fd;
+    TimerGuard<Event::ADMISSION_WAIT> timer_guard;
+    for (uint32_t i = 0; i < NUM_POLLS; ++i) {
+      sched_yield();
+      if (try_acquire(fd, base, num_slots, first)) return fd;
+    }
+    if (lock_slot(fd, base + first, /*wait=*/true)) return fd;
+    LOG_WARN("WriteAdmission: wait for a slot failed: %m");
+    posix::close(fd);
+    return -1;
+  }
+
+  static bool try_acquire(int fd, off_t base, uint32_t num_slots,
+                          uint32_t first) {
+    for (uint32_t i = 0; i < num_slots; ++i)
+      if (lock_slot(fd, base + (first + i) % num_slots, /*wait=*/false))
+        return true;
+    return false;
+  }
+
+  static bool lock_slot(int fd, off_t slot, bool wait) {
+    struct flock fl {};
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = slot;
+    fl.l_len = 1;
+    while (true) {
+      int rc = posix::fcntl(fd, wait ? F_OFD_SETLKW : F_OFD_SETLK, &fl);
+      if (rc == 0) return true;
+      if (errno != EINTR) return false;
+    }
+  }
+};
+
+}  // namespace madfs::dram
@@ -0,0 +1,356 @@
+#pragma once
+
+#include <pthread.h>
+#include <signal.h>
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "config.h"
+#include "file/file.h"
+#include "posix.h"
+#include "utils/logging.h"
+#include "utils/timer.h"
+#include "utils/utils.h"
+
+namespace madfs::dram {
+
+/**
+ * Worker threads that serve the asynchronous I/O submitted through POSIX AIO
+ * or libaio (see lib/aio.cpp); left to glibc or the kernel, it would bypass
+ * MadFS and see the raw blocks of the file.
+ *
+ * The requests submitted together (e.g., by one io_submit) are queued as
+ * jobs: a run of contiguous writes to the same file is gathered into one job
+ * and committed by a single tx, while any other request is a job of its own.
+ * A request is completed on the worker through its callback, with the number
+ * of bytes or -errno, and is owned by the callback from then on. A sync is
+ * held back, with the jobs on its file submitted after it, until the requests
+ * on the file submitted before it are done, as fsync must cover them.
+ *
+ * The workers are started on the first request. They are never joined, since
+ * they may still be waiting when the process exits.
+ */
+class AioPool : noncopyable {
+ public:
+  // a run of contiguous writes is not gathered beyond this size, where the
+  // extra copy costs more than the commits it saves
+  constexpr static size_t MAX_GATHER_BYTES = 1 << 20;
+
+  struct Request {
+    enum class Op { READ, WRITE, SYNC } op{};
+    int fd;
+    // null if fd is not a MadFS file (e.g., in a lio_listio that mixes both)
+    std::shared_ptr<File> file;
+    uint64_t offset;
+    std::vector<iovec> iov{};
+    void (*complete)(Request* req, ssize_t res);
+    // the aiocb or iocb, and the state of the API it is submitted through
+    void* tag;
+    void* context;
+    std::chrono::steady_clock::time_point submit_time{};
+
+    [[nodiscard]] size_t size() const {
+      size_t size = 0;
+      for (const iovec& v : iov) size += v.iov_len;
+      return size;
+    }
+  };
+
+ private:
+  // guards the fields below
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<std::vector<Request*>> jobs;
+  // the jobs held back per file, each run headed by a sync
+  std::unordered_map<const File*, std::deque<std::vector<Request*>>> held_jobs;
+  uint32_t num_workers{};
+  // the number of requests queued but not started, and its maximum
+  size_t queue_depth{};
+  size_t max_queue_depth{};
+
+  std::atomic<uint64_t> num_submitted{0};
+  std::atomic<uint64_t> num_done{0};
+  std::atomic<uint64_t> total_latency_ns{0};
+  std::atomic<uint64_t> max_latency_ns{0};
+
+ public:
+  /**
+   * Queue the requests submitted together; they may complete in any order,
+   * except that a sync completes after the earlier requests on its file
+   */
+  void submit(std::vector<Request*> reqs) {
+    auto now = std::chrono::steady_clock::now();
+    std::vector<std::vector<Request*>> new_jobs;
+    size_t job_bytes = 0;
+    for (Request* req : reqs) {
+      req->submit_time = now;
+      size_t size = req->size();
+      timer.count<Event::AIO_SUBMIT>(size);
+
+      if (!new_jobs.empty() && can_gather(new_jobs.back().back(), req) &&
+          job_bytes + size <= MAX_GATHER_BYTES) {
+        new_jobs.back().emplace_back(req);
+        job_bytes += size;
+      } else {
+        new_jobs.push_back({req});
+        job_bytes = size;
+      }
+    }
+    num_submitted.fetch_add(reqs.size(), std::memory_order_relaxed);
+
+    size_t num_queued = 0;
+    {
+      std::lock_guard<std::mutex> guard(mutex);
+      start_workers();
+      for (auto& job : new_jobs) {
+        File* file = job.front()->file.get();
+        auto n = static_cast<uint32_t>(job.size());
+        if (file && (job.front()->op == Request::Op::SYNC ||
+                     held_jobs.contains(file))) {
+          // counted as held first, so that finish never sees it running
+          file->num_aio_held.fetch_add(n);
+          file->num_aio_in_flight.fetch_add(n);
+          held_jobs[file].emplace_back(std::move(job));
+          num_queued += release_held_locked(file);
+        } else {
+          if (file) file->num_aio_in_flight.fetch_add(n);
+          jobs.emplace_back(std::move(job));
+          num_queued++;
+        }
+      }
+      queue_depth += reqs.size();
+      max_queue_depth = std::max(max_queue_depth, queue_depth);
+    }
+    notify_workers(num_queued);
+  }
+
+  /**
+   * @return the pool of this process
+   */
+  static AioPool& get() {
+    AioPool* pool = instance.load(std::memory_order_acquire);
+    if (likely(pool)) return *pool;
+    auto new_pool = new AioPool();
+    if (instance.compare_exchange_strong(pool, new_pool)) return *new_pool;
+    delete new_pool;  // no workers are started before it is published
+    return *pool;
+  }
+
+  /**
+   * @return the pool of this process if any request has been submitted
+   */
+  static AioPool* get_if_started() {
+    return instance.load(std::memory_order_acquire);
+  }
+
+  /**
+   * The workers are not copied into the child of fork, and POSIX drops the
+   * requests in flight there; the child starts a new pool on its first request
+   */
+  static void on_fork_child() {
+    instance.store(nullptr, std::memory_order_relaxed);
+  }
+
+  friend std::ostream& operator<<(std::ostream& out, AioPool& pool) {
+    std::lock_guard<std::mutex> guard(pool.mutex);
+    uint64_t num_done = pool.num_done.load(std::memory_order_relaxed);
+    uint64_t num_submitted = pool.num_submitted.load(std::memory_order_relaxed);
+    uint64_t total_ns = pool.total_latency_ns.load(std::memory_order_relaxed);
+    out << "AioPool: \n";
+    out << "\tworkers: " << pool.num_workers << "\n";
+    out << "\tin flight: " << num_submitted - num_done << "\n";
+    out << "\tqueue depth: " << pool.queue_depth
+        << " (max: " << pool.max_queue_depth << ")\n";
+    out << "\tcompleted: " << num_done << "\n";
+    if (num_done > 0) {
+      out << "\tlatency: " << (double)total_ns / (double)num_done / 1000.0
+          << " us avg, "
+          << (double)pool.max_latency_ns.load(std::memory_order_relaxed) /
+                 1000.0
+          << " us max\n";
+    }
+    return out;
+  }
+
+ private:
+  static inline std::atomic<AioPool*> instance{};
+
+  /**
+   * @return whether req continues the write prev to a MadFS file
+   */
+  static bool can_gather(const Request* prev, const Request* req) {
+    return prev->op == Request::Op::WRITE && req->op == Request::Op::WRITE &&
+           prev->file && prev->file == req->file &&
+           prev->offset + prev->size() == req->offset;
+  }
+
+  /**
+   * Queue the jobs held back on file up to the next sync that must still wait
+   * for the requests before it; called with the mutex held
+   *
+   * @return the number of jobs queued
+   */
+  size_t release_held_locked(File* file) {
+    auto it = held_jobs.find(file);
+    if (it == held_jobs.end()) return 0;
+    auto& held = it->second;
+    size_t num_queued = 0;
+    while (!held.empty()) {
+      std::vector<Request*>& job = held.front();
+      // the held count only changes with the mutex held
+      uint32_t num_running = file->num_aio_in_flight.load() -
+                             file->num_aio_held.load(std::memory_order_relaxed);
+      if (job.front()->op == Request::Op::SYNC && num_running > 0) break;
+      file->num_aio_held.fetch_sub(static_cast<uint32_t>(job.size()));
+      jobs.emplace_back(std::move(job));
+      held.pop_front();
+      num_queued++;
+    }
+    if (held.empty()) held_jobs.erase(it);
+    return num_queued;
+  }
+
+  void notify_workers(size_t num_queued) {
+    if (num_queued == 1)
+      cv.notify_one();
+    else if (num_queued > 1)
+      cv.notify_all();
+  }
+
+  /**
+   * Start the workers if not yet; called with the mutex held
+   */
+  void start_workers() {
+    auto target = static_cast<uint32_t>(runtime_options.aio_threads);
+    if (num_workers >= target) return;
+    // the workers must not take the signals meant for the application
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (; num_workers < target; ++num_workers)
+      std::thread(&AioPool::worker_loop, this).detach();
+    pthread_sigmask(SIG_SETMASK, &old, nullptr);
+    LOG_INFO("AioPool: %u worker threads started", num_workers);
+  }
+
+  [[noreturn]] void worker_loop() {
+    pthread_setname_np(pthread_self(), "madfs-aio");
+    while (true) {
+      std::vector<Request*> job;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return !jobs.empty(); });
+        job = std::move(jobs.front());
+        jobs.pop_front();
+        queue_depth -= job.size();
+      }
+      if (job.size() == 1)
+        finish(job.front(), exec(job.front()));
+      else
+        exec_gathered(job);
+    }
+  }
+
+  /**
+   * @return the number of bytes read or written; -errno on failure
+   */
+  static ssize_t exec(const Request* req) {
+    if (req->op == Request::Op::SYNC) {
+      int rc = req->file ? req->file->fsync() : posix::fsync(req->fd);
+      return rc < 0 ? -errno : 0;
+    }
+
+    size_t done = 0;
+    for (const iovec& v : req->iov) {
+      auto buf = static_cast<char*>(v.iov_base);
+      uint64_t offset = req->offset + done;
+      ssize_t ret;
+      if (req->op == Request::Op::READ)
+        ret = req->file ? req->file->pread(buf, v.iov_len, offset)
+                        : posix::pread(req->fd, buf, v.iov_len,
+                                       static_cast<off_t>(offset));
+      else
+        ret = req->file ? req->file->pwrite(buf, v.iov_len, offset)
+                        : posix::pwrite(req->fd, buf, v.iov_len,
+                                        static_cast<off_t>(offset));
+      if (ret < 0) return done > 0 ? static_cast<ssize_t>(done) : -errno;
+      done += static_cast<size_t>(ret);
+      if (static_cast<size_t>(ret) < v.iov_len) break;
+    }
+    return static_cast<ssize_t>(done);
+  }
+
+  /**
+   * Commit a run of contiguous writes by a single tx, and split the bytes
+   * written among them in order
+   */
+  void exec_gathered(const std::vector<Request*>& job) {
+    size_t num_bytes = 0;
+    for (const Request* req : job) num_bytes += req->size();
+    std::vector<char> buf(num_bytes);
+    char* dst = buf.data();
+    for (const Request* req : job)
+      for (const iovec& v : req->iov) {
+        std::memcpy(dst, v.iov_base, v.iov_len);
+        dst += v.iov_len;
+      }
+
+    const Request* first = job.front();
+    ssize_t ret = first->file->pwrite(buf.data(), num_bytes, first->offset);
+    if (ret < 0) ret = -errno;
+    auto left = static_cast<size_t>(std::max(ret, ssize_t{0}));
+    for (Request* req : job) {
+      if (ret < 0) {
+        finish(req, ret);
+        continue;
+      }
+      size_t n = std::min(req->size(), left);
+      left -= n;
+      finish(req, static_cast<ssize_t>(n));
+    }
+  }
+
+  void finish(Request* req, ssize_t res) {
+    auto latency = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       std::chrono::steady_clock::now() - req->submit_time)
+                       .count();
+    auto latency_ns = static_cast<uint64_t>(latency);
+    total_latency_ns.fetch_add(latency_ns, std::memory_order_relaxed);
+    uint64_t max_ns = max_latency_ns.load(std::memory_order_relaxed);
+    while (max_ns < latency_ns &&
+           !max_latency_ns.compare_exchange_weak(max_ns, latency_ns,
+                                                 std::memory_order_relaxed)) {
+    }
+    if (File* file = req->file.get()) {
+      uint32_t num_left = file->num_aio_in_flight.fetch_sub(1) - 1;
+      // the last request running before a held sync lets it go
+      if (num_left > 0 && num_left == file->num_aio_held.load()) {
+        size_t num_queued;
+        {
+          std::lock_guard<std::mutex> guard(mutex);
+          num_queued = release_held_locked(file);
+        }
+        notify_workers(num_queued);
+      }
+    }
+    num_done.fetch_add(1, std::memory_order_relaxed);
+    req->complete(req, res);
+  }
+};
+
+}  // namespace madfs::dram
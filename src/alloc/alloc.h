@@ -12,11 +12,28 @@ class Allocator {
   TxBlockAllocator tx_block;
   LogEntryAllocator log_entry;
 
+  // where the last write of this thread ended, both in the virtual and the
+  // logical space; a write starting at stream_end_vidx is taken as a
+  // sequential stream and placed at stream_end_lidx if possible (see
+  // BlockAllocator::alloc)
+  VirtualBlockIdx stream_end_vidx{};
+  LogicalBlockIdx stream_end_lidx{};
+
   Allocator(MemTable* mem_table, BitmapMgr* bitmap_mgr,
             PerThreadData* per_thread_data)
       : block(mem_table, bitmap_mgr),
         tx_block(&block, mem_table, per_thread_data),
         log_entry(&block, mem_table) {}
+
+  /**
+   * Drop all the local states without releasing them (see BlockAllocator::
+   * forget). The allocator must be destroyed afterwards.
+   */
+  void forget() {
+    block.forget();
+    tx_block.forget();
+    log_entry.reset();
+  }
 };
 
 }  // namespace madfs::dram
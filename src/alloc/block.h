@@ -2,6 +2,7 @@
 
 #include <array>
 #include <bit>
+#include <unordered_map>
 #include <vector>
 
 #include "bitmap.h"
@@ -9,15 +10,39 @@
 #include "mem_table.h"
 
 namespace madfs::dram {
+/**
+ * The free blocks owned by an allocator are kept per region, where a region is
+ * the 64 blocks managed by one bitmap entry. A mask per region tells whether a
+ * given block is free, so that a placement hint can be checked in O(1); the
+ * free lists by size serve allocations without a hint.
+ *
+ * Tx blocks and log entry blocks are taken from separate metadata regions near
+ * the front of the file, so that they do not split the data extents and the
+ * replay reads dense memory.
+ */
 class BlockAllocator {
   MemTable* mem_table;
   BitmapMgr* bitmap_mgr;
 
   // free_lists[n-1] means a free list of size n beginning from LogicalBlockIdx
+  // an entry goes stale once its run is split or merged; the resulting runs
+  // are pushed again and stale entries are dropped on pop, or all at once when
+  // they outnumber the free runs (see push_free_run)
   std::array<std::vector<LogicalBlockIdx>, BITMAP_ENTRY_BLOCKS_CAPACITY>
       free_lists{};
+  size_t num_free_list_entries = 0;
+  // the number of maximal free runs in free_regions
+  size_t num_free_runs = 0;
 
-  BitmapIdx recent_bitmap_idx{};
+  // region index -> mask of the free blocks in that region; this is the source
+  // of truth of what the allocator owns
+  std::unordered_map<uint32_t, uint64_t> free_regions;
+
+  // the first region is left for metadata (see alloc_meta)
+  BitmapIdx recent_bitmap_idx{BITMAP_ENTRY_BLOCKS_CAPACITY};
+
+  // region index -> mask of the free blocks in that metadata region
+  std::unordered_map<uint32_t, uint64_t> meta_regions;
 
  public:
   BlockAllocator(MemTable* mem_table, BitmapMgr* bitmap_mgr)
@@ -29,96 +54,128 @@ class BlockAllocator {
    * if large number of blocks required, please break it into multiple alloc and
    * use log entries to chain them together
    *
+   * With a hint, the blocks are placed at the hint if they are free, either in
+   * the local free lists or in the bitmap. Otherwise, the blocks of a
+   * sequential stream are placed at the beginning of the largest free run, or
+   * of a fresh region, so that the stream has room to continue.
+   *
    * @param num_blocks number of blocks to allocate
+   * @param hint the preferred logical block index; 0 if none
+   * @param is_stream whether the blocks continue a sequential stream
    * @return the logical block id of the first block
    */
-  [[nodiscard]] LogicalBlockIdx alloc(uint32_t num_blocks) {
+  [[nodiscard]] LogicalBlockIdx alloc(uint32_t num_blocks,
+                                      LogicalBlockIdx hint = 0,
+                                      bool is_stream = false) {
     assert(num_blocks <= BITMAP_ENTRY_BLOCKS_CAPACITY);
 
-    if (!free_lists[num_blocks - 1].empty()) {
-      LogicalBlockIdx lidx = free_lists[num_blocks - 1].back();
-      free_lists[num_blocks - 1].pop_back();
-      LOG_TRACE(
-          "Allocator::alloc: allocating from free list (fully consumed): "
-          "[n_blk: %d, lidx: %u]",
-          num_blocks, lidx.get());
-      return lidx;
+    // the bitmap is only used at the hint within the current file size, so
+    // that a stream does not grow the file while there are free runs at hand
+    bool is_hint_in_file =
+        hint + num_blocks <= mem_table->get_meta()->get_num_logical_blocks();
+    if (hint != 0 && take(hint, num_blocks, is_hint_in_file)) {
+      LOG_TRACE("Allocator::alloc: allocated at hint: [n_blk: %d, lidx: %u]",
+                num_blocks, hint.get());
+      return hint;
     }
 
-    for (uint32_t n = num_blocks + 1; n <= BITMAP_ENTRY_BLOCKS_CAPACITY; ++n) {
-      if (!free_lists[n - 1].empty()) {
-        LogicalBlockIdx lidx = free_lists[n - 1].back();
-
-        free_lists[n - 1].pop_back();
-        free_lists[n - num_blocks - 1].push_back(lidx + num_blocks);
+    if (is_stream) {
+      if (LogicalBlockIdx lidx = alloc_from_free_lists(num_blocks, true);
+          lidx != 0)
+        return lidx;
+      if (hint != 0 && !is_hint_in_file &&
+          take(hint, num_blocks, /*from_bitmap*/ true))
+        return hint;
+      if (auto idx = bitmap_mgr->alloc_batch(recent_bitmap_idx);
+          idx.has_value()) {
+        LogicalBlockIdx lidx = idx.value();
+        recent_bitmap_idx = idx.value() + BITMAP_ENTRY_BLOCKS_CAPACITY;
         LOG_TRACE(
-            "Allocator::alloc: allocating from free list (partially consumed): "
-            "[n_blk: %d, lidx: %u] -> [n_blk: %d, lidx: %u]",
-            n, lidx.get(), n - num_blocks, lidx.get() + num_blocks);
+            "Allocator::alloc: reserved a region for a stream: "
+            "[n_blk: %d, lidx: %u]",
+            num_blocks, lidx.get());
+        if (num_blocks < BITMAP_ENTRY_BLOCKS_CAPACITY)
+          free(lidx + num_blocks, BITMAP_ENTRY_BLOCKS_CAPACITY - num_blocks);
         return lidx;
       }
     }
 
-    bool is_found = false;
-
-  retry:
-    // then we have to allocate from global bitmaps
-    // but try_alloc doesn't necessarily return the number of blocks we want
-    auto [allocated_idx, allocated_bits] =
-        bitmap_mgr->try_alloc(recent_bitmap_idx);
-    LOG_TRACE("Allocator::alloc: allocating from bitmap %d: 0x%lx",
-              allocated_idx, allocated_bits);
-
-    // add available bits to the local free list
-    uint32_t num_bits_left = BITMAP_ENTRY_BLOCKS_CAPACITY;
-    LogicalBlockIdx allocated_block_idx;
-    while (num_bits_left > 0) {
-      // first remove all trailing ones
-      auto num_right_ones =
-          static_cast<uint32_t>(std::countr_one(allocated_bits));
-      allocated_bits >>= num_right_ones;
-      num_bits_left -= num_right_ones;
-
-      // allocated_bits should have many trailing zeros
-      uint32_t num_right_zeros =
-          std::min(static_cast<uint32_t>(std::countr_zero(allocated_bits)),
-                   num_bits_left);
-      // if not, it means no bits left
-      if (num_right_zeros == 0) break;
-
-      if (!is_found && num_right_zeros >= num_blocks) {
-        is_found = true;
-        allocated_block_idx =
-            allocated_idx + BITMAP_ENTRY_BLOCKS_CAPACITY - num_bits_left;
-        LOG_TRACE("Allocator::alloc: allocated blocks: [n_blk: %d, lidx: %u]",
-                  num_right_zeros, allocated_block_idx.get());
-        if (num_right_zeros > num_blocks) {
-          free_lists[num_right_zeros - num_blocks - 1].emplace_back(
-              allocated_idx + BITMAP_ENTRY_BLOCKS_CAPACITY - num_bits_left +
-              num_blocks);
-          LOG_TRACE(
-              "Allocator::alloc: unused blocks saved: [n_blk: %d, lidx: %u]",
-              num_right_zeros - num_blocks,
-              allocated_idx + BITMAP_ENTRY_BLOCKS_CAPACITY - num_bits_left +
-                  num_blocks);
-        }
-      } else {
-        free_lists[num_right_zeros - 1].emplace_back(
-            allocated_idx + BITMAP_ENTRY_BLOCKS_CAPACITY - num_bits_left);
-        LOG_TRACE(
-            "Allocator::alloc: unused blocks saved: [n_blk: %d, lidx: %u]",
-            num_right_zeros,
-            allocated_idx + BITMAP_ENTRY_BLOCKS_CAPACITY - num_bits_left);
+    if (LogicalBlockIdx lidx = alloc_from_free_lists(num_blocks);
+        lidx != 0)
+      return lidx;
+
+    while (true) {
+      // then we have to allocate from global bitmaps
+      // but try_alloc doesn't necessarily return the number of blocks we want
+      auto [allocated_idx, allocated_bits] =
+          bitmap_mgr->try_alloc(recent_bitmap_idx);
+      LOG_TRACE("Allocator::alloc: allocating from bitmap %d: 0x%lx",
+                allocated_idx, allocated_bits);
+      // this recent is not useful because we have taken all bits; move on
+      recent_bitmap_idx = allocated_idx + BITMAP_ENTRY_BLOCKS_CAPACITY;
+
+      // add the blocks that were free in the bitmap to the local free lists
+      uint32_t begin = 0;
+      while (begin < BITMAP_ENTRY_BLOCKS_CAPACITY) {
+        uint64_t bits = allocated_bits >> begin;
+        begin += static_cast<uint32_t>(std::countr_one(bits));
+        if (begin >= BITMAP_ENTRY_BLOCKS_CAPACITY) break;
+        uint32_t len = std::min(static_cast<uint32_t>(std::countr_zero(
+                                    allocated_bits >> begin)),
+                                BITMAP_ENTRY_BLOCKS_CAPACITY - begin);
+        free(allocated_idx + begin, len);
+        begin += len;
       }
-      allocated_bits >>= num_right_zeros;
-      num_bits_left -= num_right_zeros;
+
+      // don't have the right size, retry
+      if (LogicalBlockIdx lidx = alloc_from_free_lists(num_blocks);
+          lidx != 0)
+        return lidx;
+    }
+  }
+
+  /**
+   * Allocate a block for metadata (a tx block or a log entry block). These are
+   * first taken from the rest of the first region, which is not used for data;
+   * once it is used up, a whole region is taken for metadata at a time.
+   *
+   * @return the logical block index of the block
+   */
+  [[nodiscard]] LogicalBlockIdx alloc_meta() {
+    if (auto it = meta_regions.begin(); it != meta_regions.end()) {
+      auto offset = static_cast<uint32_t>(std::countr_zero(it->second));
+      LogicalBlockIdx lidx =
+          (it->first << BITMAP_ENTRY_BLOCKS_CAPACITY_SHIFT) + offset;
+      it->second &= it->second - 1;
+      if (it->second == 0) meta_regions.erase(it);
+      return lidx;
+    }
+
+    if (auto idx = bitmap_mgr->alloc_meta(); idx.has_value())
+      return idx.value();
+
+    if (auto idx = bitmap_mgr->alloc_batch(0); idx.has_value()) {
+      LogicalBlockIdx lidx = idx.value();
+      LOG_TRACE("Allocator::alloc_meta: reserved a metadata region at %u",
+                lidx.get());
+      meta_regions[region_of(lidx)] = ~BitmapEntry::mask(0, 1);
+      return lidx;
     }
-    // this recent is not useful because we have taken all bits; move on
-    recent_bitmap_idx = allocated_idx + BITMAP_ENTRY_BLOCKS_CAPACITY;
 
-    // don't have the right size, retry
-    if (!is_found) goto retry;
-    return allocated_block_idx;
+    return alloc(1);
+  }
+
+  /**
+   * Free a block allocated by alloc_meta; it is kept for metadata
+   */
+  void free_meta(LogicalBlockIdx block_idx) {
+    if (block_idx == 0) return;
+    LOG_TRACE("Allocator::alloc_meta: adding to metadata free list: %u",
+              block_idx.get());
+    uint64_t& free_mask = meta_regions[region_of(block_idx)];
+    uint64_t bit = BitmapEntry::mask(offset_in_region(block_idx), 1);
+    assert((free_mask & bit) == 0);
+    free_mask |= bit;
   }
 
   /**
@@ -128,7 +185,14 @@ class BlockAllocator {
     if (block_idx == 0) return;
     LOG_TRACE("Allocator::alloc: adding to free list: [%u, %u)",
               block_idx.get(), num_blocks + block_idx.get());
-    free_lists[num_blocks - 1].emplace_back(block_idx);
+    // the range may span regions, e.g., when the blocks were placed by a hint
+    while (num_blocks > 0) {
+      uint32_t n = std::min(num_blocks, BITMAP_ENTRY_BLOCKS_CAPACITY -
+                                            offset_in_region(block_idx));
+      add_to_region(block_idx, n);
+      block_idx = block_idx + n;
+      num_blocks -= n;
+    }
   }
 
   /**
@@ -136,9 +200,8 @@ class BlockAllocator {
    * continuous
    */
   void free(const std::vector<LogicalBlockIdx>& recycle_image) {
-    // try to group blocks
-    // we don't try to merge the blocks with existing free list since the
-    // searching is too expensive
+    // try to group blocks; the groups are merged with the free neighbors in
+    // the same region
     uint32_t group_begin = 0;
     LogicalBlockIdx group_begin_lidx = 0;
     uint32_t image_size = recycle_image.size();
@@ -153,29 +216,199 @@ class BlockAllocator {
         // continue the group if it matches the expectation
         if (recycle_image[curr] == group_begin_lidx + (curr - group_begin))
           continue;
-        LOG_TRACE("Allocator::free: adding to free list: [%u, %u)",
-                  group_begin_lidx.get(),
-                  curr - group_begin + group_begin_lidx.get());
-        free_lists[curr - group_begin - 1].emplace_back(group_begin_lidx);
+        free(group_begin_lidx, curr - group_begin);
         group_begin_lidx = recycle_image[curr];
         if (group_begin_lidx != 0) group_begin = curr;
       }
     }
-    if (group_begin_lidx != 0) {
-      LOG_TRACE("Allocator::free: adding to free list: [%u, %u)",
-                group_begin_lidx.get(),
-                group_begin_lidx.get() + image_size - group_begin);
-      free_lists[image_size - group_begin - 1].emplace_back(group_begin_lidx);
-    }
+    if (group_begin_lidx != 0)
+      free(group_begin_lidx, image_size - group_begin);
+  }
+
+  /**
+   * Drop the free lists without returning them to the bitmap. Used in a forked
+   * child, where these blocks still belong to the parent.
+   */
+  void forget() {
+    for (auto& free_list : free_lists) free_list.clear();
+    num_free_list_entries = 0;
+    num_free_runs = 0;
+    free_regions.clear();
+    meta_regions.clear();
   }
 
   /**
    * Return all the blocks in the free list to the bitmap
    */
   void return_free_list() {
-    for (uint32_t n = 0; n < BITMAP_ENTRY_BLOCKS_CAPACITY; ++n)
-      for (LogicalBlockIdx lidx : free_lists[n])
-        bitmap_mgr->free(static_cast<BitmapIdx>(lidx.get()), n + 1);
+    for (auto [region, free_mask] : free_regions)
+      return_region(region, free_mask);
+    for (auto [region, free_mask] : meta_regions)
+      return_region(region, free_mask);
+    // these blocks are no longer ours; another thread may allocate them
+    forget();
+  }
+
+  [[nodiscard]] size_t get_num_free_list_entries() const {
+    return num_free_list_entries;
+  }
+
+ private:
+  static uint32_t region_of(LogicalBlockIdx lidx) {
+    return lidx >> BITMAP_ENTRY_BLOCKS_CAPACITY_SHIFT;
+  }
+  static uint32_t offset_in_region(LogicalBlockIdx lidx) {
+    return lidx & (BITMAP_ENTRY_BLOCKS_CAPACITY - 1);
+  }
+
+  /**
+   * Return the free blocks of a region to the bitmap
+   */
+  void return_region(uint32_t region, uint64_t free_mask) const {
+    uint32_t begin = 0;
+    while (free_mask >> begin != 0) {
+      begin += static_cast<uint32_t>(std::countr_zero(free_mask >> begin));
+      uint32_t len = std::min(
+          static_cast<uint32_t>(std::countr_one(free_mask >> begin)),
+          BITMAP_ENTRY_BLOCKS_CAPACITY - begin);
+      bitmap_mgr->free(
+          (region << BITMAP_ENTRY_BLOCKS_CAPACITY_SHIFT) + begin,
+          static_cast<uint8_t>(len));
+      begin += len;
+      if (begin >= BITMAP_ENTRY_BLOCKS_CAPACITY) break;
+    }
+  }
+
+  // the number of consecutive set bits right below/from bit `idx`
+  static uint32_t ones_below(uint64_t bits, uint32_t idx) {
+    if (idx == 0) return 0;
+    return static_cast<uint32_t>(
+        std::countl_one(bits << (BITMAP_ENTRY_BLOCKS_CAPACITY - idx)));
+  }
+  static uint32_t ones_from(uint64_t bits, uint32_t idx) {
+    if (idx >= BITMAP_ENTRY_BLOCKS_CAPACITY) return 0;
+    return static_cast<uint32_t>(std::countr_one(bits >> idx));
+  }
+
+  /**
+   * Push a free run of num_blocks beginning from lidx to the free lists; if
+   * the stale entries then outnumber the free runs, the lists are rebuilt from
+   * free_regions, so that their size stays linear in the number of free runs
+   */
+  void push_free_run(LogicalBlockIdx lidx, uint32_t num_blocks) {
+    free_lists[num_blocks - 1].push_back(lidx);
+    if (++num_free_list_entries <=
+        2 * num_free_runs + BITMAP_ENTRY_BLOCKS_CAPACITY)
+      return;
+
+    for (auto& free_list : free_lists) free_list.clear();
+    num_free_list_entries = 0;
+    for (auto [region, free_mask] : free_regions) {
+      uint32_t begin = 0;
+      while (begin < BITMAP_ENTRY_BLOCKS_CAPACITY && free_mask >> begin != 0) {
+        begin += static_cast<uint32_t>(std::countr_zero(free_mask >> begin));
+        uint32_t len = ones_from(free_mask, begin);
+        free_lists[len - 1].push_back(
+            (region << BITMAP_ENTRY_BLOCKS_CAPACITY_SHIFT) + begin);
+        num_free_list_entries++;
+        begin += len;
+      }
+    }
+    assert(num_free_list_entries == num_free_runs);
+  }
+
+  /**
+   * Add [lidx, lidx + num_blocks) within a region to the free lists, merged
+   * with its free neighbors
+   */
+  void add_to_region(LogicalBlockIdx lidx, uint32_t num_blocks) {
+    uint32_t offset = offset_in_region(lidx);
+    uint64_t& free_mask = free_regions[region_of(lidx)];
+    assert((free_mask & BitmapEntry::mask(offset, num_blocks)) == 0);
+    free_mask |= BitmapEntry::mask(offset, num_blocks);
+    uint32_t left = ones_below(free_mask, offset);
+    uint32_t right = ones_from(free_mask, offset + num_blocks);
+    num_free_runs = num_free_runs + 1 - (left > 0) - (right > 0);
+    push_free_run(lidx - left, left + num_blocks + right);
+  }
+
+  /**
+   * Take [lidx, lidx + num_blocks) within a region from the free lists
+   *
+   * @return true if all of them are free in the free lists
+   */
+  bool take_from_region(LogicalBlockIdx lidx, uint32_t num_blocks) {
+    auto it = free_regions.find(region_of(lidx));
+    if (it == free_regions.end()) return false;
+    uint32_t offset = offset_in_region(lidx);
+    uint64_t range = BitmapEntry::mask(offset, num_blocks);
+    if ((it->second & range) != range) return false;
+
+    // the free run containing the range is split into the parts around it
+    uint32_t left = ones_below(it->second, offset);
+    uint32_t right = ones_from(it->second, offset + num_blocks);
+    it->second &= ~range;
+    if (it->second == 0) free_regions.erase(it);
+    num_free_runs = num_free_runs + (left > 0) + (right > 0) - 1;
+    if (left > 0) push_free_run(lidx - left, left);
+    if (right > 0) push_free_run(lidx + num_blocks, right);
+    return true;
+  }
+
+  /**
+   * Take [lidx, lidx + num_blocks) from the free lists or, if from_bitmap is
+   * set, the bitmap; the range may span two regions
+   *
+   * @return true on success; otherwise nothing is taken
+   */
+  bool take(LogicalBlockIdx lidx, uint32_t num_blocks, bool from_bitmap) {
+    uint32_t n = std::min(num_blocks,
+                          BITMAP_ENTRY_BLOCKS_CAPACITY - offset_in_region(lidx));
+    auto take_one = [&](LogicalBlockIdx begin, uint32_t len) {
+      return take_from_region(begin, len) ||
+             (from_bitmap && region_of(begin) != 0 &&
+              bitmap_mgr->alloc_range(static_cast<BitmapIdx>(begin.get()),
+                                      len));
+    };
+    if (!take_one(lidx, n)) return false;
+    if (n == num_blocks || take_one(lidx + n, num_blocks - n)) return true;
+    free(lidx, n);
+    return false;
+  }
+
+  /**
+   * Allocate from the smallest free run that fits, which keeps the larger runs
+   * intact; a stream takes the largest one instead (but at least twice its
+   * size), which leaves the most room for it to continue
+   *
+   * @return the logical block index; 0 if no such run
+   */
+  LogicalBlockIdx alloc_from_free_lists(uint32_t num_blocks,
+                                        bool is_stream = false) {
+    uint32_t min_run =
+        is_stream ? std::min(2 * num_blocks, BITMAP_ENTRY_BLOCKS_CAPACITY)
+                  : num_blocks;
+    for (uint32_t i = min_run; i <= BITMAP_ENTRY_BLOCKS_CAPACITY; ++i) {
+      uint32_t n = is_stream ? BITMAP_ENTRY_BLOCKS_CAPACITY + min_run - i : i;
+      auto& free_list = free_lists[n - 1];
+      while (!free_list.empty()) {
+        LogicalBlockIdx lidx = free_list.back();
+        free_list.pop_back();
+        num_free_list_entries--;
+        auto it = free_regions.find(region_of(lidx));
+        uint64_t range = BitmapEntry::mask(offset_in_region(lidx), n);
+        if (it == free_regions.end() || (it->second & range) != range)
+          continue;  // stale
+        LOG_TRACE(
+            "Allocator::alloc: allocating from free list: "
+            "[n_blk: %d, lidx: %u] -> [n_blk: %d, lidx: %u]",
+            n, lidx.get(), n - num_blocks, lidx.get() + num_blocks);
+        [[maybe_unused]] bool success = take_from_region(lidx, num_blocks);
+        assert(success);
+        return lidx;
+      }
+    }
+    return 0;
   }
 };
 }  // namespace madfs::dram
@@ -15,6 +15,9 @@ class LogEntryAllocator {
   LogicalBlockIdx curr_log_block_idx{0};
   LogLocalOffset curr_log_offset{0};  // offset of the next available byte
 
+  // reused buffer to merge begin_lidxs into runs
+  std::vector<pmem::LogEntry::Run> runs;
+
  public:
   LogEntryAllocator(BlockAllocator* block_allocator, MemTable* mem_table)
       : block_allocator(block_allocator), mem_table(mem_table) {}
@@ -23,7 +26,8 @@ class LogEntryAllocator {
    * populate log entries required by a single transaction; do persist but not
    * fenced
    *
-   * @param op operation code, e.g., LOG_OVERWRITE
+   * @param op operation code, e.g., LOG_OVERWRITE; LOG_OVERWRITE_RUNS falls
+   * back to LOG_OVERWRITE if the runs do not make the entries smaller
    * @param leftover_bytes remaining empty bytes in the last block
    * @param num_blocks total number blocks touched
    * @param begin_vidx start of virtual index
@@ -34,6 +38,25 @@ class LogEntryAllocator {
   LogCursor append(pmem::LogEntry::Op op, uint16_t leftover_bytes,
                    uint32_t num_blocks, VirtualBlockIdx begin_vidx,
                    const std::vector<LogicalBlockIdx>& begin_lidxs) {
+    if (op == pmem::LogEntry::Op::LOG_OVERWRITE_RUNS) {
+      // merge the chunks that are physically contiguous
+      runs.clear();
+      for (uint32_t i = 0; i < begin_lidxs.size(); ++i) {
+        uint32_t offset = i << BITMAP_ENTRY_BLOCKS_CAPACITY_SHIFT;
+        uint32_t n =
+            std::min(num_blocks - offset, BITMAP_ENTRY_BLOCKS_CAPACITY);
+        if (!runs.empty() &&
+            runs.back().begin_lidx + runs.back().num_blocks == begin_lidxs[i])
+          runs.back().num_blocks += n;
+        else
+          runs.push_back({begin_lidxs[i], n});
+      }
+      if (runs.size() * sizeof(pmem::LogEntry::Run) <
+          begin_lidxs.size() * sizeof(LogicalBlockIdx))
+        return append_runs(leftover_bytes, begin_vidx);
+      op = pmem::LogEntry::Op::LOG_OVERWRITE;
+    }
+
     const LogCursor head = this->alloc(num_blocks);
     LogCursor log_cursor = head;
 
@@ -62,6 +85,36 @@ class LogEntryAllocator {
   }
 
  private:
+  /**
+   * populate LOG_OVERWRITE_RUNS entries from `runs`
+   */
+  LogCursor append_runs(uint16_t leftover_bytes, VirtualBlockIdx begin_vidx) {
+    const LogCursor head = this->alloc(static_cast<uint32_t>(runs.size()),
+                                       sizeof(pmem::LogEntry::Run));
+    LogCursor log_cursor = head;
+
+    uint32_t i = 0;
+    while (true) {
+      log_cursor->op = pmem::LogEntry::Op::LOG_OVERWRITE_RUNS;
+      log_cursor->begin_vidx = begin_vidx;
+      pmem::LogEntry::Run* entry_runs = log_cursor->get_runs();
+      for (uint32_t j = 0; j < log_cursor->num_runs; ++j, ++i) {
+        entry_runs[j] = runs[i];
+        begin_vidx += runs[i].num_blocks;
+      }
+      if (log_cursor->has_next) {
+        log_cursor->leftover_bytes = 0;
+        log_cursor->persist();
+        log_cursor.advance(mem_table);
+      } else {  // last entry
+        log_cursor->leftover_bytes = leftover_bytes;
+        log_cursor->persist();
+        break;
+      }
+    }
+    return head;
+  }
+
   /**
    * Allocate a linked list of log entry that could fit a mapping of the given
    * length
@@ -70,14 +123,40 @@ class LogEntryAllocator {
    * @return a log cursor pointing to the first log entry
    */
   LogCursor alloc(uint32_t num_blocks) {
-    // for a log entry with only one logical block index, it takes 16 bytes
-    // if smaller than that, do not try to allocate log entry there
-    constexpr uint32_t min_required_size =
-        pmem::LogEntry::FIXED_SIZE + sizeof(LogicalBlockIdx);
+    LogCursor head = alloc(ALIGN_UP(num_blocks, BITMAP_ENTRY_BLOCKS_CAPACITY) >>
+                               BITMAP_ENTRY_BLOCKS_CAPACITY_SHIFT,
+                           sizeof(LogicalBlockIdx));
+    // each slot maps 64 blocks except the last one
+    LogCursor log_cursor = head;
+    while (true) {
+      uint32_t num_slots = log_cursor->num_blocks;
+      if (!log_cursor->has_next) {
+        log_cursor->num_blocks = num_blocks;
+        return head;
+      }
+      log_cursor->num_blocks = num_slots << BITMAP_ENTRY_BLOCKS_CAPACITY_SHIFT;
+      num_blocks -= log_cursor->num_blocks;
+      log_cursor.advance(mem_table);
+    }
+  }
+
+  /**
+   * Allocate a linked list of log entry with the given number of slots in the
+   * variable-length arrays in total
+   *
+   * @param needed_slots_cnt the total number of slots
+   * @param slot_size the size of each slot
+   * @return a log cursor pointing to the first log entry, whose num_blocks (or
+   * num_runs) is set to the number of slots in it
+   */
+  LogCursor alloc(uint32_t needed_slots_cnt, uint32_t slot_size) {
+    // for a log entry with only one slot, it takes FIXED_SIZE + slot_size
+    // bytes; if smaller than that, do not try to allocate log entry there
+    const uint32_t min_required_size = pmem::LogEntry::FIXED_SIZE + slot_size;
     if (curr_log_block_idx == 0 ||
         BLOCK_SIZE - curr_log_offset < min_required_size) {
       // no enough space left, do block allocation
-      curr_log_block_idx = block_allocator->alloc(1);
+      curr_log_block_idx = block_allocator->alloc_meta();
       curr_log_block =
           &mem_table->lidx_to_addr_rw(curr_log_block_idx)->log_entry_block;
       curr_log_offset = 0;
@@ -87,32 +166,26 @@ class LogEntryAllocator {
     pmem::LogEntryBlock* first_block = curr_log_block;
     pmem::LogEntry* first_entry = curr_log_block->get(curr_log_offset);
     pmem::LogEntry* curr_entry = first_entry;
-    uint32_t needed_lidxs_cnt =
-        ALIGN_UP(num_blocks, BITMAP_ENTRY_BLOCKS_CAPACITY) >>
-        BITMAP_ENTRY_BLOCKS_CAPACITY_SHIFT;
     while (true) {
       assert(curr_entry);
       curr_log_offset += pmem::LogEntry::FIXED_SIZE;
-      uint32_t avail_lidxs_cnt =
-          (BLOCK_SIZE - curr_log_offset) / sizeof(LogicalBlockIdx);
-      assert(avail_lidxs_cnt > 0);
-      if (needed_lidxs_cnt <= avail_lidxs_cnt) {
+      uint32_t avail_slots_cnt = (BLOCK_SIZE - curr_log_offset) / slot_size;
+      assert(avail_slots_cnt > 0);
+      if (needed_slots_cnt <= avail_slots_cnt) {
         curr_entry->has_next = false;
-        curr_entry->num_blocks = num_blocks;
-        curr_log_offset += needed_lidxs_cnt * sizeof(LogicalBlockIdx);
+        curr_entry->num_blocks = needed_slots_cnt;
+        curr_log_offset += needed_slots_cnt * slot_size;
         return {first_idx, first_block};
       }
 
       curr_entry->has_next = true;
-      curr_entry->num_blocks = avail_lidxs_cnt
-                               << BITMAP_ENTRY_BLOCKS_CAPACITY_SHIFT;
-      curr_log_offset += avail_lidxs_cnt * sizeof(LogicalBlockIdx);
-      needed_lidxs_cnt -= avail_lidxs_cnt;
-      num_blocks -= curr_entry->num_blocks;
+      curr_entry->num_blocks = avail_slots_cnt;
+      curr_log_offset += avail_slots_cnt * slot_size;
+      needed_slots_cnt -= avail_slots_cnt;
 
       assert(curr_log_offset <= BLOCK_SIZE);
       if (BLOCK_SIZE - curr_log_offset < min_required_size) {
-        curr_log_block_idx = block_allocator->alloc(1);
+        curr_log_block_idx = block_allocator->alloc_meta();
         curr_log_block =
             &mem_table->lidx_to_addr_rw(curr_log_block_idx)->log_entry_block;
         curr_log_offset = 0;
@@ -141,13 +214,13 @@ class LogEntryAllocator {
 
     // do we need to free the first le block? no if there is other le ahead
     if (log_cursor.idx.local_offset == 0)
-      block_allocator->free(log_cursor.idx.block_idx);
+      block_allocator->free_meta(log_cursor.idx.block_idx);
 
     LogicalBlockIdx prev_block_idx = log_cursor.idx.block_idx;
     while (log_cursor.advance(mem_table)) {
       if (prev_block_idx != log_cursor.idx.block_idx) {
         prev_block_idx = log_cursor.idx.block_idx;
-        block_allocator->free(prev_block_idx);
+        block_allocator->free_meta(prev_block_idx);
       }
     }
   }
@@ -24,12 +24,22 @@ class TxBlockAllocator {
         per_thread_data(per_thread_data) {}
 
   ~TxBlockAllocator() {
-    if (avail_tx_block) block_allocator->free(avail_tx_block_idx);
-    reset_per_thread_data();
+    if (avail_tx_block) block_allocator->free_meta(avail_tx_block_idx);
+    if (per_thread_data) reset_per_thread_data();
   }
 
   void reset_per_thread_data() { per_thread_data->reset(); }
 
+  /**
+   * Detach from the spare tx block and the per-thread slot without releasing
+   * them. Used in a forked child, where they still belong to the parent.
+   */
+  void forget() {
+    avail_tx_block = nullptr;
+    avail_tx_block_idx = 0;
+    per_thread_data = nullptr;
+  }
+
   [[nodiscard]] LogicalBlockIdx get_pinned_idx() const {
     return per_thread_data->get_tx_block_idx();
   }
@@ -44,9 +54,16 @@ class TxBlockAllocator {
    * thread performing the initial log replaying and do not reclaim any blocks.
    */
   void pin(LogicalBlockIdx tx_block_idx) {
+    // most transactions stay in the same tx block; skip the store to the
+    // shared memory in that case
+    if (per_thread_data->get_tx_block_idx() == tx_block_idx) return;
     per_thread_data->set_tx_block_idx(tx_block_idx);
   }
 
+  [[nodiscard]] PerThreadData* get_per_thread_data() const {
+    return per_thread_data;
+  }
+
   /**
    * @tparam B MetaBlock or TxBlock
    * @param block the block that needs a next block to be allocated
@@ -81,7 +98,7 @@ class TxBlockAllocator {
       return {avail_tx_block_idx, &tx_block->tx_block};
     }
 
-    LogicalBlockIdx new_block_idx = block_allocator->alloc(1);
+    LogicalBlockIdx new_block_idx = block_allocator->alloc_meta();
     pmem::Block* tx_block = mem_table->lidx_to_addr_rw(new_block_idx);
     memset(&tx_block->cache_lines[NUM_CL_PER_BLOCK - 1], 0, CACHELINE_SIZE);
     tx_block->tx_block.set_tx_seq(tx_seq);
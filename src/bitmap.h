@@ -1,5 +1,6 @@
 #pragma once
 
+#include <algorithm>
 #include <atomic>
 #include <bit>
 #include <bitset>
@@ -12,6 +13,7 @@
 
 #include "const.h"
 #include "idx.h"
+#include "posix.h"
 #include "utils/logging.h"
 #include "utils/utils.h"
 
@@ -31,18 +33,23 @@ class BitmapEntry : noncopyable {
   constexpr static uint64_t BITMAP_ALL_USED =
       std::numeric_limits<uint64_t>::max();
 
-  // return the index of the bit (0-63)
+  // the bits in [begin_idx, begin_idx + len); len may be 64
+  constexpr static uint64_t mask(uint32_t begin_idx, uint32_t len) {
+    return (len == BITMAP_ENTRY_BLOCKS_CAPACITY ? BITMAP_ALL_USED
+                                                : (uint64_t{1} << len) - 1)
+           << begin_idx;
+  }
+
+  // return the index of the bit (0-63); empty if all bits are allocated
   std::optional<BitmapIdx> alloc_one() {
-  retry:
     uint64_t b = entry.load(std::memory_order_acquire);
-    if (b == BITMAP_ALL_USED) return -1;
-    uint64_t allocated = (~b) & (b + 1);  // which bit is allocated
-    // if bitmap is exactly the same as we saw previously, set it allocated
-    if (!entry.compare_exchange_strong(b, b & allocated,
-                                       std::memory_order_acq_rel,
-                                       std::memory_order_acquire))
-      goto retry;
-    return static_cast<BitmapIdx>(std::countr_zero(b));
+    do {
+      if (b == BITMAP_ALL_USED) return {};
+      // b | (b + 1) sets the lowest unset bit
+    } while (!entry.compare_exchange_weak(b, b | (b + 1),
+                                          std::memory_order_acq_rel,
+                                          std::memory_order_acquire));
+    return static_cast<BitmapIdx>(std::countr_one(b));
   }
 
   // allocate all blocks in this bit; return true on success
@@ -61,11 +68,23 @@ class BitmapEntry : noncopyable {
     return entry.exchange(BITMAP_ALL_USED, std::memory_order_acq_rel);
   }
 
+  // allocate blocks in [begin_idx, begin_idx + len) if all of them are free
+  bool alloc_range(BitmapIdx begin_idx, uint32_t len) {
+    uint64_t range = mask(begin_idx, len);
+    uint64_t b = entry.load(std::memory_order_acquire);
+    do {
+      if (b & range) return false;
+    } while (!entry.compare_exchange_weak(b, b | range,
+                                          std::memory_order_acq_rel,
+                                          std::memory_order_acquire));
+    return true;
+  }
+
   // free blocks in [begin_idx, begin_idx + len)
   void free(BitmapIdx begin_idx, uint32_t len) {
   retry:
     uint64_t b = entry.load(std::memory_order_acquire);
-    uint64_t freed = b & ~((((uint64_t)1 << len) - 1) << begin_idx);
+    uint64_t freed = b & ~mask(begin_idx, len);
     if (!entry.compare_exchange_strong(b, freed, std::memory_order_acq_rel,
                                        std::memory_order_acquire))
       goto retry;
@@ -95,6 +114,13 @@ class BitmapEntry : noncopyable {
     return entry.load(std::memory_order_relaxed) & (1UL << idx);
   }
 
+  [[nodiscard]] uint64_t get() const {
+    return entry.load(std::memory_order_acquire);
+  }
+
+  // WARN: not thread-safe
+  void set(uint64_t b) { entry.store(b, std::memory_order_relaxed); }
+
   [[nodiscard]] uint64_t is_empty() const {
     return entry.load(std::memory_order_relaxed) == 0;
   }
@@ -112,17 +138,69 @@ static_assert(sizeof(BitmapEntry) == BITMAP_ENTRY_SIZE,
 
 class BitmapMgr : noncopyable {
   BitmapEntry* entries{nullptr};
+  // the shared memory is sparse, so the entries are backed before allocating
+  // from them (see reserve); the first bitmap block always is
+  const char* shm_path{nullptr};
+  mutable std::atomic<uint32_t> num_reserved_entries{
+      NUM_BITMAP_ENTRIES_PER_BLOCK};
 
   friend ::madfs::dram::File;
   friend ::madfs::utility::Converter;
 
  public:
   BitmapMgr() = default;
+
+  /**
+   * Back the entries [0, num_entries) in the shared memory, rounded up to whole
+   * bitmap blocks, so that touching them never raises SIGBUS when /dev/shm runs
+   * out of space; the failure shows here instead
+   */
+  void reserve(uint32_t num_entries) const {
+    uint32_t num_reserved =
+        num_reserved_entries.load(std::memory_order_acquire);
+    if (num_entries <= num_reserved) return;
+    num_entries = std::min(ALIGN_UP(num_entries, NUM_BITMAP_ENTRIES_PER_BLOCK),
+                           NUM_BITMAP_ENTRIES);
+    int fd = posix::open(shm_path, O_RDWR | O_NOFOLLOW | O_CLOEXEC);
+    PANIC_IF(fd < 0, "cannot open the shared memory %s", shm_path);
+    int rc = posix::posix_fallocate(fd, SHM_HEADER_SIZE,
+                                    num_entries * BITMAP_ENTRY_SIZE);
+    posix::close(fd);
+    errno = rc;
+    PANIC_IF(rc != 0, "cannot allocate the bitmap in the shared memory");
+    while (num_reserved < num_entries &&
+           !num_reserved_entries.compare_exchange_weak(
+               num_reserved, num_entries, std::memory_order_release,
+               std::memory_order_acquire)) {
+    }
+  }
+
   void set_allocated(LogicalBlockIdx block_idx) const {
     entries[block_idx >> BITMAP_ENTRY_BLOCKS_CAPACITY_SHIFT].set_allocated(
         block_idx & (BITMAP_ENTRY_BLOCKS_CAPACITY - 1));
   }
 
+  [[nodiscard]] bool is_allocated(LogicalBlockIdx block_idx) const {
+    return entries[block_idx >> BITMAP_ENTRY_BLOCKS_CAPACITY_SHIFT]
+        .is_allocated(block_idx & (BITMAP_ENTRY_BLOCKS_CAPACITY - 1));
+  }
+
+  // WARN: not thread-safe
+  void set_unallocated(LogicalBlockIdx block_idx) const {
+    entries[block_idx >> BITMAP_ENTRY_BLOCKS_CAPACITY_SHIFT].set_unallocated(
+        block_idx & (BITMAP_ENTRY_BLOCKS_CAPACITY - 1));
+  }
+
+  /**
+   * overwrite the bitmap entries [begin_entry, begin_entry + num_entries) with
+   * the ones saved in src; not thread-safe
+   */
+  void restore(const uint64_t* src, uint32_t begin_entry,
+               uint32_t num_entries) const {
+    for (uint32_t i = 0; i < num_entries; ++i)
+      entries[begin_entry + i].set(src[i]);
+  }
+
   /**
    * allocate a single block in the bitmap
    * used for managing MetaBlock::inline_bitmap
@@ -133,12 +211,23 @@ class BitmapMgr : noncopyable {
     uint32_t idx =
         static_cast<uint32_t>(hint) >> BITMAP_ENTRY_BLOCKS_CAPACITY_SHIFT;
     for (; idx < NUM_BITMAP_ENTRIES; ++idx) {
+      reserve_until(idx);
       if (auto ret = entries[idx].alloc_one(); ret.has_value())
         return (idx << BITMAP_ENTRY_BLOCKS_CAPACITY_SHIFT) + ret.value();
     }
     return {};
   }
 
+  /**
+   * allocate a single block in the first bitmap entry, whose blocks after the
+   * meta block are kept for metadata (see BlockAllocator::alloc_meta)
+   *
+   * @return the BitmapIdx; empty if the entry is used up
+   */
+  [[nodiscard]] std::optional<BitmapIdx> alloc_meta() const {
+    return entries[0].alloc_one();
+  }
+
   /**
    * allocating 64 blocks in the bitmap
    * used for managing MetaBlock::inline_bitmap
@@ -150,6 +239,7 @@ class BitmapMgr : noncopyable {
     uint32_t idx =
         static_cast<uint32_t>(hint) >> BITMAP_ENTRY_BLOCKS_CAPACITY_SHIFT;
     for (; idx < NUM_BITMAP_ENTRIES; ++idx) {
+      reserve_until(idx);
       if (bool success = entries[idx].alloc_all(); success) {
         return idx << BITMAP_ENTRY_BLOCKS_CAPACITY_SHIFT;
       }
@@ -169,6 +259,7 @@ class BitmapMgr : noncopyable {
     uint32_t idx =
         static_cast<uint32_t>(hint) >> BITMAP_ENTRY_BLOCKS_CAPACITY_SHIFT;
     for (; idx < NUM_BITMAP_ENTRIES; ++idx) {
+      reserve_until(idx);
       uint64_t allocated_bits = entries[idx].alloc_rest();
       if (allocated_bits != BitmapEntry::BITMAP_ALL_USED)
         return {idx << BITMAP_ENTRY_BLOCKS_CAPACITY_SHIFT, allocated_bits};
@@ -176,6 +267,83 @@ class BitmapMgr : noncopyable {
     PANIC("Failed to allocate from bitmap");
   }
 
+  /**
+   * allocate the blocks within index range [begin, begin + len) if they are
+   * all free; used to place blocks right next to a given one
+   * here we assume that [begin, begin + len) is within the same bitmap
+   *
+   * @return true on success
+   */
+  [[nodiscard]] bool alloc_range(BitmapIdx begin, uint32_t len) const {
+    uint32_t idx =
+        static_cast<uint32_t>(begin) >> BITMAP_ENTRY_BLOCKS_CAPACITY_SHIFT;
+    if (idx >= NUM_BITMAP_ENTRIES) return false;
+    reserve_until(idx);
+    return entries[idx].alloc_range(
+        static_cast<uint32_t>(begin) & (BITMAP_ENTRY_BLOCKS_CAPACITY - 1), len);
+  }
+
+  /**
+   * allocate num_blocks contiguous blocks starting at the beginning of a
+   * bitmap entry; the rest of the last entry is left free
+   *
+   * @return the BitmapIdx of the first block; empty if there is no such space
+   */
+  [[nodiscard]] std::optional<BitmapIdx> alloc_contiguous(
+      uint32_t num_blocks) const {
+    uint32_t num_entries =
+        ALIGN_UP(num_blocks, BITMAP_ENTRY_BLOCKS_CAPACITY) >>
+        BITMAP_ENTRY_BLOCKS_CAPACITY_SHIFT;
+    uint32_t begin = 0;
+    for (uint32_t idx = 0; idx < NUM_BITMAP_ENTRIES; ++idx) {
+      reserve_until(idx);
+      if (!entries[idx].alloc_all()) {
+        // give back the partial run and start over after this entry
+        for (uint32_t i = begin; i < idx; ++i) entries[i].set_unallocated_all();
+        begin = idx + 1;
+        continue;
+      }
+      if (idx + 1 - begin < num_entries) continue;
+      if (uint32_t rest = num_blocks & (BITMAP_ENTRY_BLOCKS_CAPACITY - 1))
+        entries[idx].free(rest, BITMAP_ENTRY_BLOCKS_CAPACITY - rest);
+      return begin << BITMAP_ENTRY_BLOCKS_CAPACITY_SHIFT;
+    }
+    for (uint32_t i = begin; i < NUM_BITMAP_ENTRIES; ++i)
+      entries[i].set_unallocated_all();
+    return {};
+  }
+
+  /**
+   * allocate all blocks of the bitmap entries [begin_entry, begin_entry +
+   * num_entries) if they are all free
+   *
+   * @return true on success; otherwise nothing is allocated
+   */
+  [[nodiscard]] bool alloc_entries(uint32_t begin_entry,
+                                   uint32_t num_entries) const {
+    for (uint32_t idx = begin_entry; idx < begin_entry + num_entries; ++idx) {
+      if (idx < NUM_BITMAP_ENTRIES && entries[idx].alloc_all()) continue;
+      for (uint32_t i = begin_entry; i < idx; ++i)
+        entries[i].free(0, BITMAP_ENTRY_BLOCKS_CAPACITY);
+      return false;
+    }
+    return true;
+  }
+
+  /**
+   * free the blocks within index range [begin, begin + len), which may span
+   * multiple bitmap entries
+   */
+  void free_range(BitmapIdx begin, uint32_t len) const {
+    while (len > 0) {
+      uint32_t offset = begin & (BITMAP_ENTRY_BLOCKS_CAPACITY - 1);
+      uint32_t n = std::min(len, BITMAP_ENTRY_BLOCKS_CAPACITY - offset);
+      entries[begin >> BITMAP_ENTRY_BLOCKS_CAPACITY_SHIFT].free(offset, n);
+      begin += n;
+      len -= n;
+    }
+  }
+
   /**
    * free the blocks within index range [begin, begin + len)
    * here we assume that [begin, begin + len) is within the same bitmap
@@ -202,6 +370,15 @@ class BitmapMgr : noncopyable {
     }
     return out;
   }
+
+ private:
+  /**
+   * back the entry idx before an allocation touches it
+   */
+  void reserve_until(uint32_t idx) const {
+    if (unlikely(idx >= num_reserved_entries.load(std::memory_order_relaxed)))
+      reserve(idx + 1);
+  }
 };
 
 }  // namespace madfs::dram
@@ -2,11 +2,14 @@
 
 #include <tbb/concurrent_vector.h>
 
+#include <algorithm>
 #include <atomic>
 #include <cstdint>
 #include <cstring>
+#include <optional>
 #include <ostream>
 #include <type_traits>
+#include <vector>
 
 #include "bitmap.h"
 #include "block/block.h"
@@ -31,14 +34,189 @@ struct FileState {
 };
 static_assert(sizeof(FileState) == 24);
 
+/**
+ * The mapping from virtual blocks to logical blocks, kept in groups of 64
+ * virtual blocks (the allocation unit of the bitmap). Each group is an 8-byte
+ * node that is either a hole, a run of contiguous logical blocks, or a pointer
+ * to a leaf of 64 entries.
+ *
+ * A write covering a whole group keeps it as a run, so a large file written
+ * sequentially costs 1/32 of a dense table, and a sparse file costs nothing
+ * for its holes. A group becomes a leaf once it is partially overwritten, and
+ * turns back into a run or a hole once its entries are contiguous again.
+ *
+ * A leaf that is no longer used is kept for the next group that needs one
+ * rather than freed, so a lock-free reader that still holds it reads valid
+ * memory; the version of the leaf is bumped when it is given up, and the
+ * reader retries if it sees the version or the node change.
+ *
+ * Readers are lock-free; writers must be serialized (by BlkTable's spinlock).
+ */
+class VidxTable : noncopyable {
+  constexpr static uint32_t GROUP_SHIFT = BITMAP_ENTRY_BLOCKS_CAPACITY_SHIFT;
+  constexpr static uint32_t GROUP_SIZE = 1 << GROUP_SHIFT;
+  constexpr static uint32_t GROUP_MASK = GROUP_SIZE - 1;
+  // leaves are at least 8-byte aligned, so a set lowest bit marks a run
+  constexpr static uint64_t RUN_BIT = 1;
+
+  struct Leaf {
+    std::atomic<LogicalBlockIdx> entries[GROUP_SIZE];
+    // bumped every time the leaf is given up by its group
+    std::atomic<uint32_t> version;
+  };
+  static_assert(std::atomic<LogicalBlockIdx>::is_always_lock_free);
+
+  // 0 for a hole; (begin_lidx << 1 | RUN_BIT) for a run; Leaf* otherwise
+  tbb::concurrent_vector<std::atomic<uint64_t>,
+                         zero_allocator<std::atomic<uint64_t>>>
+      nodes;
+  // the leaves given up by their groups, to be reused
+  std::vector<Leaf*> free_leaves;
+  // the number of leaves allocated, including the free ones
+  size_t num_leaves = 0;
+
+ public:
+  VidxTable() = default;
+  ~VidxTable() {
+    for (const auto& node : nodes)
+      if (is_leaf(node)) delete as_leaf(node);
+    for (Leaf* leaf : free_leaves) delete leaf;
+  }
+
+  /**
+   * @return the logical block index of the virtual block; 0 if it is a hole
+   */
+  [[nodiscard]] LogicalBlockIdx get(VirtualBlockIdx vidx) const {
+    uint32_t group = vidx >> GROUP_SHIFT;
+    if (group >= nodes.size()) return 0;
+    uint32_t offset = vidx & GROUP_MASK;
+    while (true) {
+      uint64_t node = nodes[group].load(std::memory_order_acquire);
+      if (node == 0) return 0;
+      if (node & RUN_BIT) return static_cast<uint32_t>(node >> 1) + offset;
+      const Leaf* leaf = as_leaf(node);
+      uint32_t version = leaf->version.load(std::memory_order_acquire);
+      LogicalBlockIdx lidx =
+          leaf->entries[offset].load(std::memory_order_acquire);
+      if (nodes[group].load(std::memory_order_acquire) == node &&
+          leaf->version.load(std::memory_order_relaxed) == version)
+        return lidx;
+    }
+  }
+
+  /**
+   * Map [begin_vidx, begin_vidx + num_blocks) to the contiguous logical blocks
+   * starting from begin_lidx, or to holes if begin_lidx is 0
+   */
+  void set(VirtualBlockIdx begin_vidx, LogicalBlockIdx begin_lidx,
+           uint32_t num_blocks) {
+    uint32_t vidx = begin_vidx.get();
+    uint32_t end_vidx = vidx + num_blocks;
+    uint32_t lidx = begin_lidx.get();
+    grow_to_fit(end_vidx);
+
+    while (vidx < end_vidx) {
+      uint32_t offset = vidx & GROUP_MASK;
+      uint32_t n = std::min(GROUP_SIZE - offset, end_vidx - vidx);
+      std::atomic<uint64_t>& node = nodes[vidx >> GROUP_SHIFT];
+      if (n == GROUP_SIZE) {
+        replace_node(node, lidx == 0 ? 0 : (uint64_t{lidx} << 1 | RUN_BIT));
+      } else {
+        Leaf* leaf = materialize(node);
+        for (uint32_t i = 0; i < n; ++i)
+          leaf->entries[offset + i].store(lidx == 0 ? 0 : lidx + i,
+                                          std::memory_order_release);
+        try_collapse(node, leaf);
+      }
+      vidx += n;
+      if (lidx != 0) lidx += n;
+    }
+  }
+
+  /**
+   * @return the upper bound of the virtual block indices ever mapped
+   */
+  [[nodiscard]] uint32_t capacity() const {
+    return static_cast<uint32_t>(nodes.size()) << GROUP_SHIFT;
+  }
+
+  /**
+   * @return the number of leaves in use by the groups
+   */
+  [[nodiscard]] size_t num_used_leaves() const {
+    return num_leaves - free_leaves.size();
+  }
+
+  /**
+   * @return the number of bytes used by the table
+   */
+  [[nodiscard]] size_t memory_usage() const {
+    return nodes.size() * sizeof(uint64_t) + num_leaves * sizeof(Leaf);
+  }
+
+ private:
+  static bool is_leaf(uint64_t node) { return node != 0 && !(node & RUN_BIT); }
+  static Leaf* as_leaf(uint64_t node) { return reinterpret_cast<Leaf*>(node); }
+
+  void grow_to_fit(uint32_t end_vidx) {
+    uint32_t num_groups = (end_vidx + GROUP_MASK) >> GROUP_SHIFT;
+    if (nodes.size() >= num_groups) return;
+    nodes.grow_to_at_least(next_pow2(num_groups - 1));
+  }
+
+  /**
+   * Store a hole or a run into the node, giving up its leaf if any
+   */
+  void replace_node(std::atomic<uint64_t>& node, uint64_t new_node) {
+    uint64_t curr = node.load(std::memory_order_relaxed);
+    node.store(new_node, std::memory_order_release);
+    if (!is_leaf(curr)) return;
+    Leaf* leaf = as_leaf(curr);
+    leaf->version.fetch_add(1, std::memory_order_release);
+    free_leaves.push_back(leaf);
+  }
+
+  /**
+   * Turn a hole or a run into a leaf with the same mapping
+   */
+  Leaf* materialize(std::atomic<uint64_t>& node) {
+    uint64_t curr = node.load(std::memory_order_relaxed);
+    if (is_leaf(curr)) return as_leaf(curr);
+    Leaf* leaf;
+    if (free_leaves.empty()) {
+      leaf = new Leaf();
+      ++num_leaves;
+    } else {
+      leaf = free_leaves.back();
+      free_leaves.pop_back();
+    }
+    for (uint32_t i = 0; i < GROUP_SIZE; ++i)
+      leaf->entries[i].store(
+          curr == 0 ? 0 : static_cast<uint32_t>(curr >> 1) + i,
+          std::memory_order_release);
+    node.store(reinterpret_cast<uint64_t>(leaf), std::memory_order_release);
+    return leaf;
+  }
+
+  /**
+   * Turn the leaf back into a hole or a run if its entries allow
+   */
+  void try_collapse(std::atomic<uint64_t>& node, const Leaf* leaf) {
+    uint32_t first = leaf->entries[0].load(std::memory_order_relaxed).get();
+    for (uint32_t i = 1; i < GROUP_SIZE; ++i) {
+      uint32_t expected = first == 0 ? 0 : first + i;
+      if (leaf->entries[i].load(std::memory_order_relaxed).get() != expected)
+        return;
+    }
+    replace_node(node, first == 0 ? 0 : (uint64_t{first} << 1 | RUN_BIT));
+  }
+};
+
 // read logs and update mapping from virtual blocks to logical blocks
 class BlkTable {
   MemTable* mem_table;
 
-  tbb::concurrent_vector<std::atomic<LogicalBlockIdx>,
-                         zero_allocator<std::atomic<LogicalBlockIdx>>>
-      table;
-  static_assert(std::atomic<LogicalBlockIdx>::is_always_lock_free);
+  VidxTable table;
 
   FileState state;
   /**
@@ -62,7 +240,7 @@ class BlkTable {
       : mem_table(mem_table),
         state{TxCursor::from_meta(mem_table->get_meta()), 0},
         version(0) {
-    table.grow_to_at_least(NUM_BLOCKS_PER_GROW);
+    // the table grows with the file when the tx history is applied
     pthread_spin_init(&spinlock, PTHREAD_PROCESS_PRIVATE);
   }
 
@@ -74,8 +252,7 @@ class BlkTable {
    */
   [[nodiscard]] LogicalBlockIdx vidx_to_lidx(
       VirtualBlockIdx virtual_block_idx) const {
-    if (virtual_block_idx >= table.size()) return 0;
-    return table[virtual_block_idx.get()];
+    return table.get(virtual_block_idx);
   }
 
   void update(FileState* result_state, Allocator* allocator = nullptr) {
@@ -99,10 +276,28 @@ class BlkTable {
    *
    * @param allocator if given, allow allocation when iterating the tx_idx
    * @param bitmap_mgr if given, initialized the bitmap
+   * @param snapshot_idx if given, the bitmap is loaded from a snapshot that
+   * reflects the tx history before this entry, so only the txs from here on
+   * are applied to the bitmap
    */
   uint64_t update_unsafe(Allocator* allocator = nullptr,
-                         BitmapMgr* bitmap_mgr = nullptr) {
+                         BitmapMgr* bitmap_mgr = nullptr,
+                         std::optional<TxEntryIdx> snapshot_idx = {}) {
     TimerGuard<Event::UPDATE> timer_guard;
+
+    // no tx history while the data is inline (see File::try_write_inline)
+    if (pmem::MetaBlock* meta = mem_table->get_meta();
+        unlikely(meta->has_inline_data())) {
+      if (uint64_t size; meta->get_inline_data_size(size) &&
+                         size > state.file_size) {
+        uint64_t old_ver = version.load(std::memory_order_relaxed);
+        version.store(old_ver + 1, std::memory_order_release);
+        state.file_size = size;
+        version.store(old_ver + 2, std::memory_order_release);
+      }
+      return state.file_size;
+    }
+
     TxCursor cursor = state.cursor;
 
     // it's possible that the previous update move idx to overflow state
@@ -117,25 +312,26 @@ class BlkTable {
     uint64_t old_ver = version.load(std::memory_order_relaxed);
     version.store(old_ver + 1, std::memory_order_release);
 
+    // the bitmap being initialized, if any, from the current tx on
+    BitmapMgr* curr_bitmap_mgr = snapshot_idx ? nullptr : bitmap_mgr;
     LogicalBlockIdx prev_tx_block_idx = 0;
     while (true) {
+      if (snapshot_idx && cursor.idx == *snapshot_idx)
+        curr_bitmap_mgr = bitmap_mgr;
       auto tx_entry = cursor.get_entry();
       if (!tx_entry.is_valid()) break;
-      if (bitmap_mgr && cursor.idx.block_idx != prev_tx_block_idx)
-        bitmap_mgr->set_allocated(cursor.idx.block_idx);
+      if (curr_bitmap_mgr && cursor.idx.block_idx != prev_tx_block_idx)
+        curr_bitmap_mgr->set_allocated(cursor.idx.block_idx);
       if (tx_entry.is_inline())
-        apply_inline_tx(tx_entry.inline_entry);
+        apply_inline_tx(tx_entry.inline_entry, curr_bitmap_mgr);
+      else if (tx_entry.is_inline_tail())
+        apply_inline_tail_tx(tx_entry.inline_tail_entry, curr_bitmap_mgr);
       else
-        apply_indirect_tx(tx_entry.indirect_entry, bitmap_mgr);
+        apply_indirect_tx(tx_entry.indirect_entry, curr_bitmap_mgr);
       prev_tx_block_idx = cursor.idx.block_idx;
       if (bool success = cursor.advance(mem_table, allocator); !success) break;
     }
 
-    // mark all live data blocks in bitmap
-    if (bitmap_mgr)
-      for (const auto& logical_idx : table)
-        bitmap_mgr->set_allocated(logical_idx);
-
     state.cursor = cursor;
 
     // inc the version into an even number to indicate they are consistent now
@@ -146,6 +342,19 @@ class BlkTable {
 
   [[nodiscard]] FileState get_state_unsafe() const { return state; }
 
+  /**
+   * Set the file size of a sealed file, whose tx history is empty. If the file
+   * is unsealed later, the replay produces the same size.
+   */
+  void init_sealed(uint64_t file_size) { state.file_size = file_size; }
+
+  /**
+   * Hold the spinlock across fork, so that the child never inherits a table
+   * in the middle of an update
+   */
+  void lock() { pthread_spin_lock(&spinlock); }
+  void unlock() { pthread_spin_unlock(&spinlock); }
+
  private:
   /**
    * Quick check if update is necessary; thread safe
@@ -159,6 +368,7 @@ class BlkTable {
    */
   [[nodiscard]] bool need_update(FileState* result_state,
                                  Allocator* allocator) const {
+    if (unlikely(mem_table->get_meta()->has_inline_data())) return true;
     uint64_t curr_ver = version.load(std::memory_order_acquire);
     if (curr_ver & 1) return true;  // old version means inconsistency
     *result_state = state;
@@ -172,9 +382,21 @@ class BlkTable {
     return result_state->cursor.get_entry().is_valid();
   }
 
-  void grow_to_fit(VirtualBlockIdx idx) {
-    if (table.size() > idx.get()) return;
-    table.grow_to_at_least(next_pow2(idx.get()));
+  /**
+   * Map [begin_vidx, begin_vidx + num_blocks) to the logical blocks starting
+   * from begin_lidx. If bitmap_mgr is given, the new blocks are marked and the
+   * blocks they replace are unmarked, as the writer of the tx has done.
+   */
+  void set_mapping(VirtualBlockIdx begin_vidx, LogicalBlockIdx begin_lidx,
+                   uint32_t num_blocks, BitmapMgr* bitmap_mgr) {
+    if (bitmap_mgr) {
+      for (uint32_t i = 0; i < num_blocks; ++i) {
+        if (LogicalBlockIdx old_lidx = table.get(begin_vidx + i); old_lidx != 0)
+          bitmap_mgr->set_unallocated(old_lidx);
+        if (begin_lidx != 0) bitmap_mgr->set_allocated(begin_lidx + i);
+      }
+    }
+    table.set(begin_vidx, begin_lidx, num_blocks);
   }
 
   /**
@@ -187,20 +409,14 @@ class BlkTable {
                          BitmapMgr* bitmap_mgr) {
     LogCursor log_cursor(tx_entry, mem_table, bitmap_mgr);
 
-    uint32_t num_blocks;
-    VirtualBlockIdx begin_vidx, end_vidx;
+    VirtualBlockIdx end_vidx;
     uint16_t leftover_bytes;
 
     do {
-      begin_vidx = log_cursor->begin_vidx;
-      num_blocks = log_cursor->num_blocks;
-      end_vidx = begin_vidx + num_blocks;
-      grow_to_fit(end_vidx);
-
-      for (uint32_t offset = 0; offset < log_cursor->num_blocks; ++offset)
-        table[begin_vidx.get() + offset] =
-            log_cursor->begin_lidxs[offset / BITMAP_ENTRY_BLOCKS_CAPACITY] +
-            offset % BITMAP_ENTRY_BLOCKS_CAPACITY;
+      end_vidx = log_cursor->for_each_run(
+          [&](VirtualBlockIdx vidx, LogicalBlockIdx lidx, uint32_t n) {
+            set_mapping(vidx, lidx, n, bitmap_mgr);
+          });
       // only the last one matters, so this variable will keep being overwritten
       leftover_bytes = log_cursor->leftover_bytes;
     } while (log_cursor.advance(mem_table, bitmap_mgr));
@@ -214,19 +430,18 @@ class BlkTable {
   /**
    * Apply an inline transaction to the block table
    * @param tx_entry the entry to be applied
+   * @param bitmap_mgr if passed, initialized the bitmap
    */
-  void apply_inline_tx(pmem::TxEntryInline tx_entry) {
+  void apply_inline_tx(pmem::TxEntryInline tx_entry, BitmapMgr* bitmap_mgr) {
     uint32_t num_blocks = tx_entry.num_blocks;
     // for dummy entry, do nothing
     if (num_blocks == 0) return;
     VirtualBlockIdx begin_vidx = tx_entry.begin_virtual_idx;
     LogicalBlockIdx begin_lidx = tx_entry.begin_logical_idx;
     VirtualBlockIdx end_vidx = begin_vidx + num_blocks;
-    grow_to_fit(end_vidx);
 
     // update block table mapping
-    for (uint32_t i = 0; i < num_blocks; ++i)
-      table[begin_vidx.get() + i] = begin_lidx + i;
+    set_mapping(begin_vidx, begin_lidx, num_blocks, bitmap_mgr);
 
     // update file size if this write exceeds current file size
     // inline tx must be aligned to BLOCK_SIZE boundary
@@ -234,17 +449,36 @@ class BlkTable {
     if (now_file_size > state.file_size) state.file_size = now_file_size;
   }
 
+  /**
+   * Apply an inline transaction with leftover bytes to the block table
+   * @param tx_entry the entry to be applied
+   * @param bitmap_mgr if passed, initialized the bitmap
+   */
+  void apply_inline_tail_tx(pmem::TxEntryInlineTail tx_entry,
+                            BitmapMgr* bitmap_mgr) {
+    VirtualBlockIdx begin_vidx = tx_entry.begin_virtual_idx;
+    VirtualBlockIdx end_vidx = begin_vidx + tx_entry.num_blocks;
+    set_mapping(begin_vidx, tx_entry.begin_logical_idx, tx_entry.num_blocks,
+                bitmap_mgr);
+
+    uint64_t now_file_size =
+        BLOCK_IDX_TO_SIZE(end_vidx) - tx_entry.leftover_bytes;
+    if (now_file_size > state.file_size) state.file_size = now_file_size;
+  }
+
   friend std::ostream& operator<<(std::ostream& out, const BlkTable& b) {
     out << "BlkTable:\n";
     out << "\tfile_size: " << b.state.file_size << "\n";
     out << "\ttail_tx_idx: " << b.state.cursor.idx << "\n";
-    for (size_t i = 0; i < b.table.size(); ++i) {
-      if (b.table[i].load() == 0) continue;
+    out << "\tmemory_usage: " << b.table.memory_usage() << "\n";
+    for (uint32_t i = 0; i < b.table.capacity(); ++i) {
+      LogicalBlockIdx lidx = b.table.get(i);
+      if (lidx == 0) continue;
       if (i >= 100) {
         out << "\t...\n";
         break;
       }
-      out << "\t" << i << " -> " << b.table[i] << "\n";
+      out << "\t" << i << " -> " << lidx << "\n";
     }
     return out;
   }
@@ -2,6 +2,7 @@
 
 #include "block/log.h"
 #include "block/meta.h"
+#include "block/snapshot.h"
 #include "block/tx.h"
 
 namespace madfs::pmem {
@@ -10,6 +11,7 @@ union Block {
   MetaBlock meta_block;
   TxBlock tx_block;
   LogEntryBlock log_entry_block;
+  BitmapSnapshotBlock bitmap_snapshot_block;
   char data[BLOCK_SIZE];
   char cache_lines[NUM_CL_PER_BLOCK][CACHELINE_SIZE];
 
@@ -39,6 +39,31 @@ class MetaBlock : public noncopyable {
       // orphan but not yet freed tx blocks are organized as a linked list;
       // these blocks are freed once they are not referenced by others
       std::atomic<LogicalBlockIdx> next_orphan_block;
+
+      // identity of the shared memory object (see dram::ShmMgr); written once
+      // so that opening the file does not need to read the xattr; it is only
+      // trusted on the inode it is made for (see shm_dev)
+      std::atomic<uint64_t> shm_ino;
+      uint64_t shm_tag;
+
+      // FORMAT_VERSION of the build that created the file
+      uint32_t format_version;
+
+      // blocks reserved by fallocate (see dram::File::fallocate): the virtual
+      // blocks from reserved_begin_vidx on are to be placed at the logical
+      // blocks from reserved_begin_lidx on; modified with the meta lock held
+      std::atomic<uint32_t> reserved_begin_vidx;
+      std::atomic<uint32_t> reserved_begin_lidx;
+      std::atomic<uint32_t> reserved_num_blocks;
+
+      // the first block of the bitmap snapshot (see BitmapSnapshotBlock); 0
+      // if there is none; modified with the meta lock held
+      std::atomic<LogicalBlockIdx> bitmap_snapshot_lidx;
+
+      // the device of the inode that shm_ino names, as the low 32 bits of
+      // st_dev, where Linux encodes the usual major and minor numbers; 0 if
+      // set by a build that did not record it
+      uint32_t shm_dev;
     } cl1_meta;
 
     // padding avoid cache line contention
@@ -58,6 +83,17 @@ class MetaBlock : public noncopyable {
       // modifications to this should be through the getter/setter functions
       // that use atomic instructions
       std::atomic<uint32_t> num_logical_blocks;
+
+      // if non-zero, the file is sealed (see utility::Sealer): the tx history
+      // is empty and virtual block i is at logical block sealed_begin_lidx + i
+      std::atomic<LogicalBlockIdx> sealed_begin_lidx;
+      uint64_t sealed_file_size;
+
+      // if INLINE_DATA_VALID is set, the data of a small file is kept in place
+      // of the inline tx entries and the rest bits are the file size; if
+      // INLINE_DATA_STALE is set, the inline tx entries still hold data that
+      // has been moved elsewhere. In both cases, there is no tx history.
+      std::atomic<uint64_t> inline_data_state;
     } cl2_meta;
 
     // padding
@@ -66,11 +102,20 @@ class MetaBlock : public noncopyable {
 
   static_assert(sizeof(cl2_meta) <= CACHELINE_SIZE);
 
+  constexpr static uint64_t INLINE_DATA_VALID = 1ul << 63;
+  constexpr static uint64_t INLINE_DATA_STALE = 1ul << 62;
+
   // 62 cache lines for tx log (~120 txs)
   std::atomic<TxEntry> tx_entries[NUM_INLINE_TX_ENTRY];
 
   static_assert(sizeof(tx_entries) == 62 * CACHELINE_SIZE);
 
+  // the field is not known to older formats, which never keep data inline
+  [[nodiscard]] uint64_t get_inline_data_state() const {
+    if (!allows_inline_data()) return 0;
+    return cl2_meta.inline_data_state.load(std::memory_order_acquire);
+  }
+
  public:
   /**
    * only called if a new file is created
@@ -82,6 +127,7 @@ class MetaBlock : public noncopyable {
 
     // initialize the signature
     memcpy(cl1_meta.signature, FILE_SIGNATURE, SIGNATURE_SIZE);
+    cl1_meta.format_version = FORMAT_VERSION;
     persist_cl_fenced(&cl1);
   }
 
@@ -91,6 +137,16 @@ class MetaBlock : public noncopyable {
            0;
   }
 
+  // whether TxEntryInlineTail and LOG_OVERWRITE_RUNS may be used
+  [[nodiscard]] bool has_compact_entries() const {
+    return cl1_meta.format_version >= FORMAT_VERSION_COMPACT;
+  }
+
+  // whether the data may be kept in the inline tx entries
+  [[nodiscard]] bool allows_inline_data() const {
+    return cl1_meta.format_version >= FORMAT_VERSION_INLINE_DATA;
+  }
+
   // acquire/release meta lock (usually only during allocation)
   // we don't need to call persistence since mutex is robust to crash
   void lock() {
@@ -134,6 +190,174 @@ class MetaBlock : public noncopyable {
 
   [[nodiscard]] static uint32_t get_tx_seq() { return 0; }
 
+  [[nodiscard]] bool is_sealed() const {
+    return cl2_meta.sealed_begin_lidx.load(std::memory_order_acquire) != 0;
+  }
+
+  /**
+   * Get the descriptor of a sealed file
+   * @return false if the file is not sealed
+   */
+  [[nodiscard]] bool get_sealed(LogicalBlockIdx& begin_lidx,
+                                uint64_t& file_size) const {
+    begin_lidx = cl2_meta.sealed_begin_lidx.load(std::memory_order_acquire);
+    file_size = cl2_meta.sealed_file_size;
+    return begin_lidx != 0;
+  }
+
+  void set_sealed(LogicalBlockIdx begin_lidx, uint64_t file_size) {
+    cl2_meta.sealed_file_size = file_size;
+    cl2_meta.sealed_begin_lidx.store(begin_lidx, std::memory_order_release);
+    persist_cl_fenced(&cl2);
+  }
+
+  // called with the meta lock held
+  void clear_sealed() {
+    cl2_meta.sealed_begin_lidx.store(0, std::memory_order_release);
+    persist_cl_fenced(&cl2);
+  }
+
+  /**
+   * Get the size of the data kept inline
+   * @return false if the data is not inline
+   */
+  [[nodiscard]] bool get_inline_data_size(uint64_t& size) const {
+    uint64_t state = get_inline_data_state();
+    size = state & ~INLINE_DATA_VALID;
+    return state & INLINE_DATA_VALID;
+  }
+
+  [[nodiscard]] bool is_inline() const {
+    return get_inline_data_state() & INLINE_DATA_VALID;
+  }
+
+  /**
+   * @return whether the inline tx entries are used for something other than
+   * the tx history, i.e., the data is inline or is being moved out
+   */
+  [[nodiscard]] bool has_inline_data() const {
+    return get_inline_data_state() != 0;
+  }
+
+  [[nodiscard]] const char* get_inline_data() const {
+    return reinterpret_cast<const char*>(tx_entries);
+  }
+
+  /**
+   * Start keeping the data inline if nothing has been written yet; called with
+   * the meta lock held
+   */
+  void try_init_inline_data() {
+    if (!allows_inline_data() || has_inline_data() || is_sealed() ||
+        get_next_tx_block() != 0 ||
+        tx_entries[0].load(std::memory_order_acquire).is_valid())
+      return;
+    cl2_meta.inline_data_state.store(INLINE_DATA_VALID,
+                                     std::memory_order_release);
+    persist_cl_fenced(&cl2);
+  }
+
+  /**
+   * Write [offset, offset + count) of the inline data, where offset is no less
+   * than the current size; the gap in between is zeroed. The new bytes become
+   * visible all at once when the size is updated, so a crash in the middle
+   * leaves the old content. Called with the meta lock held.
+   */
+  void append_inline_data(const char* buf, size_t count, uint64_t offset) {
+    uint64_t size;
+    [[maybe_unused]] bool is_inline = get_inline_data_size(size);
+    assert(is_inline && size <= offset);
+    assert(offset + count <= MAX_INLINE_DATA_SIZE);
+    char* data = reinterpret_cast<char*>(tx_entries);
+    if (offset > size) std::memset(data + size, 0, offset - size);
+    std::memcpy(data + offset, buf, count);
+    persist_fenced(data + size, offset + count - size);
+    cl2_meta.inline_data_state.store(INLINE_DATA_VALID | (offset + count),
+                                     std::memory_order_release);
+    persist_cl_fenced(&cl2);
+  }
+
+  /**
+   * Mark the inline data as moved elsewhere; readers that copied from it must
+   * retry. Called with the meta lock held.
+   */
+  void retire_inline_data() {
+    cl2_meta.inline_data_state.store(INLINE_DATA_STALE,
+                                     std::memory_order_release);
+    persist_cl_fenced(&cl2);
+  }
+
+  /**
+   * Zero the inline tx entries so that they can hold the tx history. Called
+   * with the meta lock held, after the data is retired.
+   */
+  void clear_inline_data() {
+    std::memset(reinterpret_cast<char*>(tx_entries), 0, sizeof(tx_entries));
+    persist_fenced(tx_entries, sizeof(tx_entries));
+    cl2_meta.inline_data_state.store(0, std::memory_order_release);
+    persist_cl_fenced(&cl2);
+  }
+
+  /**
+   * Get the identity of the shared memory object
+   * @return false if the identity is not set yet
+   */
+  [[nodiscard]] bool get_shm_id(uint64_t& ino, uint32_t& dev,
+                                uint64_t& tag) const {
+    ino = cl1_meta.shm_ino.load(std::memory_order_acquire);
+    dev = cl1_meta.shm_dev;
+    tag = cl1_meta.shm_tag;
+    return ino != 0;
+  }
+
+  void set_shm_id(uint64_t ino, uint64_t dev, uint64_t tag) {
+    cl1_meta.shm_tag = tag;
+    cl1_meta.shm_dev = static_cast<uint32_t>(dev);
+    cl1_meta.shm_ino.store(ino, std::memory_order_release);
+    persist_cl_fenced(&cl1);
+  }
+
+  /**
+   * Get the blocks reserved by fallocate; the result is only consistent if the
+   * meta lock is held
+   * @return false if there is no reservation
+   */
+  [[nodiscard]] bool get_reservation(VirtualBlockIdx& begin_vidx,
+                                     LogicalBlockIdx& begin_lidx,
+                                     uint32_t& num_blocks) const {
+    num_blocks = cl1_meta.reserved_num_blocks.load(std::memory_order_acquire);
+    begin_vidx = cl1_meta.reserved_begin_vidx.load(std::memory_order_relaxed);
+    begin_lidx = cl1_meta.reserved_begin_lidx.load(std::memory_order_relaxed);
+    return num_blocks != 0;
+  }
+
+  /**
+   * Set the reservation; called with the meta lock held
+   * No fence; the caller must fence before the blocks are used otherwise
+   */
+  void set_reservation(VirtualBlockIdx begin_vidx, LogicalBlockIdx begin_lidx,
+                       uint32_t num_blocks) {
+    cl1_meta.reserved_begin_vidx.store(begin_vidx.get(),
+                                       std::memory_order_relaxed);
+    cl1_meta.reserved_begin_lidx.store(begin_lidx.get(),
+                                       std::memory_order_relaxed);
+    cl1_meta.reserved_num_blocks.store(num_blocks, std::memory_order_release);
+    persist_cl_unfenced(&cl1);
+  }
+
+  /**
+   * @return the first block of the bitmap snapshot; 0 if there is none
+   */
+  [[nodiscard]] LogicalBlockIdx get_bitmap_snapshot() const {
+    return cl1_meta.bitmap_snapshot_lidx.load(std::memory_order_acquire);
+  }
+
+  // called with the meta lock held
+  void set_bitmap_snapshot(LogicalBlockIdx lidx) {
+    cl1_meta.bitmap_snapshot_lidx.store(lidx, std::memory_order_release);
+    persist_cl_fenced(&cl1);
+  }
+
   /**
    * Set the next tx block index
    * No flush+fence but leave it to flush_tx_block
@@ -222,6 +446,7 @@ class MetaBlock : public noncopyable {
 
   friend std::ostream& operator<<(std::ostream& out, const MetaBlock& block) {
     out << "MetaBlock: \n";
+    out << "\tformat_version: " << block.cl1_meta.format_version << "\n";
     out << "\tnum_logical_blocks: "
         << block.cl2_meta.num_logical_blocks.load(std::memory_order_acquire)
         << "\n";
@@ -230,6 +455,19 @@ class MetaBlock : public noncopyable {
     out << "\ttx_tail: "
         << block.cl1_meta.flushed_tx_tail.load(std::memory_order_acquire)
         << "\n";
+    LogicalBlockIdx begin_lidx;
+    uint64_t file_size;
+    if (block.get_sealed(begin_lidx, file_size))
+      out << "\tsealed: " << begin_lidx << " (" << file_size << " bytes)\n";
+    VirtualBlockIdx reserved_vidx;
+    uint32_t reserved_num_blocks;
+    if (block.get_reservation(reserved_vidx, begin_lidx, reserved_num_blocks))
+      out << "\treserved: " << reserved_vidx << " -> " << begin_lidx << " ("
+          << reserved_num_blocks << " blocks)\n";
+    if (LogicalBlockIdx lidx = block.get_bitmap_snapshot(); lidx != 0)
+      out << "\tbitmap snapshot: " << lidx << "\n";
+    if (block.get_inline_data_size(file_size))
+      out << "\tinline data: " << file_size << " bytes\n";
     return out;
   }
 };
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdint>
+
+#include "const.h"
+#include "idx.h"
+#include "utils/utils.h"
+
+namespace madfs::pmem {
+
+/**
+ * The first block of a bitmap snapshot (see dram::File::checkpoint_bitmap);
+ * the bitmap entries are kept in the blocks that follow it. Only the tx blocks
+ * and the log entry blocks referenced by the tx history are set, since the data
+ * blocks are known from the block table once the history is replayed.
+ */
+class BitmapSnapshotBlock : public noncopyable {
+  // the snapshot reflects the tx history before this entry
+  TxEntryIdx tx_idx;
+  // tx_seq of the tx block of tx_idx (0 for the meta block), used to check
+  // that the tx block is still part of the tx history
+  uint32_t tx_seq;
+  // the number of bitmap entries in the snapshot
+  uint32_t num_entries;
+  char unused[BLOCK_SIZE - sizeof(TxEntryIdx) - 2 * sizeof(uint32_t)];
+
+ public:
+  /**
+   * @return the number of blocks taken by a snapshot of num_entries bitmap
+   * entries, including this one
+   */
+  [[nodiscard]] static uint32_t get_num_blocks(uint32_t num_entries) {
+    return 1 + (num_entries + NUM_BITMAP_ENTRIES_PER_BLOCK - 1) /
+                   NUM_BITMAP_ENTRIES_PER_BLOCK;
+  }
+
+  void init(TxEntryIdx tx_idx, uint32_t tx_seq, uint32_t num_entries) {
+    this->tx_idx = tx_idx;
+    this->tx_seq = tx_seq;
+    this->num_entries = num_entries;
+    persist_cl_unfenced(this);
+  }
+
+  [[nodiscard]] TxEntryIdx get_tx_idx() const { return tx_idx; }
+  [[nodiscard]] uint32_t get_tx_seq() const { return tx_seq; }
+  [[nodiscard]] uint32_t get_num_entries() const { return num_entries; }
+  [[nodiscard]] uint32_t get_num_blocks() const {
+    return get_num_blocks(num_entries);
+  }
+};
+
+static_assert(sizeof(BitmapSnapshotBlock) == BLOCK_SIZE,
+              "BitmapSnapshotBlock must be of size BLOCK_SIZE");
+
+}  // namespace madfs::pmem
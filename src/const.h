@@ -17,6 +17,14 @@ constexpr static uint32_t CACHELINE_SIZE = 1 << CACHELINE_SHIFT;
  */
 constexpr static int SIGNATURE_SIZE = 8;
 constexpr static char FILE_SIGNATURE[SIGNATURE_SIZE] = "MADFS";
+// version of the on-PM format recorded in the meta block; files without a
+// version may be shared with older builds, so they never get entries that
+// only newer builds understand
+// adds TxEntryInlineTail and LogEntry::Op::LOG_OVERWRITE_RUNS
+constexpr static uint32_t FORMAT_VERSION_COMPACT = 2;
+// adds the inline data in the meta block (see MetaBlock::try_init_inline_data)
+constexpr static uint32_t FORMAT_VERSION_INLINE_DATA = 3;
+constexpr static uint32_t FORMAT_VERSION = FORMAT_VERSION_INLINE_DATA;
 constexpr static char SHM_XATTR_NAME[] = "user.shm_path";
 constexpr static uint16_t SHM_PATH_LEN = 64;
 // grow in the unit of 2 MB
@@ -26,6 +34,9 @@ constexpr static uint32_t GROW_UNIT_SIZE = 1 << GROW_UNIT_SHIFT;
 constexpr static uint32_t PREALLOC_SHIFT = 1 * GROW_UNIT_SHIFT;
 constexpr static uint32_t PREALLOC_SIZE = 1 * GROW_UNIT_SIZE;
 constexpr static uint32_t NUM_BLOCKS_PER_GROW = GROW_UNIT_SIZE >> BLOCK_SHIFT;
+// in the small-file mode, a new file starts with the meta block only and grows
+// by doubling until it reaches a grow unit
+constexpr static uint32_t SMALL_PREALLOC_SIZE = BLOCK_SIZE;
 
 /*
  * block index
@@ -47,6 +58,9 @@ constexpr static uint16_t NUM_CL_TX_ENTRY_IN_META =
     ((BLOCK_SIZE / CACHELINE_SIZE) - 2);
 constexpr static uint16_t NUM_INLINE_TX_ENTRY =
     NUM_CL_TX_ENTRY_IN_META * NUM_TX_ENTRY_PER_CL;
+// a small file may keep its data in place of the inline tx entries
+constexpr static uint32_t MAX_INLINE_DATA_SIZE =
+    NUM_INLINE_TX_ENTRY * TX_ENTRY_SIZE;
 
 /*
  * bitmap
@@ -70,13 +84,19 @@ constexpr static uint32_t NUM_BITMAP_ENTRIES =
 constexpr static uint32_t TOTAL_NUM_BITMAP_BYTES =
     NUM_BITMAP_BLOCKS * BLOCK_SIZE;
 
+// fsync updates the bitmap snapshot (see dram::File::checkpoint_bitmap) once
+// the tx history grows this many tx blocks past it
+constexpr static uint32_t BITMAP_SNAPSHOT_INTERVAL = 8;
+
 constexpr static uint16_t NUM_CL_PER_BLOCK = BLOCK_SIZE / CACHELINE_SIZE;
 constexpr static uint32_t NUM_OFFSET_QUEUE_SLOT = 16;
 
+// the first block of the shared memory holds the shared file attributes
+constexpr static uint32_t SHM_HEADER_SIZE = BLOCK_SIZE;
 // the last one is used for garbage collection
 constexpr static uint32_t SHM_GC_SIZE = BLOCK_SIZE;
 constexpr static uint32_t SHM_PER_THREAD_SIZE = CACHELINE_SIZE;
 constexpr static uint32_t MAX_NUM_THREADS = SHM_GC_SIZE / SHM_PER_THREAD_SIZE;
 constexpr static uint32_t SHM_SIZE =
-    NUM_BITMAP_BLOCKS * BLOCK_SIZE + SHM_GC_SIZE;
+    SHM_HEADER_SIZE + NUM_BITMAP_BLOCKS * BLOCK_SIZE + SHM_GC_SIZE;
 }  // namespace madfs
@@ -0,0 +1,174 @@
+#pragma once
+
+#include <pthread.h>
+#include <signal.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+#include "config.h"
+#include "const.h"
+#include "utils/logging.h"
+#include "utils/persist.h"
+
+namespace madfs::dram {
+
+/**
+ * Helper threads that split a large copy with its caller, since a single
+ * thread cannot saturate the bandwidth of PM.
+ *
+ * A copy is split into tasks that run on the caller and on the idle helpers;
+ * the caller returns once all of them are done. Each task ends with its own
+ * fence, so the caller may commit right after. Only one copy uses the helpers
+ * at a time; a concurrent one runs on its caller alone, as do all copies if
+ * runtime_options.copy_threads is 1.
+ *
+ * The helpers are started on the first large copy. They are never joined,
+ * since they may still be waiting when the process exits.
+ */
+class CopyPool : noncopyable {
+  // the number of bytes below which a copy is not worth another thread
+  constexpr static size_t MIN_BYTES_PER_THREAD = 1 << 20;
+
+  struct Batch {
+    void (*invoke)(const void* fn, uint32_t task_idx);
+    const void* fn;
+    uint32_t num_tasks;
+    std::atomic<uint32_t> next_task{0};
+    std::atomic<uint32_t> num_done{0};
+    // the helpers that may still touch the batch
+    uint32_t num_joined{0};
+
+    void work() {
+      uint32_t i;
+      while ((i = next_task.fetch_add(1, std::memory_order_relaxed)) <
+             num_tasks) {
+        invoke(fn, i);
+        num_done.fetch_add(1, std::memory_order_release);
+      }
+    }
+  };
+
+  // held by the copy that uses the helpers
+  std::mutex busy;
+  // the number of helpers started; guarded by busy
+  uint32_t num_helpers{};
+
+  // guards the fields below
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::condition_variable helpers_cv;
+  Batch* batch{};
+  // bumped for each batch, so that a helper joins each one at most once
+  uint64_t generation{};
+
+ public:
+  /**
+   * @return the number of tasks to split a copy of num_bytes into
+   */
+  [[nodiscard]] static uint32_t get_num_tasks(size_t num_bytes) {
+    size_t n = num_bytes / MIN_BYTES_PER_THREAD;
+    return static_cast<uint32_t>(std::clamp(
+        n, size_t{1}, static_cast<size_t>(runtime_options.copy_threads)));
+  }
+
+  /**
+   * Run fn(i) for each i in [0, num_tasks) and wait for all of them
+   */
+  template <typename Fn>
+  void run(uint32_t num_tasks, const Fn& fn) {
+    if (num_tasks <= 1 || !busy.try_lock()) {
+      for (uint32_t i = 0; i < num_tasks; ++i) fn(i);
+      return;
+    }
+    start_helpers();
+
+    Batch b{.invoke = [](const void* f,
+                         uint32_t i) { (*static_cast<const Fn*>(f))(i); },
+            .fn = &fn,
+            .num_tasks = num_tasks};
+    {
+      std::lock_guard<std::mutex> guard(mutex);
+      batch = &b;
+      generation++;
+    }
+    cv.notify_all();
+    b.work();
+    while (b.num_done.load(std::memory_order_acquire) < num_tasks)
+      _mm_pause();
+    {
+      // the batch is on the stack, so it must not be left to a helper
+      std::unique_lock<std::mutex> lock(mutex);
+      batch = nullptr;
+      helpers_cv.wait(lock, [&] { return b.num_joined == 0; });
+    }
+    busy.unlock();
+  }
+
+  /**
+   * @return the pool of this process
+   */
+  static CopyPool& get() {
+    CopyPool* pool = instance.load(std::memory_order_acquire);
+    if (likely(pool)) return *pool;
+    auto new_pool = new CopyPool();
+    if (instance.compare_exchange_strong(pool, new_pool)) return *new_pool;
+    delete new_pool;  // no helpers are started before it is published
+    return *pool;
+  }
+
+  /**
+   * The helpers are not copied into the child of fork, which starts a new
+   * pool; the old one may be in use, so it is left as is
+   */
+  static void on_fork_child() {
+    instance.store(nullptr, std::memory_order_relaxed);
+  }
+
+ private:
+  static inline std::atomic<CopyPool*> instance{};
+
+  /**
+   * Start the helpers if not yet; called with busy held
+   */
+  void start_helpers() {
+    auto target = static_cast<uint32_t>(runtime_options.copy_threads - 1);
+    if (num_helpers >= target) return;
+    // the helpers must not take the signals meant for the application
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (; num_helpers < target; ++num_helpers)
+      std::thread(&CopyPool::helper_loop, this).detach();
+    pthread_sigmask(SIG_SETMASK, &old, nullptr);
+    LOG_INFO("CopyPool: %u helper threads started", num_helpers);
+  }
+
+  [[noreturn]] void helper_loop() {
+    pthread_setname_np(pthread_self(), "madfs-copy");
+    uint64_t last_generation = 0;
+    while (true) {
+      Batch* b;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] {
+          return batch != nullptr && generation != last_generation;
+        });
+        b = batch;
+        b->num_joined++;
+        last_generation = generation;
+      }
+      b->work();
+      {
+        std::lock_guard<std::mutex> guard(mutex);
+        b->num_joined--;
+      }
+      helpers_cv.notify_one();
+    }
+  }
+};
+
+}  // namespace madfs::dram
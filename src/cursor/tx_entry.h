@@ -115,6 +115,30 @@ struct TxCursor {
     return this->try_append(entry);
   }
 
+  /**
+   * Same as try_commit, but for a committer that holds the write lease and is
+   * serialized against all other committers (see Lease::commit). The entry is
+   * published with a plain store, and the flush is deferred to fsync or the
+   * release of the lease.
+   *
+   * @return empty entry on success; conflict entry otherwise
+   */
+  pmem::TxEntry try_commit_exclusive(pmem::TxEntry entry, MemTable* mem_table,
+                                     Allocator* allocator) {
+    this->handle_overflow(mem_table, allocator);
+
+    TimerGuard<Event::TX_ENTRY_STORE> timer_guard;
+    std::atomic<pmem::TxEntry>* entries =
+        idx.is_inline() ? meta->tx_entries : block->tx_entries;
+    // the slot can only be taken by a transaction of this process committed
+    // after our snapshot
+    pmem::TxEntry curr_entry =
+        entries[idx.local_idx].load(std::memory_order_acquire);
+    if (curr_entry.is_valid()) return curr_entry;
+    entries[idx.local_idx].store(entry, std::memory_order_release);
+    return pmem::TxEntry(uint64_t{0});
+  }
+
   /**
    * Flush from the tail recorded in the meta block to `end`
    * @param mem_table used to find the memory address of the next block
@@ -0,0 +1,181 @@
+#pragma once
+
+#include <algorithm>
+#include <memory>
+#include <ostream>
+
+#include "const.h"
+#include "file/file.h"
+#include "idx.h"
+#include "tx/remap.h"
+#include "utils/logging.h"
+#include "utils/utils.h"
+
+namespace madfs::utility {
+
+/**
+ * Rewrite the fragmented ranges of a file into contiguous blocks.
+ *
+ * The file is scanned in units of DEFRAG_UNIT_NUM_BLOCKS virtual blocks; a run
+ * of mapped blocks within a unit that spans more than one extent is copied to a
+ * fresh contiguous extent and remapped by dram::RemapTx. Since the remap is
+ * committed through OCC, the file may be used by others in the meantime; a
+ * range changed by them during the copy is left as it is.
+ */
+class Defragmenter {
+  // the largest extent to build; a grow unit is mapped contiguously
+  constexpr static uint32_t DEFRAG_UNIT_NUM_BLOCKS = NUM_BLOCKS_PER_GROW;
+
+ public:
+  struct Stats {
+    // the number of mapped blocks
+    uint32_t num_blocks{};
+    // the number of runs of blocks that are contiguous both virtually and
+    // physically
+    uint32_t num_extents{};
+
+    /**
+     * @return 0 if the mapped blocks of each run of virtual blocks are
+     * contiguous; 1 if no two neighboring blocks are adjacent physically
+     */
+    [[nodiscard]] double get_score() const {
+      if (num_blocks <= 1) return 0;
+      return static_cast<double>(num_extents - 1) / (num_blocks - 1);
+    }
+
+    friend std::ostream& operator<<(std::ostream& out, const Stats& s) {
+      out << "blocks=" << s.num_blocks << " extents=" << s.num_extents
+          << " score=" << s.get_score();
+      return out;
+    }
+  };
+
+  /**
+   * @return the stats of the latest block table of the file
+   */
+  static Stats get_stats(dram::File* file) {
+    uint32_t num_blocks = update(file);
+    Stats stats;
+    LogicalBlockIdx prev_lidx = 0;
+    for (VirtualBlockIdx vidx = 0; vidx < num_blocks; ++vidx) {
+      LogicalBlockIdx lidx = file->blk_table.vidx_to_lidx(vidx);
+      if (lidx == 0) {
+        prev_lidx = 0;
+        continue;
+      }
+      stats.num_blocks++;
+      if (prev_lidx == 0 || lidx != prev_lidx + 1) stats.num_extents++;
+      prev_lidx = lidx;
+    }
+    return stats;
+  }
+
+  /**
+   * @return the number of ranges remapped
+   */
+  static uint32_t defrag(dram::File* file) {
+    if (file->is_sealed() || file->meta->is_inline()) return 0;
+
+    uint32_t num_blocks = update(file);
+    uint32_t num_remapped = 0;
+    for (uint32_t unit_begin = 0; unit_begin < num_blocks;
+         unit_begin += DEFRAG_UNIT_NUM_BLOCKS) {
+      uint32_t unit_end =
+          std::min(unit_begin + DEFRAG_UNIT_NUM_BLOCKS, num_blocks);
+      // split the unit at the holes
+      uint32_t run_begin = unit_begin;
+      while (run_begin < unit_end) {
+        if (file->blk_table.vidx_to_lidx(run_begin) == 0) {
+          run_begin++;
+          continue;
+        }
+        uint32_t run_end = run_begin + 1;
+        uint32_t num_extents = 1;
+        for (; run_end < unit_end; ++run_end) {
+          LogicalBlockIdx lidx = file->blk_table.vidx_to_lidx(run_end);
+          if (lidx == 0) break;
+          if (lidx != file->blk_table.vidx_to_lidx(run_end - 1) + 1)
+            num_extents++;
+        }
+        if (num_extents > 1 && remap(file, run_begin, run_end))
+          num_remapped++;
+        run_begin = run_end;
+      }
+    }
+    LOG_INFO("Defragmenter: %u ranges remapped", num_remapped);
+    return num_remapped;
+  }
+
+  /**
+   * Open the file at pathname and defragment it; the stats before and after
+   * are written to out
+   *
+   * @return false if the file is not a MadFS file
+   */
+  static bool defrag(const char* pathname, std::ostream& out) {
+    int fd;
+    struct stat stat_buf;
+    if (!::try_open(fd, stat_buf, pathname, O_RDWR, 0)) {
+      LOG_WARN("Defragmenter: \"%s\" is not a MadFS file", pathname);
+      if (fd >= 0) posix::close(fd);
+      return false;
+    }
+    auto file = std::make_unique<dram::File>(fd, stat_buf, O_RDWR, pathname);
+    out << "before: " << get_stats(file.get()) << "\n";
+    uint32_t num_remapped = defrag(file.get());
+    out << "after: " << get_stats(file.get()) << " (" << num_remapped
+        << " ranges remapped)\n";
+    return true;
+  }
+
+ private:
+  /**
+   * Bring the block table up to date
+   *
+   * @return the number of virtual blocks of the file
+   */
+  static uint32_t update(dram::File* file) {
+    dram::FileState state;
+    file->blk_table.update(&state);
+    return BLOCK_SIZE_TO_IDX(ALIGN_UP(state.file_size, BLOCK_SIZE));
+  }
+
+  /**
+   * Move the blocks of [begin_vidx, end_vidx) to a new contiguous extent
+   *
+   * @return true on success
+   */
+  static bool remap(dram::File* file, VirtualBlockIdx begin_vidx,
+                    VirtualBlockIdx end_vidx) {
+    uint32_t num_blocks = end_vidx - begin_vidx;
+    auto begin_lidx = file->bitmap_mgr.alloc_contiguous(num_blocks);
+    if (!begin_lidx.has_value()) {
+      LOG_WARN("Defragmenter: no contiguous space for %u blocks", num_blocks);
+      return false;
+    }
+
+    // the tx ends at the end of the file if the range covers it, so that the
+    // file size is kept
+    dram::FileState state;
+    file->blk_table.update(&state);
+    uint64_t offset = BLOCK_IDX_TO_SIZE(begin_vidx);
+    uint64_t end_offset =
+        std::min(BLOCK_IDX_TO_SIZE(end_vidx), state.file_size);
+    bool success;
+    {
+      dram::RemapTx tx(file, end_offset - offset, offset, begin_lidx.value());
+      success = tx.exec();
+    }
+    if (!success) {
+      file->bitmap_mgr.free_range(begin_lidx.value(), num_blocks);
+      LOG_DEBUG("Defragmenter: [%u, %u) changed; skipped", begin_vidx.get(),
+                end_vidx.get());
+      return false;
+    }
+    LOG_DEBUG("Defragmenter: [%u, %u) moved to logical block %u",
+              begin_vidx.get(), end_vidx.get(), begin_lidx.value());
+    return true;
+  }
+};
+
+}  // namespace madfs::utility
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <algorithm>
 #include <atomic>
 #include <cassert>
 #include <iostream>
@@ -15,10 +16,20 @@ namespace madfs::pmem {
 // BlkTable uses some assumption to simply implementation
 struct LogEntry {
   /*** define LogEntry-specific struct ***/
-  enum class Op {
+  // unsigned, so that the 2-bit field below can hold every op
+  enum class Op : uint8_t {
     LOG_INVALID = 0,
     // we start the enum from 1 so that a LogOp with value 0 is invalid
     LOG_OVERWRITE = 1,
+    // since FORMAT_VERSION_COMPACT: same as LOG_OVERWRITE, but the mapping is
+    // described as runs of contiguous logical blocks (see Run)
+    LOG_OVERWRITE_RUNS = 2,
+  };
+
+  // a contiguous range of logical blocks in a LOG_OVERWRITE_RUNS entry
+  struct Run {
+    LogicalBlockIdx begin_lidx;
+    uint32_t num_blocks;
   };
 
   /*** define actual LogEntry layout ***/
@@ -47,9 +58,14 @@ struct LogEntry {
   // the maximum number of leftover bytes is BLOCK_SIZE - 1.
   uint16_t leftover_bytes : 12;
 
-  // the number of blocks described in this log entry
-  // every 64 blocks corresponds to one entry in begin_lidxs
-  uint16_t num_blocks;
+  union {
+    // for LOG_OVERWRITE, the number of blocks described in this log entry
+    // every 64 blocks corresponds to one entry in begin_lidxs
+    uint16_t num_blocks;
+    // for LOG_OVERWRITE_RUNS, the number of runs in this log entry; begin_lidxs
+    // shall be interpreted as an array of Run
+    uint16_t num_runs;
+  };
 
   union {
     LogicalBlockIdx block_idx;
@@ -67,34 +83,77 @@ struct LogEntry {
   constexpr static uint32_t FIXED_SIZE = 12;
 
   /*** some helper functions ***/
+  [[nodiscard]] constexpr bool is_runs() const {
+    return op == Op::LOG_OVERWRITE_RUNS;
+  }
+
   [[nodiscard]] constexpr uint32_t get_lidxs_len() const {
     return ALIGN_UP(static_cast<uint32_t>(num_blocks),
                     BITMAP_ENTRY_BLOCKS_CAPACITY) >>
            BITMAP_ENTRY_BLOCKS_CAPACITY_SHIFT;
   }
 
-  // every element in lidxs corresponds to a mapping of length 64 blocks except
-  // the last one
-  [[nodiscard]] constexpr uint32_t get_last_lidx_num_blocks() const {
-    return num_blocks % BITMAP_ENTRY_BLOCKS_CAPACITY;
+  [[nodiscard]] Run* get_runs() { return reinterpret_cast<Run*>(begin_lidxs); }
+  [[nodiscard]] const Run* get_runs() const {
+    return reinterpret_cast<const Run*>(begin_lidxs);
   }
 
-  void persist() {
-    auto size = FIXED_SIZE + sizeof(LogicalBlockIdx) * get_lidxs_len();
-    persist_unfenced(this, size);
+  // the size of the variable-length array after the fixed-size fields
+  [[nodiscard]] uint32_t get_payload_size() const {
+    return is_runs() ? sizeof(Run) * num_runs
+                     : sizeof(LogicalBlockIdx) * get_lidxs_len();
   }
 
+  /**
+   * Call fn(begin_vidx, begin_lidx, num_blocks) for every contiguous range
+   * described in this log entry, regardless of the encoding
+   *
+   * @return the end of the virtual range described
+   */
+  template <typename F>
+  VirtualBlockIdx for_each_run(F&& fn) const {
+    VirtualBlockIdx vidx = begin_vidx;
+    if (is_runs()) {
+      for (uint32_t i = 0; i < num_runs; ++i) {
+        const Run& run = get_runs()[i];
+        fn(vidx, run.begin_lidx, run.num_blocks);
+        vidx += run.num_blocks;
+      }
+    } else {
+      for (uint32_t offset = 0; offset < num_blocks;
+           offset += BITMAP_ENTRY_BLOCKS_CAPACITY) {
+        uint32_t n = std::min(static_cast<uint32_t>(num_blocks) - offset,
+                              BITMAP_ENTRY_BLOCKS_CAPACITY);
+        fn(vidx, begin_lidxs[offset >> BITMAP_ENTRY_BLOCKS_CAPACITY_SHIFT], n);
+        vidx += n;
+      }
+    }
+    return vidx;
+  }
+
+  void persist() { persist_unfenced(this, FIXED_SIZE + get_payload_size()); }
+
   // a log entry can be very large (e.g. a full block), but sometimes only the
   // header gets updated and needs persistence
   void persist_header() { persist_unfenced(this, HEADER_SIZE); }
 
   friend std::ostream& operator<<(std::ostream& out, const LogEntry& entry) {
     out << "LogEntry{";
-    out << "n_blk=" << entry.num_blocks << ", ";
-    out << "vidx=" << entry.begin_vidx << ", ";
-    out << "lidxs=[" << entry.begin_lidxs[0];
-    for (uint32_t i = 1; i < entry.get_lidxs_len(); ++i)
-      out << "," << entry.begin_lidxs[i];
+    if (entry.is_runs()) {
+      out << "n_run=" << entry.num_runs << ", ";
+      out << "vidx=" << entry.begin_vidx << ", ";
+      out << "runs=[";
+      for (uint32_t i = 0; i < entry.num_runs; ++i) {
+        const Run& run = entry.get_runs()[i];
+        out << (i == 0 ? "" : ",") << run.begin_lidx << "+" << run.num_blocks;
+      }
+    } else {
+      out << "n_blk=" << entry.num_blocks << ", ";
+      out << "vidx=" << entry.begin_vidx << ", ";
+      out << "lidxs=[" << entry.begin_lidxs[0];
+      for (uint32_t i = 1; i < entry.get_lidxs_len(); ++i)
+        out << "," << entry.begin_lidxs[i];
+    }
     out << "], ";
     out << "leftover_bytes=" << entry.leftover_bytes << "}";
     return out;
@@ -105,6 +164,7 @@ static_assert(sizeof(LogEntry) == LogEntry::FIXED_SIZE,
               "LogEntry::FIXED_SIZE must match its actual size");
 
 static_assert(offsetof(LogEntry, begin_vidx) == LogEntry::HEADER_SIZE);
+static_assert(sizeof(LogEntry::Run) == 2 * sizeof(LogicalBlockIdx));
 
 /**
  * Points to the head of a linked list of LogEntry
@@ -114,9 +174,10 @@ struct __attribute__((packed)) TxEntryIndirect {
 
  private:
   bool is_inline : 1 = false;
+  bool is_inline_tail : 1 = false;
 
  public:
-  uint32_t unused : 19 = 0;
+  uint32_t unused : 18 = 0;
   // we enforce this must be 12-bit to ensure corrupted TxEntry won't cause
   // buffer-overflow issues
   LogLocalOffset local_offset : 12 = 0;
@@ -197,13 +258,76 @@ struct __attribute__((packed)) TxEntryInline {
 static_assert(sizeof(TxEntryInline) == TX_ENTRY_SIZE,
               "TxEntryInline must be 64 bits");
 
+/**
+ * Since FORMAT_VERSION_COMPACT: an inline tx entry for a block-unaligned write
+ * at the end of the file, which would otherwise need a log entry for the
+ * leftover bytes. It takes the space of a TxEntryIndirect with the
+ * is_inline_tail bit set, so the ranges are narrower than TxEntryInline.
+ */
+struct __attribute__((packed)) TxEntryInlineTail {
+  constexpr static const int NUM_BLOCKS_BITS = 6;
+  constexpr static const int BEGIN_VIRTUAL_IDX_BITS = 22;
+  constexpr static const int BEGIN_LOGICAL_IDX_BITS = 22;
+
+  constexpr static const int NUM_BLOCKS_MAX = (1 << NUM_BLOCKS_BITS) - 1;
+  constexpr static const int BEGIN_VIRTUAL_IDX_MAX =
+      (1 << BEGIN_VIRTUAL_IDX_BITS) - 1;
+  constexpr static const int BEGIN_LOGICAL_IDX_MAX =
+      (1 << BEGIN_LOGICAL_IDX_BITS) - 1;
+
+  friend union TxEntry;
+
+ private:
+  bool is_inline : 1 = false;
+  bool is_inline_tail : 1 = true;
+
+ public:
+  // same as LogEntry::leftover_bytes
+  uint32_t leftover_bytes : 12;
+  uint32_t num_blocks : NUM_BLOCKS_BITS;
+  uint32_t begin_virtual_idx : BEGIN_VIRTUAL_IDX_BITS;
+  uint32_t begin_logical_idx : BEGIN_LOGICAL_IDX_BITS;
+
+  static bool can_inline(uint32_t num_blocks, VirtualBlockIdx begin_virtual_idx,
+                         LogicalBlockIdx begin_logical_idx) {
+    return num_blocks > 0 && num_blocks <= NUM_BLOCKS_MAX &&
+           begin_virtual_idx <= BEGIN_VIRTUAL_IDX_MAX &&
+           begin_logical_idx <= BEGIN_LOGICAL_IDX_MAX;
+  }
+
+  TxEntryInlineTail(uint32_t num_blocks, VirtualBlockIdx begin_virtual_idx,
+                    LogicalBlockIdx begin_logical_idx, uint16_t leftover_bytes)
+      : leftover_bytes(leftover_bytes),
+        num_blocks(num_blocks),
+        begin_virtual_idx(begin_virtual_idx.get()),
+        begin_logical_idx(begin_logical_idx.get()) {
+    assert(can_inline(num_blocks, begin_virtual_idx, begin_logical_idx));
+    assert(leftover_bytes < BLOCK_SIZE);
+  }
+
+  friend std::ostream& operator<<(std::ostream& out,
+                                  const TxEntryInlineTail& entry) {
+    out << "TxEntryInlineTail{[" << entry.begin_virtual_idx << ", "
+        << entry.begin_virtual_idx + entry.num_blocks - 1 << "] -> ["
+        << entry.begin_logical_idx << ", "
+        << entry.begin_logical_idx + entry.num_blocks - 1
+        << "], leftover_bytes=" << entry.leftover_bytes << "}";
+    return out;
+  }
+};
+
+static_assert(sizeof(TxEntryInlineTail) == TX_ENTRY_SIZE,
+              "TxEntryInlineTail must be 64 bits");
+
 union TxEntry {
   uint64_t raw_bits;
   TxEntryIndirect indirect_entry;
   TxEntryInline inline_entry;
+  TxEntryInlineTail inline_tail_entry;
   struct {
     bool is_inline : 1;
-    uint64_t payload : 63;
+    bool is_inline_tail : 1;
+    uint64_t payload : 62;
   } fields;
 
   constexpr static const pmem::TxEntryInline TxEntryDummy{};
@@ -212,9 +336,20 @@ union TxEntry {
   TxEntry(uint64_t raw_bits) : raw_bits(raw_bits) {}
   TxEntry(TxEntryIndirect indirect_entry) : indirect_entry(indirect_entry) {}
   TxEntry(TxEntryInline inline_entry) : inline_entry(inline_entry) {}
+  TxEntry(TxEntryInlineTail inline_tail_entry)
+      : inline_tail_entry(inline_tail_entry) {}
 
   [[nodiscard]] bool is_inline() const { return fields.is_inline; }
 
+  [[nodiscard]] bool is_inline_tail() const {
+    return !fields.is_inline && fields.is_inline_tail;
+  }
+
+  // only an indirect entry refers to log entries
+  [[nodiscard]] bool is_indirect() const {
+    return !fields.is_inline && !fields.is_inline_tail;
+  }
+
   [[nodiscard]] bool is_valid() const { return raw_bits != 0; }
 
   [[nodiscard]] bool is_dummy() const {
@@ -245,8 +380,9 @@ union TxEntry {
   }
 
   friend std::ostream& operator<<(std::ostream& out, const TxEntry& tx_entry) {
-    return tx_entry.is_inline() ? out << tx_entry.inline_entry
-                                : out << tx_entry.indirect_entry;
+    if (tx_entry.is_inline()) return out << tx_entry.inline_entry;
+    if (tx_entry.is_inline_tail()) return out << tx_entry.inline_tail_entry;
+    return out << tx_entry.indirect_entry;
   }
 };
 
@@ -0,0 +1,201 @@
+#include <pthread.h>
+#include <signal.h>
+
+#include <algorithm>
+#include <thread>
+
+#include "file/file.h"
+
+namespace madfs::dram {
+WriteBuffer* File::attach_write_buffer(bool create) {
+  std::shared_ptr<WriteBuffer> b;
+  {
+    // the buffer mutex may be held through a long commit, so it is not taken
+    // here; this fd joins the writers on its first buffered write
+    std::lock_guard<std::mutex> guard(WriteBuffer::registry_mutex);
+    uint64_t generation =
+        WriteBuffer::generation.load(std::memory_order_relaxed);
+    if (WriteBuffer* attached = write_buffer.load(std::memory_order_relaxed)) {
+      write_buffer_generation.store(generation, std::memory_order_release);
+      return attached;
+    }
+
+    auto it = std::find_if(
+        WriteBuffer::registry.begin(), WriteBuffer::registry.end(),
+        [&](const std::shared_ptr<WriteBuffer>& buffer) {
+          return buffer->dev == kernel_stat.st_dev &&
+                 buffer->ino == kernel_stat.st_ino;
+        });
+    if (it != WriteBuffer::registry.end()) {
+      b = *it;
+    } else if (create) {
+      b = std::make_shared<WriteBuffer>(kernel_stat.st_dev,
+                                        kernel_stat.st_ino);
+      WriteBuffer::registry.emplace_back(b);
+      generation = WriteBuffer::generation.fetch_add(1) + 1;
+    }
+    if (b) {
+      ++b->num_files;
+      write_buffer.store(b.get(), std::memory_order_relaxed);
+    }
+    write_buffer_generation.store(generation, std::memory_order_release);
+  }
+  return b.get();
+}
+
+int File::detach_write_buffer() {
+  WriteBuffer* b = write_buffer.load(std::memory_order_relaxed);
+  if (!b) return 0;
+  int rc = 0;
+  if (can_write) {
+    std::lock_guard<std::mutex> guard(b->mutex);
+    // if the commit fails, the data stays for the other writers, if any
+    flush_write_buffer_locked(/*keep_tail=*/false);
+    std::erase(b->writers, this);
+    // no fd is left to commit what is still buffered
+    if (b->writers.empty() && b->size > 0) {
+      LOG_WARN("cannot commit the write buffer on close: %m");
+      b->size = 0;
+      rc = -1;
+    }
+  }
+
+  std::lock_guard<std::mutex> guard(WriteBuffer::registry_mutex);
+  write_buffer.store(nullptr, std::memory_order_relaxed);
+  if (--b->num_files == 0)
+    std::erase_if(WriteBuffer::registry,
+                  [&](const std::shared_ptr<WriteBuffer>& buffer) {
+                    return buffer.get() == b;
+                  });
+  return rc;
+}
+
+ssize_t File::buffer_write(const char* buf, size_t count, size_t offset) {
+  WriteBuffer& b = *write_buffer.load(std::memory_order_relaxed);
+  std::lock_guard<std::mutex> guard(b.mutex);
+
+  // a full block gains nothing from the buffer
+  bool write_through = count >= BLOCK_SIZE;
+  if (write_through || (b.size > 0 && offset != b.end())) {
+    if (flush_write_buffer_locked(/*keep_tail=*/false) != 0) return -1;
+    if (write_through) return 0;
+  }
+
+  // like a direct write, a buffered one waits for (or fails under) another
+  // process's lease; if the lease is taken after the write is buffered, the
+  // commit waits for its release in write_tx
+  PerThreadData* per_thread_data;
+  Lease::WriteMode mode;
+  if (!begin_write(per_thread_data, mode)) return -1;
+  Lease::end_write(per_thread_data, mode);
+
+  // whoever buffers data must be able to commit it
+  if (std::find(b.writers.begin(), b.writers.end(), this) == b.writers.end())
+    b.writers.emplace_back(this);
+
+  // what is left after a commit is less than a block, so the write fits
+  if (b.size + count > WriteBuffer::CAPACITY &&
+      flush_write_buffer_locked(/*keep_tail=*/true) != 0)
+    return -1;
+
+  if (b.size == 0) {
+    b.begin = offset;
+    b.since = std::chrono::steady_clock::now();
+  }
+  std::memcpy(b.data + b.size, buf, count);
+  b.size += count;
+
+  // the thread is gone in the child of fork, so it is started here, rather
+  // than in the constructor
+  if (unlikely(!WriteBuffer::flusher_started.load(std::memory_order_relaxed)) &&
+      !WriteBuffer::flusher_started.exchange(true)) {
+    // the thread must not take the signals meant for the application
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    std::thread(write_buffer_flusher_loop).detach();
+    pthread_sigmask(SIG_SETMASK, &old, nullptr);
+  }
+  return static_cast<ssize_t>(count);
+}
+
+int File::flush_write_buffer_locked(bool keep_tail) {
+  WriteBuffer& b = *write_buffer.load(std::memory_order_relaxed);
+  if (b.size == 0) return 0;
+  // a read-only fd commits through one of the fds that buffered the data
+  File* writer = can_write ? this : b.writers.front();
+
+  size_t num_bytes = b.size;
+  if (keep_tail) {
+    uint64_t aligned_end = ALIGN_DOWN(b.end(), BLOCK_SIZE);
+    num_bytes = aligned_end > b.begin ? aligned_end - b.begin : 0;
+  }
+  for (size_t done = 0; done < num_bytes;) {
+    ssize_t ret =
+        writer->write_tx(b.data + done, num_bytes - done, b.begin + done);
+    if (ret < 0) {
+      // keep what is not committed yet
+      std::memmove(b.data, b.data + done, b.size - done);
+      b.begin += done;
+      b.size -= done;
+      return -1;
+    }
+    done += static_cast<size_t>(ret);
+  }
+
+  std::memmove(b.data, b.data + num_bytes, b.size - num_bytes);
+  b.begin += num_bytes;
+  b.size -= num_bytes;
+  b.since = std::chrono::steady_clock::now();
+  return 0;
+}
+
+void File::write_buffer_flusher_loop() {
+  pthread_setname_np(pthread_self(), "madfs-flush");
+  while (true) {
+    std::this_thread::sleep_for(WriteBuffer::MAX_AGE / 2);
+    // a commit may wait for another process's lease, so the registry is not
+    // held through it; the references keep the buffers alive
+    std::vector<std::shared_ptr<WriteBuffer>> buffers;
+    {
+      std::lock_guard<std::mutex> guard(WriteBuffer::registry_mutex);
+      buffers = WriteBuffer::registry;
+    }
+    auto now = std::chrono::steady_clock::now();
+    for (const auto& b : buffers) {
+      // a busy buffer is committed by its writers soon enough
+      std::unique_lock<std::mutex> lock(b->mutex, std::try_to_lock);
+      if (!lock || b->size == 0 || now - b->since < WriteBuffer::MAX_AGE)
+        continue;
+      File* writer = b->writers.front();
+      if (writer->flush_write_buffer_locked(/*keep_tail=*/false) != 0)
+        LOG_WARN("cannot commit the write buffer of fd %d: %m", writer->fd);
+    }
+  }
+}
+
+void WriteBuffer::on_fork_prepare() {
+  registry_mutex.lock();
+  for (const auto& b : registry) {
+    b->mutex.lock();
+    if (b->size > 0 &&
+        b->writers.front()->flush_write_buffer_locked(/*keep_tail=*/false) != 0)
+      LOG_WARN("cannot commit the write buffer before fork: %m");
+  }
+}
+
+void WriteBuffer::on_fork_parent() {
+  for (const auto& b : registry) b->mutex.unlock();
+  registry_mutex.unlock();
+}
+
+void WriteBuffer::on_fork_child() {
+  for (const auto& b : registry) {
+    // what could not be committed is left to the parent
+    b->size = 0;
+    b->mutex.unlock();
+  }
+  flusher_started.store(false, std::memory_order_relaxed);
+  registry_mutex.unlock();
+}
+}  // namespace madfs::dram
@@ -0,0 +1,168 @@
+#include "file/file.h"
+#include "tx/extend.h"
+
+namespace madfs::dram {
+int File::fallocate(int mode, off_t offset, off_t len) {
+  if (unlikely(!can_write)) {
+    errno = EBADF;
+    return -1;
+  }
+  if (unlikely(offset < 0 || len <= 0)) {
+    errno = EINVAL;
+    return -1;
+  }
+  // punching holes or shifting ranges would require rewriting the tx history
+  if (unlikely(mode & ~FALLOC_FL_KEEP_SIZE)) {
+    errno = EOPNOTSUPP;
+    return -1;
+  }
+  // the reservation is consumed by the appends in order
+  if (flush_write_buffer() != 0) return -1;
+
+  auto end_offset = static_cast<uint64_t>(offset) + static_cast<uint64_t>(len);
+  if (reserve(static_cast<uint64_t>(offset), end_offset) != 0) return -1;
+  if (mode & FALLOC_FL_KEEP_SIZE) return 0;
+  return extend(end_offset);
+}
+
+int File::reserve(uint64_t offset, uint64_t end_offset) {
+  FileState state;
+  blk_table.update(&state);
+  VirtualBlockIdx begin_vidx =
+      std::max(BLOCK_SIZE_TO_IDX(offset),
+               BLOCK_SIZE_TO_IDX(ALIGN_UP(state.file_size, BLOCK_SIZE)));
+  VirtualBlockIdx end_vidx = BLOCK_SIZE_TO_IDX(ALIGN_UP(end_offset, BLOCK_SIZE));
+  // the blocks within the file are either written or left as holes
+  if (begin_vidx >= end_vidx) return 0;
+  uint32_t num_blocks = end_vidx - begin_vidx;
+
+  meta->lock();
+  // an inline small file would never reach the reservation
+  if (uint64_t size; meta->get_inline_data_size(size) &&
+                     end_offset > MAX_INLINE_DATA_SIZE)
+    spill_inline_data(size);
+
+  VirtualBlockIdx reserved_vidx;
+  LogicalBlockIdx reserved_lidx;
+  uint32_t num_reserved;
+  if (meta->get_reservation(reserved_vidx, reserved_lidx, num_reserved)) {
+    if (reserved_vidx <= begin_vidx &&
+        end_vidx <= reserved_vidx + num_reserved) {
+      meta->unlock();
+      return 0;
+    }
+    release_reservation_locked();
+  }
+
+  auto begin_lidx = bitmap_mgr.alloc_contiguous(num_blocks);
+  if (!begin_lidx.has_value()) {
+    meta->unlock();
+    LOG_WARN("fallocate: no contiguous space for %u blocks", num_blocks);
+    errno = ENOSPC;
+    return -1;
+  }
+  // ask the kernel filesystem for the space now rather than on the appends
+  mem_table.lidx_to_addr_rw(begin_lidx.value() + num_blocks - 1);
+  meta->set_reservation(begin_vidx, begin_lidx.value(), num_blocks);
+  fence();
+  meta->unlock();
+
+  LOG_DEBUG("reserved [%u, %u) at logical block %u", begin_vidx.get(),
+            end_vidx.get(), begin_lidx.value());
+  return 0;
+}
+
+int File::extend(uint64_t size) {
+  static const char zeros[BLOCK_SIZE]{};
+  while (true) {
+    FileState state;
+    blk_table.update(&state);
+    if (state.file_size >= size) return 0;
+
+    // the bytes past the end within the last block (or the inline data) are
+    // written as zeros; the blocks after it become holes
+    if (state.file_size % BLOCK_SIZE != 0 || meta->has_inline_data()) {
+      uint64_t tail_end =
+          std::min(size, ALIGN_UP(state.file_size + 1, BLOCK_SIZE));
+      if (write_tx(zeros, tail_end - state.file_size, state.file_size) < 0)
+        return -1;
+      continue;
+    }
+
+    PerThreadData* per_thread_data;
+    Lease::WriteMode mode;
+    if (unlikely(!begin_write(per_thread_data, mode))) return -1;
+    bool done = ExtendTx(this, size - state.file_size, state.file_size).exec();
+    Lease::end_write(per_thread_data, mode);
+    // otherwise, the file has grown in the meantime; check again
+    if (done) {
+      shm_mgr.get_header()->on_write(size);
+      LOG_DEBUG("extended to %lu bytes", size);
+      return 0;
+    }
+  }
+}
+
+LogicalBlockIdx File::take_reserved(VirtualBlockIdx begin_vidx,
+                                    uint32_t num_blocks) {
+  VirtualBlockIdx reserved_vidx;
+  LogicalBlockIdx reserved_lidx;
+  uint32_t num_reserved;
+  auto is_reserved = [&]() {
+    if (!meta->get_reservation(reserved_vidx, reserved_lidx, num_reserved) ||
+        begin_vidx < reserved_vidx ||
+        begin_vidx + num_blocks > reserved_vidx + num_reserved)
+      return false;
+    // each chunk of the write must be mapped contiguously, i.e., within a
+    // single grow unit; otherwise, leave the reservation to the next write
+    LogicalBlockIdx lidx = reserved_lidx + (begin_vidx - reserved_vidx);
+    for (uint32_t i = 0; i < num_blocks; i += BITMAP_ENTRY_BLOCKS_CAPACITY) {
+      uint32_t len = std::min(num_blocks - i, BITMAP_ENTRY_BLOCKS_CAPACITY);
+      if ((lidx + i) >> GROW_UNIT_IN_BLOCK_SHIFT !=
+          (lidx + i + len - 1) >> GROW_UNIT_IN_BLOCK_SHIFT)
+        return false;
+    }
+    return true;
+  };
+
+  // fast path: check without the lock
+  if (!is_reserved()) return 0;
+
+  LogicalBlockIdx lidx = 0;
+  meta->lock();
+  if (is_reserved()) {
+    uint32_t num_skipped = begin_vidx - reserved_vidx;
+    lidx = reserved_lidx + num_skipped;
+    // the new record is flushed before the data blocks are committed, as the
+    // tx fences after writing the data
+    meta->set_reservation(begin_vidx + num_blocks, lidx + num_blocks,
+                          num_reserved - num_skipped - num_blocks);
+    if (num_skipped > 0) {
+      // the skipped blocks may be reused by others right away
+      fence();
+      bitmap_mgr.free_range(reserved_lidx.get(), num_skipped);
+    }
+  }
+  meta->unlock();
+  return lidx;
+}
+
+void File::release_reservation() {
+  meta->lock();
+  release_reservation_locked();
+  meta->unlock();
+}
+
+void File::release_reservation_locked() {
+  VirtualBlockIdx reserved_vidx;
+  LogicalBlockIdx reserved_lidx;
+  uint32_t num_reserved;
+  if (!meta->get_reservation(reserved_vidx, reserved_lidx, num_reserved))
+    return;
+  meta->set_reservation(0, 0, 0);
+  fence();
+  bitmap_mgr.free_range(reserved_lidx.get(), num_reserved);
+  LOG_DEBUG("released %u reserved blocks at logical block %u", num_reserved,
+            reserved_lidx.get());
+}
+}  // namespace madfs::dram
@@ -11,22 +11,59 @@ File::File(int fd, const struct stat& stat, int flags,
     : mem_table(fd, stat.st_size, (flags & O_ACCMODE) == O_RDONLY),
       offset_mgr(),
       blk_table(&mem_table),
-      shm_mgr(fd, stat, mem_table.get_meta()),
+      shm_mgr(fd, stat, mem_table.get_meta(),
+              (flags & O_ACCMODE) == O_RDONLY),
+      lease(&shm_mgr),
       meta(mem_table.get_meta()),
       fd(fd),
       can_read((flags & O_ACCMODE) == O_RDONLY ||
                (flags & O_ACCMODE) == O_RDWR),
       can_write((flags & O_ACCMODE) == O_WRONLY ||
-                (flags & O_ACCMODE) == O_RDWR) {
-  if (stat.st_size == 0) meta->init();
+                (flags & O_ACCMODE) == O_RDWR),
+      is_nonblock(flags & O_NONBLOCK),
+      kernel_stat(stat) {
+  if (stat.st_size == 0) {
+    meta->init();
+    // a new file keeps its data inline until it outgrows the meta block
+    if (runtime_options.small_file && can_write) {
+      meta->lock();
+      meta->try_init_inline_data();
+      meta->unlock();
+    }
+  }
 
-  uint64_t file_size;
-  bool file_size_updated = false;
+  if constexpr (BuildOptions::debug) {
+    path = strdup(pathname);
+  }
 
   // only open shared memory if we may write
   if (can_write) {
     bitmap_mgr.entries = static_cast<BitmapEntry*>(shm_mgr.get_bitmap_addr());
+    bitmap_mgr.shm_path = shm_mgr.get_path();
+    // the blocks already in the file are marked when unsealing or replaying
+    bitmap_mgr.reserve(static_cast<uint32_t>(
+        ALIGN_UP(static_cast<uint64_t>(stat.st_size),
+                 BITMAP_ENTRY_BYTES_CAPACITY) /
+        BITMAP_ENTRY_BYTES_CAPACITY));
+  }
+
+  LogicalBlockIdx sealed_begin_lidx;
+  uint64_t sealed_file_size;
+  if (meta->get_sealed(sealed_begin_lidx, sealed_file_size)) {
+    if (!can_write) {
+      // neither the tx history nor the shared memory is needed
+      sealed_size = sealed_file_size;
+      sealed_data = mem_table.lidx_to_addr_ro(sealed_begin_lidx)->data_ro();
+      blk_table.init_sealed(sealed_size);
+      return;
+    }
+    unseal(sealed_begin_lidx, sealed_file_size);
+  }
 
+  uint64_t file_size;
+  bool file_size_updated = false;
+
+  if (can_write) {
     // The first bit corresponds to the meta block which should always be set
     // to 1. If it is not, then bitmap needs to be initialized.
     // BitmapEntry::is_allocated is not thread safe but we don't yet have
@@ -34,8 +71,35 @@ File::File(int fd, const struct stat& stat, int flags,
     if (!bitmap_mgr.entries[0].is_allocated(0)) {
       meta->lock();
       if (!bitmap_mgr.entries[0].is_allocated(0)) {
-        file_size = blk_table.update_unsafe(/*allocator=*/nullptr, &bitmap_mgr);
+        // with a snapshot, only the txs after it are applied to the bitmap
+        std::optional<TxEntryIdx> snapshot_idx = load_bitmap_snapshot();
+        file_size = blk_table.update_unsafe(/*allocator=*/nullptr, &bitmap_mgr,
+                                            snapshot_idx);
         file_size_updated = true;
+        // the snapshot only holds the tx and log entry blocks, so the data
+        // blocks are the ones mapped by the replayed block table
+        if (snapshot_idx) {
+          VirtualBlockIdx num_vblocks =
+              BLOCK_SIZE_TO_IDX(ALIGN_UP(file_size, BLOCK_SIZE));
+          for (VirtualBlockIdx vidx = 0; vidx < num_vblocks; ++vidx)
+            if (LogicalBlockIdx lidx = blk_table.vidx_to_lidx(vidx); lidx != 0)
+              bitmap_mgr.set_allocated(lidx);
+        }
+        // the reserved blocks are not referenced by the tx history yet
+        VirtualBlockIdx reserved_vidx;
+        LogicalBlockIdx reserved_lidx;
+        uint32_t num_reserved;
+        if (meta->get_reservation(reserved_vidx, reserved_lidx, num_reserved))
+          for (uint32_t i = 0; i < num_reserved; ++i)
+            bitmap_mgr.set_allocated(reserved_lidx + i);
+        // neither is the snapshot, which may have taken blocks freed by the
+        // txs replayed above
+        if (LogicalBlockIdx lidx = meta->get_bitmap_snapshot(); lidx != 0) {
+          uint32_t num_blocks = mem_table.lidx_to_addr_ro(lidx)
+                                    ->bitmap_snapshot_block.get_num_blocks();
+          for (uint32_t i = 0; i < num_blocks; ++i)
+            bitmap_mgr.set_allocated(lidx + i);
+        }
         bitmap_mgr.entries[0].set_allocated(0);
       }
       meta->unlock();
@@ -43,14 +107,16 @@ File::File(int fd, const struct stat& stat, int flags,
   }
 
   if (!file_size_updated) file_size = blk_table.update_unsafe();
+  shm_mgr.get_header()->init(file_size, stat.st_mtim, stat.st_size == 0);
 
   if (flags & O_APPEND) offset_mgr.seek_absolute(static_cast<off_t>(file_size));
-  if constexpr (BuildOptions::debug) {
-    path = strdup(pathname);
-  }
+  if (can_write && WriteBuffer::is_buffered_path(pathname))
+    attach_write_buffer(/*create=*/true);
 }
 
 File::~File() {
+  detach_write_buffer();
+  release_lease();
   allocators.clear();
   if (fd >= 0) posix::close(fd);
   if constexpr (BuildOptions::debug) {
@@ -58,10 +124,168 @@ File::~File() {
   }
 }
 
+void File::unseal(LogicalBlockIdx begin_lidx, uint64_t file_size) {
+  meta->lock();
+  // someone else may have unsealed it
+  if (meta->is_sealed()) unseal_locked(begin_lidx, file_size);
+  meta->unlock();
+}
+
+void File::unseal_locked(LogicalBlockIdx begin_lidx, uint64_t file_size) {
+  // a spill of the inline data may have crashed after sealing; the sealed
+  // blocks already hold the data, so the inline tx entries are reclaimed
+  if (meta->has_inline_data()) {
+    meta->retire_inline_data();
+    meta->clear_inline_data();
+  }
+
+  // the tx history may have been rebuilt by an unseal that crashed before
+  // clearing the seal; the bitmap is then rebuilt from the tx history later
+  if (TxCursor cursor = TxCursor::from_meta(meta);
+      !cursor.get_entry().is_valid()) {
+    uint32_t num_blocks = BLOCK_SIZE_TO_IDX(ALIGN_UP(file_size, BLOCK_SIZE));
+    // mark the meta block and the data blocks as used before any allocation
+    for (LogicalBlockIdx lidx = 0; lidx < begin_lidx + num_blocks; ++lidx)
+      bitmap_mgr.set_allocated(lidx);
+
+    if (num_blocks > 0) {
+      Allocator* allocator = get_local_allocator();
+      std::vector<LogicalBlockIdx> begin_lidxs;
+      for (uint32_t i = 0; i < num_blocks; i += BITMAP_ENTRY_BLOCKS_CAPACITY)
+        begin_lidxs.emplace_back(begin_lidx + i);
+      auto leftover_bytes =
+          static_cast<uint16_t>(ALIGN_UP(file_size, BLOCK_SIZE) - file_size);
+      // the data is contiguous, so a single run describes the whole file
+      LogCursor log_cursor = allocator->log_entry.append(
+          meta->has_compact_entries() ? pmem::LogEntry::Op::LOG_OVERWRITE_RUNS
+                                      : pmem::LogEntry::Op::LOG_OVERWRITE,
+          leftover_bytes, num_blocks, /*begin_vidx*/ 0, begin_lidxs);
+      cursor.try_commit(pmem::TxEntryIndirect(log_cursor.idx), &mem_table,
+                        allocator);
+      meta->flush_tx_entries(0, 1);
+      fence();
+    }
+  }
+  meta->clear_sealed();
+  LOG_INFO("File unsealed");
+}
+
+bool File::try_write_inline(const char* buf, size_t count, size_t offset,
+                            ssize_t& ret) {
+  bool done = false;
+  meta->lock();
+  if (uint64_t size; meta->get_inline_data_size(size)) {
+    // in-place overwrites are not atomic, so only new bytes are written inline
+    if (offset >= size && offset + count <= MAX_INLINE_DATA_SIZE) {
+      meta->append_inline_data(buf, count, offset);
+      ret = static_cast<ssize_t>(count);
+      done = true;
+    } else {
+      spill_inline_data(size);
+    }
+  } else if (meta->has_inline_data()) {
+    // a spill crashed after retiring the data; finish it
+    LogicalBlockIdx begin_lidx;
+    uint64_t file_size;
+    if (meta->get_sealed(begin_lidx, file_size))
+      unseal_locked(begin_lidx, file_size);
+    else
+      meta->clear_inline_data();
+  }
+  meta->unlock();
+  return done;
+}
+
+bool File::try_read_inline(char* buf, size_t count, size_t offset,
+                           ssize_t& ret) {
+  uint64_t size;
+  if (!meta->get_inline_data_size(size)) goto retired;
+
+  if (offset >= size) {
+    ret = 0;
+    return true;
+  }
+  // the bytes below the size never change while the data is inline
+  count = std::min(count, size - offset);
+  dram::memcpy(buf, meta->get_inline_data() + offset, count);
+
+  // the data is retired before the inline tx entries are reused
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (!meta->is_inline()) goto retired;
+  ret = static_cast<ssize_t>(count);
+  return true;
+
+retired:
+  // wait for the tx history to be rebuilt from the retired data
+  meta->lock();
+  meta->unlock();
+  return false;
+}
+
+void File::spill_inline_data(uint64_t size) {
+  if (size == 0) {
+    meta->retire_inline_data();
+    meta->clear_inline_data();
+    LOG_DEBUG("empty inline data cleared");
+    return;
+  }
+
+  // the data is first sealed in a new block, so a crash at any point below
+  // leaves either the inline data or the sealed block valid
+  LogicalBlockIdx lidx = get_local_allocator()->block.alloc(1);
+  pmem::memcpy_persist(mem_table.lidx_to_addr_rw(lidx)->data_rw(),
+                       meta->get_inline_data(), size);
+  fence();
+  meta->set_sealed(lidx, size);
+  unseal_locked(lidx, size);
+  LOG_DEBUG("inline data (%lu bytes) moved to block %u", size, lidx.get());
+}
+
+bool File::try_read_sealed(char* buf, size_t count, size_t offset,
+                           ssize_t& ret) {
+  const char* data = sealed_data.load(std::memory_order_acquire);
+  if (!data) return false;
+  if (!meta->is_sealed()) goto unsealed;
+
+  if (offset >= sealed_size) {
+    ret = 0;
+    return true;
+  }
+  count = std::min(count, sealed_size - offset);
+  dram::memcpy(buf, data + offset, count);
+
+  // a writer clears the seal before changing any block
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (!meta->is_sealed()) goto unsealed;
+  ret = static_cast<ssize_t>(count);
+  return true;
+
+unsealed:
+  sealed_data.store(nullptr, std::memory_order_release);
+  return false;
+}
+
+void File::on_fork_child() {
+  blk_table.unlock();
+  lease.on_fork_child();
+  // the allocators and their per-thread slots in the shared memory belong to
+  // the parent's threads, which are still using them; the child gets fresh ones
+  // lazily through get_local_allocator
+  for (auto& [_, allocator] : allocators) allocator.forget();
+  allocators.clear();
+  allocators_id = next_allocators_id.fetch_add(1);
+  offset_mgr.on_fork_child(blk_table.get_state_unsafe().cursor);
+  // the asynchronous requests are dropped in the child (see AioPool)
+  num_aio_in_flight.store(0, std::memory_order_relaxed);
+  num_aio_held.store(0, std::memory_order_relaxed);
+}
+
 std::ostream& operator<<(std::ostream& out, File& f) {
   __msan_scoped_disable_interceptor_checks();
   out << "File: fd = " << f.fd << "\n";
-  if (f.can_write) out << f.shm_mgr;
+  if (uint32_t n = f.num_aio_in_flight.load(std::memory_order_relaxed); n > 0)
+    out << "AIO in flight: " << n << "\n";
+  if (f.can_write) out << f.shm_mgr << f.lease;
   out << *f.meta;
   out << f.blk_table;
   out << f.mem_table;
@@ -75,7 +299,7 @@ std::ostream& operator<<(std::ostream& out, File& f) {
     TxCursor cursor = TxCursor::from_meta(f.meta);
     int count = 0;
 
-    while (true) {
+    while (!f.meta->has_inline_data()) {
       auto tx_entry = cursor.get_entry();
       if (!tx_entry.is_valid()) break;
       if (tx_entry.is_dummy()) goto next;
@@ -89,7 +313,7 @@ std::ostream& operator<<(std::ostream& out, File& f) {
       out << "\t" << count << ": " << cursor.idx << " -> " << tx_entry << "\n";
 
       // print log entries if the tx is not inlined
-      if (!tx_entry.is_inline()) {
+      if (tx_entry.is_indirect()) {
         LogCursor log_cursor(tx_entry.indirect_entry, &f.mem_table);
         do {
           out << "\t\t" << *log_cursor << "\n";
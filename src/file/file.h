@@ -2,6 +2,7 @@
 
 #include <fcntl.h>
 #include <pthread.h>
+#include <sys/file.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/xattr.h>
@@ -10,7 +11,10 @@
 #include <cstdint>
 #include <ctime>
 #include <iostream>
+#include <memory>
+#include <optional>
 #include <stdexcept>
+#include <tuple>
 
 #include "alloc/alloc.h"
 #include "bitmap.h"
@@ -19,22 +23,32 @@
 #include "config.h"
 #include "const.h"
 #include "entry.h"
+#include "filter.h"
 #include "idx.h"
+#include "lease.h"
 #include "mem_table.h"
 #include "offset.h"
 #include "posix.h"
 #include "shm.h"
 #include "tx/lock.h"
 #include "utils/utils.h"
+#include "write_buffer.h"
 
 // try to open a file with checking whether the given file is in MadFS format
 static bool try_open(int& fd, struct stat& stat_buf, const char* pathname,
-                      int flags, mode_t mode) {
+                     int flags, mode_t mode) {
   madfs::TimerGuard<madfs::Event::OPEN_SYS> timer_guard;
+  auto& filter = madfs::dram::OpenFilter::get();
+
+  // files outside the allowed prefixes go to the kernel without extra syscalls
+  if (!filter.may_match_path(pathname)) {
+    fd = SAFE_CALL_POSIX_FN(open, pathname, flags, mode);
+    return false;
+  }
 
   if ((flags & O_ACCMODE) == O_WRONLY) {
     LOG_INFO("File \"%s\" opened with O_WRONLY. Changed to O_RDWR.",
-              pathname);
+             pathname);
     flags &= ~O_WRONLY;
     flags |= O_RDWR;
   }
@@ -45,14 +59,9 @@ static bool try_open(int& fd, struct stat& stat_buf, const char* pathname,
     return false;
   }
 
-  if (!(flags & O_CREAT)) {
-    // a non-empty file w/o shm_path cannot be a MadFS file
-    ssize_t rc = fgetxattr(fd, madfs::SHM_XATTR_NAME, nullptr, 0);
-    if (rc == -1) return false;
-  }
-
-  int rc = SAFE_CALL_POSIX_FN(fstat, _STAT_VER, fd, &stat_buf);
-  // posix::fstat(fd, &stat_buf);
+  // fstat first, which a MadFS file needs anyway, and let the device and the
+  // negative cache rule out the file before the xattr lookup
+  int rc = madfs::posix::fstat(fd, &stat_buf);
   if (unlikely(rc < 0)) {
     LOG_WARN("File \"%s\" fstat failed: %m. Fallback to syscall.", pathname);
     return false;
@@ -64,9 +73,18 @@ static bool try_open(int& fd, struct stat& stat_buf, const char* pathname,
     return false;
   }
 
+  if (!(flags & O_CREAT)) {
+    if (!filter.may_match_inode(stat_buf)) return false;
+    // a non-empty file w/o shm_path cannot be a MadFS file
+    if (fgetxattr(fd, madfs::SHM_XATTR_NAME, nullptr, 0) == -1) {
+      filter.add_negative(stat_buf);
+      return false;
+    }
+  }
+
   if (!IS_ALIGNED(stat_buf.st_size, madfs::BLOCK_SIZE)) {
     LOG_WARN("File size not aligned for \"%s\". Fallback to syscall",
-              pathname);
+             pathname);
     return false;
   }
 
@@ -87,17 +105,47 @@ class File {
   OffsetMgr offset_mgr;
   BlkTable blk_table;
   ShmMgr shm_mgr;
+  Lease lease;
   pmem::MetaBlock* const meta;
   Lock lock;         // nop lock is used by default
   const char* path;  // only set at debug mode
   int fd;            // only used in destructor, can set to -1 to prevent close
   const bool can_read;
   const bool can_write;
+  // whether writes fail instead of waiting for another process's lease
+  const bool is_nonblock;
+  // the asynchronous requests queued or running on this file, and those of
+  // them held back until the ones before a sync are done (see AioPool)
+  std::atomic<uint32_t> num_aio_in_flight{0};
+  std::atomic<uint32_t> num_aio_held{0};
 
  private:
+  // kernel attributes at open time; used to answer fstat without syscalls
+  const struct stat kernel_stat;
+
+  // set if the file is sealed and opened for read: the data is read from this
+  // linear mapping without the block table; reset once the file is unsealed
+  std::atomic<const char*> sealed_data{nullptr};
+  uint64_t sealed_size{0};
+
+  // the write buffer of the inode, if any; it is created by the fds opened for
+  // write under runtime_options.buffered_paths, and the other fds attach to it
+  // lazily, as it may be created after they are opened
+  std::atomic<WriteBuffer*> write_buffer{nullptr};
+  // the WriteBuffer::generation when the buffer was last looked up
+  std::atomic<uint64_t> write_buffer_generation{0};
+
+  // the mode of the last successful flock, so that a failed lease can fall
+  // back to it
+  std::atomic<int> flock_mode{LOCK_UN};
+
   // each thread tid has its local allocator
   // the allocator is a per-thread per-file data structure
   tbb::concurrent_unordered_map<pid_t, Allocator> allocators;
+  // identifies the allocators above in the per-thread cache of
+  // get_local_allocator; renewed whenever they are dropped
+  uint64_t allocators_id{next_allocators_id.fetch_add(1)};
+  static inline std::atomic<uint64_t> next_allocators_id{1};
 
  public:
   File(int fd, const struct stat& stat, int flags, const char* pathname);
@@ -111,27 +159,292 @@ class File {
   ssize_t pread(char* buf, size_t count, size_t offset);
   ssize_t read(char* buf, size_t count);
   off_t lseek(off_t offset, int whence);
-  void* mmap(void* addr, size_t length, int prot, int flags,
-             size_t offset) const;
+  void* mmap(void* addr, size_t length, int prot, int flags, size_t offset);
   int fsync();
-  void stat(struct stat* buf) {
-    buf->st_size = static_cast<off_t>(blk_table.update_unsafe());
+  int flock(int operation);
+
+  /**
+   * Reserve contiguous blocks for the part of [offset, offset + len) beyond
+   * the end of the file, so that the writes there stay contiguous. Unless
+   * FALLOC_FL_KEEP_SIZE is given, the file then grows to offset + len, with
+   * the new blocks left as holes until they are written (see ExtendTx).
+   */
+  int fallocate(int mode, off_t offset, off_t len);
+
+  /**
+   * Take the reserved blocks for a write to [begin_vidx, begin_vidx +
+   * num_blocks); the reservation is consumed in order, so the reserved blocks
+   * before begin_vidx are given back.
+   *
+   * @return the first of the contiguous blocks; 0 if the range is not reserved
+   * or a chunk of it would cross a grow unit
+   */
+  LogicalBlockIdx take_reserved(VirtualBlockIdx begin_vidx,
+                                uint32_t num_blocks);
+
+  /**
+   * Give back the reserved blocks that are not used yet
+   */
+  void release_reservation();
+
+  /**
+   * Persist a snapshot of the blocks referenced by the tx history with the tx
+   * entry up to which it reflects it, so that rebuilding the bitmap after the
+   * shared memory is lost only replays the txs after it. The snapshot is
+   * extended with the txs since the last one. Called by fsync every
+   * BITMAP_SNAPSHOT_INTERVAL tx blocks, or at any time if force is set.
+   */
+  void checkpoint_bitmap(bool force = true);
+
+  /**
+   * Drop the bitmap snapshot; called with the meta lock held before replacing
+   * the tx history it refers to
+   */
+  void discard_bitmap_snapshot_locked();
+
+  /**
+   * Fill the stat buffer without any syscall: the kernel attributes are cached
+   * at open time, while size and mtime are maintained by MadFS. Attributes
+   * changed outside MadFS after open (e.g., by chmod) are not reflected.
+   *
+   * @return 0 on success; -1 if the write buffer cannot be committed
+   */
+  int stat(struct stat* buf) {
+    if (flush_write_buffer() != 0) return -1;
+    FileState state;
+    blk_table.update(&state);
+    *buf = kernel_stat;
+    // a sealed file has no shared memory
+    if (!is_sealed()) shm_mgr.get_header()->fill_stat(buf);
+    buf->st_size = static_cast<off_t>(state.file_size);
+    return 0;
+  }
+
+  /**
+   * @return whether the file is sealed and opened for read (see
+   * utility::Sealer)
+   */
+  [[nodiscard]] bool is_sealed() const {
+    return sealed_data.load(std::memory_order_acquire) != nullptr;
+  }
+
+  /**
+   * @return the write buffer of the inode, if any
+   */
+  [[nodiscard]] WriteBuffer* get_write_buffer() {
+    if (likely(write_buffer_generation.load(std::memory_order_acquire) ==
+               WriteBuffer::generation.load(std::memory_order_relaxed)))
+      return write_buffer.load(std::memory_order_relaxed);
+    return attach_write_buffer(/*create=*/false);
   }
 
+  /**
+   * Commit the write buffer and detach from it; the last fd attached to it
+   * unregisters it. Called on close, and again (as a no-op) on destruction.
+   *
+   * @return 0 on success; -1 if the last writer cannot commit the buffer, in
+   * which case the buffered data is lost
+   */
+  int detach_write_buffer();
+
+  /*
+   * fork handling: the block table and the mappings are inherited as is, so
+   * the child can use the file without replaying the log
+   */
+  void on_fork_prepare() {
+    lease.on_fork_prepare();
+    blk_table.lock();
+  }
+  void on_fork_parent() {
+    blk_table.unlock();
+    lease.on_fork_parent();
+  }
+  void on_fork_child();
+
   [[nodiscard]] Allocator* get_local_allocator() {
-    if (auto it = allocators.find(tid); it != allocators.end()) {
-      return &it->second;
-    }
+    // a thread usually asks for the same file's allocator again (e.g., at the
+    // start of a write and in its tx), so the last one skips the map lookup
+    thread_local uint64_t cached_id = 0;
+    thread_local Allocator* cached_allocator = nullptr;
+    if (cached_id == allocators_id) return cached_allocator;
 
-    auto [it, ok] = allocators.emplace(
-        std::piecewise_construct, std::forward_as_tuple(tid),
-        std::forward_as_tuple(&mem_table, &bitmap_mgr,
-                              shm_mgr.alloc_per_thread_data()));
-    PANIC_IF(!ok, "insert to thread-local allocators failed");
-    return &it->second;
+    auto it = allocators.find(tid);
+    if (it == allocators.end()) {
+      bool ok;
+      std::tie(it, ok) = allocators.emplace(
+          std::piecewise_construct, std::forward_as_tuple(tid),
+          std::forward_as_tuple(&mem_table, &bitmap_mgr,
+                                shm_mgr.alloc_per_thread_data()));
+      PANIC_IF(!ok, "insert to thread-local allocators failed");
+    }
+    cached_id = allocators_id;
+    cached_allocator = &it->second;
+    return cached_allocator;
   }
 
   friend std::ostream& operator<<(std::ostream& out, File& f);
+  // the fork handlers commit the buffers through their writers
+  friend class WriteBuffer;
+
+ private:
+  void release_lease();
+
+  /**
+   * Write [offset, offset + count) through a tx, bypassing the write buffer
+   */
+  ssize_t write_tx(const char* buf, size_t count, size_t offset);
+
+  /**
+   * Look up the write buffer of the inode and attach to it.
+   *
+   * @param create whether to create and register the buffer if there is none
+   * @return the buffer; nullptr if there is none
+   */
+  WriteBuffer* attach_write_buffer(bool create);
+
+  /**
+   * Copy a small write into the write buffer if it extends the buffered range;
+   * otherwise, commit the buffer first so that the write is ordered after it.
+   *
+   * @return count if the write is buffered; 0 if the caller must write it
+   * through a tx; -1 if the buffer cannot be committed or the write fails
+   * under another process's lease
+   */
+  ssize_t buffer_write(const char* buf, size_t count, size_t offset);
+
+  /**
+   * Commit the write buffer, if any, so that the tx history reflects all the
+   * writes to the file through this process's fds.
+   *
+   * @return 0 on success; -1 if the buffer cannot be committed, in which case
+   * the data stays buffered
+   */
+  int flush_write_buffer() {
+    WriteBuffer* b = get_write_buffer();
+    if (!b) return 0;
+    std::lock_guard<std::mutex> guard(b->mutex);
+    return flush_write_buffer_locked(/*keep_tail=*/false);
+  }
+
+  /**
+   * Commit the write buffer with its mutex held; if keep_tail is set, the last
+   * partial block is kept buffered, so that the next commit starts at a block
+   * boundary.
+   */
+  int flush_write_buffer_locked(bool keep_tail);
+
+  /**
+   * Body of the background thread that commits the buffers idle for MAX_AGE
+   */
+  [[noreturn]] static void write_buffer_flusher_loop();
+
+  // called with the meta lock held
+  void release_reservation_locked();
+
+  /**
+   * Reserve the blocks of [offset, end_offset) beyond the end of the file
+   */
+  int reserve(uint64_t offset, uint64_t end_offset);
+
+  /**
+   * Grow the file to size without a data write; nothing is done if the file is
+   * already larger
+   */
+  int extend(uint64_t size);
+
+  /**
+   * Flush the tx entries before tail and record it in the meta block
+   */
+  void flush_tx_history(TxCursor tail);
+
+  /**
+   * @return whether the tx history has grown BITMAP_SNAPSHOT_INTERVAL tx
+   * blocks past the bitmap snapshot
+   */
+  [[nodiscard]] bool need_bitmap_snapshot(TxCursor tail);
+
+  /**
+   * Update the bitmap snapshot to reflect the tx history before tail, in place
+   * if it is large enough; called with the meta lock held
+   */
+  void write_bitmap_snapshot_locked(TxCursor tail);
+
+  /**
+   * Load the bitmap snapshot, if any and still valid, into the (empty) bitmap;
+   * the data blocks must then be set from the replayed block table; called
+   * with the meta lock held
+   *
+   * @return the tx entry from which the tx history is not reflected by it
+   */
+  std::optional<TxEntryIdx> load_bitmap_snapshot();
+
+  /**
+   * @return the cursor at the first tx entry not reflected by the bitmap
+   * snapshot at lidx; empty if the snapshot is stale
+   */
+  std::optional<TxCursor> get_bitmap_snapshot_cursor(LogicalBlockIdx lidx);
+
+  /**
+   * @return the address of a bitmap entry of the snapshot at lidx
+   */
+  uint64_t* get_bitmap_snapshot_entry(LogicalBlockIdx lidx, uint32_t entry_idx);
+
+  /**
+   * Rebuild the tx history of a sealed file and clear the seal, so that it can
+   * be written as a normal file.
+   */
+  void unseal(LogicalBlockIdx begin_lidx, uint64_t file_size);
+
+  /**
+   * Rebuild the tx history of a sealed file; called with the meta lock held.
+   */
+  void unseal_locked(LogicalBlockIdx begin_lidx, uint64_t file_size);
+
+  /**
+   * Write to a small file whose data is inline in the meta block. Writes that
+   * only extend the data are done inline; others move the data out first.
+   *
+   * @param[out] ret the number of bytes written
+   * @return false if the data is not inline (anymore); the caller must fall
+   * back to a normal write with a refreshed file state
+   */
+  bool try_write_inline(const char* buf, size_t count, size_t offset,
+                        ssize_t& ret);
+
+  /**
+   * Read a small file whose data is inline in the meta block.
+   *
+   * @param[out] ret the number of bytes read
+   * @return false if the data is not inline (anymore); the caller must fall
+   * back to a normal read
+   */
+  bool try_read_inline(char* buf, size_t count, size_t offset, ssize_t& ret);
+
+  /**
+   * Move the inline data to a data block and rebuild the tx history from it,
+   * reusing the seal as the crash-consistent intermediate state. Called with
+   * the meta lock held.
+   */
+  void spill_inline_data(uint64_t size);
+
+  /**
+   * Read a sealed file from its linear mapping; no validation is needed since
+   * the data never changes while the seal is in place.
+   *
+   * @param[out] ret the number of bytes read
+   * @return false if the file is no longer sealed; the caller must fall back
+   * to a normal read
+   */
+  bool try_read_sealed(char* buf, size_t count, size_t offset, ssize_t& ret);
+
+  /**
+   * Wait for or fail on a lease held by another process before a write.
+   * @return false if the write must fail with EAGAIN
+   */
+  bool begin_write(PerThreadData*& per_thread_data, Lease::WriteMode& mode) {
+    per_thread_data = get_local_allocator()->tx_block.get_per_thread_data();
+    return lease.begin_write(per_thread_data, is_nonblock, mode);
+  }
 };
 
 }  // namespace madfs::dram
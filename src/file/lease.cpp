@@ -0,0 +1,39 @@
+#include <sys/file.h>
+
+#include "file/file.h"
+
+namespace madfs::dram {
+int File::flock(int operation) {
+  // the lease does not cover the buffered writes
+  if (flush_write_buffer() != 0) return -1;
+  // the kernel lock is always taken, so that other lockers (e.g., without
+  // MadFS or on other hosts) see it; the lease comes in addition to it
+  int mode = operation & ~LOCK_NB;
+  if (mode != LOCK_EX) {
+    // a shared lock or an unlock ends the exclusive writer
+    release_lease();
+    if (posix::flock(fd, operation) < 0) return -1;
+    flock_mode.store(mode, std::memory_order_relaxed);
+    return 0;
+  }
+
+  int prev_mode = flock_mode.load(std::memory_order_relaxed);
+  if (posix::flock(fd, operation) < 0) return -1;
+  // the lease only matters to writers
+  if (!can_write || lease.acquire(operation & LOCK_NB) == 0) {
+    flock_mode.store(LOCK_EX, std::memory_order_relaxed);
+    return 0;
+  }
+  // go back to the lock held before the call; it is not waited for, since the
+  // exclusive one we hold only lets a racing locker in between
+  int err = errno;
+  posix::flock(fd, prev_mode | LOCK_NB);
+  errno = err;
+  return -1;
+}
+
+void File::release_lease() {
+  // tx entries committed under the lease are only flushed in batches
+  lease.release([&] { fsync(); });
+}
+}  // namespace madfs::dram
@@ -4,11 +4,42 @@
 
 namespace madfs::dram {
 void* File::mmap(void* addr_hint, size_t length, int prot, int mmap_flags,
-                 size_t offset) const {
+                 size_t offset) {
   if (offset % BLOCK_SIZE != 0) {
     errno = EINVAL;
     return MAP_FAILED;
   }
+  // the mapping shows the data through the block table
+  if (flush_write_buffer() != 0) return MAP_FAILED;
+
+  // inline data is not block-aligned; move it out so that it can be mapped,
+  // or give a private copy if the file is read-only
+  if (meta->has_inline_data()) {
+    if (!can_write) {
+      void* res = posix::mmap(addr_hint, length, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (res == MAP_FAILED) return MAP_FAILED;
+      char* buf = static_cast<char*>(res);
+      if (ssize_t ret; !try_read_inline(buf, length, offset, ret))
+        pread(buf, length, offset);
+      mprotect(res, length, prot);
+      return res;
+    }
+    meta->lock();
+    if (uint64_t size; meta->get_inline_data_size(size))
+      spill_inline_data(size);
+    meta->unlock();
+    FileState state;
+    blk_table.update(&state);
+  }
+
+  // the data of a sealed file is contiguous on the file, so map it directly
+  if (const char* data = sealed_data.load(std::memory_order_acquire); data) {
+    auto data_offset =
+        static_cast<size_t>(data - reinterpret_cast<const char*>(meta));
+    return posix::mmap(addr_hint, length, prot, mmap_flags, fd,
+                       static_cast<off_t>(data_offset + offset));
+  }
 
   // reserve address space by memory-mapping /dev/zero
   static int zero_fd = posix::open("/dev/zero", O_RDONLY);
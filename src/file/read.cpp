@@ -9,6 +9,12 @@ ssize_t File::pread(char* buf, size_t count, size_t offset) {
     return -1;
   }
   if (unlikely(count == 0)) return 0;
+  if (flush_write_buffer() != 0) return -1;
+  if (ssize_t ret; is_sealed() && try_read_sealed(buf, count, offset, ret))
+    return ret;
+  if (ssize_t ret;
+      meta->has_inline_data() && try_read_inline(buf, count, offset, ret))
+    return ret;
   TimerGuard<Event::READ_TX> timer_guard;
   timer.start<Event::READ_TX_CTOR>();
   return ReadTx(this, buf, count, offset).exec();
@@ -20,6 +26,7 @@ ssize_t File::read(char* buf, size_t count) {
     return -1;
   }
   if (unlikely(count == 0)) return 0;
+  if (flush_write_buffer() != 0) return -1;
 
   FileState state;
   uint64_t ticket;
@@ -30,6 +37,18 @@ ssize_t File::read(char* buf, size_t count) {
     state = file_state;
   });
 
+  if (ssize_t ret; is_sealed() && try_read_sealed(buf, count, offset, ret)) {
+    offset_mgr.release(ticket, state.cursor);
+    return ret;
+  }
+  if (meta->has_inline_data()) {
+    if (ssize_t ret; try_read_inline(buf, count, offset, ret)) {
+      offset_mgr.release(ticket, state.cursor);
+      return ret;
+    }
+    blk_table.update(&state);
+  }
+
   return Tx::exec_and_release_offset<ReadTx>(this, buf, count, offset, state,
                                              ticket);
 }
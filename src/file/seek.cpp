@@ -3,6 +3,8 @@
 namespace madfs::dram {
 off_t File::lseek(off_t offset, int whence) {
   int64_t ret;
+  // the end of the file must include the buffered writes
+  if (whence == SEEK_END && flush_write_buffer() != 0) return -1;
 
   blk_table.update([&](const FileState& state) {
     uint64_t file_size = state.file_size;
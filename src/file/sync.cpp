@@ -2,18 +2,198 @@
 
 namespace madfs::dram {
 int File::fsync() {
+  if (flush_write_buffer() != 0) return -1;
   FileState state;
   blk_table.update(&state);
-  TxCursor::flush_up_to(&mem_table, meta, state.cursor);
+  flush_tx_history(state.cursor);
+  if (can_write && need_bitmap_snapshot(state.cursor))
+    checkpoint_bitmap(/*force=*/false);
+  // the snapshot is taken before, so that it is durable with the rest
+  return mem_table.sync();
+}
+
+void File::flush_tx_history(TxCursor tail) {
+  TxCursor::flush_up_to(&mem_table, meta, tail);
   // we keep an invariant that tx_tail must be a valid (non-overflow) idx
   // an overflow index implies that the `next` pointer of the block is not set
   // (and thus not flushed) yet, so we cannot assume it is equivalent to the
   // first index of the next block
   // here we use the last index of the block to enforce reflush later
-  uint16_t capacity = state.cursor.idx.get_capacity();
-  if (unlikely(state.cursor.idx.local_idx >= capacity))
-    state.cursor.idx.local_idx = static_cast<uint16_t>(capacity - 1);
-  meta->set_flushed_tx_tail(state.cursor.idx);
-  return 0;
+  uint16_t capacity = tail.idx.get_capacity();
+  if (unlikely(tail.idx.local_idx >= capacity))
+    tail.idx.local_idx = static_cast<uint16_t>(capacity - 1);
+  meta->set_flushed_tx_tail(tail.idx);
+}
+
+bool File::need_bitmap_snapshot(TxCursor tail) {
+  if (tail.idx.is_inline()) return false;
+  uint32_t snapshot_tx_seq = 0;
+  if (LogicalBlockIdx lidx = meta->get_bitmap_snapshot(); lidx != 0)
+    snapshot_tx_seq =
+        mem_table.lidx_to_addr_ro(lidx)->bitmap_snapshot_block.get_tx_seq();
+  return tail.block->get_tx_seq() >= snapshot_tx_seq + BITMAP_SNAPSHOT_INTERVAL;
+}
+
+void File::checkpoint_bitmap(bool force) {
+  assert(can_write);
+  meta->lock();
+  // the tx history is not replaced while the meta lock is held (see
+  // utility::GarbageCollector), so the tail found here stays in it
+  FileState state;
+  blk_table.update(&state);
+  if (!meta->has_inline_data() &&
+      (force || need_bitmap_snapshot(state.cursor)))
+    write_bitmap_snapshot_locked(state.cursor);
+  meta->unlock();
+}
+
+void File::write_bitmap_snapshot_locked(TxCursor tail) {
+  // the txs reflected by the snapshot must survive a crash
+  flush_tx_history(tail);
+
+  uint32_t num_entries =
+      std::min(ALIGN_UP(meta->get_num_logical_blocks(),
+                        BITMAP_ENTRY_BLOCKS_CAPACITY) >>
+                   BITMAP_ENTRY_BLOCKS_CAPACITY_SHIFT,
+               NUM_BITMAP_ENTRIES);
+  LogicalBlockIdx old_lidx = meta->get_bitmap_snapshot();
+  std::optional<TxCursor> begin;
+  uint32_t old_num_entries = 0;
+  if (old_lidx != 0) {
+    begin = get_bitmap_snapshot_cursor(old_lidx);
+    if (begin)
+      old_num_entries = mem_table.lidx_to_addr_ro(old_lidx)
+                            ->bitmap_snapshot_block.get_num_entries();
+  }
+
+  // the blocks referenced by the tx history only grow until it is replaced
+  // (see discard_bitmap_snapshot_locked), so a valid snapshot is extended in
+  // place with the txs after it; a new one is only needed to hold more entries
+  LogicalBlockIdx lidx = old_lidx;
+  if (begin && old_num_entries >= num_entries) {
+    num_entries = old_num_entries;
+  } else {
+    // leave room for the file to grow, so that it is rarely copied
+    num_entries = std::min(std::max(num_entries, old_num_entries * 2),
+                           NUM_BITMAP_ENTRIES);
+    uint32_t num_blocks =
+        pmem::BitmapSnapshotBlock::get_num_blocks(num_entries);
+    auto begin_lidx = bitmap_mgr.alloc_contiguous(num_blocks);
+    if (!begin_lidx.has_value()) {
+      LOG_WARN("no contiguous space for a bitmap snapshot of %u blocks",
+               num_blocks);
+      return;
+    }
+    lidx = begin_lidx.value();
+    for (uint32_t begin_entry = 0; begin_entry < num_entries;
+         begin_entry += NUM_BITMAP_ENTRIES_PER_BLOCK) {
+      uint64_t* dst = get_bitmap_snapshot_entry(lidx, begin_entry);
+      std::memset(dst, 0, BLOCK_SIZE);
+      if (begin_entry < old_num_entries)
+        std::memcpy(dst, get_bitmap_snapshot_entry(old_lidx, begin_entry),
+                    std::min(old_num_entries - begin_entry,
+                             uint32_t{NUM_BITMAP_ENTRIES_PER_BLOCK}) *
+                        BITMAP_ENTRY_SIZE);
+      pmem::persist_unfenced(dst, BLOCK_SIZE);
+    }
+    if (!begin) begin = TxCursor::from_meta(meta);
+  }
+
+  // only the tx blocks and the log entry blocks are kept: the data blocks are
+  // taken from the block table after replaying (see File::File), so the
+  // blocks in free lists or of writes not committed yet are never included
+  auto mark = [&](LogicalBlockIdx block_idx) {
+    uint32_t entry_idx = block_idx >> BITMAP_ENTRY_BLOCKS_CAPACITY_SHIFT;
+    if (entry_idx >= num_entries) return;
+    uint64_t* entry = get_bitmap_snapshot_entry(lidx, entry_idx);
+    uint64_t bit = 1UL << (block_idx & (BITMAP_ENTRY_BLOCKS_CAPACITY - 1));
+    if (*entry & bit) return;
+    *entry |= bit;
+    pmem::persist_unfenced(entry, sizeof(*entry));
+  };
+  TxCursor cursor = *begin;
+  for (bool valid = cursor.handle_overflow(&mem_table); valid && cursor < tail;
+       valid = cursor.advance(&mem_table)) {
+    pmem::TxEntry tx_entry = cursor.get_entry();
+    if (!tx_entry.is_valid()) break;
+    if (!cursor.idx.is_inline()) mark(cursor.idx.block_idx);
+    if (tx_entry.is_inline() || tx_entry.is_inline_tail()) continue;
+    LogCursor log_cursor(tx_entry.indirect_entry, &mem_table);
+    do mark(log_cursor.idx.block_idx);
+    while (log_cursor.advance(&mem_table));
+  }
+  fence();
+
+  uint32_t tx_seq = tail.idx.is_inline() ? 0 : tail.block->get_tx_seq();
+  mem_table.lidx_to_addr_rw(lidx)->bitmap_snapshot_block.init(
+      tail.idx, tx_seq, num_entries);
+  fence();
+  if (lidx != old_lidx) {
+    meta->set_bitmap_snapshot(lidx);
+    if (old_lidx != 0)
+      bitmap_mgr.free_range(old_lidx.get(),
+                            mem_table.lidx_to_addr_ro(old_lidx)
+                                ->bitmap_snapshot_block.get_num_blocks());
+  }
+  LOG_DEBUG("bitmap snapshot of %u entries taken at logical block %u",
+            num_entries, lidx.get());
+}
+
+void File::discard_bitmap_snapshot_locked() {
+  LogicalBlockIdx lidx = meta->get_bitmap_snapshot();
+  if (lidx == 0) return;
+  uint32_t num_blocks =
+      mem_table.lidx_to_addr_ro(lidx)->bitmap_snapshot_block.get_num_blocks();
+  meta->set_bitmap_snapshot(0);
+  bitmap_mgr.free_range(lidx.get(), num_blocks);
+}
+
+std::optional<TxEntryIdx> File::load_bitmap_snapshot() {
+  LogicalBlockIdx lidx = meta->get_bitmap_snapshot();
+  if (lidx == 0) return {};
+  std::optional<TxCursor> cursor = get_bitmap_snapshot_cursor(lidx);
+  if (!cursor) {
+    LOG_WARN("bitmap snapshot at logical block %u is stale; ignored",
+             lidx.get());
+    return {};
+  }
+
+  uint32_t num_entries =
+      mem_table.lidx_to_addr_ro(lidx)->bitmap_snapshot_block.get_num_entries();
+  for (uint32_t begin = 0; begin < num_entries;
+       begin += NUM_BITMAP_ENTRIES_PER_BLOCK)
+    bitmap_mgr.restore(get_bitmap_snapshot_entry(lidx, begin), begin,
+                       std::min(num_entries - begin,
+                                uint32_t{NUM_BITMAP_ENTRIES_PER_BLOCK}));
+  LOG_INFO("bitmap loaded from the snapshot at logical block %u", lidx.get());
+  return cursor->idx;
+}
+
+std::optional<TxCursor> File::get_bitmap_snapshot_cursor(LogicalBlockIdx lidx) {
+  const pmem::BitmapSnapshotBlock& snapshot =
+      mem_table.lidx_to_addr_ro(lidx)->bitmap_snapshot_block;
+  TxEntryIdx tx_idx = snapshot.get_tx_idx();
+  TxCursor cursor(tx_idx, tx_idx.is_inline()
+                              ? static_cast<void*>(meta)
+                              : mem_table.lidx_to_addr_rw(tx_idx.block_idx));
+  uint32_t tx_seq = tx_idx.is_inline() ? 0 : cursor.block->get_tx_seq();
+  if (snapshot.get_num_entries() > NUM_BITMAP_ENTRIES ||
+      tx_seq != snapshot.get_tx_seq())
+    return {};
+  // the replay reaches the entry after an overflow index in the next block
+  cursor.handle_overflow(&mem_table);
+  return cursor;
+}
+
+uint64_t* File::get_bitmap_snapshot_entry(LogicalBlockIdx lidx,
+                                          uint32_t entry_idx) {
+  // the blocks may not be contiguous in memory, so the entries are addressed
+  // block by block
+  return reinterpret_cast<uint64_t*>(
+             mem_table
+                 .lidx_to_addr_rw(lidx + 1 +
+                                  entry_idx / NUM_BITMAP_ENTRIES_PER_BLOCK)
+                 ->data_rw()) +
+         entry_idx % NUM_BITMAP_ENTRIES_PER_BLOCK;
 }
 }  // namespace madfs::dram
@@ -9,24 +9,39 @@ ssize_t File::pwrite(const char* buf, size_t count, size_t offset) {
     return -1;
   }
   if (unlikely(count == 0)) return 0;
-  // special case that we have everything aligned, no OCC
-  if (count % BLOCK_SIZE == 0 && offset % BLOCK_SIZE == 0) {
-    TimerGuard<Event::ALIGNED_TX> timer_guard;
-    timer.start<Event::ALIGNED_TX_CTOR>();
-    return AlignedTx(this, buf, count, offset).exec();
+  if (get_write_buffer()) {
+    if (ssize_t ret = buffer_write(buf, count, offset); ret != 0) return ret;
   }
+  return write_tx(buf, count, offset);
+}
 
-  // another special case where range is within a single block
-  if ((BLOCK_SIZE_TO_IDX(offset)) == BLOCK_SIZE_TO_IDX(offset + count - 1)) {
-    TimerGuard<Event::SINGLE_BLOCK_TX> timer_guard;
-    return SingleBlockTx(this, buf, count, offset).exec();
-  }
+ssize_t File::write_tx(const char* buf, size_t count, size_t offset) {
+  PerThreadData* per_thread_data;
+  Lease::WriteMode mode;
+  if (unlikely(!begin_write(per_thread_data, mode))) return -1;
 
-  // unaligned multi-block write
-  {
+  ssize_t ret;
+  if (meta->has_inline_data() && try_write_inline(buf, count, offset, ret)) {
+    // the data of a small file stays in the meta block
+  } else if (count % BLOCK_SIZE == 0 && offset % BLOCK_SIZE == 0) {
+    // special case that we have everything aligned, no OCC
+    TimerGuard<Event::ALIGNED_TX> timer_guard;
+    timer.start<Event::ALIGNED_TX_CTOR>();
+    ret = AlignedTx(this, buf, count, offset).exec();
+  } else if ((BLOCK_SIZE_TO_IDX(offset)) ==
+             BLOCK_SIZE_TO_IDX(offset + count - 1)) {
+    // another special case where range is within a single block
+    TimerGuard<Event::SINGLE_BLOCK_TX> timer_guard;
+    ret = SingleBlockTx(this, buf, count, offset).exec();
+  } else {
+    // unaligned multi-block write
     TimerGuard<Event::MULTI_BLOCK_TX> timer_guard;
-    return MultiBlockTx(this, buf, count, offset).exec();
+    ret = MultiBlockTx(this, buf, count, offset).exec();
   }
+
+  Lease::end_write(per_thread_data, mode);
+  if (ret > 0) shm_mgr.get_header()->on_write(offset + static_cast<size_t>(ret));
+  return ret;
 }
 
 ssize_t File::write(const char* buf, size_t count) {
@@ -36,6 +51,27 @@ ssize_t File::write(const char* buf, size_t count) {
   }
   if (unlikely(count == 0)) return 0;
 
+  if (get_write_buffer()) {
+    // the buffered data is not in the tx history, so there is nothing to
+    // validate the offset against
+    FileState state;
+    uint64_t ticket;
+    uint64_t offset;
+    blk_table.update([&](const FileState& file_state) {
+      offset = offset_mgr.acquire(count, file_state.file_size,
+                                  /*stop_at_boundary*/ false, ticket);
+      state = file_state;
+    });
+    ssize_t ret = buffer_write(buf, count, offset);
+    if (ret == 0) ret = write_tx(buf, count, offset);
+    offset_mgr.release(ticket, state.cursor);
+    return ret;
+  }
+
+  PerThreadData* per_thread_data;
+  Lease::WriteMode mode;
+  if (unlikely(!begin_write(per_thread_data, mode))) return -1;
+
   FileState state;
   uint64_t ticket;
   uint64_t offset;
@@ -45,25 +81,37 @@ ssize_t File::write(const char* buf, size_t count) {
     state = file_state;
   });
 
-  // special case that we have everything aligned, no OCC
-  if (count % BLOCK_SIZE == 0 && offset % BLOCK_SIZE == 0) {
-    TimerGuard<Event::ALIGNED_TX> timer_guard;
-    return Tx::exec_and_release_offset<AlignedTx>(this, buf, count, offset,
-                                                  state, ticket);
+  ssize_t ret;
+  if (meta->has_inline_data()) {
+    if (try_write_inline(buf, count, offset, ret)) {
+      offset_mgr.release(ticket, state.cursor);
+      goto done;
+    }
+    // the tx history has just been rebuilt from the inline data
+    blk_table.update(&state);
   }
 
-  // another special case where range is within a single block
-  if (BLOCK_SIZE_TO_IDX(offset) == BLOCK_SIZE_TO_IDX(offset + count - 1)) {
+  if (count % BLOCK_SIZE == 0 && offset % BLOCK_SIZE == 0) {
+    // special case that we have everything aligned, no OCC
+    TimerGuard<Event::ALIGNED_TX> timer_guard;
+    ret = Tx::exec_and_release_offset<AlignedTx>(this, buf, count, offset,
+                                                 state, ticket);
+  } else if (BLOCK_SIZE_TO_IDX(offset) ==
+             BLOCK_SIZE_TO_IDX(offset + count - 1)) {
+    // another special case where range is within a single block
     TimerGuard<Event::SINGLE_BLOCK_TX> timer_guard;
-    return Tx::exec_and_release_offset<SingleBlockTx>(this, buf, count, offset,
-                                                      state, ticket);
-  }
-
-  // unaligned multi-block write
-  {
-    TimerGuard<Event::MULTI_BLOCK_TX> timer_guard;
-    return Tx::exec_and_release_offset<MultiBlockTx>(this, buf, count, offset,
+    ret = Tx::exec_and_release_offset<SingleBlockTx>(this, buf, count, offset,
                                                      state, ticket);
+  } else {
+    // unaligned multi-block write
+    TimerGuard<Event::MULTI_BLOCK_TX> timer_guard;
+    ret = Tx::exec_and_release_offset<MultiBlockTx>(this, buf, count, offset,
+                                                    state, ticket);
   }
+
+done:
+  Lease::end_write(per_thread_data, mode);
+  if (ret > 0) shm_mgr.get_header()->on_write(offset + static_cast<size_t>(ret));
+  return ret;
 }
 }  // namespace madfs::dram
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <array>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+#include "posix.h"
+#include "utils/logging.h"
+
+namespace madfs::dram {
+
+/**
+ * Cheaply rule out files that cannot be in MadFS format, so that opening,
+ * unlinking or stat-ing them goes straight to the kernel without the extra
+ * xattr lookups.
+ *
+ * Two sources of knowledge are used:
+ * - a path-prefix allowlist (e.g., the mount points of DAX filesystems),
+ *   together with the st_dev of each prefix; when it is empty, all paths are
+ *   allowed except pseudo filesystems such as /proc;
+ * - a bounded negative cache of inodes known not to be MadFS files, keyed by
+ *   (dev, ino, ctime). Setting the xattr changes ctime, so an inode converted
+ *   into MadFS format later never hits a stale entry.
+ */
+class OpenFilter {
+  constexpr static std::array<std::string_view, 3> DENIED_PREFIXES = {
+      "/proc/", "/sys/", "/dev/"};
+  // tmpfs is often used to emulate persistent memory
+  constexpr static std::string_view SHM_PREFIX = "/dev/shm/";
+  constexpr static size_t MAX_NEGATIVE_CACHE_SIZE = 4096;
+
+  struct Key {
+    dev_t dev;
+    ino_t ino;
+    int64_t ctime;
+
+    explicit Key(const struct stat& st)
+        : dev(st.st_dev),
+          ino(st.st_ino),
+          ctime(st.st_ctim.tv_sec * 1000000000 + st.st_ctim.tv_nsec) {}
+    bool operator==(const Key&) const = default;
+  };
+
+  struct KeyHash {
+    size_t operator()(const Key& k) const {
+      return std::hash<uint64_t>()(k.ino) ^ (std::hash<uint64_t>()(k.dev) << 1) ^
+             (std::hash<int64_t>()(k.ctime) << 2);
+    }
+  };
+
+  // if non-empty, only paths under these prefixes may be MadFS files
+  std::vector<std::string> prefixes;
+  // the devices of the prefixes above
+  std::vector<dev_t> devs;
+
+  std::mutex mutex;
+  std::unordered_set<Key, KeyHash> negative_cache;
+
+  /**
+   * @param prefix_list colon-separated absolute paths; nullptr or an empty
+   * string allows all paths
+   */
+  explicit OpenFilter(const char* prefix_list) {
+    if (!prefix_list) return;
+    std::string_view list(prefix_list);
+    while (!list.empty()) {
+      size_t pos = std::min(list.find(':'), list.size());
+      std::string prefix(list.substr(0, pos));
+      list.remove_prefix(std::min(pos + 1, list.size()));
+      if (prefix.empty()) continue;
+      if (prefix[0] != '/') {
+        LOG_WARN("ignore relative path prefix \"%s\"", prefix.c_str());
+        continue;
+      }
+      if (prefix.back() != '/') prefix.push_back('/');
+
+      struct stat st {};
+      if (posix::stat(prefix.c_str(), &st) < 0) {
+        LOG_WARN("cannot stat path prefix \"%s\": %m", prefix.c_str());
+        continue;
+      }
+      if (std::find(devs.begin(), devs.end(), st.st_dev) == devs.end())
+        devs.push_back(st.st_dev);
+      prefixes.push_back(std::move(prefix));
+    }
+  }
+
+ public:
+  /**
+   * The filter is built on first use rather than in madfs_ctor, which may run
+   * before the global variables (e.g., runtime_options) are initialized.
+   *
+   * @return the process-wide filter, configured by MADFS_PATH_PREFIXES
+   */
+  static OpenFilter& get() {
+    static OpenFilter filter(std::getenv("MADFS_PATH_PREFIXES"));
+    return filter;
+  }
+
+  /**
+   * Check the path only; no syscall is involved.
+   *
+   * @return false if the path cannot be a MadFS file
+   */
+  [[nodiscard]] bool may_match_path(const char* pathname) const {
+    if (pathname[0] != '/') {
+      // relative paths are checked by the device after open
+      return true;
+    }
+    std::string_view path(pathname);
+    if (!prefixes.empty()) {
+      return std::any_of(prefixes.begin(), prefixes.end(),
+                         [&](const auto& p) { return path.starts_with(p); });
+    }
+    if (path.starts_with(SHM_PREFIX)) return true;
+    return std::none_of(DENIED_PREFIXES.begin(), DENIED_PREFIXES.end(),
+                        [&](const auto& p) { return path.starts_with(p); });
+  }
+
+  /**
+   * Check the inode against the device allowlist and the negative cache.
+   *
+   * @return false if the inode cannot be a MadFS file
+   */
+  [[nodiscard]] bool may_match_inode(const struct stat& st) {
+    if (!devs.empty() &&
+        std::find(devs.begin(), devs.end(), st.st_dev) == devs.end())
+      return false;
+    std::lock_guard<std::mutex> guard(mutex);
+    return !negative_cache.contains(Key(st));
+  }
+
+  /**
+   * Remember that the inode is not a MadFS file.
+   */
+  void add_negative(const struct stat& st) {
+    std::lock_guard<std::mutex> guard(mutex);
+    // the cache is only an optimization; start over instead of evicting
+    if (negative_cache.size() >= MAX_NEGATIVE_CACHE_SIZE) negative_cache.clear();
+    negative_cache.emplace(st);
+  }
+
+  friend std::ostream& operator<<(std::ostream& out, const OpenFilter& f) {
+    out << "OpenFilter: \n";
+    for (const auto& prefix : f.prefixes) out << "\tprefix: " << prefix << "\n";
+    out << "\tnegative_cache_size: " << f.negative_cache.size() << "\n";
+    return out;
+  }
+};
+
+}  // namespace madfs::dram
@@ -33,7 +33,7 @@ class GarbageCollector {
           int fd;
           struct stat stat_buf;
           bool success =
-              dram::File::try_open(fd, stat_buf, pathname, O_RDWR, 0);
+              ::try_open(fd, stat_buf, pathname, O_RDWR, 0);
           if (!success) {
             PANIC("Fail to open file \"%s\"", pathname);
           }
@@ -53,6 +53,47 @@ class GarbageCollector {
   bool do_gc() const {
     LOG_INFO("GarbageCollector: start transaction & log gc");
 
+    release_unused_reservation();
+    bool is_done = gc_tx_history();
+    reclaim_free_units();
+    file->checkpoint_bitmap();
+    return is_done;
+  }
+
+  /**
+   * Give the grow units that are entirely free back to the kernel filesystem,
+   * so that the space taken by the file tracks the live data. The units are
+   * held in the bitmap while punching, so that no one allocates from them.
+   *
+   * @return the number of grow units reclaimed
+   */
+  uint32_t reclaim_free_units() const {
+    constexpr uint32_t num_entries_per_unit =
+        NUM_BLOCKS_PER_GROW / BITMAP_ENTRY_BLOCKS_CAPACITY;
+    uint32_t num_units =
+        file->meta->get_num_logical_blocks() / NUM_BLOCKS_PER_GROW;
+    uint32_t num_reclaimed = 0;
+    // the first unit holds the meta block
+    for (uint32_t unit = 1; unit < num_units; ++unit) {
+      uint32_t begin_entry = unit * num_entries_per_unit;
+      if (!file->bitmap_mgr.alloc_entries(begin_entry, num_entries_per_unit))
+        continue;
+      if (file->mem_table.punch_hole(unit * NUM_BLOCKS_PER_GROW,
+                                     NUM_BLOCKS_PER_GROW))
+        num_reclaimed++;
+      file->bitmap_mgr.free_range(unit * NUM_BLOCKS_PER_GROW,
+                                  NUM_BLOCKS_PER_GROW);
+    }
+    LOG_INFO("GarbageCollector: reclaimed %u free grow units", num_reclaimed);
+    return num_reclaimed;
+  }
+
+  /**
+   * Replace the tx history with a compact one built from the block table
+   *
+   * @return true if the tx history is replaced
+   */
+  bool gc_tx_history() const {
     if (!need_new_linked_list()) {
       LOG_INFO("GarbageCollector: no need to gc");
       return false;
@@ -67,6 +108,22 @@ class GarbageCollector {
     return true;
   }
 
+  /**
+   * Give back the blocks reserved by fallocate that are not written yet; the
+   * reservation only keeps the writes in progress contiguous, and the file is
+   * no longer in use while gc runs.
+   */
+  void release_unused_reservation() const {
+    VirtualBlockIdx begin_vidx;
+    LogicalBlockIdx begin_lidx;
+    uint32_t num_blocks;
+    if (!file->meta->get_reservation(begin_vidx, begin_lidx, num_blocks))
+      return;
+    file->release_reservation();
+    LOG_INFO("GarbageCollector: released %u unused reserved blocks",
+             num_blocks);
+  }
+
   [[nodiscard]] bool need_new_linked_list() const {
     LOG_DEBUG("GarbageCollector: old_tail=%d", old_tail.idx.get());
 
@@ -89,7 +146,7 @@ class GarbageCollector {
 
   [[nodiscard]] bool create_new_linked_list() const {
     uint32_t tx_seq = 1;
-    auto first_tx_block_idx = allocator->block.alloc(1);
+    auto first_tx_block_idx = allocator->block.alloc_meta();
     auto new_block = file->mem_table.lidx_to_addr_rw(first_tx_block_idx);
     memset(&new_block->cache_lines[NUM_CL_PER_BLOCK - 1], 0, CACHELINE_SIZE);
     new_block->tx_block.set_tx_seq(tx_seq++);
@@ -106,17 +163,24 @@ class GarbageCollector {
       for (; i < num_blocks; i++) {
         auto curr_blk_idx = file->blk_table.vidx_to_lidx(i);
         auto prev_blk_idx = file->blk_table.vidx_to_lidx(i - 1);
-        if (curr_blk_idx == 0) continue;
-        // continuous blocks can be placed in 1 tx
-        if (curr_blk_idx - prev_blk_idx == 1 &&
-            i - begin < pmem::TxEntryInline::NUM_BLOCKS_MAX)
+        // continuous blocks (or holes) can be placed in 1 tx
+        bool is_continuous =
+            curr_blk_idx == 0
+                ? prev_blk_idx == 0
+                : prev_blk_idx != 0 && curr_blk_idx - prev_blk_idx == 1;
+        if (is_continuous && i - begin < pmem::TxEntryInline::NUM_BLOCKS_MAX)
+          continue;
+        // holes need no entry, except at the end for the file size
+        if (prev_blk_idx == 0) {
+          begin = i;
           continue;
+        }
         auto entry = pmem::TxEntryInline(i - begin, begin,
                                          file->blk_table.vidx_to_lidx(begin));
         new_cursor.block->store(entry, new_cursor.idx.local_idx);
         if (bool success = new_cursor.advance(&file->mem_table); !success) {
           // current block is full, flush it and allocate a new block
-          auto new_tx_block_idx = allocator->block.alloc(1);
+          auto new_tx_block_idx = allocator->block.alloc_meta();
           new_cursor.block->try_set_next_tx_block(new_tx_block_idx);
           pmem::persist_unfenced(new_cursor.block, BLOCK_SIZE);
           new_block = file->mem_table.lidx_to_addr_rw(new_tx_block_idx);
@@ -133,16 +197,21 @@ class GarbageCollector {
     // add the last commit entry
     {
       auto leftover_bytes = ALIGN_UP(file_size, BLOCK_SIZE) - file_size;
+      LogicalBlockIdx begin_lidx = file->blk_table.vidx_to_lidx(begin);
       if (leftover_bytes == 0) {
-        auto commit_entry = pmem::TxEntryInline(
-            i - begin, begin, file->blk_table.vidx_to_lidx(begin));
+        auto commit_entry = pmem::TxEntryInline(i - begin, begin, begin_lidx);
+        new_cursor.block->store(commit_entry, new_cursor.idx.local_idx);
+      } else if (file->meta->has_compact_entries() &&
+                 pmem::TxEntryInlineTail::can_inline(i - begin, begin,
+                                                     begin_lidx)) {
+        auto commit_entry = pmem::TxEntryInlineTail(i - begin, begin,
+                                                    begin_lidx, leftover_bytes);
         new_cursor.block->store(commit_entry, new_cursor.idx.local_idx);
       } else {
         // since i - begin <= 63, this can fit into one log entry
-        auto begin_lidx = std::vector{file->blk_table.vidx_to_lidx(begin)};
         dram::LogCursor log_cursor = allocator->log_entry.append(
             pmem::LogEntry::Op::LOG_OVERWRITE, leftover_bytes, i - begin, begin,
-            begin_lidx);
+            std::vector{begin_lidx});
         auto commit_entry = pmem::TxEntryIndirect(log_cursor.idx);
         new_cursor.block->store(commit_entry, new_cursor.idx.local_idx);
       }
@@ -170,7 +239,12 @@ class GarbageCollector {
       return false;
     }
     pmem::persist_fenced(new_cursor.block, BLOCK_SIZE);
+    // the bitmap snapshot refers to the old tx history; the meta lock keeps a
+    // new one from being taken before the switch
+    file->meta->lock();
+    file->discard_bitmap_snapshot_locked();
     file->meta->set_next_tx_block(first_tx_block_idx);
+    file->meta->unlock();
 
     // invalidate tx in meta block, so we can free the log blocks they point to
     file->meta->invalidate_tx_entries();
@@ -258,8 +332,8 @@ class GarbageCollector {
     // customized hash function for LogicalBlockIdx
     std::unordered_set<uint32_t> le_blocks;
     get_ref_log_entry_blocks(tx_block_cursor.block, le_blocks);
-    for (auto lidx : le_blocks) allocator->block.free(lidx);
-    allocator->block.free(tx_block_cursor.idx);
+    for (auto lidx : le_blocks) allocator->block.free_meta(lidx);
+    allocator->block.free_meta(tx_block_cursor.idx);
   }
 
   /**
@@ -275,7 +349,7 @@ class GarbageCollector {
     for (auto& e : tx_block->tx_entries) {
       auto entry = e.load(std::memory_order_relaxed);
       if (!entry.is_valid()) continue;
-      if (entry.is_inline()) continue;
+      if (!entry.is_indirect()) continue;
       dram::LogCursor le_cursor(entry.indirect_entry, &file->mem_table);
       le_cursor.get_all_blocks(&file->mem_table, le_blocks);
     }
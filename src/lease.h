@@ -0,0 +1,296 @@
+#pragma once
+
+#include <fcntl.h>
+#include <immintrin.h>
+#include <linux/membarrier.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+
+#include "cursor/tx_entry.h"
+#include "posix.h"
+#include "shm.h"
+#include "utils/logging.h"
+#include "utils/utils.h"
+
+namespace madfs::dram {
+
+/**
+ * An exclusive write lease of a file, requested by flock(LOCK_EX).
+ *
+ * The lease is an OFD write lock on the first byte of the shared memory, so
+ * the kernel releases it when the holder exits or crashes. The pid of the
+ * holder is also published in ShmHeader, so that writers only pay for a load
+ * when there is no lease. Where the kernel supports membarrier(2), the holder
+ * makes every thread of the registered processes run a full barrier after
+ * publishing itself, so the writers there skip their own fence.
+ *
+ * Once all the writers that started before the lease drain, the lease becomes
+ * exclusive: the holder's threads commit one at a time under a process-local
+ * mutex with plain stores, tx entries are flushed in batches (at fsync or when
+ * the lease is released), and local readers skip the validation after copying
+ * if no commit happened in between.
+ *
+ * Writers from other processes block until the lease is released, or fail
+ * with EAGAIN if the file is opened with O_NONBLOCK.
+ */
+class Lease {
+  // the number of spins to wait for the writers that started before the lease
+  constexpr static uint32_t MAX_DRAIN_SPINS = 1 << 20;
+
+  ShmMgr* shm_mgr;
+
+  // serialize state changes and committers of the holder
+  std::mutex mutex;
+
+  // the fd holding the OFD lock; a dedicated open file description is used so
+  // that probing through another fd never conflicts with ourselves
+  int holder_fd = -1;
+  std::atomic<bool> held{false};
+  std::atomic<bool> exclusive{false};
+  // whether the barrier after publishing the owner succeeded; without it, the
+  // writers that skip their fence may be missed, so the lease never becomes
+  // exclusive
+  bool fenced = false;
+  // bumped by every commit of the holder; read by local readers
+  std::atomic<uint64_t> commit_seq{0};
+
+ public:
+  enum class WriteMode { SHARED, LEASED };
+
+  explicit Lease(ShmMgr* shm_mgr) : shm_mgr(shm_mgr) {}
+
+  ~Lease() {
+    if (holder_fd >= 0) posix::close(holder_fd);
+  }
+
+  /**
+   * Register this process for the barriers of the holders; called when MadFS is
+   * loaded and in the child of fork. Until it succeeds, the writers of this
+   * process fence on their own.
+   */
+  static void register_barrier() {
+    long cmds = syscall(SYS_membarrier, MEMBARRIER_CMD_QUERY, 0, 0);
+    writers_skip_fence =
+        cmds > 0 && (cmds & MEMBARRIER_CMD_GLOBAL_EXPEDITED) &&
+        syscall(SYS_membarrier, MEMBARRIER_CMD_REGISTER_GLOBAL_EXPEDITED, 0,
+                0) == 0;
+  }
+
+  [[nodiscard]] bool is_held() const {
+    return held.load(std::memory_order_acquire);
+  }
+
+  [[nodiscard]] bool is_exclusive() const {
+    return exclusive.load(std::memory_order_acquire);
+  }
+
+  [[nodiscard]] uint64_t get_commit_seq() const {
+    return commit_seq.load(std::memory_order_acquire);
+  }
+
+  /**
+   * Acquire the lease.
+   *
+   * @param nonblock fail with EWOULDBLOCK instead of waiting for the holder
+   * @return 0 on success; -1 on failure with errno set
+   */
+  int acquire(bool nonblock) {
+    std::lock_guard<std::mutex> guard(mutex);
+    if (held) return 0;
+
+    int lock_fd =
+        posix::open(shm_mgr->get_path(), O_RDWR | O_NOFOLLOW | O_CLOEXEC);
+    if (lock_fd < 0) return -1;
+    if (!lock_byte(lock_fd, F_WRLCK, !nonblock)) {
+      int err = errno;
+      posix::close(lock_fd);
+      errno = (err == EACCES) ? EWOULDBLOCK : err;
+      return -1;
+    }
+    holder_fd = lock_fd;
+
+    // an old owner, if any, must have crashed since we got the OFD lock
+    shm_mgr->get_header()->set_lease_owner(getpid());
+    // order the owner before the announcements of the writers that skip their
+    // fence, in all processes
+    fenced =
+        syscall(SYS_membarrier, MEMBARRIER_CMD_GLOBAL_EXPEDITED, 0, 0) == 0;
+    held.store(true, std::memory_order_release);
+    exclusive.store(fenced && drain_writers(MAX_DRAIN_SPINS),
+                    std::memory_order_release);
+    LOG_DEBUG("lease acquired (exclusive=%d)", exclusive.load());
+    return 0;
+  }
+
+  /**
+   * Release the lease.
+   *
+   * @param flush called with committers blocked to flush the tx entries
+   * committed under the lease
+   */
+  template <typename F>
+  void release(F&& flush) {
+    std::lock_guard<std::mutex> guard(mutex);
+    if (!held) return;
+    if (is_exclusive()) flush();
+    exclusive.store(false, std::memory_order_release);
+    held.store(false, std::memory_order_release);
+    // clear the owner before unlocking, so a prober holding the lock never
+    // sees a live owner as stale
+    shm_mgr->get_header()->set_lease_owner(0);
+    lock_byte(holder_fd, F_UNLCK, false);
+    posix::close(holder_fd);
+    holder_fd = -1;
+    LOG_DEBUG("lease released");
+  }
+
+  /**
+   * Called before a write. Writers without the lease announce themselves in
+   * their per-thread data before checking the owner, and the holder checks the
+   * per-thread data after publishing itself as the owner, so one of them must
+   * see the other. The announcement is fenced only if this process is not
+   * registered for the barrier of the holder.
+   *
+   * @param per_thread_data the per-thread data of the calling thread
+   * @param nonblock fail with EAGAIN instead of waiting for the holder
+   * @param[out] mode how the write should commit
+   * @return false if the lease is held by another process and nonblock is set
+   */
+  bool begin_write(PerThreadData* per_thread_data, bool nonblock,
+                   WriteMode& mode) {
+    while (true) {
+      if (is_held()) {
+        mode = WriteMode::LEASED;
+        return true;
+      }
+      per_thread_data->begin_writing(!writers_skip_fence);
+      pid_t owner = shm_mgr->get_header()->get_lease_owner();
+      if (owner == 0) {
+        mode = WriteMode::SHARED;
+        return true;
+      }
+      per_thread_data->end_writing();
+      if (!wait_for_holder(owner, nonblock)) return false;
+    }
+  }
+
+  static void end_write(PerThreadData* per_thread_data, WriteMode mode) {
+    if (mode == WriteMode::SHARED) per_thread_data->end_writing();
+  }
+
+  /**
+   * Commit a tx entry as the lease holder.
+   *
+   * @return empty entry on success; conflict entry otherwise
+   */
+  pmem::TxEntry commit(TxCursor& cursor, pmem::TxEntry entry,
+                       MemTable* mem_table, Allocator* allocator) {
+    std::lock_guard<std::mutex> guard(mutex);
+    if (held && fenced && !is_exclusive() && drain_writers(1))
+      exclusive.store(true, std::memory_order_release);
+
+    pmem::TxEntry conflict_entry =
+        is_exclusive()
+            ? cursor.try_commit_exclusive(entry, mem_table, allocator)
+            : cursor.try_commit(entry, mem_table, allocator);
+    if (!conflict_entry.is_valid())
+      commit_seq.fetch_add(1, std::memory_order_seq_cst);
+    return conflict_entry;
+  }
+
+  /*
+   * fork handling: the lock is owned by the open file description, which the
+   * child shares with the parent; the child must not act as the holder
+   */
+  void on_fork_prepare() { mutex.lock(); }
+  void on_fork_parent() { mutex.unlock(); }
+  void on_fork_child() {
+    mutex.unlock();
+    // closing our reference keeps the parent's lock
+    if (holder_fd >= 0) posix::close(holder_fd);
+    holder_fd = -1;
+    held = false;
+    exclusive = false;
+    fenced = false;
+  }
+
+  friend std::ostream& operator<<(std::ostream& out, const Lease& lease) {
+    out << "Lease: held=" << lease.is_held()
+        << ", exclusive=" << lease.is_exclusive()
+        << ", commit_seq=" << lease.get_commit_seq() << "\n";
+    return out;
+  }
+
+ private:
+  // set by register_barrier
+  static inline bool writers_skip_fence = false;
+
+  /**
+   * Wait until no writer without the lease is in progress.
+   *
+   * A thread that crashes in the middle of a write never clears its flag; in
+   * that case, we give up and keep committing with CAS, which is always safe.
+   *
+   * @param max_spins the number of rounds to check before giving up
+   * @return true if all writers have drained
+   */
+  bool drain_writers(uint32_t max_spins) const {
+    for (size_t i = 0; i < MAX_NUM_THREADS; ++i) {
+      PerThreadData* per_thread_data = shm_mgr->get_per_thread_data(i);
+      if (!per_thread_data->has_data()) continue;
+      uint32_t spins = 0;
+      while (per_thread_data->is_writing()) {
+        if (++spins >= max_spins) return false;
+        _mm_pause();
+      }
+    }
+    return true;
+  }
+
+  /**
+   * Wait for the holder to release the lease, or clear the owner if it is
+   * stale.
+   *
+   * @return false if the lease is held and nonblock is set
+   */
+  bool wait_for_holder(pid_t owner, bool nonblock) const {
+    // ShmMgr does not keep its fd open, so probe through a temporary one
+    int fd =
+        posix::open(shm_mgr->get_path(), O_RDWR | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) return false;
+    if (!lock_byte(fd, F_RDLCK, !nonblock)) {
+      if (errno == EACCES || errno == EAGAIN) errno = EAGAIN;
+      int err = errno;
+      posix::close(fd);
+      errno = err;
+      return false;
+    }
+    // holding the read lock, no one can become the holder; a non-zero owner
+    // must be left by a crashed holder
+    shm_mgr->get_header()->clear_lease_owner(owner);
+    lock_byte(fd, F_UNLCK, false);
+    posix::close(fd);
+    return true;
+  }
+
+  static bool lock_byte(int fd, short type, bool wait) {
+    struct flock fl {};
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = 0;
+    fl.l_len = 1;
+    while (true) {
+      int rc = posix::fcntl(fd, wait ? F_OFD_SETLKW : F_OFD_SETLK, &fl);
+      if (rc == 0) return true;
+      if (errno != EINTR) return false;
+    }
+  }
+};
+
+}  // namespace madfs::dram
@@ -0,0 +1,492 @@
+#include <aio.h>
+#include <dlfcn.h>
+#include <linux/aio_abi.h>
+// defined by <linux/fs.h>, which <linux/aio_abi.h> includes
+#undef BLOCK_SIZE
+#include <signal.h>
+#include <sys/syscall.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#include "aio_pool.h"
+#include "lib.h"
+
+namespace madfs {
+
+using dram::AioPool;
+using Op = AioPool::Request::Op;
+
+namespace {
+// how often a waiter polls the requests that MadFS does not serve (e.g., the
+// kernel's in the same io_context) while waiting for its own
+constexpr auto POLL_INTERVAL = std::chrono::microseconds(100);
+
+/*
+ * The glibc versions of the POSIX AIO functions, which live in librt before
+ * glibc 2.34 and thus cannot be loaded as in posix.h
+ */
+#define NEXT_FN(fn)                                                   \
+  ([]() {                                                             \
+    static const auto next =                                          \
+        reinterpret_cast<decltype(&::fn)>(dlsym(RTLD_NEXT, #fn));     \
+    if (!next) PANIC("AIO function %s not found", #fn);               \
+    return next;                                                      \
+  }())
+
+std::chrono::steady_clock::time_point get_deadline(
+    const struct timespec* timeout) {
+  if (!timeout) return std::chrono::steady_clock::time_point::max();
+  return std::chrono::steady_clock::now() +
+         std::chrono::seconds(timeout->tv_sec) +
+         std::chrono::nanoseconds(timeout->tv_nsec);
+}
+
+/*
+ * POSIX AIO
+ *
+ * A request completes by setting the error code and return value of its
+ * aiocb, which glibc's aio_error and aio_return read as for its own requests.
+ */
+std::mutex posix_mutex;
+std::condition_variable posix_cv;
+
+// the notification of a lio_listio(LIO_NOWAIT), sent by its last request
+struct ListNotify {
+  std::atomic<size_t> num_left{0};
+  struct sigevent sig;
+};
+
+int get_error(const struct aiocb* cb) {
+  return std::atomic_ref<int>(const_cast<int&>(cb->__error_code))
+      .load(std::memory_order_acquire);
+}
+
+void notify(const struct sigevent& sig) {
+  if (sig.sigev_notify == SIGEV_SIGNAL)
+    sigqueue(getpid(), sig.sigev_signo, sig.sigev_value);
+  else if (sig.sigev_notify == SIGEV_THREAD)
+    std::thread(sig.sigev_notify_function, sig.sigev_value).detach();
+}
+
+void complete_aiocb(AioPool::Request* req, ssize_t res) {
+  auto cb = static_cast<struct aiocb*>(req->tag);
+  auto list = static_cast<ListNotify*>(req->context);
+  delete req;
+  // the aiocb may be reused once it is seen completed
+  struct sigevent sig = cb->aio_sigevent;
+  cb->__return_value = res < 0 ? -1 : res;
+  {
+    std::lock_guard<std::mutex> guard(posix_mutex);
+    std::atomic_ref<int>(cb->__error_code)
+        .store(res < 0 ? static_cast<int>(-res) : 0, std::memory_order_release);
+  }
+  posix_cv.notify_all();
+  notify(sig);
+  if (list && list->num_left.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    notify(list->sig);
+    delete list;
+  }
+}
+
+AioPool::Request* make_request(struct aiocb* cb, Op op,
+                               std::shared_ptr<dram::File> file,
+                               ListNotify* list = nullptr) {
+  auto req = new AioPool::Request{
+      .op = op,
+      .fd = cb->aio_fildes,
+      .file = std::move(file),
+      .offset = static_cast<uint64_t>(cb->aio_offset),
+      .complete = complete_aiocb,
+      .tag = cb,
+      .context = list,
+  };
+  if (op != Op::SYNC)
+    req->iov.push_back({const_cast<void*>(cb->aio_buf), cb->aio_nbytes});
+  cb->__return_value = 0;
+  cb->__error_code = EINPROGRESS;
+  return req;
+}
+
+int submit_aiocb(struct aiocb* cb, Op op, std::shared_ptr<dram::File> file) {
+  if (op != Op::SYNC && cb->aio_offset < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  LOG_DEBUG("madfs::aio(%s, %d, %zu, %ld)", file->path, static_cast<int>(op),
+            cb->aio_nbytes, cb->aio_offset);
+  AioPool::get().submit({make_request(cb, op, std::move(file))});
+  return 0;
+}
+
+/*
+ * libaio
+ *
+ * The events of the requests on MadFS files are queued here, per io_context,
+ * and returned by io_getevents before those of the kernel.
+ */
+struct AioContext {
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<io_event> events;
+  // the requests on MadFS files not completed yet
+  size_t num_in_flight{};
+};
+
+std::mutex contexts_mutex;
+std::unordered_map<aio_context_t, std::unique_ptr<AioContext>> contexts;
+
+AioContext* find_context(aio_context_t ctx, bool create) {
+  std::lock_guard<std::mutex> guard(contexts_mutex);
+  auto it = contexts.find(ctx);
+  if (it != contexts.end()) return it->second.get();
+  if (!create) return nullptr;
+  return contexts.emplace(ctx, std::make_unique<AioContext>())
+      .first->second.get();
+}
+
+long kernel_getevents(aio_context_t ctx, long min_nr, long nr,
+                      struct io_event* events, struct timespec* timeout) {
+  long ret = syscall(SYS_io_getevents, ctx, min_nr, nr, events, timeout);
+  return ret < 0 ? -errno : ret;
+}
+
+void complete_iocb(AioPool::Request* req, ssize_t res) {
+  auto cb = static_cast<struct iocb*>(req->tag);
+  auto c = static_cast<AioContext*>(req->context);
+  delete req;
+  // the iocb may be reused once its event is reaped
+  bool has_resfd = cb->aio_flags & IOCB_FLAG_RESFD;
+  auto resfd = static_cast<int>(cb->aio_resfd);
+  {
+    // notified with the mutex held, since io_destroy frees the context
+    std::lock_guard<std::mutex> guard(c->mutex);
+    c->events.push_back({.data = cb->aio_data,
+                         .obj = reinterpret_cast<uint64_t>(cb),
+                         .res = res,
+                         .res2 = 0});
+    c->num_in_flight--;
+    c->cv.notify_all();
+  }
+  if (has_resfd) {
+    uint64_t one = 1;
+    posix::write(resfd, &one, sizeof(one));
+  }
+}
+
+/**
+ * @return the request for an iocb on a MadFS file; null if its opcode is not
+ * supported
+ */
+AioPool::Request* make_request(struct iocb* cb,
+                               std::shared_ptr<dram::File> file,
+                               AioContext* c) {
+  auto req = new AioPool::Request{
+      .fd = static_cast<int>(cb->aio_fildes),
+      .file = std::move(file),
+      .offset = static_cast<uint64_t>(cb->aio_offset),
+      .complete = complete_iocb,
+      .tag = cb,
+      .context = c,
+  };
+  auto buf = reinterpret_cast<void*>(cb->aio_buf);
+  switch (cb->aio_lio_opcode) {
+    case IOCB_CMD_PREAD:
+    case IOCB_CMD_PWRITE:
+      req->op = cb->aio_lio_opcode == IOCB_CMD_PREAD ? Op::READ : Op::WRITE;
+      req->iov.push_back({buf, cb->aio_nbytes});
+      break;
+    case IOCB_CMD_PREADV:
+    case IOCB_CMD_PWRITEV: {
+      req->op = cb->aio_lio_opcode == IOCB_CMD_PREADV ? Op::READ : Op::WRITE;
+      auto iov = static_cast<const iovec*>(buf);
+      req->iov.assign(iov, iov + cb->aio_nbytes);
+      break;
+    }
+    case IOCB_CMD_FSYNC:
+    case IOCB_CMD_FDSYNC:
+      req->op = Op::SYNC;
+      break;
+    default:
+      delete req;
+      return nullptr;
+  }
+  return req;
+}
+}  // namespace
+
+extern "C" {
+int aio_read(struct aiocb* aiocbp) {
+  if (auto file = get_file(aiocbp->aio_fildes))
+    return submit_aiocb(aiocbp, Op::READ, std::move(file));
+  return NEXT_FN(aio_read)(aiocbp);
+}
+
+int aio_write(struct aiocb* aiocbp) {
+  if (auto file = get_file(aiocbp->aio_fildes))
+    return submit_aiocb(aiocbp, Op::WRITE, std::move(file));
+  return NEXT_FN(aio_write)(aiocbp);
+}
+
+int aio_fsync(int op, struct aiocb* aiocbp) {
+  if (auto file = get_file(aiocbp->aio_fildes)) {
+    if (op != O_SYNC && op != O_DSYNC) {
+      errno = EINVAL;
+      return -1;
+    }
+    return submit_aiocb(aiocbp, Op::SYNC, std::move(file));
+  }
+  return NEXT_FN(aio_fsync)(op, aiocbp);
+}
+
+int aio_suspend(const struct aiocb* const list[], int nent,
+                const struct timespec* timeout) {
+  bool has_madfs = false;
+  bool has_others = false;
+  for (int i = 0; i < nent; ++i) {
+    if (!list[i]) continue;
+    if (get_file(list[i]->aio_fildes))
+      has_madfs = true;
+    else
+      has_others = true;
+  }
+  if (!has_madfs) return NEXT_FN(aio_suspend)(list, nent, timeout);
+
+  auto deadline = get_deadline(timeout);
+  std::unique_lock<std::mutex> lock(posix_mutex);
+  while (true) {
+    for (int i = 0; i < nent; ++i)
+      if (list[i] && get_error(list[i]) != EINPROGRESS) return 0;
+    auto now = std::chrono::steady_clock::now();
+    if (now >= deadline) {
+      errno = EAGAIN;
+      return -1;
+    }
+    // the requests left to glibc do not wake us up
+    posix_cv.wait_until(
+        lock, has_others ? std::min(deadline, now + POLL_INTERVAL) : deadline);
+  }
+}
+
+int aio_cancel(int fd, struct aiocb* aiocbp) {
+  auto file = get_file(fd);
+  if (!file) return NEXT_FN(aio_cancel)(fd, aiocbp);
+  if (aiocbp && aiocbp->aio_fildes != fd) {
+    errno = EBADF;
+    return -1;
+  }
+  // the requests on MadFS files are never canceled, like most of glibc's
+  bool in_progress =
+      aiocbp ? get_error(aiocbp) == EINPROGRESS
+             : file->num_aio_in_flight.load(std::memory_order_relaxed) > 0;
+  return in_progress ? AIO_NOTCANCELED : AIO_ALLDONE;
+}
+
+int lio_listio(int mode, struct aiocb* const list[], int nent,
+               struct sigevent* sig) {
+  bool has_madfs = false;
+  for (int i = 0; i < nent; ++i)
+    if (list[i] && list[i]->aio_lio_opcode != LIO_NOP &&
+        get_file(list[i]->aio_fildes))
+      has_madfs = true;
+  if (!has_madfs || (mode != LIO_WAIT && mode != LIO_NOWAIT))
+    return NEXT_FN(lio_listio)(mode, list, nent, sig);
+
+  // the requests on other files are served by the pool as well, so that the
+  // list completes as a whole
+  std::vector<AioPool::Request*> reqs;
+  ListNotify* list_notify = nullptr;
+  if (mode == LIO_NOWAIT && sig && sig->sigev_notify != SIGEV_NONE)
+    list_notify = new ListNotify{.sig = *sig};
+  for (int i = 0; i < nent; ++i) {
+    struct aiocb* cb = list[i];
+    if (!cb || cb->aio_lio_opcode == LIO_NOP) continue;
+    if (cb->aio_lio_opcode != LIO_READ && cb->aio_lio_opcode != LIO_WRITE) {
+      cb->__error_code = EINVAL;
+      cb->__return_value = -1;
+      continue;
+    }
+    Op op = cb->aio_lio_opcode == LIO_READ ? Op::READ : Op::WRITE;
+    reqs.emplace_back(
+        make_request(cb, op, get_file(cb->aio_fildes), list_notify));
+  }
+  if (list_notify) {
+    list_notify->num_left.store(reqs.size(), std::memory_order_relaxed);
+    if (reqs.empty()) {
+      notify(list_notify->sig);
+      delete list_notify;
+    }
+  }
+  LOG_DEBUG("madfs::lio_listio(%d, %zu requests)", mode, reqs.size());
+  if (!reqs.empty()) AioPool::get().submit(std::move(reqs));
+  if (mode == LIO_NOWAIT) return 0;
+
+  bool failed = false;
+  std::unique_lock<std::mutex> lock(posix_mutex);
+  for (int i = 0; i < nent; ++i) {
+    if (!list[i] || list[i]->aio_lio_opcode == LIO_NOP) continue;
+    posix_cv.wait(lock, [&] { return get_error(list[i]) != EINPROGRESS; });
+    if (get_error(list[i]) != 0) failed = true;
+  }
+  if (failed) {
+    errno = EIO;
+    return -1;
+  }
+  return 0;
+}
+
+static_assert(sizeof(struct aiocb) == sizeof(struct aiocb64));
+
+int aio_read64(struct aiocb64* aiocbp) {
+  return aio_read(reinterpret_cast<struct aiocb*>(aiocbp));
+}
+
+int aio_write64(struct aiocb64* aiocbp) {
+  return aio_write(reinterpret_cast<struct aiocb*>(aiocbp));
+}
+
+int aio_fsync64(int op, struct aiocb64* aiocbp) {
+  return aio_fsync(op, reinterpret_cast<struct aiocb*>(aiocbp));
+}
+
+int aio_suspend64(const struct aiocb64* const list[], int nent,
+                  const struct timespec* timeout) {
+  return aio_suspend(reinterpret_cast<const struct aiocb* const*>(list), nent,
+                     timeout);
+}
+
+int aio_cancel64(int fd, struct aiocb64* aiocbp) {
+  return aio_cancel(fd, reinterpret_cast<struct aiocb*>(aiocbp));
+}
+
+int lio_listio64(int mode, struct aiocb64* const list[], int nent,
+                 struct sigevent* sig) {
+  return lio_listio(mode, reinterpret_cast<struct aiocb* const*>(list), nent,
+                    sig);
+}
+
+/*
+ * The libaio functions below return -errno on failure as libaio does. A
+ * program that issues the syscalls directly bypasses them.
+ */
+int io_submit(aio_context_t ctx, long nr, struct iocb** iocbs) {
+  if (nr < 0) return -EINVAL;
+  std::vector<AioPool::Request*> reqs;
+  AioContext* c = nullptr;
+  long num_submitted = 0;
+  int err = 0;
+  while (num_submitted < nr) {
+    // the iocbs on other files go to the kernel
+    long end = num_submitted;
+    while (end < nr && !get_file(static_cast<int>(iocbs[end]->aio_fildes)))
+      ++end;
+    if (end > num_submitted) {
+      long ret = syscall(SYS_io_submit, ctx, end - num_submitted,
+                         iocbs + num_submitted);
+      if (ret < 0) {
+        err = -errno;
+        break;
+      }
+      num_submitted += ret;
+      if (num_submitted < end) break;
+      continue;
+    }
+
+    struct iocb* cb = iocbs[num_submitted];
+    if (!c) c = find_context(ctx, /*create=*/true);
+    auto req = make_request(cb, get_file(static_cast<int>(cb->aio_fildes)), c);
+    if (!req) {
+      err = -EINVAL;
+      break;
+    }
+    reqs.emplace_back(req);
+    num_submitted++;
+  }
+
+  if (!reqs.empty()) {
+    {
+      std::lock_guard<std::mutex> guard(c->mutex);
+      c->num_in_flight += reqs.size();
+    }
+    LOG_DEBUG("madfs::io_submit(%lu, %zu requests)", ctx, reqs.size());
+    AioPool::get().submit(std::move(reqs));
+  }
+  return num_submitted > 0 ? static_cast<int>(num_submitted) : err;
+}
+
+int io_getevents(aio_context_t ctx, long min_nr, long nr,
+                 struct io_event* events, struct timespec* timeout) {
+  AioContext* c = find_context(ctx, /*create=*/false);
+  if (!c)
+    return static_cast<int>(
+        kernel_getevents(ctx, min_nr, nr, events, timeout));
+
+  auto deadline = get_deadline(timeout);
+  long n = 0;
+  std::unique_lock<std::mutex> lock(c->mutex);
+  while (true) {
+    for (; n < nr && !c->events.empty(); ++n) {
+      events[n] = c->events.front();
+      c->events.pop_front();
+    }
+    bool has_madfs = c->num_in_flight > 0;
+    if (n < nr) {
+      lock.unlock();
+      long ret;
+      if (!has_madfs && n < min_nr) {
+        // only the kernel can complete the rest
+        struct timespec left {};
+        if (timeout) {
+          auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        deadline - std::chrono::steady_clock::now())
+                        .count();
+          ns = std::max(ns, decltype(ns){0});
+          left = {.tv_sec = ns / 1'000'000'000, .tv_nsec = ns % 1'000'000'000};
+        }
+        ret = kernel_getevents(ctx, min_nr - n, nr - n, events + n,
+                               timeout ? &left : nullptr);
+        if (ret < 0) return n > 0 ? static_cast<int>(n) : static_cast<int>(ret);
+        return static_cast<int>(n + ret);
+      }
+      struct timespec zero {};
+      ret = kernel_getevents(ctx, 0, nr - n, events + n, &zero);
+      if (ret > 0) n += ret;
+      lock.lock();
+    }
+    if (n >= min_nr) return static_cast<int>(n);
+    auto now = std::chrono::steady_clock::now();
+    if (now >= deadline) return static_cast<int>(n);
+    c->cv.wait_until(lock, std::min(deadline, now + POLL_INTERVAL));
+  }
+}
+
+int io_cancel(aio_context_t ctx, struct iocb* iocb, struct io_event* result) {
+  // the requests on MadFS files are never canceled
+  if (get_file(static_cast<int>(iocb->aio_fildes))) return -EAGAIN;
+  long ret = syscall(SYS_io_cancel, ctx, iocb, result);
+  return ret < 0 ? -errno : static_cast<int>(ret);
+}
+
+int io_destroy(aio_context_t ctx) {
+  std::unique_ptr<AioContext> c;
+  {
+    std::lock_guard<std::mutex> guard(contexts_mutex);
+    if (auto it = contexts.find(ctx); it != contexts.end()) {
+      c = std::move(it->second);
+      contexts.erase(it);
+    }
+  }
+  if (c) {
+    std::unique_lock<std::mutex> lock(c->mutex);
+    c->cv.wait(lock, [&] { return c->num_in_flight == 0; });
+  }
+  long ret = syscall(SYS_io_destroy, ctx);
+  return ret < 0 ? -errno : static_cast<int>(ret);
+}
+}
+}  // namespace madfs
@@ -6,9 +6,11 @@ extern "C" {
 int close(int fd) {
   if (auto file = get_file(fd)) {
     TimerGuard<Event::CLOSE> guard;
-    LOG_DEBUG("madfs::close(%s)", file->path);
+    // like close(2) on a failed writeback, the fd is closed even so
+    int rc = file->detach_write_buffer();
+    LOG_DEBUG("madfs::close(%s) = %d", file->path, rc);
     files.unsafe_erase(fd);
-    return 0;
+    return rc;
   } else {
     LOG_DEBUG("posix::close(%d)", fd);
     // posix::close(fd);
@@ -19,10 +21,24 @@ int close(int fd) {
 int fclose(FILE* stream) {
   int fd = fileno(stream);
   if (auto file = get_file(fd)) {
+    bool is_madfs_stream;
+    {
+      std::lock_guard<std::mutex> guard(streams_mutex);
+      is_madfs_stream = streams.erase(stream) > 0;
+    }
+    if (is_madfs_stream) {
+      // a stream from fopen closes the file itself (see stdio.cpp)
+      LOG_DEBUG("madfs::fclose(%s)", file->path);
+      file.reset();
+      return SAFE_CALL_POSIX_FN(fclose, stream);
+    }
+    // a stream from fdopen: take the fd over from glibc
     LOG_DEBUG("madfs::fclose(%s)", file->path);
+    int rc = file->detach_write_buffer() == 0 ? 0 : EOF;
     file->fd = -1;
     files.unsafe_erase(fd);
-    return SAFE_CALL_POSIX_FN(fclose, stream);
+    if (SAFE_CALL_POSIX_FN(fclose, stream) != 0) rc = EOF;
+    return rc;
   } else {
     LOG_DEBUG("posix::fclose(%p)", stream);
     return SAFE_CALL_POSIX_FN(fclose, stream);
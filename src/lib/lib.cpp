@@ -3,10 +3,32 @@
 #include <cstdio>
 #include <iostream>
 
+#include "aio_pool.h"
 #include "config.h"
+#include "copy_pool.h"
+#include "utils/cpu.h"
 
 namespace madfs {
 extern "C" {
+static void madfs_atfork_prepare() {
+  dram::WriteBuffer::on_fork_prepare();
+  for (auto& [fd, file] : files) file->on_fork_prepare();
+}
+
+static void madfs_atfork_parent() {
+  for (auto& [fd, file] : files) file->on_fork_parent();
+  dram::WriteBuffer::on_fork_parent();
+}
+
+static void madfs_atfork_child() {
+  tid = static_cast<pid_t>(syscall(SYS_gettid));
+  dram::Lease::register_barrier();
+  dram::CopyPool::on_fork_child();
+  dram::AioPool::on_fork_child();
+  for (auto& [fd, file] : files) file->on_fork_child();
+  dram::WriteBuffer::on_fork_child();
+}
+
 /**
  * Called when the shared library is first loaded
  *
@@ -14,11 +36,16 @@ extern "C" {
  * e.g., all the functions in the madfs::posix namespace
  */
 void __attribute__((constructor)) madfs_ctor() {
+  pthread_atfork(madfs_atfork_prepare, madfs_atfork_parent,
+                 madfs_atfork_child);
+  dram::Lease::register_barrier();
   initialized = true;
   std::cerr << build_options << std::endl;
+  std::cerr << cpu_features << std::endl;
   std::cerr << runtime_options << std::endl;
   if (runtime_options.log_file) {
-    log_file = fopen(runtime_options.log_file, "a");
+    // the log must not be written through MadFS, which logs its writes
+    log_file = SAFE_CALL_POSIX_FN(fopen, runtime_options.log_file, "a");
   }
 }
 
@@ -26,6 +53,9 @@ void __attribute__((constructor)) madfs_ctor() {
  * Called when the shared library is unloaded
  */
 void __attribute__((destructor)) madfs_dtor() {
+  // the pool keeps its stats in every build, so they are always printed if
+  // the process used AIO
+  if (auto pool = dram::AioPool::get_if_started()) std::cerr << *pool;
   std::cerr << "MadFS unloaded" << std::endl;
 }
 }  // extern "C"
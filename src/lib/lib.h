@@ -3,6 +3,8 @@
 #include <tbb/concurrent_unordered_map.h>
 
 #include <memory>
+#include <mutex>
+#include <unordered_set>
 
 #include "file/file.h"
 
@@ -14,6 +16,10 @@ inline bool initialized = false;
 // shared across threads within the same process
 inline tbb::concurrent_unordered_map<int, std::shared_ptr<dram::File>> files;
 
+// the streams opened by fopen on MadFS files (see stdio.cpp)
+inline std::mutex streams_mutex;
+inline std::unordered_set<FILE*> streams;
+
 static std::shared_ptr<dram::File> get_file(int fd) {
   if (!initialized) return {};
   if (fd < 0) return {};
@@ -1,5 +1,6 @@
 #include <cstdarg>
 
+#include "filter.h"
 #include "lib.h"
 #include "shm.h"
 #include "utils/timer.h"
@@ -8,14 +9,17 @@ namespace madfs {
 
 extern "C" {
 int unlink(const char* path) {
-  dram::ShmMgr::unlink_by_file_path(path);
+  if (dram::OpenFilter::get().may_match_path(path))
+    dram::ShmMgr::unlink_by_file_path(path);
   int rc = posix::unlink(path);
   LOG_DEBUG("posix::unlink(%s) = %d", path, rc);
   return rc;
 }
 
 int rename(const char* oldpath, const char* newpath) {
-  if (access(newpath, F_OK) == 0) dram::ShmMgr::unlink_by_file_path(newpath);
+  if (dram::OpenFilter::get().may_match_path(newpath) &&
+      access(newpath, F_OK) == 0)
+    dram::ShmMgr::unlink_by_file_path(newpath);
   int rc = posix::rename(oldpath, newpath);
   LOG_DEBUG("posix::rename(%s, %s) = %d", oldpath, newpath, rc);
   return rc;
@@ -31,9 +35,49 @@ int ftruncate([[maybe_unused]] int fd, [[maybe_unused]] off_t length) {
   return -1;
 }
 
-int flock([[maybe_unused]] int fd, [[maybe_unused]] int operation) {
-  PANIC("flock not implemented");
-  return -1;
+int fallocate(int fd, int mode, off_t offset, off_t len) {
+  if (auto file = get_file(fd)) {
+    int rc = file->fallocate(mode, offset, len);
+    LOG_DEBUG("madfs::fallocate(%s, %d, %ld, %ld) = %d", file->path, mode,
+              offset, len, rc);
+    return rc;
+  }
+  int rc = posix::fallocate(fd, mode, offset, len);
+  LOG_DEBUG("posix::fallocate(%d, %d, %ld, %ld) = %d", fd, mode, offset, len,
+            rc);
+  return rc;
+}
+
+int fallocate64(int fd, int mode, off64_t offset, off64_t len) {
+  return fallocate(fd, mode, offset, len);
+}
+
+int posix_fallocate(int fd, off_t offset, off_t len) {
+  if (auto file = get_file(fd)) {
+    // unlike fallocate, the error number is returned instead of set
+    int rc = file->fallocate(0, offset, len) == 0 ? 0 : errno;
+    LOG_DEBUG("madfs::posix_fallocate(%s, %ld, %ld) = %d", file->path, offset,
+              len, rc);
+    return rc;
+  }
+  int rc = posix::posix_fallocate(fd, offset, len);
+  LOG_DEBUG("posix::posix_fallocate(%d, %ld, %ld) = %d", fd, offset, len, rc);
+  return rc;
+}
+
+int posix_fallocate64(int fd, off64_t offset, off64_t len) {
+  return posix_fallocate(fd, offset, len);
+}
+
+int flock(int fd, int operation) {
+  if (auto file = get_file(fd)) {
+    int rc = file->flock(operation);
+    LOG_DEBUG("madfs::flock(%s, %d) = %d", file->path, operation, rc);
+    return rc;
+  }
+  int rc = posix::flock(fd, operation);
+  LOG_DEBUG("posix::flock(%d, %d) = %d", fd, operation, rc);
+  return rc;
 }
 
 int fcntl(int fd, int cmd, ... /* arg */) {
@@ -69,13 +69,5 @@ int openat64([[maybe_unused]] int dirfd, const char* pathname, int flags, ...) {
   // TODO: implement the case where pathname is relative to dirfd
   return open_impl(pathname, flags, mode);
 }
-
-FILE* fopen(const char* filename, const char* mode) {
-  FILE* file;
-  printf("fopen: %s\n", filename);
-  file = SAFE_CALL_POSIX_FN(fopen, filename, mode);
-  LOG_DEBUG("posix::fopen(%s, %s) = %p", filename, mode, file);
-  return file;
-}
 }
 }  // namespace madfs
@@ -4,42 +4,63 @@
 namespace madfs {
 
 static int fstat_impl(int fd, struct stat* buf) {
+  if (auto file = get_file(fd)) {
+    int rc = file->stat(buf);
+    LOG_DEBUG("madfs::fstat(%d, {.st_size = %ld}) = %d", fd, buf->st_size, rc);
+    return rc;
+  }
+
   int rc = posix::fstat(fd, buf);
   if (unlikely(rc < 0)) {
     LOG_WARN("fstat failed for fd = %d: %m", fd);
     return rc;
   }
-
-  if (auto file = get_file(fd)) {
-    file->stat(buf);
-    LOG_DEBUG("madfs::fstat(%d, {.st_size = %ld})", fd, buf->st_size);
-  } else {
-    LOG_DEBUG("posix::fstat(%d)", fd);
-  }
-
+  LOG_DEBUG("posix::fstat(%d)", fd);
   return 0;
 }
 
 static int stat_impl(const char* pathname, struct stat* buf) {
-  if (int rc = SAFE_CALL_POSIX_FN(stat, _STAT_VER, pathname, buf); unlikely(rc < 0)) {
+  if (int rc = posix::stat(pathname, buf); unlikely(rc < 0)) {
     LOG_WARN("posix::stat(%s) = %d: %m", pathname, rc);
     return rc;
   }
 
+  auto& filter = dram::OpenFilter::get();
+  if (!S_ISREG(buf->st_mode) || !filter.may_match_path(pathname) ||
+      !filter.may_match_inode(*buf)) {
+    LOG_DEBUG("posix::stat(%s)", pathname);
+    return 0;
+  }
+
+  // read the attributes published in the shared memory, so we don't need to
+  // map the file and replay its log
+  if (dram::ShmMgr::fill_stat_by_file_path(pathname, buf)) {
+    LOG_DEBUG("madfs::stat(%s, {.st_size = %ld})", pathname, buf->st_size);
+    return 0;
+  }
+
+  // the shared memory is gone (e.g., after a reboot); open the file to rebuild
+  // it, which also republishes the attributes. A sealed file has no shared
+  // memory, so it is opened as well
   if (ssize_t rc = getxattr(pathname, SHM_XATTR_NAME, nullptr, 0); rc > 0) {
     int fd = open(pathname, O_RDONLY);
     if (auto file = get_file(fd)) {
-      file->stat(buf);
-      LOG_DEBUG("madfs::stat(%s, {.st_size = %ld})", pathname, buf->st_size);
+      int rc = file->stat(buf);
+      LOG_DEBUG("madfs::stat(%s, {.st_size = %ld}) = %d", pathname,
+                buf->st_size, rc);
+      int saved_errno = errno;
       close(fd);
-      return 0;
+      errno = saved_errno;
+      return rc;
     }
+    if (fd >= 0) close(fd);
+  } else {
+    filter.add_negative(*buf);
   }
 
   LOG_DEBUG("posix::stat(%s, {.st_size = %ld})", pathname, buf->st_size);
   return 0;
 }
-
 extern "C" {
 int fstat(int fd, struct stat* buf) { return fstat_impl(fd, buf); }
 
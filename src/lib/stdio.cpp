@@ -0,0 +1,143 @@
+#include <cstdlib>
+
+#include "const.h"
+#include "filter.h"
+#include "lib.h"
+
+namespace madfs {
+
+/*
+ * A FILE opened by fopen on a MadFS file is built with fopencookie, so that
+ * glibc does the buffering and formatting while the I/O goes to dram::File
+ * without any syscall. Its buffer is a multiple of the block size and aligned,
+ * so that a sequential writer flushes whole blocks through AlignedTx, and
+ * freads or fwrites of at least a buffer bypass it.
+ */
+namespace {
+constexpr size_t STREAM_BUFFER_SIZE = 16 * BLOCK_SIZE;
+
+struct Stream {
+  std::shared_ptr<dram::File> file;
+  int fd;
+  char* buf;
+};
+
+ssize_t stream_read(void* cookie, char* buf, size_t size) {
+  auto stream = static_cast<Stream*>(cookie);
+  ssize_t res = stream->file->read(buf, size);
+  LOG_DEBUG("madfs::stream_read(%s, buf, %zu) = %zd", stream->file->path, size,
+            res);
+  return res;
+}
+
+ssize_t stream_write(void* cookie, const char* buf, size_t size) {
+  auto stream = static_cast<Stream*>(cookie);
+  ssize_t res = stream->file->write(buf, size);
+  LOG_DEBUG("madfs::stream_write(%s, buf, %zu) = %zd", stream->file->path,
+            size, res);
+  // glibc takes 0 as an error without errno
+  return res < 0 ? 0 : res;
+}
+
+int stream_seek(void* cookie, off64_t* offset, int whence) {
+  auto stream = static_cast<Stream*>(cookie);
+  off_t res = stream->file->lseek(*offset, whence);
+  LOG_DEBUG("madfs::stream_seek(%s, %ld, %d) = %ld", stream->file->path,
+            *offset, whence, res);
+  if (res < 0) return -1;
+  *offset = res;
+  return 0;
+}
+
+int stream_close(void* cookie) {
+  auto stream = static_cast<Stream*>(cookie);
+  // drop the reference first, so that close destroys the file
+  stream->file.reset();
+  int rc = close(stream->fd);
+  std::free(stream->buf);
+  delete stream;
+  return rc;
+}
+
+constexpr cookie_io_functions_t stream_funcs = {
+    .read = stream_read,
+    .write = stream_write,
+    .seek = stream_seek,
+    .close = stream_close,
+};
+
+/**
+ * @return the open flags for an fopen mode; -1 if the mode is invalid
+ */
+int mode_to_flags(const char* mode) {
+  int flags;
+  switch (*mode) {
+    case 'r':
+      flags = 0;
+      break;
+    case 'w':
+      flags = O_CREAT | O_TRUNC;
+      break;
+    case 'a':
+      flags = O_CREAT | O_APPEND;
+      break;
+    default:
+      return -1;
+  }
+  bool read_write = false;
+  for (const char* c = mode + 1; *c && *c != ','; ++c) {
+    if (*c == '+') read_write = true;
+    if (*c == 'x') flags |= O_EXCL;
+    if (*c == 'e') flags |= O_CLOEXEC;
+  }
+  if (read_write) return flags | O_RDWR;
+  return flags | (*mode == 'r' ? O_RDONLY : O_WRONLY);
+}
+}  // namespace
+
+extern "C" {
+FILE* fopen(const char* filename, const char* mode) {
+  int flags = mode_to_flags(mode);
+  if (!initialized || flags < 0 ||
+      !dram::OpenFilter::get().may_match_path(filename)) {
+    FILE* stream = SAFE_CALL_POSIX_FN(fopen, filename, mode);
+    LOG_DEBUG("posix::fopen(%s, %s) = %p", filename, mode, stream);
+    return stream;
+  }
+
+  int fd = open(filename, flags, 0666);
+  if (fd < 0) return nullptr;
+  auto file = get_file(fd);
+  if (!file) {
+    // not a MadFS file
+    FILE* stream = fdopen(fd, mode);
+    if (!stream) posix::close(fd);
+    LOG_DEBUG("posix::fopen(%s, %s) = %p", filename, mode, stream);
+    return stream;
+  }
+
+  auto buf =
+      static_cast<char*>(std::aligned_alloc(BLOCK_SIZE, STREAM_BUFFER_SIZE));
+  auto cookie = new Stream{std::move(file), fd, buf};
+  FILE* stream = buf ? fopencookie(cookie, mode, stream_funcs) : nullptr;
+  if (!stream) {
+    stream_close(cookie);
+    errno = ENOMEM;
+    return nullptr;
+  }
+  setvbuf(stream, buf, _IOFBF, STREAM_BUFFER_SIZE);
+  // fileno is used to fsync or fstat the stream
+  stream->_fileno = fd;
+  {
+    std::lock_guard<std::mutex> guard(streams_mutex);
+    streams.emplace(stream);
+  }
+  LOG_DEBUG("madfs::fopen(%s, %s) = %p", filename, mode, stream);
+  return stream;
+}
+
+FILE* fopen64(const char* filename, const char* mode) {
+  return fopen(filename, mode);
+}
+}
+}  // namespace madfs
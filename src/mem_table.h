@@ -3,6 +3,8 @@
 #include <linux/mman.h>
 #include <tbb/concurrent_vector.h>
 
+#include <algorithm>
+#include <bit>
 #include <cerrno>
 #include <cstdint>
 #include <iosfwd>
@@ -18,6 +20,11 @@
 #include "utils/timer.h"
 #include "utils/utils.h"
 
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22
+#define MADV_POPULATE_WRITE 23
+#endif
+
 namespace madfs::dram {
 
 constexpr static uint32_t GROW_UNIT_IN_BLOCK_SHIFT =
@@ -39,12 +46,20 @@ class MemTable : noncopyable {
   int fd;
   int prot;
 
+  // whether the file is mapped with MAP_SYNC; if not, the kernel writes the
+  // mappings back only when asked to (see sync)
+  std::atomic<bool> map_sync;
+
   // immutable after ctor
   pmem::Block* first_region;
   uint32_t first_region_num_blocks;
+  // the first region always covers whole grow units, so a file that grows
+  // within them needs no more mappings; the blocks beyond the initial file
+  // size must be allocated before use
+  uint32_t first_region_init_num_blocks;
 
-  // map a chunk_idx to addr, where chunk_idx =
-  // (lidx - first_region_num_blocks) >> GROW_UNIT_IN_BLOCK_SHIFT
+  // map a chunk_idx to addr, where chunk_idx = lidx >> GROW_UNIT_IN_BLOCK_SHIFT;
+  // the entries covered by the first region are never used
   tbb::concurrent_vector<std::atomic<pmem::Block*>,
                          zero_allocator<std::atomic<pmem::Block*>>>
       table;
@@ -55,28 +70,46 @@ class MemTable : noncopyable {
 
  public:
   MemTable(int fd, off_t init_file_size, bool read_only)
-      : fd(fd), prot(read_only ? PROT_READ : PROT_READ | PROT_WRITE) {
+      : fd(fd),
+        prot(read_only ? PROT_READ : PROT_READ | PROT_WRITE),
+        // nothing to keep in sync with the metadata if the file is volatile
+        map_sync(BuildOptions::map_sync &&
+                 runtime_options.persist_domain != PersistDomain::NONE) {
     bool is_empty = init_file_size == 0;
-    // grow to multiple of grow_unit_size if the file is empty or the file
-    // size is not grow_unit aligned
-    bool should_grow = is_empty || !IS_ALIGNED(init_file_size, GROW_UNIT_SIZE);
+    // an empty file is preallocated; a file larger than a grow unit grows to
+    // multiple of grow_unit_size, while a smaller one (e.g., created in the
+    // small-file mode) keeps growing by doubling; a read-only file (e.g., a
+    // sealed one) is mapped as is
     off_t file_size = init_file_size;
-    if (should_grow) {
+    if (is_empty)
       file_size =
-          is_empty ? PREALLOC_SIZE : ALIGN_UP(init_file_size, GROW_UNIT_SIZE);
+          runtime_options.small_file ? SMALL_PREALLOC_SIZE : PREALLOC_SIZE;
+    else if (!read_only && init_file_size > GROW_UNIT_SIZE)
+      file_size = ALIGN_UP(init_file_size, GROW_UNIT_SIZE);
+    bool should_grow = file_size != init_file_size;
+    if (should_grow) {
       int ret = posix::fallocate(fd, 0, 0, file_size);
       PANIC_IF(ret < 0, "fallocate failed");
     }
 
-    first_region = mmap_file(static_cast<size_t>(file_size), 0, 0);
-    first_region_num_blocks = BLOCK_SIZE_TO_IDX(file_size);
+    size_t first_region_size = ALIGN_UP(static_cast<size_t>(file_size),
+                                        static_cast<size_t>(GROW_UNIT_SIZE));
+    first_region = mmap_file(first_region_size, 0, 0);
+    first_region_num_blocks = BLOCK_SIZE_TO_IDX(first_region_size);
+    first_region_init_num_blocks = BLOCK_SIZE_TO_IDX(file_size);
+    // populating the whole file would dominate the open time of a large file;
+    // only the first grow unit is populated, which holds the meta block and the
+    // early tx and log entry blocks read by replay; data pages fault lazily
+    if constexpr (BuildOptions::map_populate)
+      populate(first_region, std::min(static_cast<size_t>(file_size),
+                                      static_cast<size_t>(GROW_UNIT_SIZE)));
     meta = &first_region[0].meta_block;
     if (!is_empty && !meta->is_valid())
       throw FileInitException("invalid meta block");
 
     // update the mata block if necessary
     if (should_grow)
-      meta->set_num_logical_blocks_if_larger(first_region_num_blocks);
+      meta->set_num_logical_blocks_if_larger(first_region_init_num_blocks);
   }
 
   ~MemTable() {
@@ -100,11 +133,13 @@ class MemTable : noncopyable {
   pmem::Block* lidx_to_addr_rw(LogicalBlockIdx idx) {
     if (unlikely(idx == 0)) return nullptr;
     // super fast path: within first_region, no need touch concurrent vector
-    if (idx < first_region_num_blocks) return &first_region[idx.get()];
+    if (idx < first_region_num_blocks) {
+      if (unlikely(idx >= first_region_init_num_blocks)) grow_to_fit(idx);
+      return &first_region[idx.get()];
+    }
 
     // fast path: just look up
-    uint32_t chunk_idx =
-        (idx - first_region_num_blocks) >> GROW_UNIT_IN_BLOCK_SHIFT;
+    uint32_t chunk_idx = idx >> GROW_UNIT_IN_BLOCK_SHIFT;
     uint32_t chunk_local_idx = idx & GROW_UNIT_IN_BLOCK_MASK;
     if (chunk_idx < table.size()) {
       pmem::Block* chunk_addr = table[chunk_idx];
@@ -116,14 +151,49 @@ class MemTable : noncopyable {
     // ensure this idx has real blocks allocated; do allocation if not
     grow_to_fit(idx);
 
+    // a new chunk is mapped because some blocks in it are about to be used
     LogicalBlockIdx chunk_begin_lidx = idx & ~GROW_UNIT_IN_BLOCK_MASK;
     pmem::Block* chunk_addr = mmap_file(
         GROW_UNIT_SIZE, static_cast<off_t>(BLOCK_IDX_TO_SIZE(chunk_begin_lidx)),
-        MAP_POPULATE);
+        BuildOptions::map_populate ? MAP_POPULATE : 0);
     table[chunk_idx] = chunk_addr;
     return chunk_addr + chunk_local_idx;
   }
 
+  /**
+   * Give the blocks in [begin, begin + num_blocks) back to the kernel
+   * filesystem. The mappings are kept: the kernel drops the pages from them,
+   * and the next access faults in zeroed pages.
+   *
+   * @return true on success
+   */
+  bool punch_hole(LogicalBlockIdx begin, uint32_t num_blocks) const {
+    auto offset = static_cast<off_t>(BLOCK_IDX_TO_SIZE(begin));
+    auto length = static_cast<off_t>(BLOCK_NUM_TO_SIZE(num_blocks));
+    int ret = posix::fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                               offset, length);
+    if (ret < 0) LOG_WARN("fd %d: punch hole failed: %m", fd);
+    return ret == 0;
+  }
+
+  /**
+   * Make the stores to the mappings durable. A file mapped with MAP_SYNC (i.e.,
+   * on a DAX filesystem) is durable once its cache lines are flushed; otherwise
+   * (e.g., a file on NVMe) the kernel writes the dirty pages back here. It
+   * tracks them already, so a single fdatasync covers all the stores since the
+   * last one, both data and metadata.
+   *
+   * @return 0 on success; -1 with errno set otherwise
+   */
+  int sync() const {
+    if (map_sync.load(std::memory_order_relaxed)) return 0;
+    return posix::fdatasync(fd);
+  }
+
+  [[nodiscard]] bool is_map_sync() const {
+    return map_sync.load(std::memory_order_relaxed);
+  }
+
   [[nodiscard]] const pmem::Block* lidx_to_addr_ro(LogicalBlockIdx lidx) {
     constexpr static const char __attribute__((aligned(BLOCK_SIZE)))
     empty_block[BLOCK_SIZE]{};
@@ -142,32 +212,53 @@ class MemTable : noncopyable {
     // we have `idx + 1` since we want to grow_to_fit the file when idx is a
     // multiple of the number of blocks in a grow_to_fit unit (e.g., 512 for 2
     // MB grow_to_fit)
-    uint64_t file_size = ALIGN_UP(BLOCK_IDX_TO_SIZE(idx + 1), GROW_UNIT_SIZE);
+    // a file within the first grow unit grows by doubling, so small files stay
+    // small; the chunk mapping covers the whole unit regardless
+    uint64_t file_size = BLOCK_IDX_TO_SIZE(idx + 1);
+    file_size = file_size < GROW_UNIT_SIZE ? std::bit_ceil(file_size)
+                                           : ALIGN_UP(file_size, GROW_UNIT_SIZE);
 
     int ret = posix::fallocate(fd, 0, 0, static_cast<off_t>(file_size));
     PANIC_IF(ret, "fd %d: fallocate failed", fd);
     meta->set_num_logical_blocks_if_larger(BLOCK_SIZE_TO_IDX(file_size));
   }
 
+  /**
+   * Prefault the page table entries of a mapped range
+   */
+  void populate(void* addr, size_t length) const {
+    TimerGuard<Event::POPULATE> guard;
+    int advice = prot & PROT_WRITE ? MADV_POPULATE_WRITE : MADV_POPULATE_READ;
+    if (madvise(addr, length, advice) == 0) return;
+    // MADV_POPULATE_* requires Linux 5.14; fall back to touching the pages
+    for (size_t offset = 0; offset < length; offset += BLOCK_SIZE)
+      std::ignore = *(static_cast<volatile char*>(addr) + offset);
+  }
+
   /**
    * a private helper function that calls mmap internally
    * @return the pointer to the first block on the persistent memory
    */
   pmem::Block* mmap_file(size_t length, off_t offset, int flags = 0) {
     TimerGuard<Event::MMAP> guard;
-    if constexpr (BuildOptions::map_sync)
+    bool try_map_sync = map_sync.load(std::memory_order_relaxed);
+    if (try_map_sync)
       flags |= MAP_SHARED_VALIDATE | MAP_SYNC;
     else
       flags |= MAP_SHARED;
-    if constexpr (BuildOptions::map_populate) flags |= MAP_POPULATE;
 
     void* addr = posix::mmap(nullptr, length, prot, flags, fd, offset);
 
     if (unlikely(addr == MAP_FAILED)) {
-      if constexpr (BuildOptions::map_sync) {
+      if (try_map_sync) {
         if (errno == EOPNOTSUPP) {
-          LOG_WARN("MAP_SYNC not supported for fd = %d. Retry w/o MAP_SYNC",
-                   fd);
+          // not a DAX file: fsync writes it back, and the later mappings do not
+          // try MAP_SYNC again
+          LOG_WARN(
+              "MAP_SYNC not supported for fd = %d. Retry w/o MAP_SYNC (set "
+              "MADFS_PERSIST_DOMAIN=none if the file is not on PM)",
+              fd);
+          map_sync.store(false, std::memory_order_relaxed);
           flags &= ~(MAP_SHARED_VALIDATE | MAP_SYNC);
           flags |= MAP_SHARED;
           addr = posix::mmap(nullptr, length, prot, flags, fd, offset);
@@ -187,12 +278,13 @@ class MemTable : noncopyable {
     out << "\t" << 0 << " - " << m.first_region_num_blocks << ": "
         << m.first_region << "\n";
 
-    uint32_t chunk_idx = m.first_region_num_blocks >> GROW_UNIT_IN_BLOCK_SHIFT;
+    uint32_t chunk_idx = 0;
     for (const auto& mem_addr : m.table) {
       LogicalBlockIdx chunk_begin_lidx = chunk_idx << GROW_UNIT_IN_BLOCK_SHIFT;
+      ++chunk_idx;
+      if (mem_addr == nullptr) continue;
       out << "\t" << chunk_begin_lidx << " - "
           << chunk_begin_lidx + NUM_BLOCKS_PER_GROW << ": " << mem_addr << "\n";
-      ++chunk_idx;
     }
     return out;
   }
@@ -24,10 +24,14 @@ class OffsetMgr {
 
   off_t offset;
   uint64_t next_ticket;
-  TicketSlot queues[NUM_OFFSET_QUEUE_SLOT];
+  // only used with strict offset serialization, so allocated on first use to
+  // keep an idle open file small
+  std::atomic<TicketSlot*> queues;
 
  public:
-  explicit OffsetMgr() : offset(0), next_ticket(1), queues() {}
+  explicit OffsetMgr() : offset(0), next_ticket(1), queues(nullptr) {}
+
+  ~OffsetMgr() { delete[] queues.load(std::memory_order_relaxed); }
 
   // must have spinlock acquired
   // only call if seeking is the only serialization point
@@ -77,7 +81,8 @@ class OffsetMgr {
     if (!runtime_options.strict_offset_serial) return nullptr;
     uint64_t prev_ticket = ticket - 1;
     if (prev_ticket == 0) return nullptr;
-    const TicketSlot* slot = &queues[prev_ticket % NUM_OFFSET_QUEUE_SLOT];
+    const TicketSlot* slot =
+        &get_queues()[prev_ticket % NUM_OFFSET_QUEUE_SLOT];
     while (slot->ticket_slot.ticket.load(std::memory_order_acquire) !=
            prev_ticket)
       _mm_pause();
@@ -113,11 +118,35 @@ class OffsetMgr {
     // if we don't want strict serialization on offset, always return
     // immediately
     if (!runtime_options.strict_offset_serial) return;
-    TicketSlot* slot = &queues[ticket % NUM_OFFSET_QUEUE_SLOT];
+    TicketSlot* slot = &get_queues()[ticket % NUM_OFFSET_QUEUE_SLOT];
     slot->ticket_slot.cursor = cursor;
     slot->ticket_slot.ticket.store(ticket, std::memory_order_release);
   }
 
+  /**
+   * In a forked child, the operations in flight belong to the parent's threads
+   * and will never release their tickets; mark them all released.
+   *
+   * @param cursor the cursor of the file state inherited from the parent
+   */
+  void on_fork_child(TxCursor cursor) {
+    if (next_ticket > 1) release(next_ticket - 1, cursor);
+  }
+
+ private:
+  TicketSlot* get_queues() {
+    TicketSlot* curr = queues.load(std::memory_order_acquire);
+    if (likely(curr)) return curr;
+    auto new_queues = new TicketSlot[NUM_OFFSET_QUEUE_SLOT];
+    if (queues.compare_exchange_strong(curr, new_queues,
+                                       std::memory_order_acq_rel,
+                                       std::memory_order_acquire))
+      return new_queues;
+    delete[] new_queues;
+    return curr;
+  }
+
+ public:
   friend std::ostream& operator<<(std::ostream& out, const OffsetMgr& o) {
     out << "OffsetMgr: offset = " << o.offset << "\n";
     return out;
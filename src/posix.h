@@ -135,10 +135,12 @@ DEFINE_FN(mmap);
 DEFINE_FN(mremap);
 DEFINE_FN(munmap);
 DEFINE_FN(fallocate);
+DEFINE_FN(posix_fallocate);
 DEFINE_FN(ftruncate);
 DEFINE_FN(fsync);
 DEFINE_FN(fdatasync);
 DEFINE_FN(fcntl);
+DEFINE_FN(flock);
 DEFINE_FN(unlink);
 DEFINE_FN(rename);
 
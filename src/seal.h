@@ -0,0 +1,164 @@
+#pragma once
+
+#include <sys/xattr.h>
+
+#include <cstring>
+#include <memory>
+#include <string>
+
+#include "block/block.h"
+#include "const.h"
+#include "file/file.h"
+#include "idx.h"
+#include "posix.h"
+#include "shm.h"
+#include "utils/logging.h"
+#include "utils/persist.h"
+#include "utils/utils.h"
+
+namespace madfs::utility {
+
+/**
+ * Seal a file that will only be read from now on (e.g., an SST file).
+ *
+ * A sealed file consists of the meta block followed by the data in virtual
+ * order, so the meta block only records where the data begins and the file
+ * size; there is no tx history, no shared memory, and readers copy from a
+ * linear mapping without validation. Opening a sealed file for write unseals
+ * it by rebuilding the tx history from the descriptor (see File::unseal).
+ *
+ * The sealed file is built next to the original and renamed over it, so a
+ * crash leaves either the original or the sealed file. Like the garbage
+ * collector, this is expected to run in a dedicated process while no other
+ * process is using the file.
+ */
+class Sealer {
+  // the data follows the meta block
+  constexpr static uint32_t SEALED_BEGIN_LIDX = 1;
+
+ public:
+  /**
+   * @return true if the file is sealed, either by this call or before
+   */
+  static bool seal(const char* pathname) {
+    int fd;
+    struct stat stat_buf;
+    if (!::try_open(fd, stat_buf, pathname, O_RDONLY, 0)) {
+      LOG_WARN("Sealer: \"%s\" is not a MadFS file", pathname);
+      if (fd >= 0) posix::close(fd);
+      return false;
+    }
+    auto file =
+        std::make_unique<dram::File>(fd, stat_buf, O_RDONLY, pathname);
+    if (file->is_sealed()) return true;
+
+    if (is_in_use(file.get())) {
+      LOG_WARN("Sealer: \"%s\" is in use by other threads", pathname);
+      return false;
+    }
+
+    std::string tmp_path = std::string(pathname) + ".seal";
+    if (!build(file.get(), stat_buf, tmp_path.c_str())) {
+      posix::unlink(tmp_path.c_str());
+      return false;
+    }
+
+    // the old shared memory belongs to the old inode
+    file.reset();
+    dram::ShmMgr::unlink_by_file_path(pathname);
+    if (posix::rename(tmp_path.c_str(), pathname) < 0) {
+      LOG_WARN("Sealer: rename to \"%s\" failed: %m", pathname);
+      posix::unlink(tmp_path.c_str());
+      return false;
+    }
+    LOG_INFO("Sealer: \"%s\" sealed", pathname);
+    return true;
+  }
+
+ private:
+  /**
+   * @return true if any thread has ever accessed the file without cleaning up
+   */
+  static bool is_in_use(dram::File* file) {
+    for (size_t i = 0; i < MAX_NUM_THREADS; ++i)
+      if (file->shm_mgr.get_per_thread_data(i)->is_data_valid()) return true;
+    return false;
+  }
+
+  /**
+   * Write the sealed version of the file to a new file at tmp_path
+   */
+  static bool build(dram::File* file, const struct stat& stat_buf,
+                    const char* tmp_path) {
+    uint64_t file_size = file->blk_table.get_state_unsafe().file_size;
+    uint32_t num_blocks = BLOCK_SIZE_TO_IDX(ALIGN_UP(file_size, BLOCK_SIZE));
+    uint32_t total_blocks = SEALED_BEGIN_LIDX + num_blocks;
+    size_t total_size = BLOCK_NUM_TO_SIZE(total_blocks);
+
+    int fd = posix::open(tmp_path, O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC,
+                         stat_buf.st_mode & 07777);
+    if (fd < 0) {
+      LOG_WARN("Sealer: create \"%s\" failed: %m", tmp_path);
+      return false;
+    }
+    // best effort; only root can change the owner
+    std::ignore = fchown(fd, stat_buf.st_uid, stat_buf.st_gid);
+
+    struct stat new_stat;
+    if (posix::fallocate(fd, 0, 0, static_cast<off_t>(total_size)) < 0 ||
+        posix::fstat(fd, &new_stat) < 0) {
+      LOG_WARN("Sealer: fallocate \"%s\" failed: %m", tmp_path);
+      posix::close(fd);
+      return false;
+    }
+
+    auto region = static_cast<pmem::Block*>(posix::mmap(
+        nullptr, total_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+    if (region == MAP_FAILED) {
+      LOG_WARN("Sealer: mmap \"%s\" failed: %m", tmp_path);
+      posix::close(fd);
+      return false;
+    }
+
+    // copy the data in virtual order; holes are left as zeros
+    if (file->meta->is_inline())
+      pmem::memcpy_persist(region[SEALED_BEGIN_LIDX].data_rw(),
+                           file->meta->get_inline_data(), file_size);
+    else
+      for (VirtualBlockIdx vidx = 0; vidx < num_blocks; ++vidx) {
+        LogicalBlockIdx lidx = file->blk_table.vidx_to_lidx(vidx);
+        if (lidx == 0) continue;
+        pmem::memcpy_persist(
+            region[SEALED_BEGIN_LIDX + vidx.get()].data_rw(),
+            file->mem_table.lidx_to_addr_ro(lidx)->data_ro(), BLOCK_SIZE);
+      }
+
+    // the new inode needs its own shared memory once unsealed
+    pmem::MetaBlock* meta = &region[0].meta_block;
+    meta->init();
+    meta->set_num_logical_blocks_if_larger(total_blocks);
+    uint64_t shm_tag = dram::ShmMgr::make_tag(new_stat);
+    char shm_path[SHM_PATH_LEN];
+    dram::ShmMgr::format_path(shm_path, new_stat.st_ino, shm_tag);
+    meta->set_shm_id(new_stat.st_ino, new_stat.st_dev, shm_tag);
+    bool success =
+        fsetxattr(fd, SHM_XATTR_NAME, shm_path, SHM_PATH_LEN, 0) == 0;
+    if (!success) LOG_WARN("Sealer: set xattr of \"%s\" failed: %m", tmp_path);
+
+    // the seal is set last; before that, the file has no valid content
+    fence();
+    meta->set_sealed(SEALED_BEGIN_LIDX, file_size);
+    // the mapping is not MAP_SYNC, so the copy is written back before it
+    // replaces the original
+    if (success && posix::fdatasync(fd) < 0) {
+      LOG_WARN("Sealer: fdatasync \"%s\" failed: %m", tmp_path);
+      success = false;
+    }
+
+    posix::munmap(region, total_size);
+    posix::close(fd);
+    return success;
+  }
+};
+
+}  // namespace madfs::utility
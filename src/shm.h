@@ -4,7 +4,11 @@
 #include <sys/xattr.h>
 
 #include <atomic>
+#include <cstring>
+#include <mutex>
+#include <ctime>
 #include <ostream>
+#include <tuple>
 
 #include "const.h"
 #include "idx.h"
@@ -34,6 +38,9 @@ class alignas(SHM_PER_THREAD_SIZE) PerThreadData {
   // reclaim this block and blocks after it
   std::atomic<LogicalBlockIdx> tx_block_idx;
 
+  // set while the thread is writing without holding the lease (see Lease)
+  std::atomic<bool> writing;
+
  public:
   /**
    * @return true if there are some data stored, regardless of whether the
@@ -70,6 +77,7 @@ class alignas(SHM_PER_THREAD_SIZE) PerThreadData {
 
     index = i;
     tx_block_idx.store(0, std::memory_order_relaxed);
+    writing.store(false, std::memory_order_relaxed);
     init_robust_mutex(&mutex);
     // TODO: uncomment this
     //    pthread_mutex_lock(&mutex);
@@ -96,6 +104,7 @@ class alignas(SHM_PER_THREAD_SIZE) PerThreadData {
     //    if (is_thread_alive()) pthread_mutex_unlock(&mutex);
     index = 0;
     tx_block_idx.store(0, std::memory_order_relaxed);
+    writing.store(false, std::memory_order_relaxed);
     pthread_mutex_destroy(&mutex);
     state.store(State::UNINITIALIZED, std::memory_order_release);
   }
@@ -108,6 +117,29 @@ class alignas(SHM_PER_THREAD_SIZE) PerThreadData {
     return tx_block_idx.load(std::memory_order_relaxed);
   }
 
+  /**
+   * Announce the start of a write. It must be ordered before the following
+   * check of the lease owner (see Lease::begin_write): by a full fence, or by
+   * the barrier that the holder runs in all the registered processes.
+   *
+   * @param fence whether to fence the store
+   */
+  void begin_writing(bool fence) {
+    if (fence) {
+      writing.store(true, std::memory_order_seq_cst);
+    } else {
+      writing.store(true, std::memory_order_relaxed);
+      // the barrier of the holder only orders what the CPU does
+      std::atomic_signal_fence(std::memory_order_seq_cst);
+    }
+  }
+
+  void end_writing() { writing.store(false, std::memory_order_release); }
+
+  [[nodiscard]] bool is_writing() const {
+    return writing.load(std::memory_order_acquire);
+  }
+
  private:
   /**
    * Check the robust mutex to see if the thread is alive.
@@ -148,64 +180,212 @@ class alignas(SHM_PER_THREAD_SIZE) PerThreadData {
     if (curr_state == State::INITIALIZED) {
       os << ", is_thread_alive=" << data.is_thread_alive();
     }
-    os << ", tx_block_idx=" << data.tx_block_idx << "}";
+    os << ", tx_block_idx=" << data.tx_block_idx
+       << ", writing=" << data.writing << "}";
     return os;
   }
 };
 
 static_assert(sizeof(PerThreadData) == SHM_PER_THREAD_SIZE);
 
+/**
+ * File attributes maintained by MadFS and shared by all processes that open
+ * the file. They live at the beginning of the shared memory, so stat() can
+ * read them without constructing a File (i.e. mapping and replaying the log).
+ *
+ * Writes only grow the file size, so their updates are monotonic, and so are
+ * those of an open, which replays the log and publishes the size it sees: a
+ * writer may have published a larger one in the meantime. Only an open of an
+ * empty file (e.g., after O_TRUNC, which empties the file in the kernel) stores
+ * its size as is, dropping that of the previous content. A writer crashing
+ * between its commit and its publish only leaves the attributes stale until
+ * the next open.
+ */
+class alignas(CACHELINE_SIZE) ShmHeader {
+  std::atomic<uint64_t> file_size;
+  // in nanoseconds since the epoch
+  std::atomic<uint64_t> mtime;
+  // set once the attributes above are published by an opener
+  std::atomic<bool> is_valid;
+  // the pid of the process holding the write lease; zero if none. The lease
+  // itself is an OFD lock on the shared memory (see Lease), so this field may
+  // be stale after the holder crashes.
+  std::atomic<pid_t> lease_owner;
+
+ public:
+  /**
+   * Publish the attributes learned from a full replay of the log.
+   *
+   * @param size the file size after the replay
+   * @param kernel_mtime the mtime reported by the kernel
+   * @param is_empty whether the file is empty in the kernel
+   */
+  void init(uint64_t size, const timespec& kernel_mtime, bool is_empty) {
+    if (is_empty)
+      file_size.store(size, std::memory_order_relaxed);
+    else
+      update_size(size);
+    update_mtime(to_ns(kernel_mtime));
+    is_valid.store(true, std::memory_order_release);
+  }
+
+  /**
+   * Record a write ending at end_offset. Both fields are only written when
+   * they change, so concurrent writers mostly share the cacheline.
+   */
+  void on_write(uint64_t end_offset) {
+    update_size(end_offset);
+    update_mtime(now());
+  }
+
+  [[nodiscard]] pid_t get_lease_owner() const {
+    return lease_owner.load(std::memory_order_seq_cst);
+  }
+
+  void set_lease_owner(pid_t pid) {
+    lease_owner.store(pid, std::memory_order_seq_cst);
+  }
+
+  /**
+   * Clear the owner if it is still the given (dead) process.
+   */
+  void clear_lease_owner(pid_t stale_pid) {
+    lease_owner.compare_exchange_strong(stale_pid, 0,
+                                        std::memory_order_seq_cst);
+  }
+
+  /**
+   * @return whether the attributes are valid; if so, they are stored into buf
+   */
+  bool fill_stat(struct stat* buf) const {
+    if (!is_valid.load(std::memory_order_acquire)) return false;
+    buf->st_size = static_cast<off_t>(file_size.load(std::memory_order_relaxed));
+    timespec ts = from_ns(mtime.load(std::memory_order_relaxed));
+    if (to_ns(buf->st_mtim) < to_ns(ts)) buf->st_mtim = ts;
+    if (to_ns(buf->st_ctim) < to_ns(ts)) buf->st_ctim = ts;
+    return true;
+  }
+
+ private:
+  void update_size(uint64_t size) {
+    uint64_t old_size = file_size.load(std::memory_order_relaxed);
+    while (old_size < size &&
+           !file_size.compare_exchange_weak(old_size, size,
+                                            std::memory_order_relaxed)) {
+    }
+  }
+
+  void update_mtime(uint64_t ns) {
+    uint64_t old_ns = mtime.load(std::memory_order_relaxed);
+    while (old_ns < ns &&
+           !mtime.compare_exchange_weak(old_ns, ns, std::memory_order_relaxed)) {
+    }
+  }
+
+  // the coarse clock is served by vDSO and is as precise as the kernel's mtime
+  static uint64_t now() {
+    timespec ts{};
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    return to_ns(ts);
+  }
+
+  static uint64_t to_ns(const timespec& ts) {
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 +
+           static_cast<uint64_t>(ts.tv_nsec);
+  }
+
+  static timespec from_ns(uint64_t ns) {
+    return {static_cast<time_t>(ns / 1000000000),
+            static_cast<long>(ns % 1000000000)};
+  }
+
+ public:
+  friend std::ostream& operator<<(std::ostream& os, const ShmHeader& header) {
+    os << "ShmHeader{file_size=" << header.file_size
+       << ", mtime=" << header.mtime << ", is_valid=" << header.is_valid
+       << ", lease_owner=" << header.lease_owner << "}";
+    return os;
+  }
+};
+
+static_assert(sizeof(ShmHeader) <= SHM_HEADER_SIZE);
+
 class ShmMgr {
+  constexpr static const char* SHM_PATH_FORMAT = "/dev/shm/madfs_%016lx_%013lx";
+  // the widths above are minimums, so a path is parsed without them
+  constexpr static const char* SHM_SCAN_FORMAT = "/dev/shm/madfs_%lx_%lx";
+
   pmem::MetaBlock* meta;
-  int fd = -1;
-  void* addr = nullptr;
+  // the mode and owner used if the shared memory needs to be created
+  const mode_t mode;
+  const uid_t uid;
+  const gid_t gid;
   char path[SHM_PATH_LEN]{};
 
+  // the shared memory is opened and mapped on first use, so that a file that
+  // never needs it (e.g., a sealed file opened for read) does not create it;
+  // the fd is closed once mapped, so an open file costs a single fd
+  mutable std::once_flag map_once;
+  mutable void* addr = nullptr;
+
  public:
   /**
-   * Open and memory map the shared memory. If the shared memory does not exist,
-   * create it.
+   * Resolve the path of the shared memory. The shared memory itself is opened
+   * and memory mapped on first use; it is created if it does not exist.
    *
    * @param file_fd the file descriptor of the file that uses this shared memory
    * @param stat the stat of the file that uses this shared memory
+   * @param meta the meta block of the file
+   * @param read_only whether the meta block is mapped read-only
    */
-  ShmMgr(int file_fd, const struct stat& stat, pmem::MetaBlock* meta)
-      : meta(meta) {
-    // get or set the path of the shared memory
-    {
-      ssize_t rc = fgetxattr(file_fd, SHM_XATTR_NAME, path, SHM_PATH_LEN);
-      if (rc == -1 && errno == ENODATA) {  // no shm_path attribute, create one
-        sprintf(path, "/dev/shm/madfs_%016lx_%013lx", stat.st_ino,
-                (stat.st_ctim.tv_sec * 1000000000 + stat.st_ctim.tv_nsec) >> 3);
-        rc = fsetxattr(file_fd, SHM_XATTR_NAME, path, SHM_PATH_LEN, 0);
-        PANIC_IF(rc == -1, "failed to set shm_path attribute");
-      } else if (rc == -1) {
-        PANIC("failed to get shm_path attribute");
-      }
-    }
-
-    // use posix::open instead of shm_open since shm_open calls open, which is
-    // overloaded by madfs
-    fd = posix::open(path, O_RDWR | O_NOFOLLOW | O_CLOEXEC, S_IRUSR | S_IWUSR);
-    if (fd < 0) {
-      fd = create(path, stat.st_mode, stat.st_uid, stat.st_gid);
+  ShmMgr(int file_fd, const struct stat& stat, pmem::MetaBlock* meta,
+         bool read_only)
+      : meta(meta), mode(stat.st_mode), uid(stat.st_uid), gid(stat.st_gid) {
+    // get the path of the shared memory from the meta block if it is made for
+    // this inode; otherwise fall back to the xattr, or set both for a new file
+    uint64_t ino, tag;
+    uint32_t dev;
+    bool has_meta_id = meta->get_shm_id(ino, dev, tag);
+    if (has_meta_id && ino == stat.st_ino &&
+        (dev == 0 || dev == static_cast<uint32_t>(stat.st_dev))) {
+      format_path(path, ino, tag);
+      if (dev == 0 && !read_only) meta->set_shm_id(ino, stat.st_dev, tag);
+      return;
     }
-    LOG_DEBUG("posix::open(%s) = %d", path, fd);
 
-    addr = posix::mmap(nullptr, SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
-                       fd, 0);
-    if (addr == MAP_FAILED) {
-      posix::close(fd);
-      PANIC("mmap shared memory failed");
+    // the meta block of a byte copy (e.g., by cp) names the shared memory of
+    // the original file, and so does its xattr if copied as well; both files
+    // would allocate the same blocks, so a copy gets a new shared memory
+    char meta_path[SHM_PATH_LEN]{};
+    if (has_meta_id) format_path(meta_path, ino, tag);
+    ssize_t rc = fgetxattr(file_fd, SHM_XATTR_NAME, path, SHM_PATH_LEN);
+    if (rc == -1 && errno != ENODATA)
+      PANIC("failed to get shm_path attribute");
+    if (rc == -1 || sscanf(path, SHM_SCAN_FORMAT, &ino, &tag) != 2 ||
+        ino != stat.st_ino || strcmp(path, meta_path) == 0) {
+      ino = stat.st_ino;
+      tag = make_tag(stat);
+      format_path(path, ino, tag);
+      rc = fsetxattr(file_fd, SHM_XATTR_NAME, path, SHM_PATH_LEN, 0);
+      PANIC_IF(rc == -1, "failed to set shm_path attribute");
     }
+    // the xattr is kept for path-based operations (e.g., unlink)
+    if (!read_only) meta->set_shm_id(ino, stat.st_dev, tag);
   }
 
   ~ShmMgr() {
-    if (fd >= 0) posix::close(fd);
     if (addr != nullptr) posix::munmap(addr, SHM_SIZE);
   }
 
-  [[nodiscard]] void* get_bitmap_addr() const { return addr; }
+  [[nodiscard]] ShmHeader* get_header() const {
+    return static_cast<ShmHeader*>(get_addr());
+  }
+
+  [[nodiscard]] const char* get_path() const { return path; }
+
+  [[nodiscard]] void* get_bitmap_addr() const {
+    return static_cast<char*>(get_addr()) + SHM_HEADER_SIZE;
+  }
 
   /**
    * Get the address of the per-thread data of the current thread.
@@ -216,7 +396,8 @@ class ShmMgr {
    */
   [[nodiscard]] PerThreadData* get_per_thread_data(size_t idx) const {
     assert(idx < MAX_NUM_THREADS);
-    char* starting_addr = static_cast<char*>(addr) + TOTAL_NUM_BITMAP_BYTES;
+    char* starting_addr = static_cast<char*>(get_addr()) + SHM_HEADER_SIZE +
+                          TOTAL_NUM_BITMAP_BYTES;
     return reinterpret_cast<PerThreadData*>(starting_addr) + idx;
   }
 
@@ -238,6 +419,21 @@ class ShmMgr {
     PANIC("No empty per-thread data");
   }
 
+  static void format_path(char* shm_path, uint64_t ino, uint64_t tag) {
+    sprintf(shm_path, SHM_PATH_FORMAT, ino, tag);
+  }
+
+  /**
+   * @return the tag that, together with the inode number, identifies the
+   * shared memory of a file; derived from the ctime so that a reused inode
+   * number gets a different shared memory
+   */
+  static uint64_t make_tag(const struct stat& stat) {
+    return static_cast<uint64_t>(stat.st_ctim.tv_sec * 1000000000 +
+                                 stat.st_ctim.tv_nsec) >>
+           3;
+  }
+
   /**
    * Remove the shared memory object associated.
    */
@@ -274,8 +470,22 @@ class ShmMgr {
       PANIC("fchown on shared memory failed");
     }
 
-    if (posix::fallocate(shm_fd, 0, 0, static_cast<off_t>(SHM_SIZE)) < 0) {
+    // the shared memory is sized but left sparse, so a small file costs a few
+    // pages: the header, the per-thread data, and the first bitmap block are
+    // allocated now, and the rest of the bitmap before it is used (see
+    // BitmapMgr::reserve), so that running out of space fails an allocation
+    // instead of raising SIGBUS on a store
+    if (posix::ftruncate(shm_fd, static_cast<off_t>(SHM_SIZE)) < 0) {
       posix::close(shm_fd);
+      PANIC("ftruncate on shared memory failed");
+    }
+    constexpr off_t per_thread_offset = SHM_HEADER_SIZE + TOTAL_NUM_BITMAP_BYTES;
+    int err = posix::posix_fallocate(shm_fd, 0, SHM_HEADER_SIZE + BLOCK_SIZE);
+    if (err == 0)
+      err = posix::posix_fallocate(shm_fd, per_thread_offset, SHM_GC_SIZE);
+    if (err != 0) {
+      posix::close(shm_fd);
+      errno = err;
       PANIC("fallocate on shared memory failed");
     }
 
@@ -319,12 +529,60 @@ class ShmMgr {
     unlink_by_shm_path(shm_path);
   }
 
+  /**
+   * Fill the size and mtime of a MadFS file from its shared memory without
+   * opening the file itself.
+   *
+   * @param filepath the path of the file that uses the shared memory object
+   * @param buf the stat buffer already filled by the kernel
+   * @return true if the attributes are found and valid
+   */
+  static bool fill_stat_by_file_path(const char* filepath, struct stat* buf) {
+    char shm_path[SHM_PATH_LEN];
+    if (getxattr(filepath, SHM_XATTR_NAME, shm_path, SHM_PATH_LEN) <= 0)
+      return false;
+    int shm_fd = posix::open(shm_path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (shm_fd < 0) return false;
+    ShmHeader header;
+    ssize_t rc = posix::pread(shm_fd, &header, sizeof(header), 0);
+    posix::close(shm_fd);
+    if (rc != sizeof(header)) return false;
+    return header.fill_stat(buf);
+  }
+
+  /**
+   * @return the address of the shared memory; open and map it if not yet
+   */
+  [[nodiscard]] void* get_addr() const {
+    std::call_once(map_once, [this] { map(); });
+    return addr;
+  }
+
+ private:
+  void map() const {
+    // use posix::open instead of shm_open since shm_open calls open, which is
+    // overloaded by madfs
+    int fd =
+        posix::open(path, O_RDWR | O_NOFOLLOW | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+      fd = create(path, mode, uid, gid);
+    }
+    LOG_DEBUG("posix::open(%s) = %d", path, fd);
+
+    void* shm_addr = posix::mmap(nullptr, SHM_SIZE, PROT_READ | PROT_WRITE,
+                                 MAP_SHARED, fd, 0);
+    posix::close(fd);
+    PANIC_IF(shm_addr == MAP_FAILED, "mmap shared memory failed");
+    addr = shm_addr;
+  }
+
+ public:
   friend std::ostream& operator<<(std::ostream& os, const ShmMgr& mgr) {
     __msan_scoped_disable_interceptor_checks();
     os << "ShmMgr:\n"
-       << "\tfd = " << mgr.fd << "\n"
-       << "\taddr = " << mgr.addr << "\n"
-       << "\tpath = " << mgr.path << "\n";
+       << "\taddr = " << mgr.get_addr() << "\n"
+       << "\tpath = " << mgr.path << "\n"
+       << "\theader = " << *mgr.get_header() << "\n";
     for (size_t i = 0; i < MAX_NUM_THREADS; ++i) {
       PerThreadData* per_thread_data = mgr.get_per_thread_data(i);
       if (!per_thread_data->has_data()) continue;
@@ -0,0 +1,93 @@
+#pragma once
+
+#include "tx.h"
+
+namespace madfs::dram {
+/**
+ * ExtendTx grows the file to end_offset without writing any data (see
+ * File::fallocate): the blocks from offset on are committed as holes, which
+ * read as zeros until they are written. It commits through OCC like a write,
+ * but gives up once a tx committed in between has grown the file past offset,
+ * since the holes would then replace its blocks.
+ */
+class ExtendTx : public Tx {
+  pmem::TxEntry commit_entry;
+  LogCursor log_cursor;
+
+ public:
+  /**
+   * @param offset the end of the file, aligned to a block
+   */
+  ExtendTx(File* file, size_t count, size_t offset) : Tx(file, count, offset) {
+    assert(offset % BLOCK_SIZE == 0);
+    lock->wrlock();
+  }
+
+  /**
+   * @return true if the file is extended; false if the file has grown past
+   * offset in the meantime
+   */
+  bool exec() {
+    blk_table->update(&state, allocator);
+    if (state.file_size > offset) return false;
+    if (allocator->tx_block.get_pinned_idx() != state.get_tx_block_idx())
+      allocator->log_entry.reset();
+
+    prepare_commit_entry();
+    std::vector<LogicalBlockIdx> conflict_image(1);
+    while (true) {
+      pmem::TxEntry conflict_entry =
+          file->lease.is_held()
+              ? file->lease.commit(state.cursor, commit_entry, mem_table,
+                                   allocator)
+              : state.cursor.try_commit(commit_entry, mem_table, allocator);
+      if (!conflict_entry.is_valid()) break;
+
+      // any write to the holes would have grown the file past offset
+      bool into_new_block = false;
+      handle_conflict(conflict_entry, begin_vidx, begin_vidx, conflict_image,
+                      commit_entry.is_indirect() ? &into_new_block : nullptr);
+      if (state.file_size > offset) {
+        if (commit_entry.is_indirect()) allocator->log_entry.free(log_cursor);
+        allocator->log_entry.reset();
+        return false;
+      }
+      if (into_new_block) {
+        allocator->log_entry.free(log_cursor);
+        allocator->log_entry.reset();
+        prepare_commit_entry();
+      }
+    }
+
+    allocator->tx_block.pin(state.get_tx_block_idx());
+    return true;
+  }
+
+ private:
+  void prepare_commit_entry() {
+    auto leftover_bytes =
+        static_cast<uint16_t>(ALIGN_UP(end_offset, BLOCK_SIZE) - end_offset);
+    auto n = static_cast<uint32_t>(num_blocks);
+    if (leftover_bytes == 0 &&
+        pmem::TxEntryInline::can_inline(n, begin_vidx, 0)) {
+      commit_entry = pmem::TxEntryInline(n, begin_vidx, 0);
+      return;
+    }
+    if (leftover_bytes != 0 && file->meta->has_compact_entries() &&
+        pmem::TxEntryInlineTail::can_inline(n, begin_vidx, 0)) {
+      commit_entry = pmem::TxEntryInlineTail(n, begin_vidx, 0, leftover_bytes);
+      return;
+    }
+    // a logical index of 0 maps the chunk to a hole
+    std::vector<LogicalBlockIdx> holes(
+        ALIGN_UP(n, BITMAP_ENTRY_BLOCKS_CAPACITY) >>
+        BITMAP_ENTRY_BLOCKS_CAPACITY_SHIFT);
+    log_cursor = allocator->log_entry.append(
+        file->meta->has_compact_entries()
+            ? pmem::LogEntry::Op::LOG_OVERWRITE_RUNS
+            : pmem::LogEntry::Op::LOG_OVERWRITE,
+        leftover_bytes, n, begin_vidx, holes);
+    commit_entry = pmem::TxEntryIndirect(log_cursor.idx);
+  }
+};
+}  // namespace madfs::dram
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "copy_pool.h"
 #include "tx.h"
 
 namespace madfs::dram {
@@ -32,6 +33,13 @@ class ReadTx : public Tx {
 
     redo_image.resize(num_blocks, 0);
 
+    // if this process holds the lease exclusively, every commit bumps the
+    // sequence number; an unchanged number after the copy means no commit
+    // happened in between, so there is nothing to validate
+    const Lease& lease = file->lease;
+    const bool is_leased = !is_offset_depend && lease.is_exclusive();
+    const uint64_t commit_seq = is_leased ? lease.get_commit_seq() : 0;
+
     {
       TimerGuard<Event::READ_TX_UPDATE> timer_guard;
       if (!is_offset_depend) blk_table->update(&state);
@@ -52,27 +60,51 @@ class ReadTx : public Tx {
     {
       TimerGuard<Event::READ_TX_COPY> timer_guard;
 
-      const char* addr =
-          mem_table->lidx_to_addr_ro(blk_table->vidx_to_lidx(begin_vidx))
-              ->data_ro();
-      addr += first_block_offset;
-      size_t contiguous_bytes = first_block_size;
-      size_t buf_offset = 0;
-
-      for (VirtualBlockIdx vidx = begin_vidx + 1; vidx < end_vidx; ++vidx) {
-        const pmem::Block* curr_block =
-            mem_table->lidx_to_addr_ro(blk_table->vidx_to_lidx(vidx));
-        if (addr + contiguous_bytes == curr_block->data_ro()) {
-          contiguous_bytes += BLOCK_SIZE;
-          continue;
+      // copy the bytes of the file in [begin, end) to buf, one physically
+      // contiguous run at a time
+      auto copy = [&](size_t begin, size_t end) {
+        VirtualBlockIdx vidx = BLOCK_SIZE_TO_IDX(begin);
+        size_t block_offset = begin & (BLOCK_SIZE - 1);
+        const char* addr =
+            mem_table->lidx_to_addr_ro(blk_table->vidx_to_lidx(vidx))
+                ->data_ro() +
+            block_offset;
+        size_t contiguous_bytes = BLOCK_SIZE - block_offset;
+        char* dst = buf + (begin - offset);
+        size_t rest_bytes = end - begin;
+
+        for (++vidx; contiguous_bytes < rest_bytes; ++vidx) {
+          const pmem::Block* curr_block =
+              mem_table->lidx_to_addr_ro(blk_table->vidx_to_lidx(vidx));
+          if (addr + contiguous_bytes == curr_block->data_ro()) {
+            contiguous_bytes += BLOCK_SIZE;
+            continue;
+          }
+          dram::memcpy(dst, addr, contiguous_bytes);
+          dst += contiguous_bytes;
+          rest_bytes -= contiguous_bytes;
+          contiguous_bytes = BLOCK_SIZE;
+          addr = curr_block->data_ro();
         }
-        dram::memcpy(buf + buf_offset, addr, contiguous_bytes);
-        buf_offset += contiguous_bytes;
-        contiguous_bytes = BLOCK_SIZE;
-        addr = curr_block->data_ro();
-      }
-      dram::memcpy(buf + buf_offset, addr,
-                   std::min(contiguous_bytes, count - buf_offset));
+        dram::memcpy(dst, addr, std::min(contiguous_bytes, rest_bytes));
+      };
+
+      // a large read is split at block boundaries
+      uint32_t num_tasks = CopyPool::get_num_tasks(count);
+      auto task_begin = [&](uint32_t task_idx) {
+        if (task_idx == 0) return offset;
+        if (task_idx == num_tasks) return offset + count;
+        return ALIGN_DOWN(offset + count * task_idx / num_tasks, BLOCK_SIZE);
+      };
+      CopyPool::get().run(num_tasks, [&](uint32_t task_idx) {
+        copy(task_begin(task_idx), task_begin(task_idx + 1));
+      });
+    }
+
+    if (is_leased) {
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (lease.is_exclusive() && lease.get_commit_seq() == commit_seq)
+        goto done;
     }
 
   redo:
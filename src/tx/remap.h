@@ -0,0 +1,77 @@
+#pragma once
+
+#include "admission.h"
+#include "write.h"
+
+namespace madfs::dram {
+/**
+ * RemapTx moves the blocks of a virtual range to contiguous blocks allocated by
+ * the caller without changing the data (see utility::Defragmenter). It commits
+ * through OCC like a write, but gives up if a tx committed in between touches
+ * the range, since the copy would then be stale.
+ */
+class RemapTx : public WriteTx {
+ public:
+  RemapTx(File* file, size_t count, size_t offset,
+          LogicalBlockIdx dst_begin_lidx)
+      : WriteTx(file, /*buf=*/nullptr, count, offset, dst_begin_lidx) {}
+
+  /**
+   * @return true if the range is remapped; false if it has holes or is changed
+   * by others, in which case the destination blocks are left to the caller
+   */
+  bool exec() {
+    blk_table->update(&state, allocator);
+    if (allocator->tx_block.get_pinned_idx() != state.get_tx_block_idx())
+      allocator->log_entry.reset();
+
+    for (uint32_t i = 0; i < num_blocks; ++i) {
+      recycle_image[i] = blk_table->vidx_to_lidx(begin_vidx + i);
+      if (recycle_image[i] == 0) return false;
+    }
+
+    // copy from the snapshot above; the conflict check below makes sure that
+    // the source blocks are still the latest version when committing
+    WriteAdmission::Guard admission(BLOCK_NUM_TO_SIZE(num_blocks));
+    for (uint32_t i = 0; i < num_blocks; ++i) {
+      pmem::Block* dst_block =
+          dst_blocks[i >> BITMAP_ENTRY_BLOCKS_CAPACITY_SHIFT] +
+          (i & (BITMAP_ENTRY_BLOCKS_CAPACITY - 1));
+      const pmem::Block* src_block =
+          mem_table->lidx_to_addr_ro(recycle_image[i]);
+      pmem::memcpy_persist(dst_block->data_rw(), src_block->data_ro(),
+                           BLOCK_SIZE);
+    }
+    fence();
+
+    prepare_commit_entry();
+    while (true) {
+      pmem::TxEntry conflict_entry = try_commit();
+      if (!conflict_entry.is_valid()) break;
+
+      bool into_new_block = false;
+      if (handle_conflict(conflict_entry, begin_vidx, end_vidx - 1,
+                          recycle_image,
+                          commit_entry.is_indirect() ? &into_new_block
+                                                     : nullptr)) {
+        if (commit_entry.is_indirect()) allocator->log_entry.free(log_cursor);
+        allocator->log_entry.reset();
+        return false;
+      }
+      if (into_new_block) {
+        assert(commit_entry.is_indirect());
+        allocator->log_entry.free(log_cursor);
+        allocator->log_entry.reset();
+        prepare_commit_entry();
+      } else {
+        recheck_commit_entry();
+      }
+    }
+
+    // the old blocks of the range are no longer used
+    allocator->block.free(recycle_image);
+    allocator->tx_block.pin(state.get_tx_block_idx());
+    return true;
+  }
+};
+}  // namespace madfs::dram
@@ -111,28 +111,26 @@ class Tx {
         uint64_t possible_file_size = BLOCK_IDX_TO_SIZE(end_vidx);
         if (possible_file_size > state.file_size)
           state.file_size = possible_file_size;
+      } else if (curr_entry.is_inline_tail()) {
+        const pmem::TxEntryInlineTail& e = curr_entry.inline_tail_entry;
+        has_conflict |=
+            get_conflict_image(first_vidx, last_vidx, e.begin_virtual_idx,
+                               e.begin_logical_idx, e.num_blocks,
+                               conflict_image);
+        VirtualBlockIdx end_vidx = e.begin_virtual_idx + e.num_blocks;
+        uint64_t possible_file_size =
+            BLOCK_IDX_TO_SIZE(end_vidx) - e.leftover_bytes;
+        if (possible_file_size > state.file_size)
+          state.file_size = possible_file_size;
       } else {  // non-inline tx entry
         LogCursor log_cursor(curr_entry.indirect_entry, mem_table);
 
         do {
-          uint32_t i;
-          for (i = 0; i < log_cursor->get_lidxs_len() - 1; ++i) {
-            has_conflict |= get_conflict_image(
-                first_vidx, last_vidx,
-                log_cursor->begin_vidx +
-                    (i << BITMAP_ENTRY_BLOCKS_CAPACITY_SHIFT),
-                log_cursor->begin_lidxs[i], BITMAP_ENTRY_BLOCKS_CAPACITY,
-                conflict_image);
-          }
-          has_conflict |= get_conflict_image(
-              first_vidx, last_vidx,
-              log_cursor->begin_vidx +
-                  (i << BITMAP_ENTRY_BLOCKS_CAPACITY_SHIFT),
-              log_cursor->begin_lidxs[i],
-              log_cursor->get_last_lidx_num_blocks(), conflict_image);
-          VirtualBlockIdx end_vidx = log_cursor->begin_vidx +
-                                     (i << BITMAP_ENTRY_BLOCKS_CAPACITY_SHIFT) +
-                                     log_cursor->get_last_lidx_num_blocks();
+          VirtualBlockIdx end_vidx = log_cursor->for_each_run(
+              [&](VirtualBlockIdx vidx, LogicalBlockIdx lidx, uint32_t n) {
+                has_conflict |= get_conflict_image(first_vidx, last_vidx, vidx,
+                                                   lidx, n, conflict_image);
+              });
           uint64_t possible_file_size =
               BLOCK_IDX_TO_SIZE(end_vidx) - log_cursor->leftover_bytes;
           if (possible_file_size > state.file_size)
@@ -180,10 +178,11 @@ class Tx {
     VirtualBlockIdx overlap_first_vidx = std::max(le_first_vidx, first_vidx);
     VirtualBlockIdx overlap_last_vidx = std::min(le_last_vidx, last_vidx);
 
+    // a logical index of 0 maps the range to holes (see ExtendTx)
     for (VirtualBlockIdx vidx = overlap_first_vidx; vidx <= overlap_last_vidx;
          ++vidx) {
-      auto offset = vidx - first_vidx;
-      conflict_image[offset] = le_begin_lidx + offset;
+      conflict_image[vidx - first_vidx] =
+          le_begin_lidx == 0 ? 0 : le_begin_lidx + (vidx - le_first_vidx);
     }
     return true;
   }
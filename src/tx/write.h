@@ -29,7 +29,12 @@ class WriteTx : public Tx {
   LogCursor log_cursor;
   uint16_t leftover_bytes;
 
-  WriteTx(File* file, const char* buf, size_t count, size_t offset)
+  /**
+   * @param dst_begin_lidx if not 0, the data is written to the contiguous
+   * blocks from there on, which the caller has allocated
+   */
+  WriteTx(File* file, const char* buf, size_t count, size_t offset,
+          LogicalBlockIdx dst_begin_lidx = 0)
       : Tx(file, count, offset),
         buf(buf),
         recycle_image(local_buf_image_lidxs),
@@ -45,14 +50,33 @@ class WriteTx : public Tx {
     // for overwrite, "leftover_bytes" is zero; only in append we care
     // append log without fence because we only care flush completion
     // before try_commit
-    uint32_t rest_num_blocks = num_blocks;
+    // each chunk is placed right after the previous one, so that a large write
+    // stays contiguous and can be described by a single run
+    bool is_stream = begin_vidx > 0 && begin_vidx == allocator->stream_end_vidx;
+    LogicalBlockIdx hint =
+        is_stream ? allocator->stream_end_lidx : get_placement_hint();
+    auto rest_num_blocks = static_cast<uint32_t>(num_blocks);
+    // blocks reserved by fallocate are already contiguous and held in bitmap
+    if (dst_begin_lidx == 0)
+      dst_begin_lidx = file->take_reserved(begin_vidx, rest_num_blocks);
+    if (LogicalBlockIdx lidx = dst_begin_lidx; lidx != 0) {
+      for (uint32_t i = 0; i < rest_num_blocks;
+           i += BITMAP_ENTRY_BLOCKS_CAPACITY)
+        dst_lidxs.push_back(lidx + i);
+      hint = lidx + rest_num_blocks;
+      rest_num_blocks = 0;
+    }
     while (rest_num_blocks > 0) {
       uint32_t chunk_num_blocks =
           std::min(rest_num_blocks, BITMAP_ENTRY_BLOCKS_CAPACITY);
-      auto lidx = allocator->block.alloc(chunk_num_blocks);
+      auto lidx = allocator->block.alloc(chunk_num_blocks, hint, is_stream);
       dst_lidxs.push_back(lidx);
+      hint = lidx + chunk_num_blocks;
+      is_stream = true;
       rest_num_blocks -= chunk_num_blocks;
     }
+    allocator->stream_end_vidx = end_vidx;
+    allocator->stream_end_lidx = hint;
     assert(!dst_lidxs.empty());
 
     for (auto lidx : dst_lidxs)
@@ -68,6 +92,27 @@ class WriteTx : public Tx {
     this->ticket = ticket;
   }
 
+  /**
+   * The block table may be stale here (e.g., the last write of this thread may
+   * not be applied yet), which is fine for a hint.
+   *
+   * @return the logical block index that keeps the blocks to write physically
+   * contiguous with the previous (or the next) virtual block; 0 if there is no
+   * such neighbor, or if the blocks there are the ones being overwritten
+   */
+  [[nodiscard]] LogicalBlockIdx get_placement_hint() const {
+    LogicalBlockIdx curr_lidx = blk_table->vidx_to_lidx(begin_vidx);
+    if (begin_vidx > 0) {
+      LogicalBlockIdx prev_lidx = blk_table->vidx_to_lidx(begin_vidx - 1);
+      if (prev_lidx != 0 && prev_lidx + 1 != curr_lidx) return prev_lidx + 1;
+    }
+    LogicalBlockIdx next_lidx = blk_table->vidx_to_lidx(end_vidx);
+    if (next_lidx > num_blocks &&
+        next_lidx - static_cast<uint32_t>(num_blocks) != curr_lidx)
+      return next_lidx - static_cast<uint32_t>(num_blocks);
+    return 0;
+  }
+
   // NOTE: this function can only be called after file_size is known
   void update_leftover_bytes() {
     // this is how many bytes left at last block that is not written by us
@@ -78,23 +123,56 @@ class WriteTx : public Tx {
       leftover_bytes = 0;
   }
 
+  /**
+   * Describe the mapping with a single tx entry if possible
+   *
+   * @return true if commit_entry is set to an inline entry
+   */
+  bool try_prepare_inline_entry() {
+    if (leftover_bytes == 0) {
+      if (!pmem::TxEntryInline::can_inline(num_blocks, begin_vidx,
+                                           dst_lidxs[0]))
+        return false;
+      commit_entry = pmem::TxEntryInline(num_blocks, begin_vidx, dst_lidxs[0]);
+      return true;
+    }
+    if (!file->meta->has_compact_entries() ||
+        !pmem::TxEntryInlineTail::can_inline(num_blocks, begin_vidx,
+                                             dst_lidxs[0]))
+      return false;
+    commit_entry = pmem::TxEntryInlineTail(num_blocks, begin_vidx,
+                                           dst_lidxs[0], leftover_bytes);
+    return true;
+  }
+
   void prepare_commit_entry(bool skip_update_leftover_bytes = false) {
     // skip if file_size is unknown but leftover_bytes is known
     if (!skip_update_leftover_bytes) update_leftover_bytes();
-    if (pmem::TxEntryInline::can_inline(num_blocks, begin_vidx, dst_lidxs[0]) &&
-        leftover_bytes == 0) {
-      commit_entry = pmem::TxEntryInline(num_blocks, begin_vidx, dst_lidxs[0]);
-    } else {
-      // it's fine that we append log first as long we don't publish it by tx
-      log_cursor =
-          allocator->log_entry.append(pmem::LogEntry::Op::LOG_OVERWRITE,  // op
-                                      leftover_bytes,  // leftover_bytes
-                                      num_blocks,      // total_blocks
-                                      begin_vidx,      // begin_virtual_idx
-                                      dst_lidxs        // begin_logical_idxs
-          );
-      commit_entry = pmem::TxEntryIndirect(log_cursor.idx);
-    }
+    if (try_prepare_inline_entry()) return;
+    // it's fine that we append log first as long we don't publish it by tx
+    auto op = file->meta->has_compact_entries()
+                  ? pmem::LogEntry::Op::LOG_OVERWRITE_RUNS
+                  : pmem::LogEntry::Op::LOG_OVERWRITE;
+    log_cursor = allocator->log_entry.append(op,              // op
+                                             leftover_bytes,  // leftover_bytes
+                                             num_blocks,      // total_blocks
+                                             begin_vidx,  // begin_virtual_idx
+                                             dst_lidxs    // begin_logical_idxs
+    );
+    commit_entry = pmem::TxEntryIndirect(log_cursor.idx);
+  }
+
+  /**
+   * Try to commit commit_entry at the cursor of the state; the lease holder
+   * goes through the lease to skip the CAS and the per-cacheline flush.
+   *
+   * @return empty entry on success; conflict entry otherwise
+   */
+  pmem::TxEntry try_commit() {
+    if (file->lease.is_held())
+      return file->lease.commit(state.cursor, commit_entry, mem_table,
+                                allocator);
+    return state.cursor.try_commit(commit_entry, mem_table, allocator);
   }
 
   void recheck_commit_entry() {
@@ -104,13 +182,12 @@ class WriteTx : public Tx {
     uint16_t old_leftover_bytes = leftover_bytes;
     update_leftover_bytes();
     if (old_leftover_bytes == leftover_bytes) return;
-    if (pmem::TxEntryInline::can_inline(num_blocks, begin_vidx, dst_lidxs[0]) &&
-        leftover_bytes == 0) {
-      commit_entry = pmem::TxEntryInline(num_blocks, begin_vidx, dst_lidxs[0]);
+    if (try_prepare_inline_entry()) {
       return;
-      // the previously allocated log entries should be recycled, but for now,
-      // we just leave them there waiting for gc.
+      // the previously allocated log entries (if any) should be recycled, but
+      // for now, we just leave them there waiting for gc.
     }
+    assert(commit_entry.is_indirect());
     log_cursor.update_leftover_bytes(mem_table, leftover_bytes);
   }
 };
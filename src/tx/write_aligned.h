@@ -1,3 +1,5 @@
+#include "admission.h"
+#include "copy_pool.h"
 #include "write.h"
 
 namespace madfs::dram {
@@ -17,17 +19,24 @@ class AlignedTx : public WriteTx {
     {
       TimerGuard<Event::ALIGNED_TX_COPY> timer_guard;
 
-      // since everything is block-aligned, we can copy data directly
-      const char* rest_buf = buf;
-      size_t rest_count = count;
-
-      for (auto block : dst_blocks) {
-        size_t num_bytes = std::min(rest_count, BITMAP_ENTRY_BYTES_CAPACITY);
-        pmem::memcpy_persist(block->data_rw(), rest_buf, num_bytes);
-        rest_buf += num_bytes;
-        rest_count -= num_bytes;
-      }
-      fence();
+      // since everything is block-aligned, we can copy data directly; a large
+      // write is split by the chunks of dst_blocks
+      auto num_chunks = static_cast<uint32_t>(dst_blocks.size());
+      uint32_t num_tasks =
+          std::min(CopyPool::get_num_tasks(count), num_chunks);
+      CopyPool::get().run(num_tasks, [&](uint32_t task_idx) {
+        WriteAdmission::Guard admission(count / num_tasks);
+        uint32_t begin = num_chunks * task_idx / num_tasks;
+        uint32_t end = num_chunks * (task_idx + 1) / num_tasks;
+        for (uint32_t i = begin; i < end; ++i) {
+          size_t chunk_offset = i * BITMAP_ENTRY_BYTES_CAPACITY;
+          size_t num_bytes =
+              std::min(count - chunk_offset, BITMAP_ENTRY_BYTES_CAPACITY);
+          pmem::memcpy_persist(dst_blocks[i]->data_rw(), buf + chunk_offset,
+                               num_bytes);
+        }
+        fence();
+      });
     }
 
     {
@@ -61,8 +70,7 @@ class AlignedTx : public WriteTx {
     if constexpr (BuildOptions::cc_occ) {
       TimerGuard<Event::ALIGNED_TX_COMMIT> timer_guard;
       while (true) {
-        pmem::TxEntry conflict_entry =
-            state.cursor.try_commit(commit_entry, mem_table, allocator);
+        pmem::TxEntry conflict_entry = try_commit();
         if (!conflict_entry.is_valid()) break;
 
         bool into_new_block = false;
@@ -70,9 +78,9 @@ class AlignedTx : public WriteTx {
         // don't care whether there is a conflict, as long as recycle_image gets
         // updated
         handle_conflict(conflict_entry, begin_vidx, end_vidx - 1, recycle_image,
-                        commit_entry.is_inline() ? nullptr : &into_new_block);
+                        commit_entry.is_indirect() ? &into_new_block : nullptr);
         if (into_new_block) {
-          assert(!commit_entry.is_inline());
+          assert(commit_entry.is_indirect());
           allocator->log_entry.free(log_cursor);
           allocator->log_entry.reset();
           // re-prepare (incl. append new log entries)
@@ -83,7 +91,7 @@ class AlignedTx : public WriteTx {
       }
     } else {
       TimerGuard<Event::ALIGNED_TX_COMMIT> timer_guard;
-      state.cursor.try_commit(commit_entry, mem_table, allocator);
+      try_commit();
     }
 
     {
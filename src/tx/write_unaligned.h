@@ -1,3 +1,5 @@
+#include "admission.h"
+#include "copy_pool.h"
 #include "write.h"
 
 namespace madfs::dram {
@@ -48,6 +50,7 @@ class SingleBlockTx : public CoWTx {
   ssize_t exec() {
     timer.count<Event::SINGLE_BLOCK_TX_START>();
     bool need_redo;
+    bool is_redo = false;
 
     LogicalBlockIdx pinned_tx_block_idx = allocator->tx_block.get_pinned_idx();
     if (pinned_tx_block_idx == 0) {  // no tx_block is pinned yet
@@ -69,13 +72,9 @@ class SingleBlockTx : public CoWTx {
     recycle_image[0] = blk_table->vidx_to_lidx(begin_vidx);
     assert(recycle_image[0] != dst_lidxs[0]);
 
-    // copy data from buf
-    pmem::memcpy_persist(dst_blocks[0]->data_rw() + local_offset, buf, count);
-
   redo:
     assert(dst_blocks.size() == 1);
 
-    // copy original data
     {
       TimerGuard<Event::SINGLE_BLOCK_TX_COPY> timer_guard;
 
@@ -83,16 +82,23 @@ class SingleBlockTx : public CoWTx {
       const char* src_block =
           mem_table->lidx_to_addr_ro(recycle_image[0])->data_ro();
 
-      // copy the left part of the block
-      if (local_offset != 0) {
-        pmem::memcpy_persist(dst_block, src_block, local_offset);
-      }
+      if (!is_redo) {
+        // build the block from buf and the original data in one pass
+        pmem::assemble_block_persist(dst_block, src_block, buf, local_offset,
+                                     count);
+      } else {
+        // only the original data around buf is stale
+        // copy the left part of the block
+        if (local_offset != 0) {
+          pmem::memcpy_persist(dst_block, src_block, local_offset);
+        }
 
-      // copy the right part of the block
-      if (size_t len = BLOCK_SIZE - (local_offset + count); len != 0) {
-        char* dst = dst_block + local_offset + count;
-        const char* src = src_block + local_offset + count;
-        pmem::memcpy_persist(dst, src, len);
+        // copy the right part of the block
+        if (size_t len = BLOCK_SIZE - (local_offset + count); len != 0) {
+          char* dst = dst_block + local_offset + count;
+          const char* src = src_block + local_offset + count;
+          pmem::memcpy_persist(dst, src, len);
+        }
       }
     }
 
@@ -102,17 +108,16 @@ class SingleBlockTx : public CoWTx {
     if constexpr (BuildOptions::cc_occ) {
       timer.count<Event::SINGLE_BLOCK_TX_COMMIT>();
       // try to commit the tx entry
-      pmem::TxEntry conflict_entry =
-          state.cursor.try_commit(commit_entry, mem_table, allocator);
+      pmem::TxEntry conflict_entry = try_commit();
       if (!conflict_entry.is_valid()) goto done;  // success, no conflict
 
       bool into_new_block = false;
       // we just treat begin_vidx as both first and last vidx
-      need_redo =
-          handle_conflict(conflict_entry, begin_vidx, begin_vidx, recycle_image,
-                          commit_entry.is_inline() ? nullptr : &into_new_block);
+      need_redo = handle_conflict(
+          conflict_entry, begin_vidx, begin_vidx, recycle_image,
+          commit_entry.is_indirect() ? &into_new_block : nullptr);
       if (into_new_block) {
-        assert(!commit_entry.is_inline());
+        assert(commit_entry.is_indirect());
         allocator->log_entry.free(log_cursor);
         allocator->log_entry.reset();
         // re-prepare (incl. append new log entries)
@@ -120,12 +125,11 @@ class SingleBlockTx : public CoWTx {
       } else {
         recheck_commit_entry();
       }
-      if (!need_redo)
-        goto retry;
-      else
-        goto redo;
+      if (!need_redo) goto retry;
+      is_redo = true;
+      goto redo;
     } else {
-      state.cursor.try_commit(commit_entry, mem_table, allocator);
+      try_commit();
     }
 
   done:
@@ -171,32 +175,35 @@ class MultiBlockTx : public CoWTx {
     bool need_redo;
     LogicalBlockIdx src_first_lidx, src_last_lidx;
 
-    // copy full blocks first
+    // copy full blocks first; a large write is split by the chunks of
+    // dst_blocks
     if (num_full_blocks > 0) {
-      const char* rest_buf = buf;
-      size_t rest_full_count = BLOCK_NUM_TO_SIZE(num_full_blocks);
-      for (size_t i = 0; i < dst_blocks.size(); ++i) {
-        // get logical block pointer for this iter
-        // first block in first chunk could start from partial
-        pmem::Block* full_blocks = dst_blocks[i];
-        if (i == 0) {
-          full_blocks += (begin_full_vidx - begin_vidx);
-          rest_buf += first_block_overlap_size;
-        }
-        // calculate num of full block bytes to be copied in this iter
-        // takes care of last block in last chunk which might be partial
-        size_t num_bytes = rest_full_count;
-        if (dst_blocks.size() > 1) {
-          if (i == 0 && need_copy_first)
-            num_bytes = BITMAP_ENTRY_BYTES_CAPACITY - BLOCK_SIZE;
-          else if (i < dst_blocks.size() - 1)
-            num_bytes = BITMAP_ENTRY_BYTES_CAPACITY;
+      const uint32_t full_begin = begin_full_vidx - begin_vidx;
+      const uint32_t full_end = end_full_vidx - begin_vidx;
+      auto num_chunks = static_cast<uint32_t>(dst_blocks.size());
+      uint32_t num_tasks = std::min(
+          CopyPool::get_num_tasks(BLOCK_NUM_TO_SIZE(num_full_blocks)),
+          num_chunks);
+      CopyPool::get().run(num_tasks, [&](uint32_t task_idx) {
+        WriteAdmission::Guard admission(BLOCK_NUM_TO_SIZE(num_full_blocks) /
+                                        num_tasks);
+        uint32_t chunk_begin = num_chunks * task_idx / num_tasks;
+        uint32_t chunk_end = num_chunks * (task_idx + 1) / num_tasks;
+        for (uint32_t i = chunk_begin; i < chunk_end; ++i) {
+          // the blocks of this chunk relative to begin_vidx
+          uint32_t begin =
+              std::max(i * BITMAP_ENTRY_BLOCKS_CAPACITY, full_begin);
+          uint32_t end =
+              std::min((i + 1) * BITMAP_ENTRY_BLOCKS_CAPACITY, full_end);
+          if (begin >= end) continue;
+          pmem::memcpy_persist(
+              dst_blocks[i][begin - i * BITMAP_ENTRY_BLOCKS_CAPACITY].data_rw(),
+              buf + first_block_overlap_size +
+                  BLOCK_NUM_TO_SIZE(begin - full_begin),
+              BLOCK_NUM_TO_SIZE(end - begin));
         }
-        // actual memcpy
-        pmem::memcpy_persist(full_blocks->data_rw(), rest_buf, num_bytes);
-        rest_buf += num_bytes;
-        rest_full_count -= num_bytes;
-      }
+        fence();
+      });
     }
 
     // only get a snapshot of the tail when starting critical piece
@@ -212,22 +219,27 @@ class MultiBlockTx : public CoWTx {
     src_first_lidx = recycle_image[0];
     src_last_lidx = recycle_image[num_blocks - 1];
 
-    // write data from the buf to the first block
-    {
-      char* dst =
-          dst_blocks[0]->data_rw() + BLOCK_SIZE - first_block_overlap_size;
-      pmem::memcpy_persist(dst, buf, first_block_overlap_size);
-    }
-
-    // write data from the buf to the last block
     pmem::Block* last_dst_block =
         dst_blocks.back() + (end_full_vidx - begin_vidx) -
         BITMAP_ENTRY_BLOCKS_CAPACITY * (dst_blocks.size() - 1);
-    const char* buf_src = buf + (count - last_block_overlap_size);
-    pmem::memcpy_persist(last_dst_block->data_rw(), buf_src,
-                         last_block_overlap_size);
+
+    // build the partial first and last blocks from buf and the source blocks
+    // in one pass each
+    timer.count<Event::MULTI_BLOCK_TX_COPY>();
+    if (need_copy_first)
+      pmem::assemble_block_persist(
+          dst_blocks[0]->data_rw(),
+          mem_table->lidx_to_addr_ro(src_first_lidx)->data_ro(), buf,
+          BLOCK_SIZE - first_block_overlap_size, first_block_overlap_size);
+    if (need_copy_last)
+      pmem::assemble_block_persist(
+          last_dst_block->data_rw(),
+          mem_table->lidx_to_addr_ro(src_last_lidx)->data_ro(),
+          buf + (count - last_block_overlap_size), 0, last_block_overlap_size);
+    goto copied;
 
   redo:
+    // only the data from the source blocks around buf is stale
     timer.count<Event::MULTI_BLOCK_TX_COPY>();
     // copy the data from the first source block if exists
     if (need_copy_first && do_copy_first) {
@@ -245,6 +257,8 @@ class MultiBlockTx : public CoWTx {
       size_t size = BLOCK_SIZE - last_block_overlap_size;
       pmem::memcpy_persist(dst, src, size);
     }
+
+  copied:
     fence();
 
     if (is_offset_depend) offset_mgr->wait(ticket);
@@ -253,8 +267,7 @@ class MultiBlockTx : public CoWTx {
     if constexpr (BuildOptions::cc_occ) {
       timer.count<Event::MULTI_BLOCK_TX_COMMIT>();
       // try to commit the transaction
-      pmem::TxEntry conflict_entry =
-          state.cursor.try_commit(commit_entry, mem_table, allocator);
+      pmem::TxEntry conflict_entry = try_commit();
       if (!conflict_entry.is_valid()) goto done;  // success
       // make a copy of the first and last again
       src_first_lidx = recycle_image[0];
@@ -263,9 +276,9 @@ class MultiBlockTx : public CoWTx {
       bool into_new_block = false;
       need_redo = handle_conflict(
           conflict_entry, begin_vidx, end_full_vidx, recycle_image,
-          commit_entry.is_inline() ? nullptr : &into_new_block);
+          commit_entry.is_indirect() ? &into_new_block : nullptr);
       if (into_new_block) {
-        assert(!commit_entry.is_inline());
+        assert(commit_entry.is_indirect());
         allocator->log_entry.free(log_cursor);
         allocator->log_entry.reset();
         // re-prepare (incl. append new log entries)
@@ -284,7 +297,7 @@ class MultiBlockTx : public CoWTx {
           goto retry;
       }
     } else {
-      state.cursor.try_commit(commit_entry, mem_table, allocator);
+      try_commit();
     }
 
   done:
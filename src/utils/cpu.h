@@ -0,0 +1,119 @@
+#pragma once
+
+#include <cpuid.h>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <ostream>
+
+#include "config.h"
+
+extern "C" {
+// https://github.com/pmem/pmdk/blob/master/src/libpmem2/x86_64/memcpy_memset.h
+void memmove_movnt_avx512f_clflush(char *, const char *, size_t);
+void memmove_movnt_avx512f_clflushopt(char *, const char *, size_t);
+void memmove_movnt_avx512f_clwb(char *, const char *, size_t);
+void memmove_movnt_avx_clflush_wcbarrier(char *, const char *, size_t);
+void memmove_movnt_avx_clflushopt_wcbarrier(char *, const char *, size_t);
+void memmove_movnt_avx_clwb_wcbarrier(char *, const char *, size_t);
+
+void memmove_mov_avx512f_noflush(char *, const char *, size_t);
+void memmove_mov_avx_noflush(char *, const char *, size_t);
+}
+
+namespace madfs {
+
+/**
+ * The CPU features that pick the copy and flush kernels (see utils/persist.h).
+ * They are detected when the library is loaded rather than at build time, so
+ * that a library built on one host runs on another.
+ *
+ * All false (as before the detection runs) selects the kernels that every
+ * x86-64 CPU supports.
+ */
+inline struct CpuFeatures {
+  bool clwb{};
+  bool clflushopt{};
+  bool avx{};
+  // valgrind does not support AVX-512
+  bool avx512f{};
+
+  // dram::memcpy uses the AVX-512 kernel above this size
+  size_t avx512f_memcpy_threshold{2048};
+  // whether the threshold is measured on this host (set MADFS_AUTOTUNE)
+  bool autotuned{};
+
+  CpuFeatures() noexcept {
+    unsigned eax, ebx, ecx, edx;
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+      clwb = ebx & bit_CLWB;
+      clflushopt = ebx & bit_CLFLUSHOPT;
+    }
+    // the builtins also check that the OS saves the vector registers
+    __builtin_cpu_init();
+    avx = __builtin_cpu_supports("avx");
+    avx512f = avx && __builtin_cpu_supports("avx512f") &&
+              !BuildOptions::use_pmemcheck;
+    if (avx512f && std::getenv("MADFS_AUTOTUNE")) calibrate();
+  }
+
+  friend std::ostream &operator<<(std::ostream &out, const CpuFeatures &f) {
+    out << "CpuFeatures: \n";
+    out << "\tclwb: " << f.clwb << "\n";
+    out << "\tclflushopt: " << f.clflushopt << "\n";
+    out << "\tavx: " << f.avx << "\n";
+    out << "\tavx512f: " << f.avx512f << "\n";
+    out << "\tavx512f_memcpy_threshold: " << f.avx512f_memcpy_threshold
+        << (f.autotuned ? " (autotuned)" : "") << "\n";
+    return out;
+  }
+
+ private:
+  /**
+   * Find the smallest copy size for which the AVX-512 kernel beats the AVX one
+   * on this host; it takes a few milliseconds, so it is opt-in
+   */
+  void calibrate() {
+    constexpr size_t MIN_SIZE = 256;
+    constexpr size_t MAX_SIZE = 64 * 1024;
+    // each measurement copies this many bytes, so that small sizes are timed
+    // over enough iterations
+    constexpr size_t BYTES_PER_RUN = 2 * 1024 * 1024;
+
+    auto src = static_cast<char *>(std::aligned_alloc(64, MAX_SIZE));
+    auto dst = static_cast<char *>(std::aligned_alloc(64, MAX_SIZE));
+    if (!src || !dst) {
+      std::free(src);
+      std::free(dst);
+      return;
+    }
+    std::memset(src, 0x5a, MAX_SIZE);
+    std::memset(dst, 0, MAX_SIZE);
+
+    auto time = [&](auto kernel, size_t size) {
+      auto begin = std::chrono::steady_clock::now();
+      for (size_t n = 0; n < BYTES_PER_RUN; n += size) kernel(dst, src, size);
+      return std::chrono::steady_clock::now() - begin;
+    };
+
+    size_t threshold = MAX_SIZE;
+    for (size_t size = MIN_SIZE; size <= MAX_SIZE; size *= 2) {
+      // warm up the caches and the AVX-512 frequency license
+      time(memmove_mov_avx512f_noflush, size);
+      // by a margin, so that noise does not decide it
+      if (time(memmove_mov_avx512f_noflush, size) * 20 <
+          time(memmove_mov_avx_noflush, size) * 19) {
+        threshold = size / 2;
+        break;
+      }
+    }
+    std::free(src);
+    std::free(dst);
+    avx512f_memcpy_threshold = threshold;
+    autotuned = true;
+  }
+} cpu_features;
+
+}  // namespace madfs
@@ -61,7 +61,8 @@ struct FatalException : public std::exception {};
 #define LOG_WARN(msg, ...) MADFS_LOG(3, msg, ##__VA_ARGS__)
 
 namespace madfs {
-inline __attribute__((tls_model("initial-exec"))) thread_local const pid_t tid =
+// only updated in a forked child (see madfs_atfork_child)
+inline __attribute__((tls_model("initial-exec"))) thread_local pid_t tid =
     static_cast<pid_t>(syscall(SYS_gettid));
 inline FILE *log_file = stderr;
 }  // namespace madfs
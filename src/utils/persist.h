@@ -2,28 +2,23 @@
 
 #include <immintrin.h>
 
+#include <algorithm>
+#include <cassert>
 #include <cstring>
 
 #include "config.h"
 #include "const.h"
 #include "utils.h"
-
-extern "C" {
-// https://github.com/pmem/pmdk/blob/master/src/libpmem2/x86_64/memcpy_memset.h
-void memmove_movnt_avx512f_clflush(char *, const char *, size_t);
-void memmove_movnt_avx512f_clflushopt(char *, const char *, size_t);
-void memmove_movnt_avx512f_clwb(char *, const char *, size_t);
-void memmove_movnt_avx_clflush_wcbarrier(char *, const char *, size_t);
-void memmove_movnt_avx_clflushopt_wcbarrier(char *, const char *, size_t);
-void memmove_movnt_avx_clwb_wcbarrier(char *, const char *, size_t);
-
-void memmove_mov_avx512f_noflush(char *, const char *, size_t);
-void memmove_mov_avx_noflush(char *, const char *, size_t);
-}
+#include "utils/cpu.h"
 
 namespace madfs {
 
+/**
+ * order the stores (including the flushes) before it against the ones after it
+ * in the persistence domain; a no-op if nothing is persistent
+ */
 static inline void fence() {
+  if (runtime_options.persist_domain == PersistDomain::NONE) return;
   if constexpr (BuildOptions::enable_timer) {
     _mm_mfence();
   } else {
@@ -31,7 +26,26 @@ static inline void fence() {
   }
 }
 
+namespace dram {
+static inline void memcpy(char *dst, const char *src, size_t size) {
+  if (cpu_features.avx512f && size > cpu_features.avx512f_memcpy_threshold)
+    memmove_mov_avx512f_noflush(dst, src, size);
+  else if (cpu_features.avx)
+    memmove_mov_avx_noflush(dst, src, size);
+  else
+    std::memcpy(dst, src, size);
+}
+}  // namespace dram
+
 namespace pmem {
+/**
+ * @return whether the cache lines have to be flushed to be persistent (see
+ * PersistDomain)
+ */
+static inline bool need_flush() {
+  return runtime_options.persist_domain == PersistDomain::FLUSH;
+}
+
 /**
  * persist the cache line that contains p from any level of the cache
  * hierarchy using the appropriate instruction
@@ -39,12 +53,15 @@ namespace pmem {
  * Note that the this instruction might be reordered
  */
 static inline void persist_cl_unfenced(void *p) {
-  if constexpr (BuildOptions::support_clwb)
-    return _mm_clwb(p);
-  else if constexpr (BuildOptions::support_clflushopt)
-    return _mm_clflushopt(p);
+  if (!need_flush()) return;
+  // the instructions are emitted directly, since the compiler may not target
+  // them (see CpuFeatures)
+  if (cpu_features.clwb)
+    asm volatile("clwb %0" : "+m"(*static_cast<volatile char *>(p)));
+  else if (cpu_features.clflushopt)
+    asm volatile("clflushopt %0" : "+m"(*static_cast<volatile char *>(p)));
   else
-    return _mm_clflush(p);
+    _mm_clflush(p);
 }
 
 /**
@@ -59,6 +76,7 @@ static inline void persist_cl_fenced(void *p) {
  * persist the range [buf, buf + len) with possibly reordering
  */
 static inline void persist_unfenced(void *buf, uint64_t len) {
+  if (!need_flush()) return;
   // adjust for cacheline alignment
   len += (uint64_t)buf & (CACHELINE_SIZE - 1);
   for (uint64_t i = 0; i < len; i += CACHELINE_SIZE)
@@ -74,37 +92,80 @@ static inline void persist_fenced(void *buf, uint64_t len) {
 }
 
 static inline void memcpy_persist(char *dst, const char *src, size_t size) {
-  if constexpr (BuildOptions::support_avx512f) {
-    if constexpr (BuildOptions::support_clwb)
+  // the data is as persistent as it gets once in the caches
+  if (!need_flush()) {
+    dram::memcpy(dst, src, size);
+    return;
+  }
+  if (cpu_features.avx512f) {
+    if (cpu_features.clwb)
       memmove_movnt_avx512f_clwb(dst, src, size);
-    else if constexpr (BuildOptions::support_clflushopt)
+    else if (cpu_features.clflushopt)
       memmove_movnt_avx512f_clflushopt(dst, src, size);
     else
       memmove_movnt_avx512f_clflush(dst, src, size);
-  } else {
-    if constexpr (BuildOptions::support_clwb)
+  } else if (cpu_features.avx) {
+    if (cpu_features.clwb)
       memmove_movnt_avx_clwb_wcbarrier(dst, src, size);
-    else if constexpr (BuildOptions::support_clflushopt)
+    else if (cpu_features.clflushopt)
       memmove_movnt_avx_clflushopt_wcbarrier(dst, src, size);
     else
       memmove_movnt_avx_clflush_wcbarrier(dst, src, size);
     VALGRIND_PMC_DO_FLUSH(dst, size);
+  } else {
+    std::memcpy(dst, src, size);
+    persist_unfenced(dst, size);
   }
 }
-}  // namespace pmem
 
-namespace dram {
-static inline void memcpy(char *dst, const char *src, size_t size) {
-  if constexpr (BuildOptions::support_avx512f) {
-    if (size <= 2048) {
-      memmove_mov_avx_noflush(dst, src, size);
+/**
+ * Build the block at dst from the bytes [offset, offset + len) of buf and the
+ * rest of src_block (the copy-on-write of a partial block) in a single pass of
+ * aligned, whole-cache-line non-temporal stores, instead of up to three
+ * unaligned copies that each flush their own partial lines. Like
+ * memcpy_persist, the stores are not fenced.
+ *
+ * @param dst the block to build; must be block-aligned
+ * @param src_block the original block; must be block-aligned
+ */
+static inline void assemble_block_persist(char *dst, const char *src_block,
+                                          const char *buf, size_t offset,
+                                          size_t len) {
+  assert(offset + len <= BLOCK_SIZE);
+  if (!need_flush()) {
+    dram::memcpy(dst, src_block, offset);
+    dram::memcpy(dst + offset, buf, len);
+    dram::memcpy(dst + offset + len, src_block + offset + len,
+                 BLOCK_SIZE - offset - len);
+    return;
+  }
+
+  const size_t end = offset + len;
+  for (size_t line = 0; line < BLOCK_SIZE; line += CACHELINE_SIZE) {
+    const size_t line_end = line + CACHELINE_SIZE;
+    const char *src;
+    alignas(CACHELINE_SIZE) char merged[CACHELINE_SIZE];
+    if (line >= offset && line_end <= end) {
+      src = buf + (line - offset);
+    } else if (line_end <= offset || line >= end) {
+      src = src_block + line;
     } else {
-      memmove_mov_avx512f_noflush(dst, src, size);
+      // the line is split between buf and the original block
+      std::memcpy(merged, src_block + line, CACHELINE_SIZE);
+      size_t begin = std::max(line, offset);
+      std::memcpy(merged + (begin - line), buf + (begin - offset),
+                  std::min(line_end, end) - begin);
+      src = merged;
     }
-  } else {
-    memmove_mov_avx_noflush(dst, src, size);
+    auto d = reinterpret_cast<__m128i *>(dst + line);
+    auto s = reinterpret_cast<const __m128i *>(src);
+    _mm_stream_si128(d, _mm_loadu_si128(s));
+    _mm_stream_si128(d + 1, _mm_loadu_si128(s + 1));
+    _mm_stream_si128(d + 2, _mm_loadu_si128(s + 2));
+    _mm_stream_si128(d + 3, _mm_loadu_si128(s + 3));
   }
+  VALGRIND_PMC_DO_FLUSH(dst, BLOCK_SIZE);
 }
-}  // namespace dram
+}  // namespace pmem
 
 }  // namespace madfs
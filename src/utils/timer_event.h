@@ -11,6 +11,7 @@ enum class Event : std::size_t {
   OPEN,
   OPEN_SYS,
   MMAP,
+  POPULATE,
   CLOSE,
   FSYNC,
 
@@ -46,6 +47,10 @@ enum class Event : std::size_t {
   TX_ENTRY_LOAD,
   TX_ENTRY_STORE,
 
+  ADMISSION_WAIT,
+
+  AIO_SUBMIT,
+
   GC_CREATE,
 };
 
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <vector>
+
+#include "config.h"
+#include "const.h"
+#include "utils/logging.h"
+#include "utils/utils.h"
+
+namespace madfs::dram {
+
+class File;
+
+/**
+ * A DRAM buffer that combines the small writes of a file opened under
+ * runtime_options.buffered_paths (e.g., a log written by many short appends),
+ * which would otherwise pay a CoW block and a commit each.
+ *
+ * The buffer holds a single contiguous range of the file. Writes of less than
+ * a block that extend it are only copied into it; once it is full, its full
+ * blocks are committed as a single tx. It is also committed on fsync and
+ * close, after MAX_AGE, and before any operation that must see the data
+ * through the tx history (e.g., reads and fstat). Until then, the data is
+ * visible to no other process and lost on a crash.
+ *
+ * There is one buffer per inode in the process, shared by all its fds, so that
+ * a read or a write through any of them is ordered after the buffered data.
+ * The buffers are registered here, so that the fds opened later find them and
+ * a background thread commits the ones that have been idle for too long.
+ */
+class WriteBuffer : noncopyable {
+ public:
+  constexpr static size_t CAPACITY = 16 * BLOCK_SIZE;
+  constexpr static auto MAX_AGE = std::chrono::milliseconds(100);
+
+  const dev_t dev;
+  const ino_t ino;
+  // the fds attached to the buffer; guarded by registry_mutex
+  size_t num_files{0};
+
+  // guards the fields below; held while the buffer is committed
+  std::mutex mutex;
+  // the writable fds attached to the buffer; any of them can commit it
+  std::vector<File*> writers;
+  char* const data;
+  // the file offset of data[0]
+  uint64_t begin{};
+  size_t size{};
+  // when the oldest data in the buffer was written
+  std::chrono::steady_clock::time_point since;
+
+  WriteBuffer(dev_t dev, ino_t ino)
+      : dev(dev),
+        ino(ino),
+        data(static_cast<char*>(std::aligned_alloc(BLOCK_SIZE, CAPACITY))) {
+    PANIC_IF(!data, "WriteBuffer: allocation failed");
+  }
+  ~WriteBuffer() { std::free(data); }
+
+  [[nodiscard]] uint64_t end() const { return begin + size; }
+
+  /**
+   * @return whether a file opened with pathname is buffered
+   */
+  static bool is_buffered_path(const char* pathname) {
+    if (!runtime_options.buffered_paths || !pathname) return false;
+    std::string_view path(pathname);
+    std::string_view list(runtime_options.buffered_paths);
+    while (!list.empty()) {
+      size_t pos = std::min(list.find(':'), list.size());
+      std::string_view prefix = list.substr(0, pos);
+      list.remove_prefix(std::min(pos + 1, list.size()));
+      if (!prefix.empty() && path.starts_with(prefix)) return true;
+    }
+    return false;
+  }
+
+  /*
+   * the registry of all buffers; generation is bumped whenever a buffer is
+   * added, so that the fds opened before it look it up again
+   */
+  static inline std::mutex registry_mutex;
+  static inline std::vector<std::shared_ptr<WriteBuffer>> registry;
+  static inline std::atomic<uint64_t> generation{0};
+  static inline std::atomic<bool> flusher_started{false};
+
+  /*
+   * fork handling: the buffers are committed and locked, so that the child
+   * does not commit the data again, and the background thread does not hold
+   * any mutex in the child, where it is gone and started again on the next
+   * buffered write
+   */
+  static void on_fork_prepare();
+  static void on_fork_parent();
+  static void on_fork_child();
+};
+
+}  // namespace madfs::dram
@@ -2,29 +2,36 @@
 
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <cerrno>
 #include <climits>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <iostream>
+#include <vector>
 
 #include "const.h"
 #include "debug.h"
 #include "utils/logging.h"
 
-#define CHECK_RESULT(expected, actual, length, fd)                \
-  do {                                                            \
-    if (memcmp(expected, actual, length) != 0) {                  \
-      madfs::debug::print_file(fd);                               \
-      std::cerr << "expected: \"";                                \
-      for (int i = 0; i < length; ++i) putc(expected[i], stderr); \
-      std::cerr << "\"\n";                                        \
-      std::cerr << "actual  : \"";                                \
-      for (int i = 0; i < length; ++i) putc(actual[i], stderr);   \
-      std::cerr << "\"\n";                                        \
-      assert(false);                                              \
-    }                                                             \
+#define CHECK_RESULT(expected, actual, length, fd)             \
+  do {                                                         \
+    if (memcmp(expected, actual, length) != 0) {               \
+      madfs::debug::print_file(fd);                            \
+      std::cerr << "expected: \"";                             \
+      for (size_t i = 0; i < static_cast<size_t>(length); ++i) \
+        putc(expected[i], stderr);                             \
+      std::cerr << "\"\n";                                     \
+      std::cerr << "actual  : \"";                             \
+      for (size_t i = 0; i < static_cast<size_t>(length); ++i) \
+        putc(actual[i], stderr);                               \
+      std::cerr << "\"\n";                                     \
+      assert(false);                                           \
+    }                                                          \
   } while (0)
 
 #define ASSERT(x) PANIC_IF(!(x), "assertion failed: " #x)
@@ -58,3 +65,27 @@ static std::string random_string(int length) {
     str.push_back(chars[rand() % chars.length()]);
   return str;
 }
+
+/**
+ * Run some tests in a new process of this program with an environment variable
+ * set, since the runtime options are read when MadFS is loaded; all the tests
+ * are run if test_names is empty
+ */
+static void run_with_env(const char* name, const char* value,
+                         const std::vector<const char*>& test_names) {
+  fprintf(stderr, "rerun with %s=%s\n", name, value);
+  std::vector<const char*> argv = {program_invocation_name};
+  argv.insert(argv.end(), test_names.begin(), test_names.end());
+  argv.push_back(nullptr);
+
+  pid_t pid = fork();
+  ASSERT(pid >= 0);
+  if (pid == 0) {
+    setenv(name, value, 1);
+    execv("/proc/self/exe", const_cast<char* const*>(argv.data()));
+    _exit(127);
+  }
+  int status;
+  ASSERT(waitpid(pid, &status, 0) == pid);
+  ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
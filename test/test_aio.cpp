@@ -0,0 +1,216 @@
+#include <aio.h>
+#include <fcntl.h>
+#include <linux/aio_abi.h>
+// defined by <linux/fs.h>, which <linux/aio_abi.h> includes
+#undef BLOCK_SIZE
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "common.h"
+#include "lib/lib.h"
+
+// the libaio functions intercepted by MadFS, so that libaio is not needed
+extern "C" {
+int io_submit(aio_context_t ctx, long nr, struct iocb** iocbs);
+int io_getevents(aio_context_t ctx, long min_nr, long nr,
+                 struct io_event* events, struct timespec* timeout);
+int io_destroy(aio_context_t ctx);
+}
+
+const char* filepath = get_filepath();
+
+size_t sz;
+int rc;
+
+/**
+ * Wait for the events of all the requests submitted to a libaio context
+ */
+static void get_events(aio_context_t ctx, struct io_event* events, int num) {
+  for (int num_events = 0; num_events < num;) {
+    rc = io_getevents(ctx, 1, num - num_events, events + num_events, nullptr);
+    ASSERT(rc > 0);
+    num_events += rc;
+  }
+}
+
+static void check_file(int fd, const std::string& expected) {
+  std::vector<char> buf(expected.size());
+  sz = pread(fd, buf.data(), buf.size(), 0);
+  ASSERT(sz == buf.size());
+  CHECK_RESULT(expected.data(), buf.data(), buf.size(), fd);
+}
+
+void test_posix_aio() {
+  fprintf(stderr, "test_posix_aio\n");
+
+  unlink(filepath);
+  int fd = open(filepath, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+  ASSERT(fd >= 0);
+
+  // contiguous writes in a list are committed together
+  constexpr size_t num_reqs = 8;
+  constexpr size_t req_len = 1000;
+  std::string expected = random_string(num_reqs * req_len);
+  struct aiocb cbs[num_reqs] {};
+  struct aiocb* list[num_reqs];
+  for (size_t i = 0; i < num_reqs; ++i) {
+    cbs[i].aio_fildes = fd;
+    cbs[i].aio_lio_opcode = LIO_WRITE;
+    cbs[i].aio_buf = expected.data() + i * req_len;
+    cbs[i].aio_nbytes = req_len;
+    cbs[i].aio_offset = static_cast<off_t>(i * req_len);
+    list[i] = &cbs[i];
+  }
+  rc = lio_listio(LIO_WAIT, list, num_reqs, nullptr);
+  ASSERT(rc == 0);
+  for (auto& cb : cbs) {
+    ASSERT(aio_error(&cb) == 0);
+    ASSERT(aio_return(&cb) == req_len);
+  }
+
+  std::vector<char> buf(expected.size());
+  struct aiocb cb {};
+  cb.aio_fildes = fd;
+  cb.aio_buf = buf.data();
+  cb.aio_nbytes = buf.size();
+  rc = aio_read(&cb);
+  ASSERT(rc == 0);
+  const struct aiocb* suspend_list[] = {&cb};
+  while (aio_error(&cb) == EINPROGRESS) aio_suspend(suspend_list, 1, nullptr);
+  ASSERT(aio_return(&cb) == static_cast<ssize_t>(buf.size()));
+  CHECK_RESULT(expected.data(), buf.data(), buf.size(), fd);
+
+  rc = close(fd);
+  ASSERT(rc == 0);
+}
+
+void test_libaio() {
+  fprintf(stderr, "test_libaio\n");
+
+  std::string expected = random_string(100);
+  unlink(filepath);
+  int fd = open(filepath, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+  ASSERT(fd >= 0);
+  sz = write(fd, expected.data(), expected.size());
+  ASSERT(sz == expected.size());
+
+  // the events of MadFS files come through the same context
+  aio_context_t ctx = 0;
+  rc = static_cast<int>(syscall(SYS_io_setup, 16, &ctx));
+  ASSERT(rc == 0);
+  struct iocb write_cb {};
+  write_cb.aio_fildes = static_cast<uint32_t>(fd);
+  write_cb.aio_lio_opcode = IOCB_CMD_PWRITE;
+  write_cb.aio_buf = reinterpret_cast<uint64_t>("madfs");
+  write_cb.aio_nbytes = 5;
+  write_cb.aio_offset = 10;
+  write_cb.aio_data = 42;
+  struct iocb fsync_cb {};
+  fsync_cb.aio_fildes = static_cast<uint32_t>(fd);
+  fsync_cb.aio_lio_opcode = IOCB_CMD_FSYNC;
+  struct iocb* iocbs[] = {&write_cb, &fsync_cb};
+  rc = io_submit(ctx, 2, iocbs);
+  ASSERT(rc == 2);
+  struct io_event events[2];
+  get_events(ctx, events, 2);
+  for (auto& event : events) {
+    if (event.obj == reinterpret_cast<uint64_t>(&write_cb)) {
+      ASSERT(event.data == 42);
+      ASSERT(event.res == 5);
+    } else {
+      ASSERT(event.res == 0);
+    }
+  }
+  ASSERT(madfs::get_file(fd)->num_aio_in_flight == 0);
+  rc = io_destroy(ctx);
+  ASSERT(rc == 0);
+
+  expected.replace(10, 5, "madfs");
+  check_file(fd, expected);
+  rc = close(fd);
+  ASSERT(rc == 0);
+}
+
+void test_sync_order() {
+  fprintf(stderr, "test_sync_order\n");
+
+  unlink(filepath);
+  int fd = open(filepath, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+  ASSERT(fd >= 0);
+
+  // a sync completes after the requests submitted before it on the file, even
+  // if a large write keeps another worker busy
+  std::string large = random_string(8 << 20);
+  aio_context_t ctx = 0;
+  rc = static_cast<int>(syscall(SYS_io_setup, 16, &ctx));
+  ASSERT(rc == 0);
+  struct iocb large_cb {};
+  large_cb.aio_fildes = static_cast<uint32_t>(fd);
+  large_cb.aio_lio_opcode = IOCB_CMD_PWRITE;
+  large_cb.aio_buf = reinterpret_cast<uint64_t>(large.data());
+  large_cb.aio_nbytes = large.size();
+  large_cb.aio_offset = madfs::BLOCK_SIZE;
+  struct iocb fsync_cb {};
+  fsync_cb.aio_fildes = static_cast<uint32_t>(fd);
+  fsync_cb.aio_lio_opcode = IOCB_CMD_FSYNC;
+  struct iocb write_cb {};
+  write_cb.aio_fildes = static_cast<uint32_t>(fd);
+  write_cb.aio_lio_opcode = IOCB_CMD_PWRITE;
+  write_cb.aio_buf = reinterpret_cast<uint64_t>("madfs");
+  write_cb.aio_nbytes = 5;
+  write_cb.aio_offset = 10;
+  struct iocb fdsync_cb {};
+  fdsync_cb.aio_fildes = static_cast<uint32_t>(fd);
+  fdsync_cb.aio_lio_opcode = IOCB_CMD_FDSYNC;
+  struct iocb* iocbs[] = {&large_cb, &fsync_cb, &write_cb, &fdsync_cb};
+  constexpr int num_reqs = 4;
+  rc = io_submit(ctx, num_reqs, iocbs);
+  ASSERT(rc == num_reqs);
+  struct io_event events[num_reqs];
+  get_events(ctx, events, num_reqs);
+
+  auto position = [&](const struct iocb& iocb) {
+    for (int i = 0; i < num_reqs; ++i)
+      if (events[i].obj == reinterpret_cast<uint64_t>(&iocb)) return i;
+    return -1;
+  };
+  ASSERT(events[position(large_cb)].res == static_cast<int64_t>(large.size()));
+  ASSERT(position(large_cb) < position(fsync_cb));
+  ASSERT(position(fsync_cb) < position(fdsync_cb));
+  ASSERT(position(write_cb) < position(fdsync_cb));
+  ASSERT(madfs::get_file(fd)->num_aio_in_flight == 0);
+  ASSERT(madfs::get_file(fd)->num_aio_held == 0);
+  rc = io_destroy(ctx);
+  ASSERT(rc == 0);
+
+  // the hole before the small write reads as zeros
+  std::string expected(madfs::BLOCK_SIZE, '\0');
+  expected.replace(10, 5, "madfs");
+  expected += large;
+  check_file(fd, expected);
+  rc = close(fd);
+  ASSERT(rc == 0);
+}
+
+// the tests in the order they run; a subset may be run by name
+const std::vector<std::pair<std::string_view, void (*)()>> tests = {
+    {"test_posix_aio", test_posix_aio},
+    {"test_libaio", test_libaio},
+    {"test_sync_order", test_sync_order},
+};
+
+int main(int argc, char** argv) {
+  unsetenv("LD_PRELOAD");
+
+  for (const auto& [name, test] : tests) {
+    if (argc == 1 || std::find(argv + 1, argv + argc, name) != argv + argc)
+      test();
+  }
+  return 0;
+}
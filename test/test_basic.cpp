@@ -1,11 +1,28 @@
 #include <fcntl.h>
+#include <malloc.h>
+#include <sys/file.h>
+#include <sys/wait.h>
+#include <sys/xattr.h>
 #include <unistd.h>
 
+#include <atomic>
+#include <chrono>
 #include <cstdio>
 #include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <set>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
 
+#include "admission.h"
 #include "common.h"
+#include "defrag.h"
+#include "lib/lib.h"
+#include "seal.h"
 
 using madfs::debug::print_file;
 
@@ -147,6 +164,13 @@ void test_stat() {
   rc = fstat(fd, &stat_buf);
   ASSERT(rc == 0);
   ASSERT(stat_buf.st_size == static_cast<off_t>(test_str.length()));
+  time_t mtime = stat_buf.st_mtim.tv_sec;
+
+  // stat on an opened file is served from the shared memory
+  rc = stat(filepath, &stat_buf);
+  ASSERT(rc == 0);
+  ASSERT(stat_buf.st_size == static_cast<off_t>(test_str.length()));
+  ASSERT(stat_buf.st_mtim.tv_sec >= mtime);
 
   rc = close(fd);
   ASSERT(rc == 0);
@@ -154,6 +178,26 @@ void test_stat() {
   rc = stat(filepath, &stat_buf);
   ASSERT(rc == 0);
   ASSERT(stat_buf.st_size == static_cast<off_t>(test_str.length()));
+
+  // without the shared memory, stat falls back to replaying the log
+  rc = system("rm -rf /dev/shm/madfs_*");
+  rc = stat(filepath, &stat_buf);
+  ASSERT(rc == 0);
+  ASSERT(stat_buf.st_size == static_cast<off_t>(test_str.length()));
+
+  // O_TRUNC shrinks the size kept in the shared memory as well
+  fd = open(filepath, O_RDWR | O_TRUNC);
+  ASSERT(fd >= 0);
+  sz = write(fd, test_str.data(), 2);
+  ASSERT(sz == 2);
+  rc = fstat(fd, &stat_buf);
+  ASSERT(rc == 0);
+  ASSERT(stat_buf.st_size == 2);
+  rc = stat(filepath, &stat_buf);
+  ASSERT(rc == 0);
+  ASSERT(stat_buf.st_size == 2);
+  rc = close(fd);
+  ASSERT(rc == 0);
 }
 
 void test_stream() {
@@ -187,6 +231,970 @@ void test_unlink() {
   ASSERT(rc != 0);  // make sure that there is no bitmap left
 }
 
+void test_copy() {
+  fprintf(stderr, "test_copy\n");
+
+  std::string copy_path = std::string(filepath) + ".copy";
+  std::string block_str = random_string(madfs::BLOCK_SIZE);
+  unlink(filepath);
+  int fd = open(filepath, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+  ASSERT(fd >= 0);
+  sz = write(fd, block_str.data(), madfs::BLOCK_SIZE);
+  ASSERT(sz == madfs::BLOCK_SIZE);
+  rc = close(fd);
+  ASSERT(rc == 0);
+
+  // a byte copy with the xattr carries the identity of the original's shared
+  // memory, but must not use it
+  std::string cmd = "cp --preserve=xattr " + std::string(filepath) + " " +
+                    copy_path;
+  rc = system(cmd.c_str());
+  ASSERT(rc == 0);
+  fd = open(filepath, O_RDWR);
+  ASSERT(fd >= 0);
+  int copy_fd = open(copy_path.c_str(), O_RDWR);
+  ASSERT(copy_fd >= 0);
+  ASSERT(strcmp(madfs::get_file(fd)->shm_mgr.get_path(),
+                madfs::get_file(copy_fd)->shm_mgr.get_path()) != 0);
+
+  // both files allocate blocks independently
+  std::string copy_str = random_string(madfs::BLOCK_SIZE);
+  sz = pwrite(copy_fd, copy_str.data(), madfs::BLOCK_SIZE, madfs::BLOCK_SIZE);
+  ASSERT(sz == madfs::BLOCK_SIZE);
+  sz = pwrite(fd, test_str.data(), STR_LEN, madfs::BLOCK_SIZE);
+  ASSERT(sz == STR_LEN);
+  std::vector<char> buf(madfs::BLOCK_SIZE);
+  sz = pread(copy_fd, buf.data(), madfs::BLOCK_SIZE, madfs::BLOCK_SIZE);
+  ASSERT(sz == madfs::BLOCK_SIZE);
+  CHECK_RESULT(copy_str.data(), buf.data(), madfs::BLOCK_SIZE, copy_fd);
+  sz = pread(copy_fd, buf.data(), madfs::BLOCK_SIZE, 0);
+  ASSERT(sz == madfs::BLOCK_SIZE);
+  CHECK_RESULT(block_str.data(), buf.data(), madfs::BLOCK_SIZE, copy_fd);
+  rc = close(copy_fd);
+  ASSERT(rc == 0);
+  rc = close(fd);
+  ASSERT(rc == 0);
+
+  // the new identity is kept
+  copy_fd = open(copy_path.c_str(), O_RDONLY);
+  ASSERT(copy_fd >= 0);
+  sz = pread(copy_fd, buf.data(), madfs::BLOCK_SIZE, madfs::BLOCK_SIZE);
+  ASSERT(sz == madfs::BLOCK_SIZE);
+  CHECK_RESULT(copy_str.data(), buf.data(), madfs::BLOCK_SIZE, copy_fd);
+  rc = close(copy_fd);
+  ASSERT(rc == 0);
+  rc = unlink(copy_path.c_str());
+  ASSERT(rc == 0);
+}
+
+void test_filter() {
+  fprintf(stderr, "test_filter\n");
+
+  std::filesystem::path dir = std::filesystem::absolute(filepath).parent_path();
+  std::filesystem::path prefix = dir / "madfs_prefix";
+  if (!std::getenv("MADFS_PATH_PREFIXES")) {
+    // without prefixes, the first open of a plain file remembers it as well,
+    // so that later opens skip the xattr lookup
+    std::string plain = dir / "madfs_plain.txt";
+    int fd =
+        madfs::posix::open(plain.c_str(), O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+    ASSERT(fd >= 0);
+    sz = madfs::posix::write(fd, "hello", 5);
+    ASSERT(sz == 5);
+    rc = madfs::posix::close(fd);
+    ASSERT(rc == 0);
+    fd = open(plain.c_str(), O_RDONLY);
+    ASSERT(fd >= 0);
+    ASSERT(madfs::get_file(fd) == nullptr);
+    struct stat st {};
+    rc = fstat(fd, &st);
+    ASSERT(rc == 0);
+    ASSERT(!madfs::dram::OpenFilter::get().may_match_inode(st));
+    rc = close(fd);
+    ASSERT(rc == 0);
+    unlink(plain.c_str());
+
+    std::filesystem::create_directory(prefix);
+    run_with_env("MADFS_PATH_PREFIXES", prefix.c_str(), {"test_filter"});
+    std::filesystem::remove_all(prefix);
+    return;
+  }
+
+  // a file under the prefixes is a MadFS file
+  std::string inside = prefix / "inside.txt";
+  int fd = open(inside.c_str(), O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+  ASSERT(fd >= 0);
+  ASSERT(madfs::get_file(fd) != nullptr);
+  rc = close(fd);
+  ASSERT(rc == 0);
+
+  // a file outside the prefixes goes to the kernel
+  std::string outside = dir / "madfs_outside.txt";
+  unlink(outside.c_str());
+  fd = open(outside.c_str(), O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+  ASSERT(fd >= 0);
+  ASSERT(madfs::get_file(fd) == nullptr);
+  sz = write(fd, "hello", 5);
+  ASSERT(sz == 5);
+  rc = close(fd);
+  ASSERT(rc == 0);
+  struct stat st {};
+  rc = stat(outside.c_str(), &st);
+  ASSERT(rc == 0);
+  ASSERT(st.st_size == 5);
+  ASSERT(getxattr(outside.c_str(), madfs::SHM_XATTR_NAME, nullptr, 0) < 0);
+  unlink(outside.c_str());
+
+  // a plain file under the prefixes is remembered after its first stat, and
+  // later opens skip the xattr lookup
+  std::string plain = prefix / "plain.txt";
+  fd = madfs::posix::open(plain.c_str(), O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+  ASSERT(fd >= 0);
+  sz = madfs::posix::write(fd, "hello", 5);
+  ASSERT(sz == 5);
+  rc = madfs::posix::close(fd);
+  ASSERT(rc == 0);
+  auto& filter = madfs::dram::OpenFilter::get();
+  rc = stat(plain.c_str(), &st);
+  ASSERT(rc == 0);
+  ASSERT(st.st_size == 5);
+  ASSERT(!filter.may_match_inode(st));
+  fd = open(plain.c_str(), O_RDONLY);
+  ASSERT(fd >= 0);
+  ASSERT(madfs::get_file(fd) == nullptr);
+  rc = close(fd);
+  ASSERT(rc == 0);
+}
+
+void test_fork() {
+  fprintf(stderr, "test_fork\n");
+
+  unlink(filepath);
+  int fd = open(filepath, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+  ASSERT(fd >= 0);
+
+  sz = pwrite(fd, test_str.data(), madfs::BLOCK_SIZE, 0);
+  ASSERT(sz == madfs::BLOCK_SIZE);
+
+  // the child uses the inherited file without reopening it
+  pid_t pid = fork();
+  ASSERT(pid >= 0);
+  if (pid == 0) {
+    sz = pread(fd, buff, madfs::BLOCK_SIZE, 0);
+    ASSERT(sz == madfs::BLOCK_SIZE);
+    ASSERT(memcmp(buff, test_str.data(), madfs::BLOCK_SIZE) == 0);
+    sz = pwrite(fd, test_str.data() + madfs::BLOCK_SIZE, madfs::BLOCK_SIZE,
+                madfs::BLOCK_SIZE);
+    ASSERT(sz == madfs::BLOCK_SIZE);
+    _exit(0);
+  }
+
+  int status;
+  rc = waitpid(pid, &status, 0);
+  ASSERT(rc == pid);
+  ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+  // the parent still works and sees the child's write
+  sz = pwrite(fd, test_str.data(), 8, madfs::BLOCK_SIZE * 2);
+  ASSERT(sz == 8);
+  sz = pread(fd, buff, madfs::BLOCK_SIZE * 2, 0);
+  ASSERT(sz == madfs::BLOCK_SIZE * 2);
+  ASSERT(memcmp(buff, test_str.data(), madfs::BLOCK_SIZE * 2) == 0);
+
+  rc = close(fd);
+  ASSERT(rc == 0);
+}
+
+void test_lease() {
+  fprintf(stderr, "test_lease\n");
+
+  unlink(filepath);
+  int fd = open(filepath, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+  ASSERT(fd >= 0);
+
+  rc = flock(fd, LOCK_EX | LOCK_NB);
+  ASSERT(rc == 0);
+  sz = pwrite(fd, test_str.data(), madfs::BLOCK_SIZE, 0);
+  ASSERT(sz == madfs::BLOCK_SIZE);
+  sz = pwrite(fd, test_str.data() + 8, 8, 8);
+  ASSERT(sz == 8);
+
+  // other processes cannot write while the lease is held
+  pid_t pid = fork();
+  ASSERT(pid >= 0);
+  if (pid == 0) {
+    int child_fd = open(filepath, O_RDWR | O_NONBLOCK);
+    ASSERT(child_fd >= 0);
+    ASSERT(flock(child_fd, LOCK_EX | LOCK_NB) == -1 && errno == EWOULDBLOCK);
+    ASSERT(flock(child_fd, LOCK_SH | LOCK_NB) == -1 && errno == EWOULDBLOCK);
+    sz = pwrite(child_fd, test_str.data(), 8, 0);
+    ASSERT(static_cast<ssize_t>(sz) == -1 && errno == EAGAIN);
+    sz = pread(child_fd, buff, madfs::BLOCK_SIZE, 0);
+    ASSERT(sz == madfs::BLOCK_SIZE);
+    ASSERT(memcmp(buff, test_str.data(), 8) == 0);
+    ASSERT(memcmp(buff + 8, test_str.data() + 8, 8) == 0);
+    _exit(0);
+  }
+
+  int status;
+  rc = waitpid(pid, &status, 0);
+  ASSERT(rc == pid);
+  ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+  sz = pread(fd, buff, 16, 0);
+  ASSERT(sz == 16);
+  ASSERT(memcmp(buff, test_str.data(), 16) == 0);
+
+  // after the release, everyone can write again
+  rc = flock(fd, LOCK_UN);
+  ASSERT(rc == 0);
+  pid = fork();
+  ASSERT(pid >= 0);
+  if (pid == 0) {
+    int child_fd = open(filepath, O_RDWR | O_NONBLOCK);
+    ASSERT(child_fd >= 0);
+    sz = pwrite(child_fd, test_str.data(), 8, 0);
+    ASSERT(sz == 8);
+    _exit(0);
+  }
+  rc = waitpid(pid, &status, 0);
+  ASSERT(rc == pid);
+  ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+  // the lock of a read-only fd excludes other lockers too, and a shared lock
+  // does not take the lease
+  int ro_fd = open(filepath, O_RDONLY);
+  ASSERT(ro_fd >= 0);
+  rc = flock(ro_fd, LOCK_EX | LOCK_NB);
+  ASSERT(rc == 0);
+  ASSERT(flock(fd, LOCK_SH | LOCK_NB) == -1 && errno == EWOULDBLOCK);
+  rc = flock(ro_fd, LOCK_UN);
+  ASSERT(rc == 0);
+  rc = flock(fd, LOCK_SH);
+  ASSERT(rc == 0);
+  ASSERT(!madfs::get_file(fd)->lease.is_held());
+  ASSERT(flock(ro_fd, LOCK_EX | LOCK_NB) == -1 && errno == EWOULDBLOCK);
+
+  // when the lease is taken elsewhere, the shared lock held before stays
+  int lock_fd = open(madfs::get_file(fd)->shm_mgr.get_path(), O_RDWR);
+  ASSERT(lock_fd >= 0);
+  struct flock fl {};
+  fl.l_type = F_WRLCK;
+  fl.l_whence = SEEK_SET;
+  fl.l_len = 1;
+  // MadFS does not forward fcntl, so the lock is taken as the lease does
+  rc = madfs::posix::fcntl(lock_fd, F_OFD_SETLK, &fl);
+  ASSERT(rc == 0);
+  ASSERT(flock(fd, LOCK_EX | LOCK_NB) == -1 && errno == EWOULDBLOCK);
+  ASSERT(flock(ro_fd, LOCK_EX | LOCK_NB) == -1 && errno == EWOULDBLOCK);
+  rc = flock(ro_fd, LOCK_SH | LOCK_NB);
+  ASSERT(rc == 0);
+  rc = close(lock_fd);
+  ASSERT(rc == 0);
+  rc = close(ro_fd);
+  ASSERT(rc == 0);
+
+  rc = close(fd);
+  ASSERT(rc == 0);
+}
+
+void test_seal() {
+  fprintf(stderr, "test_seal\n");
+
+  unlink(filepath);
+  int fd = open(filepath, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+  ASSERT(fd >= 0);
+  sz = pwrite(fd, test_str.data(), STR_LEN, 0);
+  ASSERT(sz == STR_LEN);
+  rc = close(fd);
+  ASSERT(rc == 0);
+
+  ASSERT(madfs::utility::Sealer::seal(filepath));
+
+  // read-only opens use the linear layout
+  fd = open(filepath, O_RDONLY);
+  ASSERT(fd >= 0);
+  struct stat st {};
+  rc = fstat(fd, &st);
+  ASSERT(rc == 0 && st.st_size == STR_LEN);
+  sz = pread(fd, buff, STR_LEN, 0);
+  ASSERT(sz == STR_LEN);
+  CHECK_RESULT(test_str.data(), buff, STR_LEN, fd);
+  rc = close(fd);
+  ASSERT(rc == 0);
+
+  // opening for write unseals the file
+  fd = open(filepath, O_RDWR);
+  ASSERT(fd >= 0);
+  sz = pwrite(fd, test_str.data(), 8, STR_LEN);
+  ASSERT(sz == 8);
+  sz = pread(fd, buff, STR_LEN, 0);
+  ASSERT(sz == STR_LEN);
+  CHECK_RESULT(test_str.data(), buff, STR_LEN, fd);
+  sz = pread(fd, buff, 8, STR_LEN);
+  ASSERT(sz == 8);
+  CHECK_RESULT(test_str.data(), buff, 8, fd);
+  rc = close(fd);
+  ASSERT(rc == 0);
+}
+
+void test_small_file() {
+  fprintf(stderr, "test_small_file\n");
+
+  // the mode is picked when MadFS is loaded; the tests that touch small files
+  // are run again with it
+  if (!madfs::runtime_options.small_file)
+    run_with_env("MADFS_SMALL_FILE", "1",
+                 {"test_write", "test_read", "test_stat", "test_seal",
+                  "test_small_file"});
+
+  unlink(filepath);
+  int fd = open(filepath, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+  ASSERT(fd >= 0);
+  // with MADFS_SMALL_FILE set, the data stays in the meta block until it is
+  // overwritten or outgrows it
+  bool small_file = madfs::runtime_options.small_file;
+  auto file = madfs::get_file(fd);
+
+  // the shared memory backs its header, per-thread data, and the first bitmap
+  // block up front, but not the rest of the bitmap
+  struct stat shm_stat {};
+  rc = stat(file->shm_mgr.get_path(), &shm_stat);
+  ASSERT(rc == 0);
+  ASSERT(shm_stat.st_size == madfs::SHM_SIZE);
+  auto shm_used = static_cast<size_t>(shm_stat.st_blocks) * 512;
+  ASSERT(shm_used >= 3 * madfs::BLOCK_SIZE && shm_used < madfs::SHM_SIZE);
+  // the next bitmap block is backed once a large file needs it
+  file->bitmap_mgr.reserve(madfs::NUM_BITMAP_ENTRIES_PER_BLOCK + 1);
+  rc = stat(file->shm_mgr.get_path(), &shm_stat);
+  ASSERT(rc == 0);
+  ASSERT(static_cast<size_t>(shm_stat.st_blocks) * 512 >=
+         shm_used + madfs::BLOCK_SIZE);
+
+  sz = write(fd, test_str.data(), 300);
+  ASSERT(sz == 300);
+  sz = write(fd, test_str.data() + 300, 100);
+  ASSERT(sz == 100);
+  if (small_file) ASSERT(file->meta->is_inline());
+  sz = pread(fd, buff, STR_LEN, 0);
+  ASSERT(sz == 400);
+  CHECK_RESULT(test_str.data(), buff, 400, fd);
+
+  // an overwrite moves the data out
+  sz = pwrite(fd, test_str.data(), 8, 0);
+  ASSERT(sz == 8);
+  ASSERT(!file->meta->is_inline());
+  sz = pwrite(fd, test_str.data() + 400, madfs::BLOCK_SIZE, 400);
+  ASSERT(sz == madfs::BLOCK_SIZE);
+  sz = pread(fd, buff, STR_LEN, 0);
+  ASSERT(sz == 400 + madfs::BLOCK_SIZE);
+  CHECK_RESULT(test_str.data(), buff, 400 + madfs::BLOCK_SIZE, fd);
+
+  file.reset();
+  rc = close(fd);
+  ASSERT(rc == 0);
+}
+
+void test_vidx_table() {
+  fprintf(stderr, "test_vidx_table\n");
+
+  using madfs::VirtualBlockIdx;
+  madfs::dram::VidxTable table;
+  auto get = [&](uint32_t vidx) { return table.get(VirtualBlockIdx(vidx)); };
+  auto set = [&](uint32_t vidx, uint32_t lidx, uint32_t num_blocks) {
+    table.set(VirtualBlockIdx(vidx), madfs::LogicalBlockIdx(lidx), num_blocks);
+  };
+  ASSERT(get(0) == 0 && get(1000) == 0);
+
+  // whole groups are kept as runs or holes
+  set(0, 1000, 128);
+  set(128, 0, 128);
+  ASSERT(get(0) == 1000 && get(63) == 1063 && get(127) == 1127);
+  ASSERT(get(128) == 0 && get(255) == 0);
+  ASSERT(table.num_used_leaves() == 0);
+
+  // an overwrite inside a run splits it
+  set(10, 5000, 3);
+  ASSERT(get(9) == 1009 && get(10) == 5000 && get(12) == 5002);
+  ASSERT(get(13) == 1013 && get(64) == 1064);
+  ASSERT(table.num_used_leaves() == 1);
+
+  // a hole inside a run
+  set(20, 0, 2);
+  ASSERT(get(19) == 1019 && get(20) == 0 && get(21) == 0 && get(22) == 1022);
+
+  // a write across two groups splits both
+  set(60, 7000, 8);
+  ASSERT(get(59) == 1059 && get(60) == 7000 && get(63) == 7003);
+  ASSERT(get(64) == 7004 && get(67) == 7007 && get(68) == 1068);
+  ASSERT(table.num_used_leaves() == 2);
+
+  // a leaf whose entries are contiguous again turns back into a run
+  set(0, 3000, 32);
+  ASSERT(table.num_used_leaves() == 2);
+  set(32, 3032, 32);
+  ASSERT(get(0) == 3000 && get(20) == 3020 && get(63) == 3063);
+  ASSERT(table.num_used_leaves() == 1);
+
+  // ... or into a hole
+  set(64, 0, 32);
+  set(96, 0, 32);
+  ASSERT(get(64) == 0 && get(127) == 0);
+  ASSERT(table.num_used_leaves() == 0);
+
+  // the leaves given up are reused
+  size_t memory_usage = table.memory_usage();
+  set(130, 9000, 1);
+  set(200, 9001, 1);
+  ASSERT(get(130) == 9000 && get(131) == 0 && get(200) == 9001);
+  ASSERT(table.num_used_leaves() == 2);
+  ASSERT(table.memory_usage() == memory_usage);
+}
+
+void test_compact_entries() {
+  fprintf(stderr, "test_compact_entries\n");
+
+  constexpr size_t LARGE_SIZE = 1024 * madfs::BLOCK_SIZE;
+  std::string large_str = random_string(LARGE_SIZE);
+
+  unlink(filepath);
+  int fd = open(filepath, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+  ASSERT(fd >= 0);
+  {
+    auto file = madfs::get_file(fd);
+    ASSERT(file->meta->has_compact_entries());
+
+    // a large write into fresh space is described by runs
+    sz = write(fd, large_str.data(), LARGE_SIZE);
+    ASSERT(sz == LARGE_SIZE);
+    // a block-unaligned append stays inline
+    sz = write(fd, test_str.data(), 100);
+    ASSERT(sz == 100);
+
+    int num_indirect = 0, num_inline_tail = 0;
+    for (auto cursor = madfs::dram::TxCursor::from_meta(file->meta);;) {
+      auto tx_entry = cursor.get_entry();
+      if (!tx_entry.is_valid()) break;
+      if (tx_entry.is_inline_tail()) num_inline_tail++;
+      if (tx_entry.is_indirect()) {
+        num_indirect++;
+        madfs::dram::LogCursor log_cursor(tx_entry.indirect_entry,
+                                          &file->mem_table);
+        ASSERT(log_cursor->is_runs());
+        ASSERT(!log_cursor->has_next);
+      }
+      if (!cursor.advance(&file->mem_table)) break;
+    }
+    ASSERT(num_indirect == 1);
+    ASSERT(num_inline_tail == 1);
+  }
+  rc = close(fd);
+  ASSERT(rc == 0);
+
+  // replay the entries from scratch
+  fd = open(filepath, O_RDONLY);
+  ASSERT(fd >= 0);
+  std::vector<char> large_buf(LARGE_SIZE + madfs::BLOCK_SIZE);
+  sz = pread(fd, large_buf.data(), large_buf.size(), 0);
+  ASSERT(sz == LARGE_SIZE + 100);
+  const char* tail_buf = large_buf.data() + LARGE_SIZE;
+  CHECK_RESULT(large_str.data(), large_buf.data(), LARGE_SIZE, fd);
+  CHECK_RESULT(test_str.data(), tail_buf, 100, fd);
+  rc = close(fd);
+  ASSERT(rc == 0);
+}
+
+void test_locality() {
+  fprintf(stderr, "test_locality\n");
+
+  constexpr uint32_t num_blocks = 256;
+  constexpr int num_passes = 16;
+  std::string block_str = random_string(madfs::BLOCK_SIZE);
+
+  unlink(filepath);
+  int fd = open(filepath, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+  ASSERT(fd >= 0);
+  auto file = madfs::get_file(fd);
+
+  // the number of places where neighboring virtual blocks are not physically
+  // adjacent
+  auto count_breaks = [&]() {
+    file->blk_table.update([](const auto&) {});
+    uint32_t num_breaks = 0;
+    for (uint32_t i = 1; i < num_blocks; ++i)
+      if (file->blk_table.vidx_to_lidx(i) !=
+          file->blk_table.vidx_to_lidx(i - 1) + 1)
+        num_breaks++;
+    return num_breaks;
+  };
+
+  // small appends are placed right after each other
+  for (uint32_t i = 0; i < num_blocks; ++i) {
+    sz = write(fd, block_str.data(), madfs::BLOCK_SIZE);
+    ASSERT(sz == madfs::BLOCK_SIZE);
+  }
+  ASSERT(count_breaks() == 0);
+
+  // sequential overwrites move every block, but the stream stays in runs of
+  // at least a region each, without growing the file
+  for (int pass = 0; pass < num_passes; ++pass) {
+    for (uint32_t i = 0; i < num_blocks; ++i) {
+      sz = pwrite(fd, block_str.data(), madfs::BLOCK_SIZE,
+                  i * madfs::BLOCK_SIZE);
+      ASSERT(sz == madfs::BLOCK_SIZE);
+    }
+    ASSERT(count_breaks() <=
+           num_blocks / madfs::BITMAP_ENTRY_BLOCKS_CAPACITY + 1);
+    ASSERT(file->meta->get_num_logical_blocks() == madfs::NUM_BLOCKS_PER_GROW);
+    // every overwrite splits and merges free runs, but the free lists only
+    // keep a few entries per run
+    ASSERT(file->get_local_allocator()->block.get_num_free_list_entries() <=
+           num_blocks);
+  }
+
+  std::vector<char> buf(madfs::BLOCK_SIZE);
+  for (uint32_t i = 0; i < num_blocks; ++i) {
+    sz = pread(fd, buf.data(), madfs::BLOCK_SIZE, i * madfs::BLOCK_SIZE);
+    ASSERT(sz == madfs::BLOCK_SIZE);
+    CHECK_RESULT(block_str.data(), buf.data(), madfs::BLOCK_SIZE, fd);
+  }
+
+  rc = close(fd);
+  ASSERT(rc == 0);
+}
+
+void test_fallocate() {
+  fprintf(stderr, "test_fallocate\n");
+
+  constexpr uint32_t num_blocks = 200;
+  std::string block_str = random_string(madfs::BLOCK_SIZE);
+
+  unlink(filepath);
+  int fd = open(filepath, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+  ASSERT(fd >= 0);
+  auto file = madfs::get_file(fd);
+
+  rc = posix_fallocate(fd, 0, num_blocks * madfs::BLOCK_SIZE);
+  ASSERT(rc == 0);
+  madfs::VirtualBlockIdx reserved_vidx;
+  madfs::LogicalBlockIdx reserved_lidx;
+  uint32_t num_reserved;
+  ASSERT(file->meta->get_reservation(reserved_vidx, reserved_lidx,
+                                     num_reserved));
+  ASSERT(reserved_vidx == 0 && num_reserved == num_blocks);
+  madfs::LogicalBlockIdx begin_lidx = reserved_lidx;
+  // the file grows, and the new blocks read as zeros
+  ASSERT(lseek(fd, 0, SEEK_END) == num_blocks * madfs::BLOCK_SIZE);
+  std::vector<char> buf(madfs::BLOCK_SIZE);
+  std::vector<char> zeros(madfs::BLOCK_SIZE);
+  sz = pread(fd, buf.data(), madfs::BLOCK_SIZE, 10 * madfs::BLOCK_SIZE);
+  ASSERT(sz == madfs::BLOCK_SIZE);
+  CHECK_RESULT(zeros.data(), buf.data(), madfs::BLOCK_SIZE, fd);
+
+  // the writes consume the reservation in order, despite the tx blocks
+  // allocated in between
+  for (uint32_t i = 0; i < num_blocks; ++i) {
+    sz = pwrite(fd, block_str.data(), madfs::BLOCK_SIZE, i * madfs::BLOCK_SIZE);
+    ASSERT(sz == madfs::BLOCK_SIZE);
+  }
+  ASSERT(!file->meta->get_reservation(reserved_vidx, reserved_lidx,
+                                      num_reserved));
+  file->blk_table.update([](const auto&) {});
+  for (uint32_t i = 0; i < num_blocks; ++i)
+    ASSERT(file->blk_table.vidx_to_lidx(i) == begin_lidx + i);
+
+  // punching holes is not supported
+  rc = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0,
+                 madfs::BLOCK_SIZE);
+  ASSERT(rc == -1 && errno == EOPNOTSUPP);
+
+  // with FALLOC_FL_KEEP_SIZE, only the blocks are reserved; a reservation
+  // skipped by the writes is given back
+  rc = fallocate(fd, FALLOC_FL_KEEP_SIZE, 0,
+                 2 * num_blocks * madfs::BLOCK_SIZE);
+  ASSERT(rc == 0);
+  ASSERT(lseek(fd, 0, SEEK_END) == num_blocks * madfs::BLOCK_SIZE);
+  ASSERT(file->meta->get_reservation(reserved_vidx, reserved_lidx,
+                                     num_reserved));
+  ASSERT(reserved_vidx == num_blocks && num_reserved == num_blocks);
+  sz = pwrite(fd, block_str.data(), madfs::BLOCK_SIZE,
+              (num_blocks + 10) * madfs::BLOCK_SIZE);
+  ASSERT(sz == madfs::BLOCK_SIZE);
+  file->blk_table.update([](const auto&) {});
+  ASSERT(file->blk_table.vidx_to_lidx(num_blocks + 10) == reserved_lidx + 10);
+
+  for (uint32_t i = 0; i < num_blocks; ++i) {
+    sz = pread(fd, buf.data(), madfs::BLOCK_SIZE, i * madfs::BLOCK_SIZE);
+    ASSERT(sz == madfs::BLOCK_SIZE);
+    CHECK_RESULT(block_str.data(), buf.data(), madfs::BLOCK_SIZE, fd);
+  }
+
+  // an unaligned size is kept exactly, and the rest of the last block reads as
+  // zeros
+  uint64_t size = (num_blocks + 11) * madfs::BLOCK_SIZE + 100;
+  rc = posix_fallocate(fd, 0, static_cast<off_t>(size + 100));
+  ASSERT(rc == 0);
+  ASSERT(lseek(fd, 0, SEEK_END) == static_cast<off_t>(size + 100));
+  sz = pwrite(fd, block_str.data(), 50, static_cast<off_t>(size + 200));
+  ASSERT(sz == 50);
+  rc = posix_fallocate(fd, 0, static_cast<off_t>(size + 1000));
+  ASSERT(rc == 0);
+  ASSERT(lseek(fd, 0, SEEK_END) == static_cast<off_t>(size + 1000));
+  sz = pread(fd, buf.data(), 1000, static_cast<off_t>(size));
+  ASSERT(sz == 1000);
+  CHECK_RESULT(zeros.data(), buf.data(), 200, fd);
+  const char* written = buf.data() + 200;
+  CHECK_RESULT(block_str.data(), written, 50, fd);
+  const char* rest = written + 50;
+  CHECK_RESULT(zeros.data(), rest, 750, fd);
+
+  rc = close(fd);
+  ASSERT(rc == 0);
+}
+
+void test_meta_regions() {
+  fprintf(stderr, "test_meta_regions\n");
+
+  // enough txs to spill over the inline tx entries into tx blocks
+  constexpr uint32_t num_blocks = 1024;
+  std::string block_str = random_string(madfs::BLOCK_SIZE);
+
+  unlink(filepath);
+  int fd = open(filepath, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+  ASSERT(fd >= 0);
+  auto file = madfs::get_file(fd);
+
+  for (uint32_t i = 0; i < num_blocks; ++i) {
+    sz = write(fd, block_str.data(), madfs::BLOCK_SIZE);
+    ASSERT(sz == madfs::BLOCK_SIZE);
+  }
+
+  // the tx blocks do not share a region with any data block
+  std::set<uint32_t> data_regions;
+  file->blk_table.update([](const auto&) {});
+  for (uint32_t i = 0; i < num_blocks; ++i)
+    data_regions.insert(file->blk_table.vidx_to_lidx(i) >>
+                        madfs::BITMAP_ENTRY_BLOCKS_CAPACITY_SHIFT);
+  madfs::LogicalBlockIdx tx_block_idx = file->meta->get_next_tx_block();
+  ASSERT(tx_block_idx != 0);
+  for (; tx_block_idx != 0;
+       tx_block_idx = file->mem_table.lidx_to_addr_ro(tx_block_idx)
+                          ->tx_block.get_next_tx_block())
+    ASSERT(!data_regions.contains(tx_block_idx >>
+                                  madfs::BITMAP_ENTRY_BLOCKS_CAPACITY_SHIFT));
+
+  std::vector<char> buf(madfs::BLOCK_SIZE);
+  for (uint32_t i = 0; i < num_blocks; ++i) {
+    sz = pread(fd, buf.data(), madfs::BLOCK_SIZE, i * madfs::BLOCK_SIZE);
+    ASSERT(sz == madfs::BLOCK_SIZE);
+    CHECK_RESULT(block_str.data(), buf.data(), madfs::BLOCK_SIZE, fd);
+  }
+
+  rc = close(fd);
+  ASSERT(rc == 0);
+}
+
+void test_defrag() {
+  fprintf(stderr, "test_defrag\n");
+
+  constexpr uint32_t num_blocks = 256;
+  std::vector<std::string> block_strs;
+  for (uint32_t i = 0; i < num_blocks; ++i)
+    block_strs.push_back(random_string(madfs::BLOCK_SIZE));
+
+  unlink(filepath);
+  int fd = open(filepath, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+  ASSERT(fd >= 0);
+  auto file = madfs::get_file(fd);
+
+  for (uint32_t i = 0; i < num_blocks; ++i) {
+    sz = write(fd, block_strs[i].data(), madfs::BLOCK_SIZE);
+    ASSERT(sz == madfs::BLOCK_SIZE);
+  }
+  // overwrite every other block, so that no two neighbors stay adjacent
+  for (uint32_t i = 0; i < num_blocks; i += 2) {
+    sz = pwrite(fd, block_strs[i].data(), madfs::BLOCK_SIZE,
+                i * madfs::BLOCK_SIZE);
+    ASSERT(sz == madfs::BLOCK_SIZE);
+  }
+  // a partial last block
+  sz = write(fd, block_strs[0].data(), 100);
+  ASSERT(sz == 100);
+
+  using madfs::utility::Defragmenter;
+  auto before = Defragmenter::get_stats(file.get());
+  ASSERT(before.num_blocks == num_blocks + 1);
+  ASSERT(before.num_extents > 1);
+  ASSERT(Defragmenter::defrag(file.get()) == 1);
+  auto after = Defragmenter::get_stats(file.get());
+  ASSERT(after.num_blocks == num_blocks + 1);
+  ASSERT(after.num_extents == 1 && after.get_score() == 0);
+  ASSERT(lseek(fd, 0, SEEK_END) == num_blocks * madfs::BLOCK_SIZE + 100);
+
+  std::vector<char> buf(madfs::BLOCK_SIZE);
+  for (uint32_t i = 0; i < num_blocks; ++i) {
+    sz = pread(fd, buf.data(), madfs::BLOCK_SIZE, i * madfs::BLOCK_SIZE);
+    ASSERT(sz == madfs::BLOCK_SIZE);
+    CHECK_RESULT(block_strs[i].data(), buf.data(), madfs::BLOCK_SIZE, fd);
+  }
+  sz = pread(fd, buf.data(), madfs::BLOCK_SIZE, num_blocks * madfs::BLOCK_SIZE);
+  ASSERT(sz == 100);
+  CHECK_RESULT(block_strs[0].data(), buf.data(), 100, fd);
+
+  rc = close(fd);
+  ASSERT(rc == 0);
+}
+
+// the allocation state of each block of the file in the bitmap
+static std::vector<bool> get_bitmap(int fd) {
+  auto file = madfs::get_file(fd);
+  std::vector<bool> bitmap(file->meta->get_num_logical_blocks());
+  for (uint32_t i = 0; i < bitmap.size(); ++i)
+    bitmap[i] = file->bitmap_mgr.is_allocated(i);
+  return bitmap;
+}
+
+void test_bitmap_snapshot() {
+  fprintf(stderr, "test_bitmap_snapshot\n");
+
+  // enough txs for fsync to take a snapshot
+  constexpr uint32_t num_blocks = 64;
+  constexpr uint32_t num_txs =
+      (madfs::BITMAP_SNAPSHOT_INTERVAL + 1) * madfs::NUM_TX_ENTRY_PER_BLOCK;
+  std::vector<std::string> block_strs;
+  for (uint32_t i = 0; i < num_blocks; ++i)
+    block_strs.push_back(random_string(madfs::BLOCK_SIZE));
+
+  unlink(filepath);
+  int fd = open(filepath, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+  ASSERT(fd >= 0);
+  for (uint32_t i = 0; i < num_txs; ++i) {
+    uint32_t vidx = i % num_blocks;
+    sz = pwrite(fd, block_strs[vidx].data(), madfs::BLOCK_SIZE,
+                vidx * madfs::BLOCK_SIZE);
+    ASSERT(sz == madfs::BLOCK_SIZE);
+  }
+  rc = fsync(fd);
+  ASSERT(rc == 0);
+  ASSERT(madfs::get_file(fd)->meta->get_bitmap_snapshot() != 0);
+  // the txs after the snapshot overwrite some blocks and append others
+  for (uint32_t i = 0; i < num_blocks; i += 3) {
+    sz = pwrite(fd, block_strs[i].data(), madfs::BLOCK_SIZE,
+                (num_blocks + i) * madfs::BLOCK_SIZE);
+    ASSERT(sz == madfs::BLOCK_SIZE);
+    sz = pwrite(fd, block_strs[i].data(), madfs::BLOCK_SIZE,
+                i * madfs::BLOCK_SIZE);
+    ASSERT(sz == madfs::BLOCK_SIZE);
+  }
+  rc = close(fd);
+  ASSERT(rc == 0);
+
+  // rebuild the bitmap from the snapshot
+  rc = system("rm -rf /dev/shm/madfs_*");
+  fd = open(filepath, O_RDWR);
+  ASSERT(fd >= 0);
+  {
+    auto file = madfs::get_file(fd);
+    file->meta->lock();
+    file->discard_bitmap_snapshot_locked();
+    file->meta->unlock();
+  }
+  std::vector<bool> from_snapshot = get_bitmap(fd);
+  rc = close(fd);
+  ASSERT(rc == 0);
+
+  // rebuild it again from the whole tx history; every block in use must have
+  // been marked above as well
+  rc = system("rm -rf /dev/shm/madfs_*");
+  fd = open(filepath, O_RDWR);
+  ASSERT(fd >= 0);
+  std::vector<bool> from_scratch = get_bitmap(fd);
+  ASSERT(from_scratch.size() <= from_snapshot.size());
+  for (uint32_t i = 0; i < from_scratch.size(); ++i)
+    ASSERT(!from_scratch[i] || from_snapshot[i]);
+
+  std::vector<char> buf(madfs::BLOCK_SIZE);
+  for (uint32_t i = 0; i < num_blocks; ++i) {
+    sz = pread(fd, buf.data(), madfs::BLOCK_SIZE, i * madfs::BLOCK_SIZE);
+    ASSERT(sz == madfs::BLOCK_SIZE);
+    CHECK_RESULT(block_strs[i].data(), buf.data(), madfs::BLOCK_SIZE, fd);
+  }
+  rc = close(fd);
+  ASSERT(rc == 0);
+}
+
+void test_large_copy() {
+  fprintf(stderr, "test_large_copy\n");
+
+  // large enough to be split across the copy helpers
+  constexpr size_t len = 16 << 20;
+  std::string large_str = random_string(len);
+
+  unlink(filepath);
+  int fd = open(filepath, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+  ASSERT(fd >= 0);
+
+  sz = write(fd, large_str.data(), len);
+  ASSERT(sz == len);
+  // an unaligned overwrite breaks the physical contiguity in the middle
+  sz = pwrite(fd, test_str.data(), STR_LEN, len / 2 + 1);
+  ASSERT(sz == STR_LEN);
+  std::memcpy(large_str.data() + len / 2 + 1, test_str.data(), STR_LEN);
+
+  // an unaligned write of many full blocks
+  std::string new_str = random_string(len / 2);
+  sz = pwrite(fd, new_str.data(), len / 2, 100);
+  ASSERT(sz == len / 2);
+  std::memcpy(large_str.data() + 100, new_str.data(), len / 2);
+
+  std::vector<char> buf(len);
+  sz = pread(fd, buf.data(), len, 0);
+  ASSERT(sz == len);
+  CHECK_RESULT(large_str.data(), buf.data(), len, fd);
+  // an unaligned read past the end of the file
+  sz = pread(fd, buf.data(), len, 123);
+  ASSERT(sz == len - 123);
+  const char* expected = large_str.data() + 123;
+  CHECK_RESULT(expected, buf.data(), len - 123, fd);
+
+  rc = close(fd);
+  ASSERT(rc == 0);
+}
+
+void test_admission() {
+  fprintf(stderr, "test_admission\n");
+
+  // the cap is picked when MadFS is loaded
+  if (madfs::runtime_options.max_pm_writers != 1) {
+    run_with_env("MADFS_MAX_PM_WRITERS", "1",
+                 {"test_large_copy", "test_admission"});
+    return;
+  }
+  using madfs::dram::WriteAdmission;
+
+  // with a single slot, a second large copy waits for the first one, while a
+  // small one goes ahead
+  std::atomic<bool> admitted = false;
+  std::thread waiter;
+  {
+    WriteAdmission::Guard guard(WriteAdmission::MIN_BYTES);
+    waiter = std::thread([&]() {
+      WriteAdmission::Guard other_guard(WriteAdmission::MIN_BYTES);
+      admitted = true;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    ASSERT(!admitted);
+    WriteAdmission::Guard small_guard(WriteAdmission::MIN_BYTES - 1);
+  }
+  waiter.join();
+  ASSERT(admitted);
+
+  // the slot of a process that dies holding it is freed
+  pid_t pid = fork();
+  ASSERT(pid >= 0);
+  if (pid == 0) {
+    WriteAdmission::Guard guard(WriteAdmission::MIN_BYTES);
+    // no destructor runs, as if the process crashed
+    _exit(0);
+  }
+  int status;
+  rc = waitpid(pid, &status, 0);
+  ASSERT(rc == pid && WIFEXITED(status));
+  { WriteAdmission::Guard guard(WriteAdmission::MIN_BYTES); }
+
+  // no other user can take the slots
+  struct stat stat_buf;
+  std::string path = "/dev/shm/madfs_admission_" + std::to_string(getuid());
+  rc = stat(path.c_str(), &stat_buf);
+  ASSERT(rc == 0);
+  ASSERT((stat_buf.st_mode & (S_IRWXG | S_IRWXO)) == 0);
+}
+
+void test_cow() {
+  fprintf(stderr, "test_cow\n");
+
+  constexpr size_t len = madfs::BLOCK_SIZE * 4;
+  std::string expected = random_string(len);
+
+  unlink(filepath);
+  int fd = open(filepath, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+  ASSERT(fd >= 0);
+  sz = write(fd, expected.data(), len);
+  ASSERT(sz == len);
+
+  // partial blocks split at and between cache lines, within a block and
+  // across blocks
+  const std::pair<size_t, size_t> ranges[] = {
+      {0, 1},      {1, 62},     {64, 64},    {63, 66},   {100, 3000},
+      {4000, 96},  {4095, 1},   {4096, 100}, {4000, 200}, {100, 8000},
+      {5000, 10000},
+  };
+  for (auto [offset, count] : ranges) {
+    std::string str = random_string(static_cast<int>(count));
+    sz = pwrite(fd, str.data(), count, offset);
+    ASSERT(sz == count);
+    expected.replace(offset, count, str);
+  }
+
+  std::vector<char> buf(len);
+  sz = pread(fd, buf.data(), len, 0);
+  ASSERT(sz == len);
+  CHECK_RESULT(expected.data(), buf.data(), len, fd);
+
+  rc = close(fd);
+  ASSERT(rc == 0);
+}
+
+// the number of lines in the file, e.g., the number of VMAs in /proc/self/maps
+static size_t count_lines(const char* path) {
+  std::ifstream in(path);
+  return std::count(std::istreambuf_iterator<char>(in),
+                    std::istreambuf_iterator<char>(), '\n');
+}
+
+void test_many_files() {
+  fprintf(stderr, "test_many_files\n");
+
+  constexpr int num_files = 256;
+  std::vector<std::string> paths;
+  for (int i = 0; i < num_files; ++i)
+    paths.emplace_back(std::string(filepath) + "." + std::to_string(i));
+  for (const auto& path : paths) unlink(path.c_str());
+
+  size_t num_vmas = count_lines("/proc/self/maps");
+  auto num_fds = static_cast<size_t>(std::distance(
+      std::filesystem::directory_iterator("/proc/self/fd"),
+      std::filesystem::directory_iterator()));
+
+  std::vector<int> fds;
+  fds.reserve(num_files);
+  struct mallinfo2 mi = mallinfo2();
+  size_t heap_bytes = mi.uordblks + mi.hblkhd;
+  for (const auto& path : paths) {
+    int fd = open(path.c_str(), O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+    ASSERT(fd >= 0);
+    fds.push_back(fd);
+  }
+
+  // an idle open file costs one mapping of the file, one mapping of the shared
+  // memory, a single fd and less than 8 KB of heap; leave some room for the
+  // allocator's own mappings
+  size_t new_num_vmas = count_lines("/proc/self/maps");
+  auto new_num_fds = static_cast<size_t>(std::distance(
+      std::filesystem::directory_iterator("/proc/self/fd"),
+      std::filesystem::directory_iterator()));
+  ASSERT(new_num_vmas - num_vmas <= 2 * num_files + 16);
+  ASSERT(new_num_fds - num_fds == num_files);
+  mi = mallinfo2();
+  ASSERT(mi.uordblks + mi.hblkhd - heap_bytes < 8192 * num_files);
+
+  for (int fd : fds) {
+    rc = close(fd);
+    ASSERT(rc == 0);
+  }
+  for (const auto& path : paths) unlink(path.c_str());
+}
+
 void test_print() {
   fprintf(stderr, "test_print\n");
 
@@ -215,18 +1223,43 @@ void test_print() {
   ASSERT(rc == 0);
 }
 
-int main() {
+// the tests in the order they run; a subset may be run by name
+const std::vector<std::pair<std::string_view, void (*)()>> tests = {
+    {"test_write", test_write},
+    {"test_read", test_read},
+    {"test_lseek", test_lseek},
+    {"test_mmap", test_mmap},
+    {"test_stat", test_stat},
+    {"test_stream", test_stream},
+    {"test_unlink", test_unlink},
+    {"test_copy", test_copy},
+    {"test_filter", test_filter},
+    {"test_fork", test_fork},
+    {"test_lease", test_lease},
+    {"test_seal", test_seal},
+    {"test_small_file", test_small_file},
+    {"test_vidx_table", test_vidx_table},
+    {"test_compact_entries", test_compact_entries},
+    {"test_locality", test_locality},
+    {"test_fallocate", test_fallocate},
+    {"test_meta_regions", test_meta_regions},
+    {"test_defrag", test_defrag},
+    {"test_bitmap_snapshot", test_bitmap_snapshot},
+    {"test_large_copy", test_large_copy},
+    {"test_admission", test_admission},
+    {"test_cow", test_cow},
+    {"test_many_files", test_many_files},
+    {"test_print", test_print},
+};
+
+int main(int argc, char** argv) {
   unsetenv("LD_PRELOAD");
   test_str = random_string(STR_LEN);
   unlink(filepath);
 
-  test_write();
-  test_read();
-  test_lseek();
-  test_mmap();
-  test_stat();
-  test_stream();
-  test_unlink();
-  test_print();
+  for (const auto& [name, test] : tests) {
+    if (argc == 1 || std::find(argv + 1, argv + argc, name) != argv + argc)
+      test();
+  }
   return 0;
 }
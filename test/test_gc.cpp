@@ -1,5 +1,8 @@
 #include <fcntl.h>
 
+#include <string>
+#include <vector>
+
 #include "common.h"
 #include "gc.h"
 #include "lib/lib.h"
@@ -65,6 +68,90 @@ void basic_test(BasicTestOpt opt) {
   }
 }
 
+/**
+ * Test that the grow units freed by overwrites are given back to the kernel
+ */
+void reclaim_test() {
+  constexpr uint32_t num_blocks = madfs::NUM_BLOCKS_PER_GROW * 3;
+  std::string block_str = random_string(BLOCK_SIZE);
+
+  unlink(filepath);
+  int fd = open(filepath, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+  for (uint32_t i = 0; i < num_blocks; ++i) {
+    ssize_t ret = write(fd, block_str.data(), BLOCK_SIZE);
+    ASSERT(ret == BLOCK_SIZE);
+  }
+  // a single overwrite of the whole file places the new blocks away from the
+  // old ones, which are then freed
+  std::string file_str;
+  for (uint32_t i = 0; i < num_blocks; ++i) file_str += block_str;
+  ssize_t ret = pwrite(fd, file_str.data(), file_str.size(), 0);
+  ASSERT(ret == static_cast<ssize_t>(file_str.size()));
+  close(fd);
+
+  struct stat stat_before, stat_after;
+  ASSERT(madfs::posix::stat(filepath, &stat_before) == 0);
+  {
+    GarbageCollector garbage_collector(filepath);
+    ASSERT(garbage_collector.reclaim_free_units() > 0);
+  }
+  ASSERT(madfs::posix::stat(filepath, &stat_after) == 0);
+  ASSERT(stat_after.st_blocks < stat_before.st_blocks);
+  ASSERT(stat_after.st_size == stat_before.st_size);
+
+  fd = open(filepath, O_RDWR);
+  std::vector<char> buf(BLOCK_SIZE);
+  for (uint32_t i = 0; i < num_blocks; ++i) {
+    ssize_t ret = pread(fd, buf.data(), BLOCK_SIZE, i * BLOCK_SIZE);
+    ASSERT(ret == BLOCK_SIZE);
+    CHECK_RESULT(block_str.data(), buf.data(), BLOCK_SIZE, fd);
+  }
+  close(fd);
+}
+
+/**
+ * Test that the blocks reserved by fallocate are given back, while the holes
+ * it leaves in the file survive the new tx history
+ */
+void reservation_test() {
+  constexpr uint32_t num_blocks = 100;
+  std::string block_str = random_string(BLOCK_SIZE);
+
+  unlink(filepath);
+  int fd = open(filepath, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+  ASSERT(posix_fallocate(fd, 0, num_blocks * BLOCK_SIZE + 100) == 0);
+  // enough txs for gc to build a new tx history
+  ssize_t ret;
+  for (uint32_t i = 0; i < NUM_INLINE_TX_ENTRY + 2 * NUM_TX_ENTRY_PER_BLOCK;
+       ++i) {
+    ret = pwrite(fd, block_str.data(), BLOCK_SIZE, 10 * BLOCK_SIZE);
+    ASSERT(ret == BLOCK_SIZE);
+  }
+  close(fd);
+
+  {
+    GarbageCollector garbage_collector(filepath);
+    garbage_collector.do_gc();
+    madfs::VirtualBlockIdx reserved_vidx;
+    madfs::LogicalBlockIdx reserved_lidx;
+    uint32_t num_reserved;
+    ASSERT(!garbage_collector.get_file()->meta->get_reservation(
+        reserved_vidx, reserved_lidx, num_reserved));
+  }
+
+  fd = open(filepath, O_RDWR);
+  ASSERT(lseek(fd, 0, SEEK_END) == num_blocks * BLOCK_SIZE + 100);
+  std::vector<char> buf(BLOCK_SIZE);
+  std::vector<char> zeros(BLOCK_SIZE);
+  for (uint32_t i = 0; i <= num_blocks; ++i) {
+    ret = pread(fd, buf.data(), BLOCK_SIZE, i * BLOCK_SIZE);
+    ASSERT(ret == static_cast<ssize_t>(i < num_blocks ? BLOCK_SIZE : 100));
+    CHECK_RESULT((i == 10 ? block_str.data() : zeros.data()), buf.data(), ret,
+                 fd);
+  }
+  close(fd);
+}
+
 /**
  * Test the basic functionality of garbage collection.
  *
@@ -158,5 +245,7 @@ int main() {
     basic_test({.num_bytes_per_iter = BLOCK_SIZE * 65});
   }
 
+  reclaim_test();
+  reservation_test();
   sync_test();
 }
@@ -0,0 +1,262 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "common.h"
+#include "lib/lib.h"
+
+constexpr size_t NUM_BLOCKS = 64;
+constexpr size_t FILE_SIZE = NUM_BLOCKS * madfs::BLOCK_SIZE;
+
+const char* filepath = get_filepath();
+
+ssize_t sz;
+int rc;
+
+static void check_file(int fd, const std::string& expected) {
+  std::vector<char> buf(expected.size());
+  sz = pread(fd, buf.data(), expected.size(), 0);
+  ASSERT(sz == static_cast<ssize_t>(expected.size()));
+  CHECK_RESULT(expected.data(), buf.data(), expected.size(), fd);
+}
+
+static void check_mmap(int fd, const std::string& expected) {
+  void* ptr = mmap(nullptr, expected.size(), PROT_READ, MAP_SHARED, fd, 0);
+  ASSERT(ptr != MAP_FAILED);
+  const char* mapped = static_cast<const char*>(ptr);
+  CHECK_RESULT(expected.data(), mapped, expected.size(), fd);
+  rc = munmap(ptr, expected.size());
+  ASSERT(rc == 0);
+}
+
+/**
+ * Check the content of the file once more after its shared memory is gone, so
+ * that everything is rebuilt from what is on PM
+ */
+static void check_reopen(const std::string& expected) {
+  rc = system("rm -rf /dev/shm/madfs_*");
+  int fd = open(filepath, O_RDONLY);
+  ASSERT(fd >= 0);
+  check_file(fd, expected);
+  rc = close(fd);
+  ASSERT(rc == 0);
+}
+
+void test_aligned() {
+  fprintf(stderr, "test_aligned\n");
+
+  std::string expected = random_string(FILE_SIZE);
+  unlink(filepath);
+  int fd = open(filepath, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+  ASSERT(fd >= 0);
+
+  // one block at a time, then many blocks at once
+  for (size_t i = 0; i < NUM_BLOCKS; ++i) {
+    sz = write(fd, expected.data() + i * madfs::BLOCK_SIZE, madfs::BLOCK_SIZE);
+    ASSERT(sz == madfs::BLOCK_SIZE);
+  }
+  std::string str = random_string(FILE_SIZE / 2);
+  sz = pwrite(fd, str.data(), str.size(), madfs::BLOCK_SIZE);
+  ASSERT(sz == static_cast<ssize_t>(str.size()));
+  expected.replace(madfs::BLOCK_SIZE, str.size(), str);
+
+  rc = fsync(fd);
+  ASSERT(rc == 0);
+  check_file(fd, expected);
+  check_mmap(fd, expected);
+  rc = close(fd);
+  ASSERT(rc == 0);
+  check_reopen(expected);
+}
+
+void test_unaligned() {
+  fprintf(stderr, "test_unaligned\n");
+
+  std::string expected = random_string(FILE_SIZE);
+  unlink(filepath);
+  int fd = open(filepath, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+  ASSERT(fd >= 0);
+  sz = write(fd, expected.data(), expected.size());
+  ASSERT(sz == static_cast<ssize_t>(expected.size()));
+
+  // partial blocks split at and between cache lines, within a block and
+  // across blocks, and an unaligned write of many full blocks
+  const std::pair<size_t, size_t> ranges[] = {
+      {0, 1},         {1, 62},        {64, 64},       {63, 66},
+      {100, 3000},    {4000, 96},     {4095, 1},      {4096, 100},
+      {4000, 200},    {100, 8000},    {5000, 10000},  {123, FILE_SIZE / 2},
+  };
+  for (auto [offset, count] : ranges) {
+    std::string str = random_string(static_cast<int>(count));
+    sz = pwrite(fd, str.data(), count, static_cast<off_t>(offset));
+    ASSERT(sz == static_cast<ssize_t>(count));
+    expected.replace(offset, count, str);
+  }
+  // and one past the end of the file
+  std::string tail = random_string(100);
+  sz = pwrite(fd, tail.data(), tail.size(), FILE_SIZE - 10);
+  ASSERT(sz == static_cast<ssize_t>(tail.size()));
+  expected.replace(FILE_SIZE - 10, 10, tail);
+
+  rc = fsync(fd);
+  ASSERT(rc == 0);
+  check_file(fd, expected);
+  check_mmap(fd, expected);
+  rc = close(fd);
+  ASSERT(rc == 0);
+  check_reopen(expected);
+}
+
+void test_large() {
+  fprintf(stderr, "test_large\n");
+
+  // large enough to be split across the copy helpers
+  constexpr size_t len = 16 << 20;
+  std::string expected = random_string(len);
+  unlink(filepath);
+  int fd = open(filepath, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+  ASSERT(fd >= 0);
+  sz = write(fd, expected.data(), len);
+  ASSERT(sz == len);
+  std::string str = random_string(len / 2);
+  sz = pwrite(fd, str.data(), str.size(), 100);
+  ASSERT(sz == static_cast<ssize_t>(str.size()));
+  expected.replace(100, str.size(), str);
+
+  rc = fsync(fd);
+  ASSERT(rc == 0);
+  check_file(fd, expected);
+  rc = close(fd);
+  ASSERT(rc == 0);
+  check_reopen(expected);
+}
+
+void test_reservation() {
+  fprintf(stderr, "test_reservation\n");
+
+  unlink(filepath);
+  int fd = open(filepath, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+  ASSERT(fd >= 0);
+  rc = posix_fallocate(fd, 0, FILE_SIZE);
+  ASSERT(rc == 0);
+  // the blocks not written yet read as zeros
+  std::string expected(FILE_SIZE, '\0');
+  for (size_t i = 0; i < NUM_BLOCKS; i += 2) {
+    std::string str = random_string(madfs::BLOCK_SIZE);
+    sz = pwrite(fd, str.data(), str.size(),
+                static_cast<off_t>(i * madfs::BLOCK_SIZE));
+    ASSERT(sz == madfs::BLOCK_SIZE);
+    expected.replace(i * madfs::BLOCK_SIZE, str.size(), str);
+  }
+
+  rc = fsync(fd);
+  ASSERT(rc == 0);
+  check_file(fd, expected);
+  rc = close(fd);
+  ASSERT(rc == 0);
+  check_reopen(expected);
+}
+
+void test_bitmap_snapshot() {
+  fprintf(stderr, "test_bitmap_snapshot\n");
+
+  // enough txs for fsync to take a snapshot, and some more after it
+  constexpr size_t num_txs =
+      (madfs::BITMAP_SNAPSHOT_INTERVAL + 1) * madfs::NUM_TX_ENTRY_PER_BLOCK;
+  std::string expected = random_string(FILE_SIZE);
+  unlink(filepath);
+  int fd = open(filepath, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+  ASSERT(fd >= 0);
+  for (size_t i = 0; i < num_txs; ++i) {
+    size_t offset = i % NUM_BLOCKS * madfs::BLOCK_SIZE;
+    sz = pwrite(fd, expected.data() + offset, madfs::BLOCK_SIZE,
+                static_cast<off_t>(offset));
+    ASSERT(sz == madfs::BLOCK_SIZE);
+  }
+  rc = fsync(fd);
+  ASSERT(rc == 0);
+  ASSERT(madfs::get_file(fd)->meta->get_bitmap_snapshot() != 0);
+  for (size_t i = 0; i < NUM_BLOCKS; i += 3) {
+    std::string str = random_string(madfs::BLOCK_SIZE);
+    sz = pwrite(fd, str.data(), str.size(),
+                static_cast<off_t>(i * madfs::BLOCK_SIZE));
+    ASSERT(sz == madfs::BLOCK_SIZE);
+    expected.replace(i * madfs::BLOCK_SIZE, str.size(), str);
+  }
+
+  rc = fsync(fd);
+  ASSERT(rc == 0);
+  rc = close(fd);
+  ASSERT(rc == 0);
+  check_reopen(expected);
+
+  // the bitmap loaded from the snapshot is the same as the one rebuilt from
+  // the whole tx history, except for the blocks of the snapshot itself; the
+  // blocks left in the free lists or of uncommitted writes are never restored
+  auto count_allocated = [](int fd) {
+    madfs::dram::File* file = madfs::get_file(fd).get();
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < file->meta->get_num_logical_blocks(); ++i)
+      if (file->bitmap_mgr.is_allocated(madfs::LogicalBlockIdx(i))) ++count;
+    return count;
+  };
+  rc = system("rm -rf /dev/shm/madfs_*");
+  fd = open(filepath, O_RDWR);
+  ASSERT(fd >= 0);
+  madfs::dram::File* file = madfs::get_file(fd).get();
+  madfs::LogicalBlockIdx snapshot_lidx = file->meta->get_bitmap_snapshot();
+  ASSERT(snapshot_lidx != 0);
+  uint32_t num_snapshot_blocks =
+      file->mem_table.lidx_to_addr_ro(snapshot_lidx)
+          ->bitmap_snapshot_block.get_num_blocks();
+  uint32_t num_loaded = count_allocated(fd);
+  file->meta->set_bitmap_snapshot(0);
+  rc = close(fd);
+  ASSERT(rc == 0);
+
+  rc = system("rm -rf /dev/shm/madfs_*");
+  fd = open(filepath, O_RDWR);
+  ASSERT(fd >= 0);
+  uint32_t num_rebuilt = count_allocated(fd);
+  ASSERT(num_loaded == num_rebuilt + num_snapshot_blocks);
+  check_file(fd, expected);
+  rc = close(fd);
+  ASSERT(rc == 0);
+}
+
+// the tests in the order they run; a subset may be run by name
+const std::vector<std::pair<std::string_view, void (*)()>> tests = {
+    {"test_aligned", test_aligned},
+    {"test_unaligned", test_unaligned},
+    {"test_large", test_large},
+    {"test_reservation", test_reservation},
+    {"test_bitmap_snapshot", test_bitmap_snapshot},
+};
+
+int main(int argc, char** argv) {
+  unsetenv("LD_PRELOAD");
+  unlink(filepath);
+
+  // the domain is picked when MadFS is loaded, so the weaker ones are tested
+  // in new processes
+  bool is_flush =
+      madfs::runtime_options.persist_domain == madfs::PersistDomain::FLUSH;
+  ASSERT(is_flush == madfs::pmem::need_flush());
+
+  for (const auto& [name, test] : tests) {
+    if (argc == 1 || std::find(argv + 1, argv + argc, name) != argv + argc)
+      test();
+  }
+
+  if (is_flush) {
+    std::vector<const char*> test_names(argv + 1, argv + argc);
+    for (const char* domain : {"fence", "none"})
+      run_with_env("MADFS_PERSIST_DOMAIN", domain, test_names);
+  }
+  return 0;
+}
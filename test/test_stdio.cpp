@@ -0,0 +1,89 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "common.h"
+
+// not a multiple of the stream buffer, so that the last flush is partial
+constexpr size_t LEN = madfs::BLOCK_SIZE * 20 + 10;
+
+const char* filepath = get_filepath();
+
+size_t sz;
+int rc;
+
+void test_fwrite() {
+  fprintf(stderr, "test_fwrite\n");
+
+  // many small fwrites go through the stream buffer
+  std::string expected = random_string(LEN);
+  unlink(filepath);
+  FILE* stream = fopen(filepath, "w");
+  ASSERT(stream != nullptr);
+  for (size_t offset = 0; offset < LEN; offset += 10) {
+    sz = fwrite(expected.data() + offset, 1, 10, stream);
+    ASSERT(sz == 10);
+  }
+  rc = fflush(stream);
+  ASSERT(rc == 0);
+  struct stat st {};
+  rc = fstat(fileno(stream), &st);
+  ASSERT(rc == 0);
+  ASSERT(static_cast<size_t>(st.st_size) == LEN);
+  rc = fclose(stream);
+  ASSERT(rc == 0);
+}
+
+void test_append() {
+  fprintf(stderr, "test_append\n");
+
+  std::string expected = random_string(LEN);
+  unlink(filepath);
+  int fd = open(filepath, O_CREAT | O_WRONLY, S_IRUSR | S_IWUSR);
+  ASSERT(fd >= 0);
+  sz = write(fd, expected.data(), expected.size());
+  ASSERT(sz == expected.size());
+  rc = close(fd);
+  ASSERT(rc == 0);
+
+  // the file grows at its end, and is read back through the same stream
+  FILE* stream = fopen(filepath, "a+");
+  ASSERT(stream != nullptr);
+  sz = fwrite("tail", 1, 4, stream);
+  ASSERT(sz == 4);
+  expected += "tail";
+  rc = fseek(stream, 0, SEEK_SET);
+  ASSERT(rc == 0);
+  std::vector<char> buf(expected.size());
+  sz = fread(buf.data(), 1, buf.size(), stream);
+  ASSERT(sz == buf.size());
+  CHECK_RESULT(expected.data(), buf.data(), buf.size(), fileno(stream));
+
+  rc = fseek(stream, -4, SEEK_END);
+  ASSERT(rc == 0);
+  ASSERT(ftell(stream) == static_cast<long>(LEN));
+  ASSERT(fgetc(stream) == 't');
+  rc = fclose(stream);
+  ASSERT(rc == 0);
+}
+
+// the tests in the order they run; a subset may be run by name
+const std::vector<std::pair<std::string_view, void (*)()>> tests = {
+    {"test_fwrite", test_fwrite},
+    {"test_append", test_append},
+};
+
+int main(int argc, char** argv) {
+  unsetenv("LD_PRELOAD");
+
+  for (const auto& [name, test] : tests) {
+    if (argc == 1 || std::find(argv + 1, argv + argc, name) != argv + argc)
+      test();
+  }
+  return 0;
+}
@@ -0,0 +1,218 @@
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "common.h"
+#include "lib/lib.h"
+
+// small enough to be combined in DRAM
+constexpr size_t WRITE_SIZE = 100;
+constexpr size_t LEN = WRITE_SIZE * 1700;
+
+const char* filepath = get_filepath();
+
+size_t sz;
+int rc;
+
+/**
+ * Check the whole file against the expected content through a new fd
+ */
+static void check_file(const std::string& expected) {
+  int fd = open(filepath, O_RDONLY);
+  ASSERT(fd >= 0);
+  std::vector<char> buf(expected.size());
+  sz = pread(fd, buf.data(), buf.size(), 0);
+  ASSERT(sz == buf.size());
+  CHECK_RESULT(expected.data(), buf.data(), buf.size(), fd);
+  rc = close(fd);
+  ASSERT(rc == 0);
+}
+
+void test_shared() {
+  fprintf(stderr, "test_shared\n");
+
+  // all fds of the file in this process see the buffered writes
+  std::string expected = random_string(LEN);
+  struct stat st {};
+
+  unlink(filepath);
+  int fd = open(filepath, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+  ASSERT(fd >= 0);
+  int reader_fd = open(filepath, O_RDONLY);
+  ASSERT(reader_fd >= 0);
+  for (size_t offset = 0; offset < LEN; offset += WRITE_SIZE) {
+    sz = write(fd, expected.data() + offset, WRITE_SIZE);
+    ASSERT(sz == WRITE_SIZE);
+    if (offset == 0) {
+      auto buffer = madfs::get_file(fd)->get_write_buffer();
+      ASSERT(buffer != nullptr && buffer->size == WRITE_SIZE);
+      ASSERT(madfs::get_file(reader_fd)->get_write_buffer() == buffer);
+    }
+    // reads, fstat and seeks to the end see the buffered data
+    if (offset % 30000 == 0) {
+      int check_fd = offset % 60000 == 0 ? fd : reader_fd;
+      rc = fstat(check_fd, &st);
+      ASSERT(rc == 0);
+      ASSERT(static_cast<size_t>(st.st_size) == offset + WRITE_SIZE);
+      char c;
+      sz = pread(check_fd, &c, 1, offset + WRITE_SIZE - 1);
+      ASSERT(sz == 1);
+      ASSERT(c == expected[offset + WRITE_SIZE - 1]);
+    }
+  }
+  ASSERT(lseek(fd, 0, SEEK_END) == static_cast<off_t>(LEN));
+
+  rc = close(reader_fd);
+  ASSERT(rc == 0);
+  rc = close(fd);
+  ASSERT(rc == 0);
+  check_file(expected);
+}
+
+void test_order() {
+  fprintf(stderr, "test_order\n");
+
+  std::string expected = random_string(LEN);
+  unlink(filepath);
+  int fd = open(filepath, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+  ASSERT(fd >= 0);
+  for (size_t offset = 0; offset < LEN; offset += WRITE_SIZE) {
+    sz = write(fd, expected.data() + offset, WRITE_SIZE);
+    ASSERT(sz == WRITE_SIZE);
+  }
+
+  // a write through another fd is ordered after the buffered ones
+  sz = write(fd, "buffered", 8);
+  ASSERT(sz == 8);
+  int other_fd = open(filepath, O_WRONLY);
+  ASSERT(other_fd >= 0);
+  sz = pwrite(other_fd, "direct", 6, LEN);
+  ASSERT(sz == 6);
+  rc = close(other_fd);
+  ASSERT(rc == 0);
+  expected += "directed";
+  char tail[8];
+  sz = pread(fd, tail, sizeof(tail), LEN);
+  ASSERT(sz == sizeof(tail));
+  CHECK_RESULT("directed", tail, sizeof(tail), fd);
+
+  // a write elsewhere and a large one are ordered after the buffered ones
+  sz = pwrite(fd, "abc", 3, 10);
+  ASSERT(sz == 3);
+  expected.replace(10, 3, "abc");
+  std::string large = random_string(madfs::BLOCK_SIZE * 2);
+  sz = pwrite(fd, large.data(), large.size(), 50);
+  ASSERT(sz == large.size());
+  expected.replace(50, large.size(), large);
+  sz = pwrite(fd, "xyz", 3, 51);
+  ASSERT(sz == 3);
+  expected.replace(51, 3, "xyz");
+  rc = fsync(fd);
+  ASSERT(rc == 0);
+
+  rc = close(fd);
+  ASSERT(rc == 0);
+  check_file(expected);
+}
+
+void test_close() {
+  fprintf(stderr, "test_close\n");
+
+  // close commits the buffer
+  std::string expected = random_string(WRITE_SIZE);
+  unlink(filepath);
+  int fd = open(filepath, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+  ASSERT(fd >= 0);
+  sz = write(fd, expected.data(), expected.size());
+  ASSERT(sz == expected.size());
+  ASSERT(madfs::get_file(fd)->get_write_buffer()->size == expected.size());
+  rc = close(fd);
+  ASSERT(rc == 0);
+  check_file(expected);
+}
+
+void test_error() {
+  fprintf(stderr, "test_error\n");
+
+  unlink(filepath);
+  int fd = open(filepath, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+  ASSERT(fd >= 0);
+  rc = close(fd);
+  ASSERT(rc == 0);
+
+  // the child takes the lease on request; it is forked first, since fork
+  // commits the write buffer
+  int to_child[2], to_parent[2];
+  ASSERT(pipe(to_child) == 0 && pipe(to_parent) == 0);
+  pid_t pid = fork();
+  ASSERT(pid >= 0);
+  if (pid == 0) {
+    char c;
+    ASSERT(read(to_child[0], &c, 1) == 1);
+    int lease_fd = open(filepath, O_RDWR);
+    ASSERT(lease_fd >= 0);
+    ASSERT(flock(lease_fd, LOCK_EX) == 0);
+    ASSERT(write(to_parent[1], "l", 1) == 1);
+    ASSERT(read(to_child[0], &c, 1) == 1);
+    _exit(0);
+  }
+
+  // a nonblocking fd cannot commit under another process's lease, and every
+  // operation that must see the buffered data fails
+  fd = open(filepath, O_RDWR | O_NONBLOCK);
+  ASSERT(fd >= 0);
+  sz = write(fd, "buffered", 8);
+  ASSERT(sz == 8);
+  ASSERT(write(to_child[1], "l", 1) == 1);
+  char c;
+  ASSERT(read(to_parent[0], &c, 1) == 1);
+
+  struct stat st {};
+  rc = fstat(fd, &st);
+  ASSERT(rc == -1 && errno == EAGAIN);
+  sz = pread(fd, &c, 1, 0);
+  ASSERT(sz == static_cast<size_t>(-1) && errno == EAGAIN);
+  ASSERT(lseek(fd, 0, SEEK_END) == -1 && errno == EAGAIN);
+  // the fd is closed, but the data is lost
+  rc = close(fd);
+  ASSERT(rc == -1 && errno == EAGAIN);
+
+  ASSERT(write(to_child[1], "x", 1) == 1);
+  int status;
+  ASSERT(waitpid(pid, &status, 0) == pid);
+  ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  for (int pipe_fd : {to_child[0], to_child[1], to_parent[0], to_parent[1]})
+    close(pipe_fd);
+  check_file("");
+}
+
+// the tests in the order they run; a subset may be run by name
+const std::vector<std::pair<std::string_view, void (*)()>> tests = {
+    {"test_shared", test_shared},
+    {"test_order", test_order},
+    {"test_close", test_close},
+    {"test_error", test_error},
+};
+
+int main(int argc, char** argv) {
+  unsetenv("LD_PRELOAD");
+
+  // the buffered paths are picked when MadFS is loaded
+  if (!madfs::runtime_options.buffered_paths) {
+    run_with_env("MADFS_BUFFERED_PATHS", filepath,
+                 std::vector<const char*>(argv + 1, argv + argc));
+    return 0;
+  }
+
+  for (const auto& [name, test] : tests) {
+    if (argc == 1 || std::find(argv + 1, argv + argc, name) != argv + argc)
+      test();
+  }
+  return 0;
+}
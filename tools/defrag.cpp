@@ -0,0 +1,18 @@
+/**
+ * Rewrite the fragmented ranges of a file contiguously.
+ */
+#include "defrag.h"
+
+#include <iostream>
+
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    std::cerr << "Usage: " << argv[0] << " <file>" << std::endl;
+    return 1;
+  }
+
+  const char *filename = argv[1];
+  bool success = madfs::utility::Defragmenter::defrag(filename, std::cout);
+
+  return success ? 0 : 1;
+}
@@ -0,0 +1,19 @@
+/**
+ * Seal a file so that it is read without the tx history or the shared memory.
+ */
+#include "seal.h"
+
+#include <iostream>
+
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    std::cerr << "Usage: " << argv[0] << " <file>" << std::endl;
+    return 1;
+  }
+
+  const char *filename = argv[1];
+  bool is_sealed = madfs::utility::Sealer::seal(filename);
+  std::cout << "sealed=" << is_sealed << std::endl;
+
+  return is_sealed ? 0 : 1;
+}